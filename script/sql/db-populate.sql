@@ -27,10 +27,10 @@ INSERT INTO users_chats(ID_USERS,ID_CHAT,CREATION_TIME,READ_MSG_TIME) VALUES(4,3
 
 /*TABLE FRIENS*/
 
-INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(1,2,0);
-INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(3,2,0);
-INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(3,4,0);
-INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(2,4,0);
+INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(1,2,0),(2,1,0);
+INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(3,2,0),(2,3,0);
+INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(3,4,0),(4,3,0);
+INSERT INTO friends(ID1,ID2,CREATION_TIME) VALUES(2,4,0),(4,2,0);
 
 /*TABLE REQUEST*/
 
@@ -25,10 +25,12 @@ CREATE TABLE chats(
  FOREIGN KEY (ID_ADMIN) REFERENCES users(ID) on delete cascade on update cascade
 );
 
+/* every friendship is stored twice, (user, friend) and (friend, user) */
 CREATE TABLE friends(
  ID1 INT(10) NOT NULL, 
  ID2 INT(10) NOT NULL,
  CREATION_TIME INT(10),
+ PRIMARY KEY (ID1, ID2),
  FOREIGN KEY (ID1) REFERENCES users(ID) on delete cascade on update cascade,
  FOREIGN KEY (ID2) REFERENCES users(ID) on delete cascade on update cascade 
 );
@@ -49,6 +51,7 @@ CREATE TABLE messages(
  FILE_ VARCHAR(50),
  TEXT VARCHAR(500),
  CREATION_TIME INT(10),
+ UNIQUE KEY (ID_CHAT, CREATION_TIME),
  FOREIGN KEY (ID_SENDER) REFERENCES users(ID) on delete cascade on update cascade,
  FOREIGN KEY (ID_CHAT) REFERENCES chats(ID) on delete cascade on update cascade
 );
@@ -61,4 +64,28 @@ CREATE TABLE friends_request(
  FOREIGN KEY (ID2_request) REFERENCES users(ID) on delete cascade on update cascade 
 );
 
+/* changes of the data of every user, SEQ is the sync cursor of the clients.
+   TYPE: 1 chat changed, 2 chat left, 3 new friend, 4 friend request (ID_REF is the chat or the user) */
+CREATE TABLE events(
+ SEQ BIGINT NOT NULL AUTO_INCREMENT,
+ ID_USER INT(10) NOT NULL,
+ TYPE INT NOT NULL,
+ ID_REF INT(10) NOT NULL,
+ CREATION_TIME INT(10),
+ PRIMARY KEY (SEQ),
+ KEY (ID_USER, SEQ),
+ FOREIGN KEY (ID_USER) REFERENCES users(ID) on delete cascade on update cascade
+);
+
+/* the attachment of every message, stored once by the SHA-256 of its content
+   in server_files/ab/cd/<HASH> */
+CREATE TABLE attachments(
+ ID_CHAT INT(10) NOT NULL,
+ SEND_TIME INT(10) NOT NULL,
+ HASH CHAR(64) NOT NULL,
+ PRIMARY KEY (ID_CHAT, SEND_TIME),
+ KEY (HASH),
+ FOREIGN KEY (ID_CHAT) REFERENCES chats(ID) on delete cascade on update cascade
+);
+
 insert into users (NAME, PASS, INFORMATION) values ('System',  '', 'Sup, im da real system');
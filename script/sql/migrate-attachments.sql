@@ -0,0 +1,13 @@
+/* Adds the content addressed attachments. Run once on databases created
+   before them, the older files are still read from server_files/_<chat><time>. */
+
+USE PSD;
+
+CREATE TABLE attachments(
+ ID_CHAT INT(10) NOT NULL,
+ SEND_TIME INT(10) NOT NULL,
+ HASH CHAR(64) NOT NULL,
+ PRIMARY KEY (ID_CHAT, SEND_TIME),
+ KEY (HASH),
+ FOREIGN KEY (ID_CHAT) REFERENCES chats(ID) on delete cascade on update cascade
+);
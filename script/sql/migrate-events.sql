@@ -0,0 +1,15 @@
+/* Adds the events of the delta sync (get_changes). Run once on databases
+   created before it, the clients get a snapshot on their first sync anyway. */
+
+USE PSD;
+
+CREATE TABLE events(
+ SEQ BIGINT NOT NULL AUTO_INCREMENT,
+ ID_USER INT(10) NOT NULL,
+ TYPE INT NOT NULL,
+ ID_REF INT(10) NOT NULL,
+ CREATION_TIME INT(10),
+ PRIMARY KEY (SEQ),
+ KEY (ID_USER, SEQ),
+ FOREIGN KEY (ID_USER) REFERENCES users(ID) on delete cascade on update cascade
+);
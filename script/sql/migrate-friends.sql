@@ -0,0 +1,19 @@
+/* Stores every friendship in both directions, (user, friend) and (friend, user),
+   with primary key (ID1, ID2). Run once on databases created before it. */
+
+USE PSD;
+
+CREATE TABLE friends_new(
+ ID1 INT(10) NOT NULL, 
+ ID2 INT(10) NOT NULL,
+ CREATION_TIME INT(10),
+ PRIMARY KEY (ID1, ID2),
+ FOREIGN KEY (ID1) REFERENCES users(ID) on delete cascade on update cascade,
+ FOREIGN KEY (ID2) REFERENCES users(ID) on delete cascade on update cascade 
+);
+
+INSERT IGNORE INTO friends_new(ID1, ID2, CREATION_TIME) SELECT ID1, ID2, MIN(CREATION_TIME) FROM friends GROUP BY ID1, ID2;
+INSERT IGNORE INTO friends_new(ID1, ID2, CREATION_TIME) SELECT ID2, ID1, MIN(CREATION_TIME) FROM friends GROUP BY ID1, ID2;
+
+RENAME TABLE friends TO friends_old, friends_new TO friends;
+DROP TABLE friends_old;
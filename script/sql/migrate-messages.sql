@@ -0,0 +1,75 @@
+/* Makes the time of a message unique inside its chat, UNIQUE KEY (ID_CHAT, CREATION_TIME).
+   Run once on databases created before it. The repeated messages are not deleted, they
+   are moved to the next free second of the chat. The one with a file keeps its time, so
+   its attachments row and its file in server_files/_<chat><time> still point at it. */
+
+USE PSD;
+
+CREATE TABLE messages_renumbered(
+ N INT NOT NULL AUTO_INCREMENT,
+ ID_SENDER INT(10) NOT NULL,
+ ID_CHAT INT(10) NOT NULL,
+ FILE_ VARCHAR(50),
+ TEXT VARCHAR(500),
+ CREATION_TIME INT(10),
+ OLD_TIME INT(10),
+ PRIMARY KEY (N),
+ KEY (ID_CHAT, CREATION_TIME)
+);
+
+INSERT INTO messages_renumbered(ID_SENDER, ID_CHAT, FILE_, TEXT, CREATION_TIME, OLD_TIME)
+	SELECT ID_SENDER, ID_CHAT, FILE_, TEXT, CREATION_TIME, CREATION_TIME FROM messages
+	ORDER BY ID_CHAT, CREATION_TIME, (FILE_ IS NULL), ID_SENDER;
+
+DELIMITER //
+CREATE PROCEDURE renumber_messages()
+BEGIN
+	DECLARE done INT DEFAULT 0;
+	DECLARE n_row, chat, old_time, new_time INT;
+	DECLARE repeated CURSOR FOR
+		SELECT r.N, r.ID_CHAT, r.CREATION_TIME FROM messages_renumbered r
+		WHERE EXISTS (SELECT 1 FROM messages_renumbered f
+			WHERE f.ID_CHAT = r.ID_CHAT AND f.CREATION_TIME = r.CREATION_TIME AND f.N < r.N)
+		ORDER BY r.N;
+	DECLARE CONTINUE HANDLER FOR NOT FOUND SET done = 1;
+
+	OPEN repeated;
+	next_row: LOOP
+		FETCH repeated INTO n_row, chat, old_time;
+		IF done THEN
+			LEAVE next_row;
+		END IF;
+		SET new_time = old_time + 1;
+		WHILE EXISTS (SELECT 1 FROM messages_renumbered WHERE ID_CHAT = chat AND CREATION_TIME = new_time) DO
+			SET new_time = new_time + 1;
+		END WHILE;
+		UPDATE messages_renumbered SET CREATION_TIME = new_time WHERE N = n_row;
+	END LOOP;
+	CLOSE repeated;
+END //
+DELIMITER ;
+
+CALL renumber_messages();
+DROP PROCEDURE renumber_messages;
+
+START TRANSACTION;
+DELETE FROM messages;
+INSERT INTO messages(ID_SENDER, ID_CHAT, FILE_, TEXT, CREATION_TIME)
+	SELECT ID_SENDER, ID_CHAT, FILE_, TEXT, CREATION_TIME FROM messages_renumbered;
+/* an attachments row goes with its message, if the one with the file was renumbered */
+UPDATE attachments a JOIN messages_renumbered r
+	ON (a.ID_CHAT = r.ID_CHAT AND a.SEND_TIME = r.OLD_TIME)
+	SET a.SEND_TIME = r.CREATION_TIME
+	WHERE r.CREATION_TIME <> r.OLD_TIME AND r.FILE_ IS NOT NULL
+	AND NOT EXISTS (SELECT 1 FROM messages k WHERE k.ID_CHAT = r.ID_CHAT
+		AND k.CREATION_TIME = r.OLD_TIME AND k.FILE_ IS NOT NULL);
+SELECT ROW_COUNT() AS attachments_moved;
+COMMIT;
+
+SELECT COUNT(*) AS messages_renumbered FROM messages_renumbered WHERE CREATION_TIME <> OLD_TIME;
+SELECT ID_CHAT, OLD_TIME, CREATION_TIME AS NEW_TIME, FILE_ FROM messages_renumbered
+	WHERE CREATION_TIME <> OLD_TIME ORDER BY ID_CHAT, OLD_TIME;
+
+DROP TABLE messages_renumbered;
+
+ALTER TABLE messages ADD UNIQUE KEY (ID_CHAT, CREATION_TIME);
@@ -0,0 +1,461 @@
+/*******************************************************************************
+ *	attach_cache.c
+ *
+ *  Local copies of the attachments, by the hash of their content
+ *
+ *
+ *  This file is part of PSD-IMS
+ * 
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+// copy_file_range
+#define _GNU_SOURCE
+
+#include "attach_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "debug_def.h"
+
+#ifdef DEBUG
+#include "leak_detector_c.h"
+#endif
+
+#define ATT_INDEX_FILE "index"
+#define ATT_INITIAL_ELEMS (16)
+#define ATT_COPY_BYTES (64*1024)
+
+
+void _att_blob_path(attach_cache *cache, const char *hash, char *path) {
+	snprintf(path, ATT_CACHE_PATH_CHARS, "%s/%s", cache->dir, hash);
+}
+
+
+int _att_find_blob(attach_cache *cache, const char *hash) {
+	int i;
+
+	for (i = 0 ; i < cache->n_blobs ; i++) {
+		if (strcmp(cache->blobs[i].hash, hash) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+int _att_find_entry(attach_cache *cache, int chat_id, int msg_timestamp) {
+	int i;
+
+	for (i = 0 ; i < cache->n_entries ; i++) {
+		if (cache->entries[i].chat_id == chat_id && cache->entries[i].msg_timestamp == msg_timestamp) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Returns the index of the new blob or -1 if fails
+ */
+int _att_add_blob(attach_cache *cache, const char *hash, long long size) {
+	att_blob *blobs;
+
+	if (cache->n_blobs == cache->max_blobs) {
+		if ((blobs = realloc(cache->blobs, sizeof(att_blob)*cache->max_blobs*2)) == NULL) {
+			return -1;
+		}
+		cache->blobs = blobs;
+		cache->max_blobs *= 2;
+	}
+
+	strcpy(cache->blobs[cache->n_blobs].hash, hash);
+	cache->blobs[cache->n_blobs].size = size;
+	cache->blobs[cache->n_blobs].last_used = ++cache->use_clock;
+	cache->total_size += size;
+
+	return cache->n_blobs++;
+}
+
+
+/*
+ * Sets the blob of the message, replacing the one it had
+ * Returns 0 or -1 if fails
+ */
+int _att_add_entry(attach_cache *cache, int chat_id, int msg_timestamp, const char *hash) {
+	att_entry *entries;
+	int i;
+
+	if ((i = _att_find_entry(cache, chat_id, msg_timestamp)) == -1) {
+		if (cache->n_entries == cache->max_entries) {
+			if ((entries = realloc(cache->entries, sizeof(att_entry)*cache->max_entries*2)) == NULL) {
+				return -1;
+			}
+			cache->entries = entries;
+			cache->max_entries *= 2;
+		}
+		i = cache->n_entries++;
+	}
+
+	cache->entries[i].chat_id = chat_id;
+	cache->entries[i].msg_timestamp = msg_timestamp;
+	strcpy(cache->entries[i].hash, hash);
+
+	return 0;
+}
+
+
+/*
+ * Removes the blob, its file and the messages that had it
+ */
+void _att_remove_blob(attach_cache *cache, int blob) {
+	char path[ATT_CACHE_PATH_CHARS];
+	int i;
+
+	_att_blob_path(cache, cache->blobs[blob].hash, path);
+	unlink(path);
+
+	for (i = 0 ; i < cache->n_entries ; ) {
+		if (strcmp(cache->entries[i].hash, cache->blobs[blob].hash) == 0) {
+			cache->entries[i] = cache->entries[--cache->n_entries];
+		}
+		else {
+			i++;
+		}
+	}
+
+	cache->total_size -= cache->blobs[blob].size;
+	cache->blobs[blob] = cache->blobs[--cache->n_blobs];
+}
+
+
+/*
+ * Evicts the least recently used blobs, but keep_hash (NULL if none),
+ * until the cache fits its budget
+ */
+void _att_evict(attach_cache *cache, const char *keep_hash) {
+	int i, oldest;
+
+	while (cache->budget > 0 && cache->total_size > cache->budget) {
+		oldest = -1;
+		for (i = 0 ; i < cache->n_blobs ; i++) {
+			if (keep_hash != NULL && strcmp(cache->blobs[i].hash, keep_hash) == 0) {
+				continue;
+			}
+			if (oldest == -1 || cache->blobs[i].last_used < cache->blobs[oldest].last_used) {
+				oldest = i;
+			}
+		}
+		if (oldest == -1) {
+			break;
+		}
+		DEBUG_INFO_PRINTF("Evicting the attachment %s", cache->blobs[oldest].hash);
+		_att_remove_blob(cache, oldest);
+	}
+}
+
+
+/*
+ * Writes the index, aside and renamed so it is never seen half written
+ * Returns 0 or -1 if fails
+ */
+int _att_save_index(attach_cache *cache) {
+	char path[ATT_CACHE_PATH_CHARS];
+	char tmp_path[ATT_CACHE_PATH_CHARS + 4];
+	FILE *fd;
+	int i;
+
+	snprintf(path, ATT_CACHE_PATH_CHARS, "%s/%s", cache->dir, ATT_INDEX_FILE);
+	sprintf(tmp_path, "%s.tmp", path);
+	if ((fd = fopen(tmp_path, "w")) == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not save the attachment cache index");
+		return -1;
+	}
+	for (i = 0 ; i < cache->n_blobs ; i++) {
+		fprintf(fd, "B %s %lld %lld\n", cache->blobs[i].hash, cache->blobs[i].size, cache->blobs[i].last_used);
+	}
+	for (i = 0 ; i < cache->n_entries ; i++) {
+		fprintf(fd, "E %d %d %s\n", cache->entries[i].chat_id, cache->entries[i].msg_timestamp, cache->entries[i].hash);
+	}
+	if (fclose(fd) != 0 || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Loads the index, without the blobs whose file is not there anymore
+ */
+void _att_load_index(attach_cache *cache) {
+	char path[ATT_CACHE_PATH_CHARS];
+	char hash[CONTENT_HASH_CHARS + 1];
+	char type;
+	long long size, last_used;
+	int chat_id, msg_timestamp;
+	struct stat st;
+	FILE *fd;
+	int blob;
+
+	snprintf(path, ATT_CACHE_PATH_CHARS, "%s/%s", cache->dir, ATT_INDEX_FILE);
+	if ((fd = fopen(path, "r")) == NULL) {
+		return;
+	}
+
+	while (fscanf(fd, " %c", &type) == 1) {
+		if (type == 'B' && fscanf(fd, "%64s %lld %lld", hash, &size, &last_used) == 3) {
+			_att_blob_path(cache, hash, path);
+			if (!content_hash_valid(hash) || stat(path, &st) != 0 || _att_find_blob(cache, hash) != -1) {
+				continue;
+			}
+			if ((blob = _att_add_blob(cache, hash, st.st_size)) != -1) {
+				cache->blobs[blob].last_used = last_used;
+				if (last_used > cache->use_clock) {
+					cache->use_clock = last_used;
+				}
+			}
+		}
+		else if (type == 'E' && fscanf(fd, "%d %d %64s", &chat_id, &msg_timestamp, hash) == 3) {
+			// the blobs are written first
+			if (_att_find_blob(cache, hash) != -1) {
+				_att_add_entry(cache, chat_id, msg_timestamp, hash);
+			}
+		}
+		else {
+			break;
+		}
+	}
+
+	fclose(fd);
+}
+
+
+attach_cache *att_cache_new(const char *dir, long long budget) {
+	DEBUG_TRACE_PRINT();
+	attach_cache *cache;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		DEBUG_FAILURE_PRINTF("Could not create the attachment cache directory");
+		return NULL;
+	}
+
+	if ((cache = malloc(sizeof(attach_cache))) == NULL) {
+		return NULL;
+	}
+	cache->dir = malloc(strlen(dir) + sizeof(char));
+	cache->blobs = malloc(sizeof(att_blob)*ATT_INITIAL_ELEMS);
+	cache->entries = malloc(sizeof(att_entry)*ATT_INITIAL_ELEMS);
+	if (cache->dir == NULL || cache->blobs == NULL || cache->entries == NULL) {
+		free(cache->dir);
+		free(cache->blobs);
+		free(cache->entries);
+		free(cache);
+		return NULL;
+	}
+	strcpy(cache->dir, dir);
+	cache->budget = budget;
+	cache->total_size = 0;
+	cache->use_clock = 0;
+	cache->n_blobs = 0;
+	cache->max_blobs = ATT_INITIAL_ELEMS;
+	cache->n_entries = 0;
+	cache->max_entries = ATT_INITIAL_ELEMS;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	_att_load_index(cache);
+	_att_evict(cache, NULL);
+
+	return cache;
+}
+
+
+void att_cache_free(attach_cache *cache) {
+	DEBUG_TRACE_PRINT();
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache->dir);
+	free(cache->blobs);
+	free(cache->entries);
+	free(cache);
+}
+
+
+void att_cache_set_budget(attach_cache *cache, long long budget) {
+	pthread_mutex_lock(&cache->mutex);
+	cache->budget = budget;
+	_att_evict(cache, NULL);
+	_att_save_index(cache);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+int att_cache_find(attach_cache *cache, int chat_id, int msg_timestamp, char *path) {
+	int entry, blob;
+
+	pthread_mutex_lock(&cache->mutex);
+	if ((entry = _att_find_entry(cache, chat_id, msg_timestamp)) == -1
+			|| (blob = _att_find_blob(cache, cache->entries[entry].hash)) == -1) {
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	// the use is saved with the next change of the index
+	cache->blobs[blob].last_used = ++cache->use_clock;
+	_att_blob_path(cache, cache->blobs[blob].hash, path);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 1;
+}
+
+
+void att_cache_download_path(attach_cache *cache, int chat_id, int msg_timestamp, char *path) {
+	snprintf(path, ATT_CACHE_PATH_CHARS, "%s/_%d_%d", cache->dir, chat_id, msg_timestamp);
+}
+
+
+/*
+ * Adds the blob, already in its file, as the attachment of the message
+ * Returns 0 or -1 if fails
+ */
+int _att_cache_add(attach_cache *cache, int chat_id, int msg_timestamp, const char *hash, long long size, char *path) {
+	int blob;
+
+	pthread_mutex_lock(&cache->mutex);
+	if ((blob = _att_find_blob(cache, hash)) != -1) {
+		cache->blobs[blob].last_used = ++cache->use_clock;
+	}
+	else if (_att_add_blob(cache, hash, size) == -1) {
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+	if (_att_add_entry(cache, chat_id, msg_timestamp, hash) != 0) {
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+	_att_evict(cache, hash);
+	_att_save_index(cache);
+	pthread_mutex_unlock(&cache->mutex);
+
+	_att_blob_path(cache, hash, path);
+
+	return 0;
+}
+
+
+int att_cache_put_file(attach_cache *cache, int chat_id, int msg_timestamp, const char *file_path, char *path) {
+	DEBUG_TRACE_PRINT();
+	char hash[CONTENT_HASH_CHARS + 1];
+	char blob_path[ATT_CACHE_PATH_CHARS];
+	struct stat st;
+
+	if (stat(file_path, &st) != 0 || content_hash_file(file_path, hash) != 0) {
+		return -1;
+	}
+
+	// the same content is only stored once
+	_att_blob_path(cache, hash, blob_path);
+	if (access(blob_path, F_OK) == 0) {
+		unlink(file_path);
+	}
+	else if (rename(file_path, blob_path) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not move the file to the attachment cache");
+		return -1;
+	}
+
+	return _att_cache_add(cache, chat_id, msg_timestamp, hash, st.st_size, path);
+}
+
+
+/*
+ * Copies size bytes of in to out, in the kernel if it can
+ * Returns 0 or -1 if fails
+ */
+int _att_copy_fd(int in, int out, long long size) {
+	char buff[ATT_COPY_BYTES];
+	ssize_t n_read, n_written = 0, written;
+
+	// shares the extents where the file system can, and never maps the file in user space
+	while (size > 0) {
+		if ((n_written = copy_file_range(in, NULL, out, NULL, size, 0)) <= 0) {
+			break;
+		}
+		size -= n_written;
+	}
+	if (size == 0) {
+		return 0;
+	}
+	if (n_written == -1 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+		return -1;
+	}
+
+	// the offsets are where copy_file_range stopped
+	while ((n_read = read(in, buff, ATT_COPY_BYTES)) > 0) {
+		for (written = 0 ; written < n_read ; written += n_written) {
+			if ((n_written = write(out, buff + written, n_read - written)) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	return (n_read == 0)? 0 : -1;
+}
+
+
+int att_cache_put_copy(attach_cache *cache, int chat_id, int msg_timestamp, const char *file_path, char *path) {
+	DEBUG_TRACE_PRINT();
+	char tmp_path[ATT_CACHE_PATH_CHARS];
+	struct stat st;
+	int in, out;
+	int ret_value;
+
+	if ((in = open(file_path, O_RDONLY)) == -1) {
+		DEBUG_FAILURE_PRINTF("Could not open the file");
+		return -1;
+	}
+	snprintf(tmp_path, ATT_CACHE_PATH_CHARS, "%s/_copy.XXXXXX", cache->dir);
+	if (fstat(in, &st) != 0 || (out = mkstemp(tmp_path)) == -1) {
+		DEBUG_FAILURE_PRINTF("Could not create the file");
+		close(in);
+		return -1;
+	}
+
+	ret_value = _att_copy_fd(in, out, st.st_size);
+	close(in);
+	if (close(out) != 0 || ret_value != 0) {
+		DEBUG_FAILURE_PRINTF("Could not copy the file to the attachment cache");
+		unlink(tmp_path);
+		return -1;
+	}
+
+	// hashed after the copy, the blob is named by what was really copied
+	if (att_cache_put_file(cache, chat_id, msg_timestamp, tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
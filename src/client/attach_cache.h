@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *	attach_cache.h
+ *
+ *  Local copies of the attachments, by the hash of their content
+ *
+ *
+ *  This file is part of PSD-IMS
+ * 
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __ATTACH_CACHE
+#define __ATTACH_CACHE
+
+#include "content_hash.h"
+#include <pthread.h>
+
+// max chars of the path of a file of the cache, with the '\0'
+#define ATT_CACHE_PATH_CHARS (256)
+
+
+typedef struct att_blob att_blob;
+struct att_blob {
+	char hash[CONTENT_HASH_CHARS + 1];
+	long long size;
+	long long last_used;		// use clock of the cache, the lowest is evicted first
+};
+
+typedef struct att_entry att_entry;
+struct att_entry {
+	int chat_id;
+	int msg_timestamp;
+	char hash[CONTENT_HASH_CHARS + 1];
+};
+
+typedef struct attach_cache attach_cache;
+struct attach_cache {
+	char *dir;
+	long long budget;			// max bytes of the blobs, 0 if unlimited
+	long long total_size;
+	long long use_clock;
+	att_blob *blobs;			// one file for every content
+	int n_blobs;
+	int max_blobs;
+	att_entry *entries;			// messages with their attachment in the cache
+	int n_entries;
+	int max_entries;
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Opens the cache in dir, created if it does not exist, with its index.
+ * Its blobs are evicted, least recently used first, beyond budget bytes (0 if unlimited)
+ * Returns a pointer to the cache or NULL if fails
+ */
+attach_cache *att_cache_new(const char *dir, long long budget);
+
+void att_cache_free(attach_cache *cache);
+
+/*
+ * Sets the max bytes of the cache and evicts the blobs beyond them
+ */
+void att_cache_set_budget(attach_cache *cache, long long budget);
+
+/*
+ * Looks for the attachment of the message, and writes the path of its copy
+ * in path (ATT_CACHE_PATH_CHARS)
+ * Returns 1 if it is in the cache or 0
+ */
+int att_cache_find(attach_cache *cache, int chat_id, int msg_timestamp, char *path);
+
+/*
+ * Writes in path (ATT_CACHE_PATH_CHARS) where the attachment of the message
+ * must be downloaded before it is put in the cache with att_cache_put_file
+ */
+void att_cache_download_path(attach_cache *cache, int chat_id, int msg_timestamp, char *path);
+
+/*
+ * Moves the file at file_path into the cache as the attachment of the
+ * message, and writes the path of its copy in path (ATT_CACHE_PATH_CHARS)
+ * Returns 0 or -1 if fails
+ */
+int att_cache_put_file(attach_cache *cache, int chat_id, int msg_timestamp, const char *file_path, char *path);
+
+/*
+ * Copies the file at file_path into the cache as the attachment of the
+ * message, and writes the path of its copy in path (ATT_CACHE_PATH_CHARS)
+ * Returns 0 or -1 if fails
+ */
+int att_cache_put_copy(attach_cache *cache, int chat_id, int msg_timestamp, const char *file_path, char *path);
+
+
+#endif /* __ATTACH_CACHE */
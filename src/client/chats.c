@@ -144,6 +144,7 @@ int cha_add_chat(chats *chats, int chat_id, const char *description, char *admin
 	}
 	info->id = chat_id;
 	info->read_timestamp = read_timestamp;
+	info->synced_read_timestamp = read_timestamp;
 	info->all_read_timestamp = all_read_timestamp;
 	info->unread_messages = 0;
 	info->pending_messages = 0;
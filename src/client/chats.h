@@ -38,6 +38,7 @@ struct chat_info {
 	int id;
 	char *description;
 	int read_timestamp;
+	int synced_read_timestamp;	// read_timestamp the server was last told about
 	int all_read_timestamp;
 	int unread_messages;
 	int pending_messages;
@@ -92,6 +93,12 @@ typedef list_iterator chat_iterator;
 		(chat_info->unread_messages = 0); \
 		mes_get_timestamp(chat_info->messages, chat_info->read_timestamp)
 
+#define cha_read_dirty(chat_info) \
+		(chat_info->read_timestamp != chat_info->synced_read_timestamp)
+
+#define cha_set_read_synced(chat_info, timestamp) \
+		(chat_info->synced_read_timestamp = timestamp)
+
 #define cha_set_all_read_timestamp(chat_info, timestamp) \
 		(chat_info->all_read_timestamp = timestamp)
 
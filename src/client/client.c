@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 
 #include "psd_ims_client.h"
 #include "client_graphic_v2.h"
@@ -38,15 +39,26 @@
 
 int main( int argc, char **argv ) {
 
+	char *bin_port;
+
 	if( argc < 2 ) {
-		printf("Usage: %s <url>:<port>\n", argv[0]);
+		printf("Usage: %s <url>:<port> [<host>:<binary_port>]\n", argv[0]);
 		return 0; 
 	}
 
+	// a server that closes its socket must fail the write, not kill the client
+	signal(SIGPIPE, SIG_IGN);
+
 	// Initialize client
 	psd_ims_client *client = psd_new_client();
 	psd_bind_network(client, argv[1]);
 
+	// messages and notifications through the binary transport
+	if (argc > 2 && (bin_port = strrchr(argv[2], ':')) != NULL) {
+		*bin_port = '\0';
+		psd_bind_binary_transport(client, argv[2], atoi(bin_port + 1));
+	}
+
 	// TODO If posible, load info from local files
 
 
@@ -426,6 +426,7 @@ int attach_file(char *file_path, char *file_info, int max_info_chars) {
 
 int download_attach(psd_ims_client *client, int chat_id) {
 	char msg_timestamp[MAX_INPUT_CHARS];
+	char path[ATT_CACHE_PATH_CHARS];
 	int timestamp;
 	chat_mes_iterator *iterator;
 	char *sender = NULL, *text = NULL, *attach_path = NULL;
@@ -454,6 +455,10 @@ int download_attach(psd_ims_client *client, int chat_id) {
 		wait_user();
 		return -1;
 	}
+	if (psd_attachment_path(client, chat_id, timestamp, path) == 0) {
+		printf(" attachment saved in %s\n", path);
+		wait_user();
+	}
 	return 0;
 }
 
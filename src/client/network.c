@@ -27,12 +27,37 @@
 #include "psdims.nsmap"
 #include "network.h"
 #include "psd_ims_client.h"
+#include "ims_bin.h"
+#include "content_hash.h"
 #include "bool.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "debug_def.h"
 
+// times a request is retried if the server is overloaded
+#define NET_MAX_RETRIES (3)
+// first wait before a retry when the server gives no hint, doubled on every retry
+#define NET_RETRY_SECS (1)
+// smaller requests are not compressed
+#define NET_COMPRESS_MIN_BYTES (1024)
+// send and receive timeout of the binary transport
+#define NET_BIN_TIMEOUT_SECS (60)
+// chunks of an upload sent at once, each one by its own connection
+#define NET_UPLOAD_STREAMS (4)
+// times a chunk is sent or requested again before the transfer fails
+#define NET_CHUNK_RETRIES (3)
+
 #ifdef DEBUG
 #include "leak_detector_c.h"
 #endif
@@ -119,6 +144,185 @@ void _net_unlink_chat_list(struct soap *soap, psdims__chat_list *chats) {
 }
 
 
+int _net_parse_header(struct soap *soap, const char *key, const char *val) {
+	network *network = (struct network*)soap->user;
+
+	if (!strcasecmp(key, "Retry-After")) {
+		network->retry_after = atoi(val);
+	}
+
+	return network->fparsehdr(soap, key, val);
+}
+
+/*
+ * Waits before retrying a request that the server rejected because it was
+ * overloaded (503) or that exceeded its rate (429), as long as its Retry-After
+ * hint or with an exponential backoff
+ * Returns TRUE if the request must be retried or FALSE
+ */
+boolean _net_retry(network *network, int soap_response) {
+	int wait_secs;
+
+	if ((soap_response != 503 && soap_response != 429) || network->n_retries >= NET_MAX_RETRIES) {
+		network->n_retries = 0;
+		network->retry_after = 0;
+		return FALSE;
+	}
+
+	wait_secs = (network->retry_after > 0)? network->retry_after : (NET_RETRY_SECS << network->n_retries);
+	DEBUG_INFO_PRINTF("Server overloaded, retrying in %d seconds", wait_secs);
+	sleep(wait_secs);
+
+	network->n_retries++;
+	network->retry_after = 0;
+	return TRUE;
+}
+
+
+/*
+ * Compresses the next requests if they are large enough
+ */
+void _net_compress(network *network, size_t request_bytes) {
+#ifdef WITH_ZLIB
+	if (request_bytes >= NET_COMPRESS_MIN_BYTES) {
+		soap_set_omode(&network->soap, SOAP_ENC_ZLIB);
+	}
+	else {
+		soap_clr_omode(&network->soap, SOAP_ENC_ZLIB);
+	}
+#endif
+}
+
+
+int _net_bin_connect(network *network) {
+	struct addrinfo hints;
+	struct addrinfo *addrs, *addr;
+	struct timeval timeout;
+	char port[16];
+	int one = 1;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", network->bin_port);
+	if (getaddrinfo(network->bin_host, port, &hints, &addrs) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not resolve %s", network->bin_host);
+		return -1;
+	}
+
+	for (addr = addrs ; addr != NULL ; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+
+	if (fd < 0) {
+		DEBUG_FAILURE_PRINTF("Could not connect to %s:%d", network->bin_host, network->bin_port);
+		return -1;
+	}
+
+	timeout.tv_sec = NET_BIN_TIMEOUT_SECS;
+	timeout.tv_usec = 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	network->bin_socket = fd;
+
+	return 0;
+}
+
+
+void _net_bin_close(network *network) {
+	if (network->bin_socket != -1) {
+		close(network->bin_socket);
+		network->bin_socket = -1;
+	}
+}
+
+/*
+ * Sends the request encoded in bin_request and receives the response.
+ * The connection is opened again once if the server closed it (they are all reads)
+ * Returns 0 and the reader of the result, or -1 if fails
+ */
+int _net_bin_call(network *network, bin_reader *reader) {
+	int attempt;
+
+	for (attempt = 0 ; attempt < 2 ; attempt++) {
+		if (network->bin_socket == -1 && _net_bin_connect(network) != 0) {
+			return -1;
+		}
+		if (bin_write_frame(network->bin_socket, &network->bin_request) == 0
+				&& bin_read_frame(network->bin_socket, &network->bin_response, BIN_MAX_FRAME_BYTES) == 0) {
+			break;
+		}
+		_net_bin_close(network);
+	}
+	if (attempt == 2) {
+		DEBUG_FAILURE_PRINTF("Binary request failed");
+		return -1;
+	}
+
+	bin_reader_init(reader, bin_buffer_payload(&network->bin_response), bin_buffer_payload_size(&network->bin_response));
+	if (bin_get_uint(reader) != BIN_STATUS_OK) {
+		DEBUG_FAILURE_PRINTF("Server request failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * get_chat_messages through the binary transport, the result is allocated in the soap struct
+ * Returns 0 or -1 if fails
+ */
+int _net_bin_get_chat_messages(network *network, int chat_id, int timestamp, psdims__message_list *messages) {
+	bin_buffer *request = &network->bin_request;
+	bin_reader reader;
+
+	bin_buffer_clear(request);
+	if (bin_put_uint(request, BIN_OP_GET_CHAT_MESSAGES) != 0 || bin_put_login(request, &network->login_info) != 0
+			|| bin_put_int(request, chat_id) != 0 || bin_put_int(request, timestamp) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not encode the request");
+		return -1;
+	}
+	if (_net_bin_call(network, &reader) != 0) {
+		return -1;
+	}
+
+	return bin_get_message_list(&reader, &network->soap, messages);
+}
+
+/*
+ * get_pending_notifications through the binary transport, the result is allocated in the soap struct
+ * Returns 0 or -1 if fails
+ */
+int _net_bin_get_notifications(network *network, int timestamp, psdims__sync *sync, psdims__notifications *notifications) {
+	bin_buffer *request = &network->bin_request;
+	bin_reader reader;
+
+	bin_buffer_clear(request);
+	if (bin_put_uint(request, BIN_OP_GET_PENDING_NOTIFICATIONS) != 0 || bin_put_login(request, &network->login_info) != 0
+			|| bin_put_int(request, timestamp) != 0 || bin_put_sync(request, sync) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not encode the request");
+		return -1;
+	}
+	if (_net_bin_call(network, &reader) != 0) {
+		return -1;
+	}
+
+	return bin_get_notifications(&reader, &network->soap, notifications);
+}
+
+
 /*
  *
  *
@@ -140,6 +344,24 @@ network *net_new() {
 	new_network->soap.recv_timeout = 60;			// 60 secs
 
 	soap_init(&new_network->soap);
+
+	// keeps the Retry-After hint of the overloaded responses
+	new_network->n_retries = 0;
+	new_network->retry_after = 0;
+	new_network->fparsehdr = new_network->soap.fparsehdr;
+	new_network->soap.fparsehdr = _net_parse_header;
+	new_network->soap.user = new_network;
+
+	new_network->transport = NET_TRANSPORT_SOAP;
+	new_network->bin_host = NULL;
+	new_network->bin_port = 0;
+	new_network->bin_socket = -1;
+
+#ifdef WITH_ZLIB
+	// accepts compressed responses (Accept-Encoding), the server decides
+	soap_set_imode(&new_network->soap, SOAP_ENC_ZLIB);
+#endif
+
 	return new_network;
 }
 
@@ -153,6 +375,13 @@ void net_free(network *network) {
 	soap_end(&network->soap);
 	soap_done(&network->soap);
 
+	if (network->bin_host != NULL) {
+		_net_bin_close(network);
+		bin_buffer_free(&network->bin_request);
+		bin_buffer_free(&network->bin_response);
+		free(network->bin_host);
+	}
+
 	free(network->serverURL);
 	free(network->login_info.name);
 	free(network->login_info.password);
@@ -180,6 +409,57 @@ int net_bind_network(network *network, char *serverURL) {
 }
 
 
+/*
+ * Selects the transport of the message and notification reads
+ *
+ */
+int net_set_transport(network *network, int transport, char *host, int port) {
+	DEBUG_TRACE_PRINT();
+	char *bin_host;
+
+	if (transport == NET_TRANSPORT_SOAP) {
+		network->transport = NET_TRANSPORT_SOAP;
+		_net_bin_close(network);
+		return 0;
+	}
+
+	if (host == NULL || port <= 0) {
+		DEBUG_FAILURE_PRINTF("Invalid binary transport address");
+		return -1;
+	}
+	if( (bin_host = malloc( sizeof(char)*(strlen(host)+1) )) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate the binary transport host");
+		return -1;
+	}
+	strcpy(bin_host, host);
+
+	// the buffers are kept for every request of the network
+	if (network->bin_host == NULL) {
+		if (bin_buffer_init(&network->bin_request, BIN_MAX_FRAME_BYTES) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not allocate the binary transport buffers");
+			free(bin_host);
+			return -1;
+		}
+		if (bin_buffer_init(&network->bin_response, BIN_MAX_FRAME_BYTES) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not allocate the binary transport buffers");
+			bin_buffer_free(&network->bin_request);
+			free(bin_host);
+			return -1;
+		}
+	}
+	else {
+		_net_bin_close(network);
+		free(network->bin_host);
+	}
+
+	network->bin_host = bin_host;
+	network->bin_port = port;
+	network->transport = NET_TRANSPORT_BINARY;
+
+	return 0;
+}
+
+
 /*
  *
  *
@@ -199,7 +479,9 @@ psdims__user_info *net_login(network *network, char *name, char *password) {
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_user(&network->soap, network->serverURL, "", &login_info, user_info);
+	do {
+		soap_response = soap_call_psdims__get_user(&network->soap, network->serverURL, "", &login_info, user_info);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -249,7 +531,9 @@ psdims__user_info *net_recv_user_info(network *network, char *name) {
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_friend_info(&network->soap, network->serverURL, "", &network->login_info, name, user_info);
+	do {
+		soap_response = soap_call_psdims__get_friend_info(&network->soap, network->serverURL, "", &network->login_info, name, user_info);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -280,7 +564,9 @@ psdims__client_data *net_recv_all_data(network *network) {
 		return NULL;
 	}
 	
-	soap_response = soap_call_psdims__get_all_data(&network->soap, network->serverURL, "", &network->login_info, client_data);
+	do {
+		soap_response = soap_call_psdims__get_all_data(&network->soap, network->serverURL, "", &network->login_info, client_data);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -296,6 +582,33 @@ psdims__client_data *net_recv_all_data(network *network) {
 }
 
 
+psdims__changes *net_recv_changes(network *network, LONG64 cursor) {
+	DEBUG_TRACE_PRINT();
+	int soap_response = 0;
+	psdims__changes *changes;
+	char *soap_error;	
+	
+	if ( (changes = malloc(sizeof(psdims__changes)) ) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for the changes");
+		return NULL;
+	}
+	
+	do {
+		soap_response = soap_call_psdims__get_changes(&network->soap, network->serverURL, "", &network->login_info, cursor, changes);
+	} while (_net_retry(network, soap_response));
+	if( soap_response != SOAP_OK ) {
+		soap_error = malloc(sizeof(char)*200);
+		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
+		DEBUG_FAILURE_PRINTF("Server request failed: %s", soap_error);
+		free(soap_error);
+		free(changes);
+		return NULL;
+	}
+	
+	return changes;
+}
+
+
 /*
  *
  *
@@ -319,7 +632,7 @@ psdims__notifications *net_recv_notifications(network *network, int timestamp, i
 	}
 	
 	// Create sync struct
-	if ( (sync.chat_read_timestamps.chat = malloc(sizeof(psdims__notif_chat_info)*n_chats) ) == NULL ) {
+	if ( (sync.chat_read_timestamps.chat = malloc(sizeof(psdims__notif_chat_info)*n_chats + 1) ) == NULL ) {
 		DEBUG_FAILURE_PRINTF("Could not allocate memory for sync");
 		return NULL;
 	}	
@@ -329,7 +642,19 @@ psdims__notifications *net_recv_notifications(network *network, int timestamp, i
 		sync.chat_read_timestamps.chat[i].timestamp = read_timestamp[i];
 	}
 
-	soap_response = soap_call_psdims__get_pending_notifications(&network->soap, network->serverURL, "", &network->login_info, timestamp, &sync, notification_list);
+	if (network->transport == NET_TRANSPORT_BINARY) {
+		if (_net_bin_get_notifications(network, timestamp, &sync, notification_list) != 0) {
+			free(sync.chat_read_timestamps.chat);
+			free(notification_list);
+			return NULL;
+		}
+		soap_response = SOAP_OK;
+	}
+	else {
+		do {
+			soap_response = soap_call_psdims__get_pending_notifications(&network->soap, network->serverURL, "", &network->login_info, timestamp, &sync, notification_list);
+		} while (_net_retry(network, soap_response));
+	}
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -366,7 +691,18 @@ psdims__message_list *net_recv_pending_messages(network *network, int chat_id, i
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_chat_messages(&network->soap, network->serverURL, "", &network->login_info, chat_id, timestamp, message_list);
+	if (network->transport == NET_TRANSPORT_BINARY) {
+		if (_net_bin_get_chat_messages(network, chat_id, timestamp, message_list) != 0) {
+			free(message_list);
+			return NULL;
+		}
+		soap_response = SOAP_OK;
+	}
+	else {
+		do {
+			soap_response = soap_call_psdims__get_chat_messages(&network->soap, network->serverURL, "", &network->login_info, chat_id, timestamp, message_list);
+		} while (_net_retry(network, soap_response));
+	}
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -402,7 +738,9 @@ psdims__file *net_get_attachment(network *network, int chat_id, int msg_timestam
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_attachment(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, file);
+	do {
+		soap_response = soap_call_psdims__get_attachment(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, file);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -438,7 +776,9 @@ psdims__chat_list *net_get_chat_list(network *network, int timestamp) {
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_chats(&network->soap, network->serverURL, "", &network->login_info, timestamp,  chat_list);
+	do {
+		soap_response = soap_call_psdims__get_chats(&network->soap, network->serverURL, "", &network->login_info, timestamp,  chat_list);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -474,7 +814,9 @@ psdims__user_list *net_get_friend_list(network *network, int timestamp) {
 		return NULL;
 	}
 
-	soap_response = soap_call_psdims__get_friends(&network->soap, network->serverURL, "", &network->login_info, timestamp,  user_list);
+	do {
+		soap_response = soap_call_psdims__get_friends(&network->soap, network->serverURL, "", &network->login_info, timestamp,  user_list);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -505,7 +847,9 @@ int net_user_register(network *network, char *name, char *password, char *inform
 	user_info.password = password;
 	user_info.information = information;
 
-	soap_response = soap_call_psdims__user_register(&network->soap, network->serverURL, "", &user_info, &errcode);
+	do {
+		soap_response = soap_call_psdims__user_register(&network->soap, network->serverURL, "", &user_info, &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -533,7 +877,9 @@ int net_user_unregister(network *network, char *name, char *password){
 	user_info.name = name;
 	user_info.password = password;
 
-	soap_response = soap_call_psdims__user_unregister(&network->soap, network->serverURL, "", &user_info,  &errcode);
+	do {
+		soap_response = soap_call_psdims__user_unregister(&network->soap, network->serverURL, "", &user_info,  &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -561,7 +907,9 @@ int net_create_chat(network *network, char *description, char *member, int *chat
 	new_chat.description = description;
 	new_chat.member = member;
 
-	soap_response = soap_call_psdims__create_chat(&network->soap, network->serverURL, "", &network->login_info, &new_chat, chat_id);
+	do {
+		soap_response = soap_call_psdims__create_chat(&network->soap, network->serverURL, "", &network->login_info, &new_chat, chat_id);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -585,7 +933,9 @@ int net_add_user_to_chat(network *network, char *member, int chat_id) {
 	int errcode = 0;
 	char *soap_error;
 
-	soap_response = soap_call_psdims__add_member(&network->soap, network->serverURL, "", &network->login_info, member, chat_id, &errcode);
+	do {
+		soap_response = soap_call_psdims__add_member(&network->soap, network->serverURL, "", &network->login_info, member, chat_id, &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -609,7 +959,9 @@ int net_remove_user_from_chat(network *network, char *member, int chat_id) {
 	int errcode = 0;
 	char *soap_error;
 
-	soap_response = soap_call_psdims__remove_member(&network->soap, network->serverURL, "", &network->login_info, member, chat_id, &errcode);
+	do {
+		soap_response = soap_call_psdims__remove_member(&network->soap, network->serverURL, "", &network->login_info, member, chat_id, &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -633,7 +985,9 @@ int net_quit_from_chat(network *network, int chat_id) {
 	int errcode = 0;
 	char *soap_error;
 
-	soap_response = soap_call_psdims__quit_from_chat(&network->soap, network->serverURL, "", &network->login_info, chat_id, &errcode);
+	do {
+		soap_response = soap_call_psdims__quit_from_chat(&network->soap, network->serverURL, "", &network->login_info, chat_id, &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -666,7 +1020,11 @@ int net_send_message(network *network, int chat_id, char *text, char *attach_nam
 	message_info.text = text;
 	message_info.file_name = attach_name;
 
-	soap_response = soap_call_psdims__send_message(&network->soap, network->serverURL, "", &network->login_info, chat_id, &message_info, timestamp);
+	_net_compress(network, (text != NULL)? strlen(text) : 0);
+	do {
+		soap_response = soap_call_psdims__send_message(&network->soap, network->serverURL, "", &network->login_info, chat_id, &message_info, timestamp);
+	} while (_net_retry(network, soap_response));
+	_net_compress(network, 0);
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -699,8 +1057,37 @@ int net_send_attachment(network *network, int chat_id, int msg_timestamp, unsign
 	file.__ptr = ptr;
 	file.__size = size;
 
+	_net_compress(network, size);
+	do {
+		soap_response = soap_call_psdims__send_attachment(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, &file, &errcode);
+	} while (_net_retry(network, soap_response));
+	_net_compress(network, 0);
+	if( soap_response != SOAP_OK ) {
+		soap_error = malloc(sizeof(char)*200);
+		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
+		DEBUG_FAILURE_PRINTF("Server request failed: %s", soap_error);
+		free(soap_error);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int net_send_attachment_hash(network *network, int chat_id, int msg_timestamp, char *hash) {
+	DEBUG_TRACE_PRINT();
+	int soap_response = 0;
+	int errcode = 0;
+	char *soap_error;
+
+	if( !network->logged ) {
+		DEBUG_FAILURE_PRINTF("Not logged");
+		return -1;
+	}
 
-	soap_response = soap_call_psdims__send_attachment(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, &file, &errcode);
+	do {
+		soap_response = soap_call_psdims__send_attachment_hash(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, hash, &errcode);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -709,6 +1096,338 @@ int net_send_attachment(network *network, int chat_id, int msg_timestamp, unsign
 		return -1;
 	}
 
+	return (errcode == 0)? 1 : 0;
+}
+
+
+typedef struct net_upload net_upload;
+struct net_upload {
+	network *network;
+	int fd;
+	char hash[CONTENT_HASH_CHARS + 1];
+	int size;
+	int chunk_size;
+	int next_offset;		// of the next chunk to send, protected by mutex
+	int failed;
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Sends chunks of the upload until there are no more, with its own soap context
+ */
+void *_net_upload_worker(void *arg) {
+	net_upload *upload = (net_upload*)arg;
+	network *network = upload->network;
+	struct soap *soap;
+	psdims__chunk chunk;
+	char chunk_hash[CONTENT_HASH_CHARS + 1];
+	unsigned char *buff;
+	int offset, size;
+	int errcode;
+	int tries;
+	int stop;
+
+	soap = soap_copy(&network->soap);
+	buff = malloc(upload->chunk_size + 1);
+	if ( soap == NULL || buff == NULL ) {
+		pthread_mutex_lock(&upload->mutex);
+		upload->failed = 1;
+		pthread_mutex_unlock(&upload->mutex);
+		if ( soap != NULL ) {
+			soap_free(soap);
+		}
+		free(buff);
+		return NULL;
+	}
+	// the retry state of network is only for its own requests
+	soap->user = NULL;
+	soap->fparsehdr = network->fparsehdr;
+
+	while (1) {
+		pthread_mutex_lock(&upload->mutex);
+		offset = upload->next_offset;
+		upload->next_offset += upload->chunk_size;
+		stop = upload->failed || (offset >= upload->size);
+		pthread_mutex_unlock(&upload->mutex);
+		if ( stop ) {
+			break;
+		}
+
+		size = (upload->size - offset < upload->chunk_size)? (upload->size - offset) : upload->chunk_size;
+		if ( pread(upload->fd, buff, size, offset) != size || content_hash_buffer(buff, size, chunk_hash) != 0 ) {
+			DEBUG_FAILURE_PRINTF("Could not read the file");
+			errcode = -1;
+		}
+		else {
+			chunk.data.__ptr = buff;
+			chunk.data.__size = size;
+			chunk.hash = chunk_hash;
+			chunk.offset = offset;
+			chunk.total_size = upload->size;
+
+			errcode = -1;
+			for ( tries = 0 ; tries < NET_CHUNK_RETRIES && errcode != 0 ; tries++ ) {
+				if ( soap_call_psdims__upload_chunk(soap, network->serverURL, "", &network->login_info, upload->hash, &chunk, &errcode) != SOAP_OK ) {
+					DEBUG_FAILURE_PRINTF("Could not send the chunk at %d", offset);
+					errcode = -1;
+				}
+				soap_end(soap);
+			}
+		}
+
+		if ( errcode != 0 ) {
+			pthread_mutex_lock(&upload->mutex);
+			upload->failed = 1;
+			pthread_mutex_unlock(&upload->mutex);
+		}
+	}
+
+	free(buff);
+	soap_destroy(soap);
+	soap_end(soap);
+	soap_free(soap);
+
+	return NULL;
+}
+
+
+int net_upload_attachment(network *network, int chat_id, int msg_timestamp, const char *path) {
+	DEBUG_TRACE_PRINT();
+	int soap_response = 0;
+	psdims__upload_info info;
+	psdims__upload_state state;
+	net_upload upload;
+	pthread_t workers[NET_UPLOAD_STREAMS];
+	int n_workers;
+	int errcode = 0;
+	struct stat st;
+	char *soap_error;
+
+	if( !network->logged ) {
+		DEBUG_FAILURE_PRINTF("Not logged");
+		return -1;
+	}
+
+	if ( (upload.fd = open(path, O_RDONLY)) == -1 ) {
+		DEBUG_FAILURE_PRINTF("Could not read the file");
+		return -1;
+	}
+	if ( fstat(upload.fd, &st) != 0 || content_hash_file(path, upload.hash) != 0 ) {
+		close(upload.fd);
+		return -1;
+	}
+	upload.network = network;
+	upload.size = st.st_size;
+	upload.failed = 0;
+	pthread_mutex_init(&upload.mutex, NULL);
+
+	info.hash = upload.hash;
+	info.size = upload.size;
+	do {
+		soap_response = soap_call_psdims__upload_begin(&network->soap, network->serverURL, "", &network->login_info, &info, &state);
+	} while (_net_retry(network, soap_response));
+	if( soap_response != SOAP_OK || state.chunk_size <= 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not start the upload");
+		pthread_mutex_destroy(&upload.mutex);
+		close(upload.fd);
+		return -1;
+	}
+
+	// from the first chunk the server has not
+	if ( !state.done && state.offset < upload.size ) {
+		upload.chunk_size = state.chunk_size;
+		upload.next_offset = state.offset - (state.offset % state.chunk_size);
+
+		for ( n_workers = 0 ; n_workers < NET_UPLOAD_STREAMS ; n_workers++ ) {
+			if ( upload.next_offset + n_workers*upload.chunk_size >= upload.size ) {
+				break;
+			}
+			if ( pthread_create(&workers[n_workers], NULL, _net_upload_worker, &upload) != 0 ) {
+				break;
+			}
+		}
+		if ( n_workers == 0 ) {
+			upload.failed = 1;
+		}
+		while ( n_workers > 0 ) {
+			pthread_join(workers[--n_workers], NULL);
+		}
+	}
+	pthread_mutex_destroy(&upload.mutex);
+	close(upload.fd);
+
+	if ( upload.failed ) {
+		DEBUG_FAILURE_PRINTF("Could not upload the file");
+		return -1;
+	}
+
+	do {
+		soap_response = soap_call_psdims__upload_commit(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, upload.hash, &errcode);
+	} while (_net_retry(network, soap_response));
+	if( soap_response != SOAP_OK ) {
+		soap_error = malloc(sizeof(char)*200);
+		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
+		DEBUG_FAILURE_PRINTF("Server request failed: %s", soap_error);
+		free(soap_error);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Receives the chunk at offset, requested again while it does not match its hash
+ * Returns 0 or -1 if fails
+ */
+int _net_recv_chunk(network *network, int chat_id, int msg_timestamp, int offset, psdims__chunk *chunk) {
+	char hash[CONTENT_HASH_CHARS + 1];
+	int soap_response;
+	int tries;
+
+	for ( tries = 0 ; tries < NET_CHUNK_RETRIES ; tries++ ) {
+		do {
+			soap_response = soap_call_psdims__get_attachment_chunk(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, offset, chunk);
+		} while (_net_retry(network, soap_response));
+		if ( soap_response != SOAP_OK ) {
+			return -1;
+		}
+		if ( chunk->hash != NULL && content_hash_buffer(chunk->data.__ptr, chunk->data.__size, hash) == 0 && strcmp(hash, chunk->hash) == 0 ) {
+			return 0;
+		}
+		DEBUG_FAILURE_PRINTF("The chunk at %d does not match its hash", offset);
+		soap_dealloc(&network->soap, chunk->data.__ptr);
+	}
+
+	return -1;
+}
+
+
+/*
+ * Downloads the attachment from its signed url with a plain GET, from offset
+ * to the end of the file (Range), and writes it in fd
+ * Returns 0 and the size of the file in offset or -1 if fails
+ */
+int _net_download_url(network *network, int chat_id, int msg_timestamp, int fd, off_t *offset) {
+	int soap_response;
+	char *url_path = NULL;
+	char *url;
+	char range[64];
+	const char *host_end;
+	char *body;
+	size_t body_len = 0;
+	off_t first;
+	int ret_value = -1;
+
+	do {
+		soap_response = soap_call_psdims__get_attachment_url(&network->soap, network->serverURL, "", &network->login_info, chat_id, msg_timestamp, &url_path);
+	} while (_net_retry(network, soap_response));
+	if ( soap_response != SOAP_OK || url_path == NULL ) {
+		soap_end(&network->soap);
+		return -1;
+	}
+
+	// the signed path goes on the scheme and host of the server url
+	host_end = strstr(network->serverURL, "://");
+	host_end = (host_end != NULL)? strchr(host_end + 3, '/') : NULL;
+	if ( host_end == NULL ) {
+		host_end = network->serverURL + strlen(network->serverURL);
+	}
+	if ( (url = malloc((host_end - network->serverURL) + strlen(url_path) + 1)) == NULL ) {
+		soap_end(&network->soap);
+		return -1;
+	}
+	sprintf(url, "%.*s%s", (int)(host_end - network->serverURL), network->serverURL, url_path);
+
+	if ( *offset > 0 ) {
+		sprintf(range, "Range: bytes=%lld-", (long long)*offset);
+		network->soap.http_extra_header = range;
+	}
+
+	if ( soap_GET(&network->soap, url, NULL) == SOAP_OK ) {
+		// 200 when the server sends the whole file
+		first = (network->soap.status == 206)? *offset : 0;
+		if ( (body = soap_http_get_body(&network->soap, &body_len)) != NULL
+				&& soap_end_recv(&network->soap) == SOAP_OK
+				&& (first > 0 || ftruncate(fd, 0) == 0)
+				&& pwrite(fd, body, body_len, first) == (ssize_t)body_len ) {
+			*offset = first + body_len;
+			ret_value = 0;
+		}
+	}
+	network->soap.http_extra_header = NULL;
+	soap_closesock(&network->soap);
+	soap_end(&network->soap);
+	free(url);
+
+	return ret_value;
+}
+
+
+int net_download_attachment(network *network, int chat_id, int msg_timestamp, const char *path) {
+	DEBUG_TRACE_PRINT();
+	psdims__chunk chunk;
+	char *part_path;
+	int fd;
+	off_t offset;
+	int total_size = -1;
+
+	if( !network->logged ) {
+		DEBUG_FAILURE_PRINTF("Not logged");
+		return -1;
+	}
+
+	if ( (part_path = malloc(strlen(path) + 6)) == NULL ) {
+		return -1;
+	}
+	sprintf(part_path, "%s.part", path);
+	if ( (fd = open(part_path, O_WRONLY | O_CREAT, 0600)) == -1 ) {
+		DEBUG_FAILURE_PRINTF("Could not create the file");
+		free(part_path);
+		return -1;
+	}
+	offset = lseek(fd, 0, SEEK_END);
+
+	// the chunks are only requested if the file can not be downloaded from its url
+	if ( offset >= 0 && _net_download_url(network, chat_id, msg_timestamp, fd, &offset) == 0 ) {
+		total_size = offset;
+	}
+
+	while ( offset >= 0 && (total_size < 0 || offset < total_size) ) {
+		if ( _net_recv_chunk(network, chat_id, msg_timestamp, offset, &chunk) != 0 ) {
+			// what was received is not the start of this file
+			if ( total_size < 0 && offset > 0 && ftruncate(fd, 0) == 0 ) {
+				offset = 0;
+				continue;
+			}
+			offset = -1;
+			break;
+		}
+		total_size = chunk.total_size;
+		if ( chunk.data.__size <= 0 && offset < total_size ) {
+			offset = -1;
+		}
+		else if ( pwrite(fd, chunk.data.__ptr, chunk.data.__size, offset) != chunk.data.__size ) {
+			DEBUG_FAILURE_PRINTF("Could not save the received file");
+			offset = -1;
+		}
+		else {
+			offset += chunk.data.__size;
+		}
+		// the chunks are not kept until the soap context is cleaned
+		soap_dealloc(&network->soap, chunk.data.__ptr);
+		soap_dealloc(&network->soap, chunk.hash);
+	}
+	close(fd);
+
+	if ( offset < 0 || rename(part_path, path) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not receive the file");
+		free(part_path);
+		return -1;
+	}
+
+	free(part_path);
 	return 0;
 }
 
@@ -727,7 +1446,9 @@ int net_send_friend_request(network *network, char *user, int *timestamp) {
 		return -1;
 	}
 
-	soap_response = soap_call_psdims__send_friend_request(&network->soap, network->serverURL, "", &network->login_info, user, timestamp);
+	do {
+		soap_response = soap_call_psdims__send_friend_request(&network->soap, network->serverURL, "", &network->login_info, user, timestamp);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -755,7 +1476,9 @@ int net_send_request_accept(network *network, char *user, int *timestamp) {
 		return -1;
 	}
 
-	soap_response = soap_call_psdims__accept_request(&network->soap, network->serverURL, "", &network->login_info, user, timestamp);
+	do {
+		soap_response = soap_call_psdims__accept_request(&network->soap, network->serverURL, "", &network->login_info, user, timestamp);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -784,7 +1507,9 @@ int net_send_request_decline(network *network, char *user) {
 		return -1;
 	}
 
-	soap_response = soap_call_psdims__decline_request(&network->soap, network->serverURL, "", &network->login_info, user, &timestamp);
+	do {
+		soap_response = soap_call_psdims__decline_request(&network->soap, network->serverURL, "", &network->login_info, user, &timestamp);
+	} while (_net_retry(network, soap_response));
 	if( soap_response != SOAP_OK ) {
 		soap_error = malloc(sizeof(char)*200);
 		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
@@ -798,6 +1523,177 @@ int net_send_request_decline(network *network, char *user) {
 }
 
 
+/* =========================================================================
+ *  Batches of operations
+ * =========================================================================*/
+
+void _net_batch_clear(net_batch *batch) {
+	int i;
+
+	for ( i = 0 ; i < batch->ops.__sizenelems ; i++ ) {
+		free(batch->sync[i].chat_read_timestamps.chat);
+		batch->sync[i].chat_read_timestamps.chat = NULL;
+	}
+	batch->ops.__sizenelems = 0;
+}
+
+
+psdims__batch_op *_net_batch_next_op(net_batch *batch, enum psdims__batch_op_type type) {
+	psdims__batch_op *op;
+
+	if ( batch->ops.__sizenelems >= NET_BATCH_MAX_OPS ) {
+		DEBUG_FAILURE_PRINTF("The batch is full");
+		return NULL;
+	}
+
+	op = &batch->op[batch->ops.__sizenelems];
+	op->type = type;
+	op->chat_id = 0;
+	op->timestamp = 0;
+	op->sync = NULL;
+
+	return op;
+}
+
+
+net_batch *net_batch_new(boolean transaction) {
+	DEBUG_TRACE_PRINT();
+	net_batch *batch;
+	int i;
+
+	if ( (batch = malloc(sizeof(net_batch))) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for the batch");
+		return NULL;
+	}
+
+	batch->ops.__sizenelems = 0;
+	batch->ops.op = batch->op;
+	batch->ops.transaction = transaction;
+	for ( i = 0 ; i < NET_BATCH_MAX_OPS ; i++ ) {
+		batch->sync[i].chat_read_timestamps.__sizenelems = 0;
+		batch->sync[i].chat_read_timestamps.chat = NULL;
+	}
+
+	return batch;
+}
+
+
+void net_batch_free(net_batch *batch) {
+	DEBUG_TRACE_PRINT();
+	_net_batch_clear(batch);
+	free(batch);
+}
+
+
+int net_batch_add_notifications(net_batch *batch, int timestamp, int chat_id[], int read_timestamp[], int n_chats) {
+	DEBUG_TRACE_PRINT();
+	psdims__batch_op *op;
+	psdims__sync *sync;
+	int i;
+
+	if ( (op = _net_batch_next_op(batch, BATCH_NOTIFICATIONS)) == NULL ) {
+		return -1;
+	}
+
+	sync = &batch->sync[batch->ops.__sizenelems];
+	if ( n_chats > 0 ) {
+		if ( (sync->chat_read_timestamps.chat = malloc(sizeof(psdims__notif_chat_info)*n_chats)) == NULL ) {
+			DEBUG_FAILURE_PRINTF("Could not allocate memory for sync");
+			return -1;
+		}
+	}
+	sync->chat_read_timestamps.__sizenelems = n_chats;
+	for ( i = 0 ; i < n_chats ; i++ ) {
+		sync->chat_read_timestamps.chat[i].chat_id = chat_id[i];
+		sync->chat_read_timestamps.chat[i].timestamp = read_timestamp[i];
+	}
+
+	op->timestamp = timestamp;
+	op->sync = sync;
+
+	return batch->ops.__sizenelems++;
+}
+
+
+int net_batch_add_messages(net_batch *batch, int chat_id, int timestamp) {
+	DEBUG_TRACE_PRINT();
+	psdims__batch_op *op;
+
+	if ( (op = _net_batch_next_op(batch, BATCH_CHAT_MESSAGES)) == NULL ) {
+		return -1;
+	}
+	op->chat_id = chat_id;
+	op->timestamp = timestamp;
+
+	return batch->ops.__sizenelems++;
+}
+
+
+int net_batch_add_chats(net_batch *batch, int timestamp) {
+	DEBUG_TRACE_PRINT();
+	psdims__batch_op *op;
+
+	if ( (op = _net_batch_next_op(batch, BATCH_CHATS)) == NULL ) {
+		return -1;
+	}
+	op->timestamp = timestamp;
+
+	return batch->ops.__sizenelems++;
+}
+
+
+psdims__batch_results *net_send_batch(network *network, net_batch *batch) {
+	DEBUG_TRACE_PRINT();
+	int soap_response = 0;
+	psdims__batch_results *results;
+	psdims__batch_result *result;
+	char *soap_error;
+	int i;
+
+	if( !network->logged ) {
+		DEBUG_FAILURE_PRINTF("Not logged");
+		return NULL;
+	}
+
+	if ( (results = malloc(sizeof(psdims__batch_results)) ) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for the batch results");
+		return NULL;
+	}
+
+	do {
+		soap_response = soap_call_psdims__batch(&network->soap, network->serverURL, "", &network->login_info, &batch->ops, results);
+	} while (_net_retry(network, soap_response));
+	_net_batch_clear(batch);
+	if( soap_response != SOAP_OK ) {
+		soap_error = malloc(sizeof(char)*200);
+		soap_sprint_fault(&network->soap, soap_error, sizeof(char)*200);
+		DEBUG_FAILURE_PRINTF("Server request failed: %s", soap_error);
+		free(soap_error);
+		free(results);
+		return NULL;
+	}
+
+	for ( i = 0 ; i < results->__sizenelems ; i++ ) {
+		result = &results->result[i];
+		if ( result->notifications != NULL ) {
+			_net_unlink_notification_list(&network->soap, result->notifications);
+			soap_unlink(&network->soap, result->notifications);
+		}
+		if ( result->messages != NULL ) {
+			_net_unlink_message_list(&network->soap, result->messages);
+			soap_unlink(&network->soap, result->messages);
+		}
+		if ( result->chats != NULL ) {
+			_net_unlink_chat_list(&network->soap, result->chats);
+			soap_unlink(&network->soap, result->chats);
+		}
+	}
+	soap_unlink(&network->soap, results->result);
+
+	return results;
+}
+
+
 void net_free_file(psdims__file *file) {
 	DEBUG_TRACE_PRINT();
 	free(file->__ptr);
@@ -889,3 +1785,30 @@ void net_free_chat_list(psdims__chat_list *chats) {
 }
 
 
+void net_free_changes(psdims__changes *changes) {
+	DEBUG_TRACE_PRINT();
+	free(changes);
+}
+
+
+void net_free_batch_results(psdims__batch_results *results) {
+	DEBUG_TRACE_PRINT();
+	int i;
+
+	for ( i = 0 ; i < results->__sizenelems ; i++ ) {
+		if ( results->result[i].notifications != NULL ) {
+			net_free_notification_list(results->result[i].notifications);
+		}
+		if ( results->result[i].messages != NULL ) {
+			net_free_message_list(results->result[i].messages);
+			free(results->result[i].messages);
+		}
+		if ( results->result[i].chats != NULL ) {
+			net_free_chat_list(results->result[i].chats);
+		}
+	}
+	free(results->result);
+	free(results);
+}
+
+
@@ -29,14 +29,38 @@
 
 #include "soapH.h"
 #include "bool.h"
+#include "bin_codec.h"
 //#include "psdims.nsmap"
 
+// max operations sent in a single batch request
+#define NET_BATCH_MAX_OPS (64)
+
+// transport of the message and notification reads, the rest are always soap
+#define NET_TRANSPORT_SOAP		(0)
+#define NET_TRANSPORT_BINARY	(1)
+
 typedef struct network network;
 struct network {
 	boolean logged;
 	psdims__login_info login_info;
 	char *serverURL;
 	struct soap soap;
+	int n_retries;			// of the current request
+	int retry_after;		// Retry-After of the last response, 0 if none
+	int (*fparsehdr)(struct soap*, const char*, const char*);	// default gsoap header parser
+	int transport;
+	char *bin_host;			// of the binary transport, NULL if it was never set
+	int bin_port;
+	int bin_socket;			// -1 if not connected
+	bin_buffer bin_request;
+	bin_buffer bin_response;
+};
+
+typedef struct net_batch net_batch;
+struct net_batch {
+	psdims__batch_ops ops;
+	psdims__batch_op op[NET_BATCH_MAX_OPS];
+	psdims__sync sync[NET_BATCH_MAX_OPS];	// of the notification operations
 };
 
 /*
@@ -57,6 +81,14 @@ void net_free(network *network);
  */
 int net_bind_network(network *network, char *serverURL);
 
+/*
+ * Sends the message and notification reads through the binary transport
+ * of the server (host and port), or through soap again with NET_TRANSPORT_SOAP.
+ * The connection is opened on the first read
+ * Returns 0 or -1 if fails
+ */
+int net_set_transport(network *network, int transport, char *host, int port);
+
 /*
  *
  *
@@ -82,6 +114,13 @@ void net_logout(network *network);
  */
  psdims__client_data *net_recv_all_data(network *network);
 
+/*
+ * The changes of the client data after cursor (-1 for all of them).
+ * The lists belong to the soap context, like the ones of net_recv_all_data
+ * Returns the changes or NULL if fails
+ */
+psdims__changes *net_recv_changes(network *network, LONG64 cursor);
+
 /*
  *
  *
@@ -167,6 +206,27 @@ int net_send_message(network *network, int chat_id, char *text, char *attach_nam
  */
 int net_send_attachment(network *network, int chat_id, int msg_timestamp, unsigned char *ptr, int size);
 
+/*
+ * Attaches the file the server already has with that content hash
+ * Returns 1 if attached, 0 if the server has not the file or -1 if fails
+ */
+int net_send_attachment_hash(network *network, int chat_id, int msg_timestamp, char *hash);
+
+/*
+ * Uploads the file in chunks, several of them at once, and attaches it. A failed
+ * upload is resumed by the next call from the last chunk the server stored
+ * Returns 0 or -1 if fails
+ */
+int net_upload_attachment(network *network, int chat_id, int msg_timestamp, const char *path);
+
+/*
+ * Downloads the attached file to path, through path.part, from its signed url
+ * or in chunks if it can not. A failed download is resumed by the next call
+ * from the end of path.part
+ * Returns 0 or -1 if fails
+ */
+int net_download_attachment(network *network, int chat_id, int msg_timestamp, const char *path);
+
 /*
  *
  *
@@ -185,6 +245,32 @@ int net_send_request_accept(network *network, char *user, int *timestamp);
  */
 int net_send_request_decline(network *network, char *user);
 
+/*
+ * Allocates an empty batch of operations. If transaction is TRUE,
+ * the server runs all of them on the same snapshot of the data
+ * Returns a pointer to the batch or NULL if fails
+ */
+net_batch *net_batch_new(boolean transaction);
+
+void net_batch_free(net_batch *batch);
+
+/*
+ * Queue an operation in the batch, they are sent with net_send_batch
+ * Return the position of its result or -1 if the batch is full
+ */
+int net_batch_add_notifications(net_batch *batch, int timestamp, int chat_id[], int read_timestamp[], int n_chats);
+
+int net_batch_add_messages(net_batch *batch, int chat_id, int timestamp);
+
+int net_batch_add_chats(net_batch *batch, int timestamp);
+
+/*
+ * Sends all the queued operations in a single request and empties the batch.
+ * The result of every operation has its own error code
+ * Returns the results (freed with net_free_batch_results) or NULL if fails
+ */
+psdims__batch_results *net_send_batch(network *network, net_batch *batch);
+
 
 /*
  *
@@ -206,6 +292,10 @@ void net_free_chat();
 
 void net_free_chat_list(psdims__chat_list *chats);
 
+void net_free_changes(psdims__changes *changes);
+
+void net_free_batch_results(psdims__batch_results *results);
+
 
 
 #endif /* __NETWORK */
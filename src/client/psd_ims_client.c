@@ -51,9 +51,13 @@
 	(strlen(string) + sizeof(char))
 
 
-int _recv_messages(psd_ims_client *client, chat_info *chat) {
+/*
+ * Adds the received messages to the chat. If it succeeds, the content
+ * of the list is freed
+ * Returns the number of added messages or -1 if fails
+ */
+int _add_recv_messages(psd_ims_client *client, chat_info *chat, psdims__message_list *list) {
 	DEBUG_TRACE_PRINT();
-	psdims__message_list *list;
 	char **sender;
 	char **text;
 	char **attach_path;
@@ -61,21 +65,10 @@ int _recv_messages(psd_ims_client *client, chat_info *chat) {
 
 	int n_messages;
 	int i;
-	int timestamp;
 	int chat_id;
 
-	cha_get_messages_timestamp(chat, timestamp);
 	chat_id = cha_get_id(chat);
 
-
-	pthread_mutex_lock(&client->network_mutex);
-	if( (list = net_recv_pending_messages(client->network, chat_id, timestamp)) == NULL ) {
-		pthread_mutex_unlock(&client->network_mutex);
-		DEBUG_FAILURE_PRINTF("Could not get the message list");
-		return -1;
-	}
-	pthread_mutex_unlock(&client->network_mutex);
-
 	sender = (char**)malloc(sizeof(char*)*list->__sizenelems);
 	text = (char**)malloc(sizeof(char*)*list->__sizenelems);
 	attach_path = (char**)malloc(sizeof(char*)*list->__sizenelems);
@@ -113,6 +106,175 @@ int _recv_messages(psd_ims_client *client, chat_info *chat) {
 }
 
 
+int _recv_messages(psd_ims_client *client, chat_info *chat) {
+	DEBUG_TRACE_PRINT();
+	psdims__message_list *list;
+	int timestamp;
+	int chat_id;
+
+	cha_get_messages_timestamp(chat, timestamp);
+	chat_id = cha_get_id(chat);
+
+	pthread_mutex_lock(&client->network_mutex);
+	if( (list = net_recv_pending_messages(client->network, chat_id, timestamp)) == NULL ) {
+		pthread_mutex_unlock(&client->network_mutex);
+		DEBUG_FAILURE_PRINTF("Could not get the message list");
+		return -1;
+	}
+	pthread_mutex_unlock(&client->network_mutex);
+
+	return _add_recv_messages(client, chat, list);
+}
+
+
+/*
+ * Receives the messages of several chats in a single batch request
+ * Returns the number of received messages or -1 if any chat fails
+ */
+int _recv_messages_batch(psd_ims_client *client, chat_info *chats[], int n_chats) {
+	DEBUG_TRACE_PRINT();
+	net_batch *batch;
+	psdims__batch_results *results;
+	int timestamp;
+	int chat_id;
+	int n_messages = 0;
+	int ret_val = 0;
+	int ret;
+	int i;
+
+	if (n_chats == 0) {
+		return 0;
+	}
+	if ( (batch = net_batch_new(FALSE)) == NULL ) {
+		return -1;
+	}
+	for ( i = 0 ; i < n_chats ; i++ ) {
+		cha_get_messages_timestamp(chats[i], timestamp);
+		chat_id = cha_get_id(chats[i]);
+		net_batch_add_messages(batch, chat_id, timestamp);
+	}
+
+	pthread_mutex_lock(&client->network_mutex);
+	results = net_send_batch(client->network, batch);
+	pthread_mutex_unlock(&client->network_mutex);
+	net_batch_free(batch);
+	if ( results == NULL || results->__sizenelems != n_chats ) {
+		DEBUG_FAILURE_PRINTF("Could not get the message lists");
+		if ( results != NULL ) {
+			net_free_batch_results(results);
+		}
+		return -1;
+	}
+
+	for ( i = 0 ; i < n_chats ; i++ ) {
+		if ( results->result[i].error != 0 || results->result[i].messages == NULL ) {
+			DEBUG_FAILURE_PRINTF("Could not get the chat messages");
+			ret_val = -1;
+			continue;
+		}
+		if ( (ret = _add_recv_messages(client, chats[i], results->result[i].messages)) < 0 ) {
+			ret_val = -1;
+			continue;
+		}
+		n_messages += ret;
+		free(results->result[i].messages);
+		results->result[i].messages = NULL;
+	}
+	net_free_batch_results(results);
+
+	return (ret_val < 0)? ret_val : n_messages;
+}
+
+
+/*
+ * Adds a received chat with its members
+ * Returns 0 or -1 if fails
+ */
+int _add_recv_chat(psd_ims_client *client, psdims__chat_info *info) {
+	DEBUG_TRACE_PRINT();
+	friend_info **members;
+	char **member_names;
+	int ret;
+	int j;
+
+	DEBUG_INFO_PRINTF("Adding chat <%d, %s>", info->chat_id, info->description);
+	if ( (members = malloc(sizeof(friend_info *)*info->members.__sizenelems)) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for temp member list");
+		return -1;
+	}
+	if ( (member_names = malloc(sizeof(char *)*info->members.__sizenelems)) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for temp member list");
+		free(members);
+		return -1;
+	}
+
+	pthread_mutex_lock(&client->friends_mutex);	
+	for ( j = 0 ; j < info->members.__sizenelems ; j ++ ) {
+		members[j] = fri_find_friend(client->friends, info->members.name[j].string);
+		member_names[j] = info->members.name[j].string;
+		DEBUG_INFO_PRINTF("Member <%d, %s, %s>", j , member_names[j], ((members[j] != NULL)? "FRIEND" : "NOT FRIEND") );
+	}
+	pthread_mutex_unlock(&client->friends_mutex);
+	
+	pthread_mutex_lock(&client->chats_mutex);
+	ret = cha_add_chat(client->chats, info->chat_id, info->description, info->admin, members, member_names, 
+			info->members.__sizenelems, MAX_MEMBERS, MAX_MESSAGES, info->read_timestamp, info->all_read_timestamp);
+	pthread_mutex_unlock(&client->chats_mutex);
+	if ( ret != 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not add chat");
+	}
+
+	free(members);
+	free(member_names);
+	return (ret != 0)? -1 : 0;
+}
+
+
+/*
+ * Sets the members of a known chat to the received ones.
+ * Must be called with chats_mutex locked
+ * Returns 0 or -1 if fails
+ */
+int _sync_chat_members(psd_ims_client *client, chat_info *chat, psdims__chat_info *info) {
+	DEBUG_TRACE_PRINT();
+	member_iterator *iter;
+	member_info *member;
+	char **gone;
+	int n_gone;
+	int j;
+
+	for ( j = 0 ; j < info->members.__sizenelems ; j ++ ) {
+		if ( member_find_member(cha_members(chat), info->members.name[j].string) == NULL ) {
+			cha_add_member(chat, fri_find_friend(client->friends, info->members.name[j].string), info->members.name[j].string);
+		}
+	}
+
+	// the list can not change while it is iterated
+	if ( (gone = malloc(sizeof(char *)*(member_num_members(cha_members(chat)) + 1))) == NULL ) {
+		return -1;
+	}
+	n_gone = 0;
+	for ( iter = member_get_members_iterator(cha_members(chat)) ; iter != NULL ; member_iterator_next(cha_members(chat), iter) ) {
+		member = member_get_info(iter);
+		for ( j = 0 ; j < info->members.__sizenelems ; j ++ ) {
+			if ( strcmp(member_name(member), info->members.name[j].string) == 0 ) {
+				break;
+			}
+		}
+		if ( j == info->members.__sizenelems ) {
+			gone[n_gone++] = member_name(member);
+		}
+	}
+	for ( j = 0 ; j < n_gone ; j++ ) {
+		DEBUG_INFO_PRINTF("removing member <%d, %s>", info->chat_id, gone[j]);
+		cha_del_member(chat, gone[j]);
+	}
+
+	free(gone);
+	return 0;
+}
+
+
 /* =========================================================================
  *  Client struct
  * =========================================================================*/
@@ -130,6 +292,7 @@ psd_ims_client *psd_new_client() {
 	client->user_pass = NULL;
 	client->last_connection = 0; //TODO change this
 	client->last_notif_timestamp = 0;
+	client->sync_cursor = -1;
 
 	pthread_mutex_init(&client->new_chats_mutex, NULL);
 	pthread_mutex_init(&client->chats_mutex, NULL);
@@ -141,6 +304,9 @@ psd_ims_client *psd_new_client() {
 	client->requests = req_new(MAX_FRIEND_REQUESTS);
 	client->chats = cha_new(MAX_CHATS);
 	client->network = net_new();
+	if ((client->attach_cache = att_cache_new(ATTACH_CACHE_DIR, ATTACH_CACHE_BUDGET)) == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not open the attachment cache");
+	}
 
 	return client;
 }
@@ -161,6 +327,9 @@ void psd_free_client(psd_ims_client *client) {
 	req_free(client->requests);
 	cha_free(client->chats);
 	net_free(client->network);	
+	if (client->attach_cache != NULL) {
+		att_cache_free(client->attach_cache);
+	}
 
 	free(client->user_name);
 	free(client->user_pass);
@@ -169,6 +338,18 @@ void psd_free_client(psd_ims_client *client) {
 }
 
 
+/*
+ * Sets the max bytes of the attachment cache, 0 if unlimited
+ */
+void psd_set_attach_cache_budget(psd_ims_client *client, long long budget) {
+	DEBUG_TRACE_PRINT();
+
+	if (client->attach_cache != NULL) {
+		att_cache_set_budget(client->attach_cache, budget);
+	}
+}
+
+
 /*
  * Sets client name
  * Returns o or -1 if fails
@@ -224,6 +405,17 @@ int psd_bind_network(psd_ims_client *client, char *serverURL) {
 }
 
 
+int psd_bind_binary_transport(psd_ims_client *client, char *host, int port) {
+	int ret_value;
+
+	pthread_mutex_lock(&client->network_mutex);
+	ret_value = net_set_transport(client->network, NET_TRANSPORT_BINARY, host, port);
+	pthread_mutex_unlock(&client->network_mutex);
+
+	return ret_value;
+}
+
+
 /*
  * Gets the user information from the server
  * Returns 0 or -1 if fails
@@ -279,6 +471,7 @@ void psd_logout(psd_ims_client *client) {
 	client->user_info = NULL;
 	client->last_connection = 0; //TODO change this
 	client->last_notif_timestamp = 0;
+	client->sync_cursor = -1;
 
 	// Free structures
 	fri_free(client->friends);
@@ -331,96 +524,89 @@ int psd_user_unregister(psd_ims_client *client, char *name, char *password) {
 
 
 /*
- * Receive the client data since the beginning of time
+ * Receive the changes of the client data since the last sync, all of them
+ * the first time or when the server has no longer the older changes
  * Returns 0 or -1 if fails
  */
-int psd_recv_all_data(psd_ims_client *client) {
+int psd_recv_changes(psd_ims_client *client) {
 	DEBUG_TRACE_PRINT();
-	psdims__client_data *client_data;
-	psdims__chat_list *chats;
-	int i, j;
-	friend_info **members;
-	char **member_names;
+	psdims__changes *changes;
+	chat_info *chat;
+	int i;
 
 	pthread_mutex_lock(&client->network_mutex);
-	if( (client_data = net_recv_all_data(client->network)) == NULL ) {
+	if( (changes = net_recv_changes(client->network, client->sync_cursor)) == NULL ) {
 		pthread_mutex_unlock(&client->network_mutex);
 		DEBUG_FAILURE_PRINTF("Could not retrieve the client data");
 		return -1;
 	}
 	pthread_mutex_unlock(&client->network_mutex);
 
-	client->last_notif_timestamp = client_data->timestamp;
+	if (changes->snapshot) {
+		client->last_notif_timestamp = changes->timestamp;
+	}
 
 	// new friend requests
 	pthread_mutex_lock(&client->requests_mutex);
-	for( i = 0 ; i < client_data->friend_requests.__sizenelems ; i++ ) {
-		DEBUG_INFO_PRINTF("adding request <%d, %s>",client_data->friend_requests.user[i].send_date, client_data->friend_requests.user[i].name.string);
-		req_add_request(client->requests, client_data->friend_requests.user[i].name.string, client_data->friend_requests.user[i].send_date);
+	for( i = 0 ; i < changes->friend_requests.__sizenelems ; i++ ) {
+		DEBUG_INFO_PRINTF("adding request <%d, %s>",changes->friend_requests.user[i].send_date, changes->friend_requests.user[i].name.string);
+		req_add_request(client->requests, changes->friend_requests.user[i].name.string, changes->friend_requests.user[i].send_date);
 	}
-	req_list_set_timestamp(client->requests, client_data->timestamp);
+	req_list_set_timestamp(client->requests, changes->timestamp);
 	pthread_mutex_unlock(&client->requests_mutex);
 
 	// new friends
 	pthread_mutex_lock(&client->friends_mutex);
-	for( i = 0 ; i < client_data->friends.__sizenelems ; i++ ) {
-		DEBUG_INFO_PRINTF("adding friend <%s, %s>", client_data->friends.user[i].name, client_data->friends.user[i].information);
-		fri_add_friend(client->friends, client_data->friends.user[i].name, client_data->friends.user[i].information);
+	for( i = 0 ; i < changes->friends.__sizenelems ; i++ ) {
+		DEBUG_INFO_PRINTF("adding friend <%s, %s>", changes->friends.user[i].name, changes->friends.user[i].information);
+		fri_add_friend(client->friends, changes->friends.user[i].name, changes->friends.user[i].information);
 	}
-	fri_set_timestamp(client->friends, client_data->timestamp);
+	fri_set_timestamp(client->friends, changes->timestamp);
 	pthread_mutex_unlock(&client->friends_mutex);
 	
-	// add chats
-	chats = &(client_data->chats);
-	for( i = 0 ; i < chats->__sizenelems ; i++ ) {
-		DEBUG_INFO_PRINTF("Adding chat <%d, %s>", chats->chat_info[i].chat_id, chats->chat_info[i].description);
-		// Alloc member list
-		if ( (members = malloc(sizeof(friend_info *)*chats->chat_info[i].members.__sizenelems)) == NULL ) {
-			DEBUG_FAILURE_PRINTF("Could not allocate memory for temp member list");
-			net_free_chat_list(chats);
-			return -1;
-		}
-		if ( (member_names = malloc(sizeof(char *)*chats->chat_info[i].members.__sizenelems)) == NULL ) {
-			DEBUG_FAILURE_PRINTF("Could not allocate memory for temp member list");
-			net_free_chat_list(chats);
-			free(members);
-			return -1;
-		}
-
-		pthread_mutex_lock(&client->friends_mutex);	
-		for ( j = 0 ; j < chats->chat_info[i].members.__sizenelems ; j ++ ) {
-			members[j] = fri_find_friend(client->friends, chats->chat_info[i].members.name[j].string);
-			member_names[j] = chats->chat_info[i].members.name[j].string;
-			DEBUG_INFO_PRINTF("Member <%d, %s, %s>", j , member_names[j], ((members[j] != NULL)? "FRIEND" : "NOT FRIEND") );
-		}
-		pthread_mutex_unlock(&client->friends_mutex);
-		
+	// new or changed chats, the admins are updated by the notifications
+	for( i = 0 ; i < changes->chats.__sizenelems ; i++ ) {
 		pthread_mutex_lock(&client->chats_mutex);
-		if ( cha_add_chat(client->chats, chats->chat_info[i].chat_id, chats->chat_info[i].description, 
-				chats->chat_info[i].admin, members, member_names, chats->chat_info[i].members.__sizenelems, 
-				MAX_MEMBERS, MAX_MESSAGES, chats->chat_info[i].read_timestamp, chats->chat_info[i].all_read_timestamp) != 0 ) {
+		if ( (chat = cha_find_chat(client->chats, changes->chats.chat_info[i].chat_id)) != NULL ) {
+			pthread_mutex_lock(&client->friends_mutex);
+			_sync_chat_members(client, chat, &(changes->chats.chat_info[i]));
+			pthread_mutex_unlock(&client->friends_mutex);
 			pthread_mutex_unlock(&client->chats_mutex);
-			net_free_chat_list(chats);
-			DEBUG_FAILURE_PRINTF("Could not add chat");
+			continue;
 		}
-	
 		pthread_mutex_unlock(&client->chats_mutex);
-
-		// Free member list
-		free(members);
-		free(member_names);
+		_add_recv_chat(client, &(changes->chats.chat_info[i]));
 	}
-	
+
+	// chats the user left
 	pthread_mutex_lock(&client->chats_mutex);
-	cha_set_timestamp(client->chats, chats->last_timestamp);
+	for( i = 0 ; i < changes->left_chats.__sizenelems ; i++ ) {
+		DEBUG_INFO_PRINTF("removing chat <%d>", changes->left_chats.chat[i].chat_id);
+		cha_del_chat(client->chats, changes->left_chats.chat[i].chat_id);
+	}
+	if (changes->snapshot) {
+		cha_set_timestamp(client->chats, changes->chats.last_timestamp);
+	}
 	pthread_mutex_unlock(&client->chats_mutex);
 
-	//free_client_data(client_data);
+	client->sync_cursor = changes->cursor;
+	net_free_changes(changes);
 
 	return 0;
 }
 
 
+/*
+ * Receive the client data since the beginning of time
+ * Returns 0 or -1 if fails
+ */
+int psd_recv_all_data(psd_ims_client *client) {
+	DEBUG_TRACE_PRINT();
+
+	return psd_recv_changes(client);
+}
+
+
 /*
  * Receive the pending notifications
  * Returns the number of received notifications or -1 if fails
@@ -438,21 +624,27 @@ int psd_recv_notifications(psd_ims_client *client) {
 	int n_sync_chats = 0;
 	
 
+	// only the chats read since the last sync
 	pthread_mutex_lock(&client->chats_mutex);
-	n_sync_chats = cha_num_chats(client->chats);
-	
-	
-	chats_id = malloc(sizeof(int)*n_sync_chats);
-	chats_read_timestamp = malloc(sizeof(int)*n_sync_chats);
+	chats_id = malloc(sizeof(int)*(cha_num_chats(client->chats) + 1));
+	chats_read_timestamp = malloc(sizeof(int)*(cha_num_chats(client->chats) + 1));
+	if ( chats_id == NULL || chats_read_timestamp == NULL ) {
+		pthread_mutex_unlock(&client->chats_mutex);
+		free(chats_id);
+		free(chats_read_timestamp);
+		DEBUG_FAILURE_PRINTF("Could not allocate memory for the sync list");
+		return -1;
+	}
 
 	iterator = cha_get_chats_iterator(client->chats);
-	i = 0;
 	while (iterator != NULL) {
 		chat = cha_get_info(iterator);
-		chats_id[i] = cha_get_id(chat);
-		chats_read_timestamp[i] = cha_read_timestamp(chat);
+		if ( cha_read_dirty(chat) ) {
+			chats_id[n_sync_chats] = cha_get_id(chat);
+			chats_read_timestamp[n_sync_chats] = cha_read_timestamp(chat);
+			n_sync_chats++;
+		}
 		cha_iterator_next(client->chats, iterator);
-		i++;
 	}
 	pthread_mutex_unlock(&client->chats_mutex);
 
@@ -466,6 +658,15 @@ int psd_recv_notifications(psd_ims_client *client) {
 	}
 	pthread_mutex_unlock(&client->network_mutex);
 
+	// the chats read meanwhile stay dirty
+	pthread_mutex_lock(&client->chats_mutex);
+	for( i = 0 ; i < n_sync_chats ; i++ ) {
+		if ( (chat = cha_find_chat(client->chats, chats_id[i])) != NULL ) {
+			cha_set_read_synced(chat, chats_read_timestamp[i]);
+		}
+	}
+	pthread_mutex_unlock(&client->chats_mutex);
+
 	free(chats_id);
 	free(chats_read_timestamp);
 
@@ -497,7 +698,7 @@ int psd_recv_notifications(psd_ims_client *client) {
 	for( i = 0 ; i < notifications->chat_members.__sizenelems ; i++ ) {
 		if ( (chat = cha_find_chat(client->chats, notifications->chat_members.member[i].chat_id)) == NULL ) {
 			pthread_mutex_unlock(&client->chats_mutex);
-			psd_recv_chats(client);
+			psd_recv_changes(client);
 			pthread_mutex_lock(&client->chats_mutex);
 			if ( (chat = cha_find_chat(client->chats, notifications->chat_members.member[i].chat_id)) == NULL ) {
 				DEBUG_FAILURE_PRINTF("Crap... a member in a ghost chat");
@@ -512,7 +713,7 @@ int psd_recv_notifications(psd_ims_client *client) {
 	for( i = 0 ; i < notifications->rem_chat_members.__sizenelems ; i++ ) {
 		if ( (chat = cha_find_chat(client->chats, notifications->rem_chat_members.member[i].chat_id)) == NULL ) {
 			pthread_mutex_unlock(&client->chats_mutex);
-			psd_recv_chats(client);
+			psd_recv_changes(client);
 			pthread_mutex_lock(&client->chats_mutex);
 			if ( (chat = cha_find_chat(client->chats, notifications->rem_chat_members.member[i].chat_id)) == NULL ) {
 				DEBUG_FAILURE_PRINTF("Crap... a member deleted from ghost chat");
@@ -526,7 +727,7 @@ int psd_recv_notifications(psd_ims_client *client) {
 	for( i = 0 ; i < notifications->chat_admins.__sizenelems ; i++ ) {
 		if ( (chat = cha_find_chat(client->chats, notifications->chat_admins.member[i].chat_id)) == NULL ) {
 			pthread_mutex_unlock(&client->chats_mutex);
-			psd_recv_chats(client);
+			psd_recv_changes(client);
 			pthread_mutex_lock(&client->chats_mutex);
 			if ( (chat = cha_find_chat(client->chats, notifications->chat_admins.member[i].chat_id)) == NULL ) {
 				DEBUG_FAILURE_PRINTF("Crap... an admin of a ghost chat");
@@ -547,7 +748,7 @@ int psd_recv_notifications(psd_ims_client *client) {
 		DEBUG_INFO_PRINTF("chat with messages <%d>",notifications->chats_with_messages.chat[i].chat_id);
 		if ( (chat = cha_find_chat(client->chats, notifications->chats_with_messages.chat[i].chat_id)) == NULL ) {
 			pthread_mutex_unlock(&client->chats_mutex);
-			psd_recv_chats(client);
+			psd_recv_changes(client);
 			pthread_mutex_lock(&client->chats_mutex);
 			if ( (chat = cha_find_chat(client->chats, notifications->chats_with_messages.chat[i].chat_id)) == NULL ) {
 				DEBUG_FAILURE_PRINTF("Crap, you have message from a ghost chat");
@@ -559,7 +760,7 @@ int psd_recv_notifications(psd_ims_client *client) {
 	for( i = 0 ; i < notifications->chats_read_times.__sizenelems ; i++ ) {
 		if ( (chat = cha_find_chat(client->chats, notifications->chats_read_times.chat[i].chat_id)) == NULL ) {
 			pthread_mutex_unlock(&client->chats_mutex);
-			psd_recv_chats(client);
+			psd_recv_changes(client);
 			pthread_mutex_lock(&client->chats_mutex);
 			if ( (chat = cha_find_chat(client->chats, notifications->chats_read_times.chat[i].chat_id)) == NULL ) {
 				DEBUG_FAILURE_PRINTF("Crap, you have double check info from a ghost chat");
@@ -628,22 +829,26 @@ int psd_recv_pending_messages(psd_ims_client *client, int chat_id) {
 int psd_recv_all_messages(psd_ims_client *client) {
 	DEBUG_TRACE_PRINT();
 	chat_iterator *iterator;
-	chat_info *chat;
+	chat_info *chats[NET_BATCH_MAX_OPS];
+	int n_chats = 0;
 	int ret_val = 0;
-	int ret;
 
+	// the chats are asked in batches, a request for each NET_BATCH_MAX_OPS chats
 	pthread_mutex_lock(&client->chats_mutex);
 	iterator = cha_get_chats_iterator(client->chats);
 	while( iterator != NULL ) {
-		chat = cha_get_info(iterator);
-		if( (ret = _recv_messages(client, chat)) < 0 ) {
-			DEBUG_FAILURE_PRINTF("Could not get the chat messages");
-			ret_val = ret;
-			cha_iterator_next(client->chats, iterator);
-			continue;
+		chats[n_chats++] = cha_get_info(iterator);
+		if ( n_chats == NET_BATCH_MAX_OPS ) {
+			if ( _recv_messages_batch(client, chats, n_chats) < 0 ) {
+				ret_val = -1;
+			}
+			n_chats = 0;
 		}
 		iterator = cha_iterator_next(client->chats, iterator);
 	}
+	if ( _recv_messages_batch(client, chats, n_chats) < 0 ) {
+		ret_val = -1;
+	}
 	pthread_mutex_unlock(&client->chats_mutex);
 
 	return ret_val;
@@ -658,24 +863,28 @@ int psd_recv_all_pending_messages(psd_ims_client *client) {
 	DEBUG_TRACE_PRINT();
 	chat_iterator *iterator;
 	chat_info *chat;
+	chat_info *chats[NET_BATCH_MAX_OPS];
+	int n_chats = 0;
 	int ret_val = 0;
-	int ret;
 
+	// the pending chats are asked in batches, a request for each NET_BATCH_MAX_OPS chats
 	pthread_mutex_lock(&client->chats_mutex);
 	iterator = cha_get_chats_iterator(client->chats);
 	while( iterator != NULL ) {
 		chat = cha_get_info(iterator);
-		if (cha_pending(chat) <= 0 ) {
-			cha_iterator_next(client->chats, iterator);
-			continue;
+		if (cha_pending(chat) > 0 ) {
+			chats[n_chats++] = chat;
 		}
-		if( (ret = _recv_messages(client, chat)) < 0 ) {
-			DEBUG_FAILURE_PRINTF("Could not get the chat messages");
-			ret_val = ret;
-			cha_iterator_next(client->chats, iterator);
-			continue;
+		if ( n_chats == NET_BATCH_MAX_OPS ) {
+			if ( _recv_messages_batch(client, chats, n_chats) < 0 ) {
+				ret_val = -1;
+			}
+			n_chats = 0;
 		}
-		cha_iterator_next(client->chats, iterator);
+		iterator = cha_iterator_next(client->chats, iterator);
+	}
+	if ( _recv_messages_batch(client, chats, n_chats) < 0 ) {
+		ret_val = -1;
 	}
 	pthread_mutex_unlock(&client->chats_mutex);
 
@@ -684,48 +893,56 @@ int psd_recv_all_pending_messages(psd_ims_client *client) {
 
 
 /*
- *
- *
+ * Receive the message's attachment, only if it is not in the attachment cache yet
+ * Returns 0 or -1 if fails
  */
 int psd_recv_message_attachment(psd_ims_client *client, int chat_id, int msg_timestamp) {
 	DEBUG_TRACE_PRINT();
 	
-	psdims__file *file;
-	char file_path[MAX_FILE_PATH_CHARS];
-	FILE *fd;
-	struct stat st;
+	char file_path[ATT_CACHE_PATH_CHARS];
+	char cache_path[ATT_CACHE_PATH_CHARS];
 
-	pthread_mutex_lock(&client->network_mutex);
-	if( (file = net_get_attachment(client->network, chat_id, msg_timestamp)) == NULL ) {
-		pthread_mutex_unlock(&client->network_mutex);
-		DEBUG_FAILURE_PRINTF("Could not receive the chat list");
+	if( client->attach_cache == NULL ) {
+		DEBUG_FAILURE_PRINTF("There is no attachment cache");
 		return -1;
 	}
-	pthread_mutex_unlock(&client->network_mutex);
-	
-	if( stat(ATTACH_FILES_DIR_RCV, &st) == -1 ) {
-		mkdir(ATTACH_FILES_DIR_RCV, 0700);
+
+	// Received or sent before, there is no need to ask the server
+	if( att_cache_find(client->attach_cache, chat_id, msg_timestamp, cache_path) ) {
+		DEBUG_INFO_PRINTF("Attachment found in the cache");
+		return 0;
 	}
-	
-	// Create the file path
-	create_file_path_rcv(file_path, chat_id, msg_timestamp);
 
-	// Write the file in the disk
-	if( (fd = fopen(file_path, "w")) == NULL ) {
-		DEBUG_FAILURE_PRINTF("Could not create the file");
-		net_free_file(file);
+	att_cache_download_path(client->attach_cache, chat_id, msg_timestamp, file_path);
+
+	// Write the file in the disk, resuming a failed download
+	pthread_mutex_lock(&client->network_mutex);
+	if( net_download_attachment(client->network, chat_id, msg_timestamp, file_path) != 0 ) {
+		pthread_mutex_unlock(&client->network_mutex);
+		DEBUG_FAILURE_PRINTF("Could not receive the file");
 		return -1;
 	}
-	if( fwrite(file->__ptr, file->__size, 1, fd) != 1 ) {
-		DEBUG_FAILURE_PRINTF("Could not save the received file");
-		fclose(fd);
-		net_free_file(file);
+	pthread_mutex_unlock(&client->network_mutex);
+
+	if( att_cache_put_file(client->attach_cache, chat_id, msg_timestamp, file_path, cache_path) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not put the file in the attachment cache");
 		return -1;
 	}
 
-	fclose(fd);
+	return 0;
+}
 
-	net_free_file(file);
+
+/*
+ * Writes in path (ATT_CACHE_PATH_CHARS) the local copy of the message's attachment
+ * Returns 0 or -1 if it is not in the attachment cache
+ */
+int psd_attachment_path(psd_ims_client *client, int chat_id, int msg_timestamp, char *path) {
+	DEBUG_TRACE_PRINT();
+
+	if( client->attach_cache == NULL || !att_cache_find(client->attach_cache, chat_id, msg_timestamp, path) ) {
+		return -1;
+	}
 
 	return 0;
 }
@@ -982,39 +1199,32 @@ int psd_send_message(psd_ims_client *client, int chat_id, char *text, char *file
 	DEBUG_TRACE_PRINT();
 	
 	int send_timestamp = 0;
-	char file_path_internal[MAX_FILE_PATH_CHARS];
-	char * file_buff = NULL;
-	char * file_buff_aux;
-	FILE *fd;
+	char file_path_internal[ATT_CACHE_PATH_CHARS];
 	struct stat st;
-	int written_blocks = 0;
-	int readed_blocks = 0;
-	int total_blocks = 0;
 	chat_info *chat;
 	
 	pthread_mutex_lock(&client->chats_mutex);
 	if( (chat = cha_find_chat(client->chats, chat_id)) == NULL ) {
+		pthread_mutex_unlock(&client->chats_mutex);
 		DEBUG_FAILURE_PRINTF("The chat does not exist");
 		return -1;
 	}
 	pthread_mutex_unlock(&client->chats_mutex);
 
-	/* Read the attached file */
-	DEBUG_INFO_PRINTF("Reading the attached file");
+	/* Check the attached file, it is streamed from the disk later */
 	if( file_path != NULL ) {
-		file_buff = malloc( sizeof(char)*MAX_FILE_CHARS);
-		if( (fd = fopen(file_path, "r")) == NULL ) {
+		if( stat(file_path, &st) != 0 || !S_ISREG(st.st_mode) ) {
 			DEBUG_FAILURE_PRINTF("Could not read the file");
 			return -1;
 		}
-
-		file_buff_aux = file_buff;
-		do {
-			readed_blocks = fread(file_buff_aux++, 1, 1, fd);
-			total_blocks += readed_blocks;
-		} while( (readed_blocks == 1) && (total_blocks < MAX_FILE_CHARS) );
-
-		fclose(fd);
+		if( st.st_size > MAX_FILE_CHARS ) {
+			DEBUG_FAILURE_PRINTF("The file is too big");
+			return -1;
+		}
+		if( client->attach_cache == NULL ) {
+			DEBUG_FAILURE_PRINTF("There is no attachment cache");
+			return -1;
+		}
 	}
 
 	/* Send the message */
@@ -1027,36 +1237,19 @@ int psd_send_message(psd_ims_client *client, int chat_id, char *text, char *file
 	}
 	pthread_mutex_unlock(&client->network_mutex);
 
-	/* Copy the attached file to an internal directory */
-	DEBUG_INFO_PRINTF("Copying the file in the internal directory");
+	/* Copy the attached file to the attachment cache, it is not downloaded again */
+	DEBUG_INFO_PRINTF("Copying the file in the attachment cache");
 	if( file_path != NULL ) {
-		
-		// Create the file path
-		create_file_path_snd(file_path_internal, chat_id, send_timestamp);
-
-		if( stat(ATTACH_FILES_DIR_SND, &st) == -1 ) {
-			mkdir(ATTACH_FILES_DIR_SND, 0700);
-		}
-
-		// Copy the attached file
-		if( (fd = fopen(file_path_internal, "w")) == NULL ) {
-			DEBUG_FAILURE_PRINTF("Could not open the file");
+		if( att_cache_put_copy(client->attach_cache, chat_id, send_timestamp, file_path, file_path_internal) != 0 ) {
+			DEBUG_FAILURE_PRINTF("Could not copy the file");
 			return -1;
 		}
-
-		written_blocks = 0;
-		file_buff_aux = file_buff;
-		do {
-			written_blocks += fwrite(file_buff_aux++, 1, 1, fd);
-		} while( written_blocks < total_blocks);
-
-		fclose(fd);
 	}
 	
-	// Send the attachment
+	// Send the attachment, in chunks and only if the server has not the file yet
 	if( file_path != NULL ) {
 		pthread_mutex_lock(&client->network_mutex);
-		if( net_send_attachment(client->network, chat_id, send_timestamp, file_buff, sizeof(char)*total_blocks) != 0 ) {
+		if( net_upload_attachment(client->network, chat_id, send_timestamp, file_path_internal) != 0 ) {
 			pthread_mutex_unlock(&client->network_mutex);
 			DEBUG_FAILURE_PRINTF("Could not send the message");
 			return -1;
@@ -1064,8 +1257,6 @@ int psd_send_message(psd_ims_client *client, int chat_id, char *text, char *file
 		pthread_mutex_unlock(&client->network_mutex);
 	}
 
-	free(file_buff);
-
 	return 0;
 }
 
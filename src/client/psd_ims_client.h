@@ -35,8 +35,9 @@
 #define MAX_FILE_PATH_CHARS (100)
 	// max file size = 10MB
 #define MAX_FILE_CHARS (10485760)
-#define ATTACH_FILES_DIR_RCV "attached_files_rcv"
-#define ATTACH_FILES_DIR_SND "attached_files_snd"
+#define ATTACH_CACHE_DIR "attached_files"
+	// default max size of the attachment cache = 256MB
+#define ATTACH_CACHE_BUDGET (268435456)
 
 #include "friends.h"
 #include "chats.h"
@@ -44,6 +45,7 @@
 #include "messages.h"
 #include "chat_members.h"
 #include "network.h"
+#include "attach_cache.h"
 #include <pthread.h>
 
 
@@ -56,8 +58,10 @@ struct psd_ims_client {
 	// timestamps
 	int last_connection;
 	int last_notif_timestamp;
+	LONG64 sync_cursor;		// of the last get_changes, -1 before the first one
 	// lists
 	network *network;
+	attach_cache *attach_cache;	// attachments sent and received, NULL if it could not be opened
 	friends *friends;
 	friend_requests *requests;
 	chats *chats;
@@ -108,12 +112,6 @@ typedef struct chat_member_iterator chat_member_iterator;
 #define psd_chats_timestamp(client, timestamp) \
 		cha_get_timestamp(client->chats, timestamp)
 
-
-#define create_file_path_snd(buff, chat_id, timestamp) \
-		sprintf(buff, "%s/_%d%d", ATTACH_FILES_DIR_SND, chat_id, timestamp)
-		
-#define create_file_path_rcv(buff, chat_id, timestamp) \
-		sprintf(buff, "%s/_%d%d", ATTACH_FILES_DIR_RCV, chat_id, timestamp)
 		
 /* =========================================================================
  *  Iterators
@@ -462,6 +460,11 @@ psd_ims_client *psd_new_client();
  */
 void psd_free_client(psd_ims_client *client);
 
+/*
+ * Sets the max bytes of the attachment cache, 0 if unlimited
+ */
+void psd_set_attach_cache_budget(psd_ims_client *client, long long budget);
+
 /*
  * Sets client name
  * Returns o or -1 if fails
@@ -484,6 +487,13 @@ int psd_set_pass(psd_ims_client *client, const char *pass);
  */
 int psd_bind_network(psd_ims_client *client, char *serverURL);
 
+/*
+ * Receives the messages and notifications through the binary transport
+ * of the server, listening on host and port
+ * Returns 0 or -1 if fails
+ */
+int psd_bind_binary_transport(psd_ims_client *client, char *host, int port);
+
 /*
  * Gets the user information from the server
  * Returns 0 or -1 if fails
@@ -539,11 +549,29 @@ int psd_recv_all_messages(psd_ims_client *client);
 int psd_recv_all_pending_messages(psd_ims_client *client);
 
 /*
- * Receive the message's attachment
+ * Receive the message's attachment, only if it is not in the attachment cache yet
  * Returns 0 or -1 if fails
  */
 int psd_recv_message_attachment(psd_ims_client *client, int chat_id, int msg_timestamp);
 
+/*
+ * Writes in path (ATT_CACHE_PATH_CHARS) the local copy of the message's attachment
+ * Returns 0 or -1 if it is not in the attachment cache
+ */
+int psd_attachment_path(psd_ims_client *client, int chat_id, int msg_timestamp, char *path);
+
+/*
+ * Receive the changes of the client data since the last sync
+ * Returns 0 or -1 if fails
+ */
+int psd_recv_changes(psd_ims_client *client);
+
+/*
+ * Receive the client data since the beginning of time
+ * Returns 0 or -1 if fails
+ */
+int psd_recv_all_data(psd_ims_client *client);
+
 /*
  * Receive the user chats
  * Returns the number of created chats or -1 if fails
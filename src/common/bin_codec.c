@@ -0,0 +1,286 @@
+/*******************************************************************************
+ *  bin_codec.c
+ *
+ *  Compact binary encoding: varints, length-prefixed strings and frames
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "bin_codec.h"
+
+#include "debug_def.h"
+
+#ifdef DEBUG
+#include "leak_detector_c.h"
+#endif
+
+#define INITIAL_CAPACITY (1024)
+// max bytes of a varint with 64 bits
+#define MAX_VARINT_BYTES (10)
+
+
+int _bin_reserve(bin_buffer *buff, size_t bytes) {
+	unsigned char *new_data;
+	size_t new_capacity;
+
+	if (buff->size + bytes <= buff->capacity) {
+		return 0;
+	}
+	if (buff->size + bytes > buff->max_size) {
+		DEBUG_FAILURE_PRINTF("The binary buffer is full");
+		return -1;
+	}
+
+	new_capacity = buff->capacity * 2;
+	while (new_capacity < buff->size + bytes) {
+		new_capacity *= 2;
+	}
+	if (new_capacity > buff->max_size) {
+		new_capacity = buff->max_size;
+	}
+
+	new_data = realloc(buff->data, new_capacity);
+	if (new_data == NULL) {
+		return -1;
+	}
+	buff->data = new_data;
+	buff->capacity = new_capacity;
+
+	return 0;
+}
+
+/*
+ * Encodes the varint in out
+ * Returns the number of bytes
+ */
+int _bin_varint(unsigned char *out, unsigned long long value) {
+	int n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (unsigned char)value;
+
+	return n;
+}
+
+int _bin_io(int fd, unsigned char *data, size_t size, int writing) {
+	ssize_t ret;
+
+	while (size > 0) {
+		// a peer that closed the socket must fail the write, not raise SIGPIPE
+		ret = writing? send(fd, data, size, MSG_NOSIGNAL) : read(fd, data, size);
+		if (ret < 0 && errno == ENOTSOCK) {
+			ret = write(fd, data, size);
+		}
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return -1;
+		}
+		data += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+
+/* =========================================================================
+ *  Encoding
+ * =========================================================================*/
+
+int bin_buffer_init(bin_buffer *buff, size_t max_size) {
+	buff->capacity = (max_size < INITIAL_CAPACITY)? max_size : INITIAL_CAPACITY;
+	if (buff->capacity < BIN_FRAME_HEADER_BYTES) {
+		return -1;
+	}
+	buff->data = malloc(buff->capacity);
+	if (buff->data == NULL) {
+		return -1;
+	}
+	buff->size = BIN_FRAME_HEADER_BYTES;
+	buff->max_size = max_size;
+
+	return 0;
+}
+
+
+void bin_buffer_free(bin_buffer *buff) {
+	free(buff->data);
+	buff->data = NULL;
+}
+
+
+int bin_put_uint(bin_buffer *buff, unsigned long long value) {
+	if (_bin_reserve(buff, MAX_VARINT_BYTES) != 0) {
+		return -1;
+	}
+	buff->size += _bin_varint(buff->data + buff->size, value);
+
+	return 0;
+}
+
+
+int bin_put_int(bin_buffer *buff, long long value) {
+	return bin_put_uint(buff, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+
+int bin_put_string(bin_buffer *buff, const char *string) {
+	size_t length;
+
+	// the length is shifted by one, 0 is a NULL string
+	if (string == NULL) {
+		return bin_put_uint(buff, 0);
+	}
+
+	length = strlen(string);
+	if (bin_put_uint(buff, length + 1) != 0 || _bin_reserve(buff, length) != 0) {
+		return -1;
+	}
+	memcpy(buff->data + buff->size, string, length);
+	buff->size += length;
+
+	return 0;
+}
+
+
+/* =========================================================================
+ *  Decoding
+ * =========================================================================*/
+
+void bin_reader_init(bin_reader *reader, const unsigned char *data, size_t size) {
+	reader->data = data;
+	reader->size = size;
+	reader->pos = 0;
+	reader->error = 0;
+}
+
+
+unsigned long long bin_get_uint(bin_reader *reader) {
+	unsigned long long value = 0;
+	int shift = 0;
+	unsigned char byte;
+
+	do {
+		if (reader->pos >= reader->size || shift >= 64) {
+			reader->error = 1;
+			return 0;
+		}
+		byte = reader->data[reader->pos++];
+		value |= (unsigned long long)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return value;
+}
+
+
+long long bin_get_int(bin_reader *reader) {
+	unsigned long long value;
+
+	value = bin_get_uint(reader);
+
+	return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+
+size_t bin_get_string(bin_reader *reader, const char **string) {
+	unsigned long long length;
+
+	*string = NULL;
+	length = bin_get_uint(reader);
+	if (length == 0 || reader->error) {
+		return 0;
+	}
+
+	length--;
+	if (length > reader->size - reader->pos) {
+		reader->error = 1;
+		return 0;
+	}
+	*string = (const char*)(reader->data + reader->pos);
+	reader->pos += length;
+
+	return length;
+}
+
+
+/* =========================================================================
+ *  Frames
+ * =========================================================================*/
+
+int bin_write_frame(int fd, bin_buffer *buff) {
+	unsigned char header[MAX_VARINT_BYTES];
+	size_t payload_size;
+	int header_size;
+
+	// the header is written just before the payload, so it is a single write
+	payload_size = bin_buffer_payload_size(buff);
+	header_size = _bin_varint(header, payload_size);
+	if (header_size > BIN_FRAME_HEADER_BYTES) {
+		DEBUG_FAILURE_PRINTF("The frame is too large");
+		return -1;
+	}
+	memcpy(bin_buffer_payload(buff) - header_size, header, header_size);
+
+	return _bin_io(fd, bin_buffer_payload(buff) - header_size, header_size + payload_size, 1);
+}
+
+
+int bin_read_frame(int fd, bin_buffer *buff, size_t max_payload) {
+	unsigned long long payload_size = 0;
+	unsigned char byte;
+	int shift = 0;
+
+	do {
+		if (shift >= 7*BIN_FRAME_HEADER_BYTES || _bin_io(fd, &byte, 1, 0) != 0) {
+			return -1;
+		}
+		payload_size |= (unsigned long long)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	if (payload_size > max_payload) {
+		DEBUG_FAILURE_PRINTF("The frame is too large");
+		return -1;
+	}
+
+	bin_buffer_clear(buff);
+	if (_bin_reserve(buff, payload_size) != 0) {
+		DEBUG_FAILURE_PRINTF("The frame does not fit in the buffer");
+		return -1;
+	}
+	if (_bin_io(fd, bin_buffer_payload(buff), payload_size, 0) != 0) {
+		return -1;
+	}
+	buff->size += payload_size;
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*******************************************************************************
+ *  bin_codec.h
+ *
+ *  Compact binary encoding: varints, length-prefixed strings and frames
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __BIN_CODEC
+#define __BIN_CODEC
+
+#include <stddef.h>
+
+// space reserved before the payload for the frame length (a varint)
+#define BIN_FRAME_HEADER_BYTES (5)
+
+
+/*
+ * Growing buffer where the values are encoded, the payload starts
+ * after the space reserved for the frame header
+ */
+typedef struct bin_buffer bin_buffer;
+struct bin_buffer {
+	unsigned char *data;
+	size_t size;			// bytes used, including the header space
+	size_t capacity;
+	size_t max_size;		// the buffer does not grow further
+};
+
+/*
+ * Reads the values of an encoded payload. Any read past the end sets error
+ * and returns 0/NULL, so the values can be read unchecked and error tested
+ * at the end
+ */
+typedef struct bin_reader bin_reader;
+struct bin_reader {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	int error;
+};
+
+/* =========================================================================
+ *  Buffer access macros
+ * =========================================================================*/
+
+#define bin_buffer_payload(buff_ptr)		((buff_ptr)->data + BIN_FRAME_HEADER_BYTES)
+#define bin_buffer_payload_size(buff_ptr)	((buff_ptr)->size - BIN_FRAME_HEADER_BYTES)
+#define bin_buffer_clear(buff_ptr)			((buff_ptr)->size = BIN_FRAME_HEADER_BYTES)
+
+/* =========================================================================
+ *  Encoding
+ * =========================================================================*/
+
+/*
+ * Returns 0 or -1 if fails
+ */
+int bin_buffer_init(bin_buffer *buff, size_t max_size);
+
+void bin_buffer_free(bin_buffer *buff);
+
+/*
+ * Unsigned varint, 7 bits per byte
+ * Returns 0 or -1 if the buffer cannot grow
+ */
+int bin_put_uint(bin_buffer *buff, unsigned long long value);
+
+/*
+ * Zigzag varint, the small negative values are short too
+ * Returns 0 or -1 if the buffer cannot grow
+ */
+int bin_put_int(bin_buffer *buff, long long value);
+
+/*
+ * Length-prefixed string, NULL is kept apart from ""
+ * Returns 0 or -1 if the buffer cannot grow
+ */
+int bin_put_string(bin_buffer *buff, const char *string);
+
+/* =========================================================================
+ *  Decoding
+ * =========================================================================*/
+
+void bin_reader_init(bin_reader *reader, const unsigned char *data, size_t size);
+
+unsigned long long bin_get_uint(bin_reader *reader);
+
+long long bin_get_int(bin_reader *reader);
+
+/*
+ * Gives the string (not terminated) inside the payload, *string is NULL for
+ * a NULL string
+ * Returns its length
+ */
+size_t bin_get_string(bin_reader *reader, const char **string);
+
+/* =========================================================================
+ *  Frames
+ * =========================================================================*/
+
+/*
+ * Sends the payload of the buffer prefixed by its length
+ * Returns 0 or -1 if fails
+ */
+int bin_write_frame(int fd, bin_buffer *buff);
+
+/*
+ * Receives a frame in the buffer (its payload). Its length is checked
+ * against max_payload before any memory is reserved for it
+ * Returns 0, or -1 if fails, the connection is closed or the frame
+ * is larger than max_payload or the buffer max_size
+ */
+int bin_read_frame(int fd, bin_buffer *buff, size_t max_payload);
+
+
+#endif /* __BIN_CODEC */
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ *  content_hash.c
+ *
+ *  SHA-256 of the attachments, as lowercase hex
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <openssl/evp.h>
+#include "content_hash.h"
+
+#include "debug_def.h"
+
+#define HASH_READ_BYTES (64*1024)
+
+
+void _hash_to_hex(const unsigned char *digest, char *hex) {
+	const char *digits = "0123456789abcdef";
+	int i;
+
+	for (i = 0 ; i < CONTENT_HASH_CHARS/2 ; i++) {
+		hex[2*i] = digits[digest[i] >> 4];
+		hex[2*i + 1] = digits[digest[i] & 0x0f];
+	}
+	hex[CONTENT_HASH_CHARS] = '\0';
+}
+
+
+int content_hash_buffer(const unsigned char *data, size_t size, char *hex) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	if (EVP_Digest(data, size, digest, &digest_len, EVP_sha256(), NULL) != 1) {
+		DEBUG_FAILURE_PRINTF("Could not hash the buffer");
+		return -1;
+	}
+	_hash_to_hex(digest, hex);
+
+	return 0;
+}
+
+
+int content_hash_file(const char *path, char *hex) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned char buff[HASH_READ_BYTES];
+	unsigned int digest_len;
+	EVP_MD_CTX *ctx;
+	FILE *fd;
+	size_t n_read;
+	int ret_value = -1;
+
+	if ((fd = fopen(path, "rb")) == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not open the file");
+		return -1;
+	}
+	if ((ctx = EVP_MD_CTX_create()) == NULL) {
+		fclose(fd);
+		return -1;
+	}
+
+	if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1) {
+		while ((n_read = fread(buff, 1, HASH_READ_BYTES, fd)) > 0) {
+			if (EVP_DigestUpdate(ctx, buff, n_read) != 1) {
+				break;
+			}
+		}
+		if (!ferror(fd) && feof(fd) && EVP_DigestFinal_ex(ctx, digest, &digest_len) == 1) {
+			_hash_to_hex(digest, hex);
+			ret_value = 0;
+		}
+	}
+
+	EVP_MD_CTX_destroy(ctx);
+	fclose(fd);
+
+	return ret_value;
+}
+
+
+int content_hash_valid(const char *hex) {
+	int i;
+
+	if (hex == NULL) {
+		return 0;
+	}
+	for (i = 0 ; i < CONTENT_HASH_CHARS ; i++) {
+		if (!((hex[i] >= '0' && hex[i] <= '9') || (hex[i] >= 'a' && hex[i] <= 'f'))) {
+			return 0;
+		}
+	}
+
+	return (hex[CONTENT_HASH_CHARS] == '\0');
+}
@@ -0,0 +1,53 @@
+/*******************************************************************************
+ *  content_hash.h
+ *
+ *  SHA-256 of the attachments, as lowercase hex
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __CONTENT_HASH
+#define __CONTENT_HASH
+
+#include <stddef.h>
+
+// chars of a hash, without the '\0'
+#define CONTENT_HASH_CHARS (64)
+
+
+/*
+ * Hashes size bytes of data into hex (CONTENT_HASH_CHARS + 1 chars)
+ * Returns 0 or -1 if fails
+ */
+int content_hash_buffer(const unsigned char *data, size_t size, char *hex);
+
+/*
+ * Hashes the content of the file into hex (CONTENT_HASH_CHARS + 1 chars)
+ * Returns 0 or -1 if fails
+ */
+int content_hash_file(const char *path, char *hex);
+
+/*
+ * Returns 1 if hex is a well formed hash (it is safe to use it in a path), or 0
+ */
+int content_hash_valid(const char *hex);
+
+
+#endif /* __CONTENT_HASH */
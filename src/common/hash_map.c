@@ -0,0 +1,237 @@
+/*******************************************************************************
+ *  hash_map.c
+ *
+ *  A generic int-keyed hash map implementation
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+
+#include <stdlib.h>
+#include "hash_map.h"
+
+#include "debug_def.h"
+
+#ifdef DEBUG
+#include "leak_detector_c.h"
+#endif
+
+// max average number of items per bucket before growing
+#define MAX_LOAD_FACTOR (2)
+
+
+unsigned int _hash(int key, int n_buckets) {
+	unsigned int h = (unsigned int)key;
+	// integer mix, spreads sequential ids over the buckets
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h % n_buckets;
+}
+
+hash_map_node *_hmap_find_node(hash_map *map, int key) {
+	hash_map_node *node;
+
+	node = map->buckets[_hash(key, map->n_buckets)];
+	while (node != NULL) {
+		if (node->key == key) {
+			return node;
+		}
+		node = node->next;
+	}
+	return NULL;
+}
+
+int _hmap_grow(hash_map *map) {
+	DEBUG_TRACE_PRINT();
+	hash_map_node **new_buckets;
+	hash_map_node *node, *next;
+	int new_n_buckets;
+	int i;
+	unsigned int pos;
+
+	new_n_buckets = map->n_buckets * 2;
+	new_buckets = calloc(new_n_buckets, sizeof(hash_map_node*));
+	if (new_buckets == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not grow the hash map");
+		return -1;
+	}
+
+	for (i = 0 ; i < map->n_buckets ; i++) {
+		node = map->buckets[i];
+		while (node != NULL) {
+			next = node->next;
+			pos = _hash(node->key, new_n_buckets);
+			node->next = new_buckets[pos];
+			new_buckets[pos] = node;
+			node = next;
+		}
+	}
+
+	free(map->buckets);
+	map->buckets = new_buckets;
+	map->n_buckets = new_n_buckets;
+
+	return 0;
+}
+
+
+/* =========================================================================
+ *  Hash map functions
+ * =========================================================================*/
+
+hash_map *hmap_new(int n_buckets, void (*item_free)(void *item)) {
+	DEBUG_TRACE_PRINT();
+	hash_map *new_map;
+
+	if (item_free == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create hash map, NULL free function");
+		return NULL;
+	}
+	if (n_buckets < 1) {
+		n_buckets = 1;
+	}
+
+	new_map = malloc(sizeof(hash_map));
+	if (new_map == NULL) {
+		return NULL;
+	}
+
+	new_map->buckets = calloc(n_buckets, sizeof(hash_map_node*));
+	if (new_map->buckets == NULL) {
+		free(new_map);
+		return NULL;
+	}
+
+	new_map->n_buckets = n_buckets;
+	new_map->n_elems = 0;
+	new_map->item_free = item_free;
+
+	return new_map;
+}
+
+
+void hmap_free(hash_map *map) {
+	DEBUG_TRACE_PRINT();
+	hmap_clear(map);
+	free(map->buckets);
+	free(map);
+}
+
+
+void *hmap_find(hash_map *map, int key) {
+	hash_map_node *node;
+
+	node = _hmap_find_node(map, key);
+
+	return (node != NULL)? node->item : NULL;
+}
+
+
+int hmap_add(hash_map *map, int key, void *item) {
+	DEBUG_TRACE_PRINT();
+	hash_map_node *node;
+	unsigned int pos;
+
+	if (item == NULL) {
+		DEBUG_FAILURE_PRINTF("The added item cannot be null");
+		return -1;
+	}
+
+	if (_hmap_find_node(map, key) != NULL) {
+		DEBUG_FAILURE_PRINTF("The key does exist in the map");
+		return -1;
+	}
+
+	if (map->n_elems >= map->n_buckets * MAX_LOAD_FACTOR) {
+		// if it can not grow, keep working with longer chains
+		_hmap_grow(map);
+	}
+
+	node = malloc(sizeof(hash_map_node));
+	if (node == NULL) {
+		return -1;
+	}
+
+	pos = _hash(key, map->n_buckets);
+	node->key = key;
+	node->item = item;
+	node->next = map->buckets[pos];
+	map->buckets[pos] = node;
+	map->n_elems++;
+
+	return 0;
+}
+
+
+int hmap_delete(hash_map *map, int key) {
+	DEBUG_TRACE_PRINT();
+	hash_map_node **prev;
+	hash_map_node *node;
+
+	prev = &map->buckets[_hash(key, map->n_buckets)];
+	while (*prev != NULL) {
+		node = *prev;
+		if (node->key == key) {
+			*prev = node->next;
+			map->item_free(node->item);
+			free(node);
+			map->n_elems--;
+			return 0;
+		}
+		prev = &node->next;
+	}
+
+	return -1;
+}
+
+
+void hmap_clear(hash_map *map) {
+	DEBUG_TRACE_PRINT();
+	hash_map_node *node, *next;
+	int i;
+
+	for (i = 0 ; i < map->n_buckets ; i++) {
+		node = map->buckets[i];
+		while (node != NULL) {
+			next = node->next;
+			map->item_free(node->item);
+			free(node);
+			node = next;
+		}
+		map->buckets[i] = NULL;
+	}
+	map->n_elems = 0;
+}
+
+
+void hmap_foreach(hash_map *map, void (*func)(int key, void *item, void *arg), void *arg) {
+	hash_map_node *node, *next;
+	int i;
+
+	for (i = 0 ; i < map->n_buckets ; i++) {
+		node = map->buckets[i];
+		while (node != NULL) {
+			next = node->next;
+			func(node->key, node->item, arg);
+			node = next;
+		}
+	}
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+ *  hash_map.h
+ *
+ *  A generic int-keyed hash map implementation
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __GENERIC_HASH_MAP
+#define __GENERIC_HASH_MAP
+
+
+typedef struct hash_map_node hash_map_node;
+struct hash_map_node {
+	int key;
+	void *item;
+	struct hash_map_node *next;
+};
+
+typedef struct hash_map hash_map;
+struct hash_map {
+	hash_map_node **buckets;
+	int n_buckets;
+	int n_elems;
+	void (*item_free)(void *item);		// function to free the map items
+};
+
+/* =========================================================================
+ *  Hash map access macros
+ * =========================================================================*/
+
+#define hmap_num_elems(map_ptr)		(map_ptr->n_elems)
+#define hmap_empty(map_ptr)			(map_ptr->n_elems == 0)
+
+/* =========================================================================
+ *  Hash map functions
+ * =========================================================================*/
+
+/*
+ * Allocates a new hash map with (at least) n_buckets buckets.
+ * The map grows automatically when it gets too loaded.
+ * Returns a pointer to the map or NULL if fails
+ */
+hash_map *hmap_new(int n_buckets, void (*item_free)(void *item));
+
+/*
+ * Frees the map and all its items
+ */
+void hmap_free(hash_map *map);
+
+/*
+ * Returns the item stored with key or NULL if it does not exist
+ */
+void *hmap_find(hash_map *map, int key);
+
+/*
+ * Adds the item with the given key
+ * Returns 0 or -1 if fails (or the key does exist)
+ */
+int hmap_add(hash_map *map, int key, void *item);
+
+/*
+ * Removes (and frees) the item stored with key
+ * Returns 0 or -1 if the key does not exist
+ */
+int hmap_delete(hash_map *map, int key);
+
+/*
+ * Removes (and frees) all the items
+ */
+void hmap_clear(hash_map *map);
+
+/*
+ * Calls func for every item in the map, in no particular order
+ */
+void hmap_foreach(hash_map *map, void (*func)(int key, void *item, void *arg), void *arg);
+
+
+#endif /* __GENERIC_HASH_MAP */
@@ -161,6 +161,69 @@ typedef struct psdims__client_data {
 	int timestamp;
 } psdims__client_data;
 
+// Changes since a sync cursor
+typedef struct psdims__changes {
+	int snapshot;		// 1 if the lists are all the data, not the changes
+	psdims__chat_list chats;				// new or changed chats, with all their members
+	psdims__notif_chat_list left_chats;		// chats the user is no longer a member of
+	psdims__user_list friends;
+	psdims__notif_friend_list friend_requests;
+	LONG64 cursor;		// cursor of the next get_changes
+	int timestamp;
+} psdims__changes;
+
+// Chunked transfers of the attachments
+typedef struct psdims__upload_info {
+	char *hash;			// SHA-256 of the whole file
+	int size;
+} psdims__upload_info;
+
+typedef struct psdims__upload_state {
+	int chunk_size;		// the offsets are multiples of it
+	int offset;			// the chunks before it are stored
+	int done;			// 1 if the server already has the file
+} psdims__upload_state;
+
+typedef struct psdims__chunk {
+	psdims__file data;
+	char *hash;			// SHA-256 of data
+	int offset;
+	int total_size;		// of the whole file
+} psdims__chunk;
+
+// Batches of operations
+enum psdims__batch_op_type {
+	BATCH_NOTIFICATIONS,	// get_pending_notifications(timestamp, sync)
+	BATCH_CHAT_MESSAGES,	// get_chat_messages(chat_id, timestamp)
+	BATCH_CHATS				// get_chats(timestamp)
+};
+
+typedef struct psdims__batch_op {
+	enum psdims__batch_op_type type;
+	int chat_id;
+	int timestamp;
+	psdims__sync *sync;
+} psdims__batch_op;
+
+typedef struct psdims__batch_ops {
+	int __sizenelems;
+	psdims__batch_op *op;
+	int transaction;	// 1 if the operations must see the same snapshot of the data
+} psdims__batch_ops;
+
+typedef struct psdims__batch_result {
+	enum psdims__batch_op_type type;
+	int error;			// 0 or -1 if the operation failed
+	psdims__notifications *notifications;
+	psdims__message_list *messages;
+	psdims__chat_list *chats;
+} psdims__batch_result;
+
+typedef struct psdims__batch_results {
+	int __sizenelems;
+	psdims__batch_result *result;	// in the same order as the operations
+} psdims__batch_results;
+
 
 /********************************************************************
  * Basicas
@@ -198,6 +261,9 @@ int psdims__get_pending_notifications(psdims__login_info *login, int timestamp,
 //
 int psdims__get_all_data(psdims__login_info *login, psdims__client_data *client_data);
 
+// get the changes of the client data after cursor (-1 for all of them)
+int psdims__get_changes(psdims__login_info *login, LONG64 cursor, psdims__changes *changes);
+
 // create new chat
 int psdims__create_chat(psdims__login_info *login, psdims__new_chat *new_chat, int *chat_id);
 
@@ -216,6 +282,24 @@ int psdims__send_message(psdims__login_info *login, int chat_id, psdims__message
 // Send a file to attach msd_id
 int psdims__send_attachment(psdims__login_info *login, int chat_id, int msg_timestamp, psdims__file *file, int *ERRCODE);
 
+// Attach to msg_id the file the server already has with that SHA-256, ERRCODE is 1 if it has not
+int psdims__send_attachment_hash(psdims__login_info *login, int chat_id, int msg_timestamp, char *hash, int *ERRCODE);
+
+// get a signed url, valid for a while, to download the file attached to msg_id with a plain GET
+int psdims__get_attachment_url(psdims__login_info *login, int chat_id, int msg_timestamp, char **url);
+
+// start or resume the upload of a file in chunks
+int psdims__upload_begin(psdims__login_info *login, psdims__upload_info *info, psdims__upload_state *state);
+
+// send a chunk of the upload of the file with that hash, ERRCODE is 1 if the chunk did not match its hash
+int psdims__upload_chunk(psdims__login_info *login, char *file_hash, psdims__chunk *chunk, int *ERRCODE);
+
+// attach the uploaded file to msg_id
+int psdims__upload_commit(psdims__login_info *login, int chat_id, int msg_timestamp, char *hash, int *ERRCODE);
+
+// get a chunk of the file attached to msg_id
+int psdims__get_attachment_chunk(psdims__login_info *login, int chat_id, int msg_timestamp, int offset, psdims__chunk *chunk);
+
 // enviar solicitud de amistad a usuario
 int psdims__send_friend_request(psdims__login_info *login, char* request_name, int *timestamp);
 
@@ -225,6 +309,9 @@ int psdims__accept_request(psdims__login_info *login, char *request_name, int *t
 // rechazar solicitud de amistad
 int psdims__decline_request(psdims__login_info *login, char *request_name, int *timestamp);
 
+// run several read operations in a single request
+int psdims__batch(psdims__login_info *login, psdims__batch_ops *batch, psdims__batch_results *results);
+
 
 /********************************************************************
  * Mensajes
@@ -0,0 +1,241 @@
+/*******************************************************************************
+ *  ims_bin.c
+ *
+ *  Binary encoding of the ims.h operations
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+
+#include <string.h>
+#include "ims_bin.h"
+
+
+char *_bin_get_soap_string(bin_reader *reader, struct soap *soap) {
+	const char *string;
+	size_t length;
+	char *copy;
+
+	length = bin_get_string(reader, &string);
+	if (string == NULL) {
+		return NULL;
+	}
+
+	copy = soap_malloc(soap, length + 1);
+	if (copy == NULL) {
+		reader->error = 1;
+		return NULL;
+	}
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+
+	return copy;
+}
+
+/*
+ * Reads the number of elements of an array and allocates it in soap.
+ * Every element takes at least a byte, so a corrupted count cannot
+ * allocate more than the payload size
+ */
+void *_bin_get_soap_array(bin_reader *reader, struct soap *soap, size_t elem_size, int *n_elems) {
+	unsigned long long n;
+	void *array;
+
+	*n_elems = 0;
+	n = bin_get_uint(reader);
+	if (reader->error || n > reader->size - reader->pos) {
+		reader->error = 1;
+		return NULL;
+	}
+	if (n == 0) {
+		return NULL;
+	}
+
+	array = soap_malloc(soap, n * elem_size);
+	if (array == NULL) {
+		reader->error = 1;
+		return NULL;
+	}
+	*n_elems = (int)n;
+
+	return array;
+}
+
+
+int _bin_put_chat_list(bin_buffer *buff, const psdims__notif_chat_list *chats) {
+	int i;
+
+	if (bin_put_uint(buff, chats->__sizenelems) != 0)
+		return -1;
+	for (i = 0 ; i < chats->__sizenelems ; i++) {
+		if (bin_put_int(buff, chats->chat[i].chat_id) != 0 || bin_put_int(buff, chats->chat[i].timestamp) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void _bin_get_chat_list(bin_reader *reader, struct soap *soap, psdims__notif_chat_list *chats) {
+	int i;
+
+	chats->chat = _bin_get_soap_array(reader, soap, sizeof(psdims__notif_chat_info), &chats->__sizenelems);
+	for (i = 0 ; i < chats->__sizenelems ; i++) {
+		chats->chat[i].chat_id = bin_get_int(reader);
+		chats->chat[i].timestamp = bin_get_int(reader);
+	}
+}
+
+int _bin_put_member_list(bin_buffer *buff, const psdims__notif_chat_member_list *members) {
+	int i;
+
+	if (bin_put_uint(buff, members->__sizenelems) != 0)
+		return -1;
+	for (i = 0 ; i < members->__sizenelems ; i++) {
+		if (bin_put_string(buff, members->member[i].name.string) != 0 || bin_put_int(buff, members->member[i].chat_id) != 0
+				|| bin_put_int(buff, members->member[i].timestamp) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void _bin_get_member_list(bin_reader *reader, struct soap *soap, psdims__notif_chat_member_list *members) {
+	int i;
+
+	members->member = _bin_get_soap_array(reader, soap, sizeof(psdims__notif_member_info), &members->__sizenelems);
+	for (i = 0 ; i < members->__sizenelems ; i++) {
+		members->member[i].name.string = _bin_get_soap_string(reader, soap);
+		members->member[i].chat_id = bin_get_int(reader);
+		members->member[i].timestamp = bin_get_int(reader);
+	}
+}
+
+
+int bin_put_login(bin_buffer *buff, const psdims__login_info *login) {
+	return (bin_put_string(buff, login->name) != 0 || bin_put_string(buff, login->password) != 0)? -1 : 0;
+}
+
+int bin_get_login(bin_reader *reader, struct soap *soap, psdims__login_info *login) {
+	login->name = _bin_get_soap_string(reader, soap);
+	login->password = _bin_get_soap_string(reader, soap);
+
+	return reader->error? -1 : 0;
+}
+
+
+int bin_put_sync(bin_buffer *buff, const psdims__sync *sync) {
+	return _bin_put_chat_list(buff, &sync->chat_read_timestamps);
+}
+
+int bin_get_sync(bin_reader *reader, struct soap *soap, psdims__sync *sync) {
+	_bin_get_chat_list(reader, soap, &sync->chat_read_timestamps);
+
+	return reader->error? -1 : 0;
+}
+
+
+int bin_put_message_list(bin_buffer *buff, const psdims__message_list *messages) {
+	int i;
+
+	if (bin_put_uint(buff, messages->__sizenelems) != 0)
+		return -1;
+	for (i = 0 ; i < messages->__sizenelems ; i++) {
+		if (bin_put_string(buff, messages->messages[i].user) != 0 || bin_put_string(buff, messages->messages[i].text) != 0
+				|| bin_put_string(buff, messages->messages[i].file_name) != 0 || bin_put_int(buff, messages->messages[i].send_date) != 0)
+			return -1;
+	}
+	if (bin_put_int(buff, messages->read_timestamp) != 0 || bin_put_int(buff, messages->last_timestamp) != 0)
+		return -1;
+
+	return 0;
+}
+
+int bin_get_message_list(bin_reader *reader, struct soap *soap, psdims__message_list *messages) {
+	int i;
+
+	messages->messages = _bin_get_soap_array(reader, soap, sizeof(psdims__message_info), &messages->__sizenelems);
+	for (i = 0 ; i < messages->__sizenelems ; i++) {
+		messages->messages[i].user = _bin_get_soap_string(reader, soap);
+		messages->messages[i].text = _bin_get_soap_string(reader, soap);
+		messages->messages[i].file_name = _bin_get_soap_string(reader, soap);
+		messages->messages[i].send_date = bin_get_int(reader);
+	}
+	messages->read_timestamp = bin_get_int(reader);
+	messages->last_timestamp = bin_get_int(reader);
+
+	return reader->error? -1 : 0;
+}
+
+
+int bin_put_notifications(bin_buffer *buff, const psdims__notifications *notifications) {
+	int i;
+
+	if (bin_put_uint(buff, notifications->friend_request.__sizenelems) != 0)
+		return -1;
+	for (i = 0 ; i < notifications->friend_request.__sizenelems ; i++) {
+		if (bin_put_string(buff, notifications->friend_request.user[i].name.string) != 0
+				|| bin_put_int(buff, notifications->friend_request.user[i].send_date) != 0)
+			return -1;
+	}
+
+	if (bin_put_uint(buff, notifications->new_friends.__sizenelems) != 0)
+		return -1;
+	for (i = 0 ; i < notifications->new_friends.__sizenelems ; i++) {
+		if (bin_put_string(buff, notifications->new_friends.user[i].name) != 0
+				|| bin_put_string(buff, notifications->new_friends.user[i].information) != 0)
+			return -1;
+	}
+	if (bin_put_int(buff, notifications->new_friends.last_timestamp) != 0)
+		return -1;
+
+	if (_bin_put_chat_list(buff, &notifications->chats_with_messages) != 0
+			|| _bin_put_chat_list(buff, &notifications->chats_read_times) != 0
+			|| _bin_put_member_list(buff, &notifications->chat_members) != 0
+			|| _bin_put_member_list(buff, &notifications->rem_chat_members) != 0
+			|| _bin_put_member_list(buff, &notifications->chat_admins) != 0
+			|| bin_put_int(buff, notifications->last_timestamp) != 0)
+		return -1;
+
+	return 0;
+}
+
+int bin_get_notifications(bin_reader *reader, struct soap *soap, psdims__notifications *notifications) {
+	int i;
+
+	notifications->friend_request.user = _bin_get_soap_array(reader, soap, sizeof(psdims__notif_friend_info), &notifications->friend_request.__sizenelems);
+	for (i = 0 ; i < notifications->friend_request.__sizenelems ; i++) {
+		notifications->friend_request.user[i].name.string = _bin_get_soap_string(reader, soap);
+		notifications->friend_request.user[i].send_date = bin_get_int(reader);
+	}
+
+	notifications->new_friends.user = _bin_get_soap_array(reader, soap, sizeof(psdims__user_info), &notifications->new_friends.__sizenelems);
+	for (i = 0 ; i < notifications->new_friends.__sizenelems ; i++) {
+		notifications->new_friends.user[i].name = _bin_get_soap_string(reader, soap);
+		notifications->new_friends.user[i].information = _bin_get_soap_string(reader, soap);
+	}
+	notifications->new_friends.last_timestamp = bin_get_int(reader);
+
+	_bin_get_chat_list(reader, soap, &notifications->chats_with_messages);
+	_bin_get_chat_list(reader, soap, &notifications->chats_read_times);
+	_bin_get_member_list(reader, soap, &notifications->chat_members);
+	_bin_get_member_list(reader, soap, &notifications->rem_chat_members);
+	_bin_get_member_list(reader, soap, &notifications->chat_admins);
+	notifications->last_timestamp = bin_get_int(reader);
+
+	return reader->error? -1 : 0;
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+ *  ims_bin.h
+ *
+ *  Binary encoding of the ims.h operations
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __IMS_BIN
+#define __IMS_BIN
+
+#include "soapH.h"
+#include "bin_codec.h"
+
+/*
+ * A request frame is the operation (varint) followed by its arguments, in
+ * the same order as in ims.h. A response frame is the status followed by
+ * the result if it is BIN_STATUS_OK
+ */
+#define BIN_OP_GET_CHAT_MESSAGES			(1)		// login, chat_id, timestamp -> message_list
+#define BIN_OP_GET_PENDING_NOTIFICATIONS	(2)		// login, timestamp, sync -> notifications
+
+#define BIN_STATUS_OK		(0)
+#define BIN_STATUS_ERROR	(1)
+
+// max bytes of a frame in both ends
+#define BIN_MAX_FRAME_BYTES (16*1024*1024)
+// max bytes of a request frame, a login with a few ints and the read timestamps of the chats
+#define BIN_MAX_REQUEST_BYTES (8*1024)
+
+
+/*
+ * The put functions return 0 or -1 if the buffer cannot grow.
+ * The get functions allocate the strings and arrays in soap and
+ * return 0 or -1 if the payload is not valid
+ */
+int bin_put_login(bin_buffer *buff, const psdims__login_info *login);
+int bin_get_login(bin_reader *reader, struct soap *soap, psdims__login_info *login);
+
+int bin_put_sync(bin_buffer *buff, const psdims__sync *sync);
+int bin_get_sync(bin_reader *reader, struct soap *soap, psdims__sync *sync);
+
+int bin_put_message_list(bin_buffer *buff, const psdims__message_list *messages);
+int bin_get_message_list(bin_reader *reader, struct soap *soap, psdims__message_list *messages);
+
+int bin_put_notifications(bin_buffer *buff, const psdims__notifications *notifications);
+int bin_get_notifications(bin_reader *reader, struct soap *soap, psdims__notifications *notifications);
+
+
+#endif /* __IMS_BIN */
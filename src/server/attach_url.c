@@ -0,0 +1,130 @@
+/*******************************************************************************
+ *	attach_url.c
+ *
+ *  Signed URLs of the attachments, served by plain HTTP GET
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "attach_url.h"
+
+#include "debug_def.h"
+
+#define ATTACH_KEY_BYTES (32)
+#define ATTACH_SIGNATURE_CHARS (64)
+
+// the key only lives in memory, a restart invalidates the signed urls
+static unsigned char attach_key[ATTACH_KEY_BYTES];
+static int attach_key_ready = 0;
+
+
+int attach_url_init() {
+	if (RAND_bytes(attach_key, ATTACH_KEY_BYTES) != 1) {
+		DEBUG_FAILURE_PRINTF("Could not create the key of the attachment urls");
+		return -1;
+	}
+	attach_key_ready = 1;
+
+	return 0;
+}
+
+
+/*
+ * Writes in signature (ATTACH_SIGNATURE_CHARS + 1) the hex HMAC of the signed fields
+ * Returns 0 or -1 if fails
+ */
+int _attach_signature(int chat_id, int msg_timestamp, long expires, char *signature) {
+	const char *digits = "0123456789abcdef";
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	char fields[3*24];
+	int n_chars;
+	unsigned int i;
+
+	if (!attach_key_ready) {
+		return -1;
+	}
+
+	n_chars = sprintf(fields, "%d/%d/%ld", chat_id, msg_timestamp, expires);
+	if (HMAC(EVP_sha256(), attach_key, ATTACH_KEY_BYTES, (unsigned char*)fields, n_chars, digest, &digest_len) == NULL
+			|| 2*digest_len != ATTACH_SIGNATURE_CHARS) {
+		return -1;
+	}
+
+	for (i = 0 ; i < digest_len ; i++) {
+		signature[2*i] = digits[digest[i] >> 4];
+		signature[2*i + 1] = digits[digest[i] & 0x0f];
+	}
+	signature[ATTACH_SIGNATURE_CHARS] = '\0';
+
+	return 0;
+}
+
+
+int attach_url_sign(int chat_id, int msg_timestamp, char *url) {
+	char signature[ATTACH_SIGNATURE_CHARS + 1];
+	long expires;
+
+	expires = (long)time(NULL) + ATTACH_URL_SECS;
+	if (_attach_signature(chat_id, msg_timestamp, expires, signature) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not sign the attachment url");
+		return -1;
+	}
+	sprintf(url, "%s%d/%d/%ld/%s", ATTACH_URL_PREFIX, chat_id, msg_timestamp, expires, signature);
+
+	return 0;
+}
+
+
+int attach_url_verify(const char *url, int *chat_id, int *msg_timestamp) {
+	char signature[ATTACH_SIGNATURE_CHARS + 1];
+	char expected[ATTACH_SIGNATURE_CHARS + 1];
+	long expires;
+	int n_chars = 0;
+
+	if (strncmp(url, ATTACH_URL_PREFIX, sizeof(ATTACH_URL_PREFIX) - 1) != 0) {
+		return -1;
+	}
+	url += sizeof(ATTACH_URL_PREFIX) - 1;
+
+	if (sscanf(url, "%d/%d/%ld/%64[0-9a-f]%n", chat_id, msg_timestamp, &expires, signature, &n_chars) != 4
+			|| url[n_chars] != '\0' || strlen(signature) != ATTACH_SIGNATURE_CHARS) {
+		return -1;
+	}
+	if (expires < (long)time(NULL)) {
+		DEBUG_INFO_PRINTF("The attachment url has expired");
+		return -1;
+	}
+
+	if (_attach_signature(*chat_id, *msg_timestamp, expires, expected) != 0
+			|| CRYPTO_memcmp(signature, expected, ATTACH_SIGNATURE_CHARS) != 0) {
+		DEBUG_FAILURE_PRINTF("The attachment url is not signed by the server");
+		return -1;
+	}
+
+	return 0;
+}
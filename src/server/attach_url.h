@@ -0,0 +1,56 @@
+/*******************************************************************************
+ *	attach_url.h
+ *
+ *  Signed URLs of the attachments, served by plain HTTP GET
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __ATTACH_URL
+#define __ATTACH_URL
+
+#define ATTACH_URL_PREFIX "/attach/"
+// chars of the path of a signed url, with the '\0'
+#define ATTACH_URL_CHARS (sizeof(ATTACH_URL_PREFIX) + 3*21 + 64)
+// a signed url is valid during these seconds
+#define ATTACH_URL_SECS (300)
+
+
+/*
+ * Creates the random key of the signatures, the urls signed before are not valid
+ * Returns 0 or -1 if fails
+ */
+int attach_url_init();
+
+/*
+ * Writes in url (ATTACH_URL_CHARS) the path /attach/<chat>/<msg>/<expires>/<signature>,
+ * with the HMAC-SHA256 of the rest of it
+ * Returns 0 or -1 if fails
+ */
+int attach_url_sign(int chat_id, int msg_timestamp, char *url);
+
+/*
+ * Checks the signature and the expiration of the path of the url
+ * Returns 0 and the message of the attachment or -1 if it is not valid
+ */
+int attach_url_verify(const char *url, int *chat_id, int *msg_timestamp);
+
+
+#endif /* __ATTACH_URL */
@@ -0,0 +1,142 @@
+/*******************************************************************************
+ *	blob_store.c
+ *
+ *  Attachment files, stored once by the hash of their content
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "blob_store.h"
+
+#include "debug_def.h"
+
+
+void blob_path(const char *hash, char *path) {
+	sprintf(path, "%s/%.2s/%.2s/%s", BLOB_FILES_DIR, hash, hash + 2, hash);
+}
+
+
+int blob_exists(const char *hash) {
+	char path[BLOB_PATH_CHARS];
+	struct stat st;
+
+	blob_path(hash, path);
+	return (stat(path, &st) == 0);
+}
+
+
+/*
+ * Creates the two fan-out directories of the blob
+ * Returns 0 or -1 if fails
+ */
+int _blob_mkdirs(const char *hash) {
+	char dir[BLOB_PATH_CHARS];
+
+	if (mkdir(BLOB_FILES_DIR, 0700) == -1 && errno != EEXIST) {
+		return -1;
+	}
+	sprintf(dir, "%s/%.2s", BLOB_FILES_DIR, hash);
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		return -1;
+	}
+	sprintf(dir, "%s/%.2s/%.2s", BLOB_FILES_DIR, hash, hash + 2);
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int blob_put(file_io *io, const unsigned char *data, int size, char *hash) {
+	DEBUG_TRACE_PRINT();
+	char path[BLOB_PATH_CHARS];
+	char tmp_path[BLOB_PATH_CHARS + 8];
+	int tmp_fd;
+
+	if (content_hash_buffer(data, size, hash) != 0) {
+		return -1;
+	}
+	if (blob_exists(hash)) {
+		return 0;
+	}
+	if (_blob_mkdirs(hash) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the blob directories");
+		return -1;
+	}
+
+	// written aside and renamed, a blob is never seen half written
+	blob_path(hash, path);
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	if ((tmp_fd = mkstemp(tmp_path)) == -1) {
+		DEBUG_FAILURE_PRINTF("Could not create the file");
+		return -1;
+	}
+	// synced before the rename, a stored blob is never lost by a crash
+	if (file_io_pwrite(io, tmp_fd, data, size, 0) != size || file_io_sync(io, tmp_fd) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not save the received file");
+		close(tmp_fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (close(tmp_fd) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	// the same content uploaded meanwhile is simply replaced
+	if (rename(tmp_path, path) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not store the blob");
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int blob_move(const char *path, const char *hash) {
+	DEBUG_TRACE_PRINT();
+	char blob[BLOB_PATH_CHARS];
+
+	if (blob_exists(hash)) {
+		unlink(path);
+		return 0;
+	}
+	if (_blob_mkdirs(hash) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the blob directories");
+		return -1;
+	}
+
+	blob_path(hash, blob);
+	if (rename(path, blob) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not store the blob");
+		return -1;
+	}
+
+	return 0;
+}
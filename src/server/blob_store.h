@@ -0,0 +1,62 @@
+/*******************************************************************************
+ *	blob_store.h
+ *
+ *  Attachment files, stored once by the hash of their content
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __BLOB_STORE
+#define __BLOB_STORE
+
+#include "content_hash.h"
+#include "file_io.h"
+
+#define BLOB_FILES_DIR "server_files"
+// chars of the path of a blob, with the '\0'
+#define BLOB_PATH_CHARS (sizeof(BLOB_FILES_DIR) + CONTENT_HASH_CHARS + 8)
+
+
+/*
+ * Writes the path of the blob, <dir>/ab/cd/abcd..., in path (BLOB_PATH_CHARS)
+ */
+void blob_path(const char *hash, char *path);
+
+/*
+ * Returns 1 if the blob is stored or 0
+ */
+int blob_exists(const char *hash);
+
+/*
+ * Stores the data, unless a blob with the same content is already stored,
+ * and writes its hash (CONTENT_HASH_CHARS + 1) in hash. The file is written
+ * and synced by io (NULL to do it in the calling thread)
+ * Returns 0 or -1 if fails
+ */
+int blob_put(file_io *io, const unsigned char *data, int size, char *hash);
+
+/*
+ * Moves the file at path, whose content has that hash, to the blob store
+ * Returns 0 or -1 if fails
+ */
+int blob_move(const char *path, const char *hash);
+
+
+#endif /* __BLOB_STORE */
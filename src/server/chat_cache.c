@@ -0,0 +1,527 @@
+/*******************************************************************************
+ *	chat_cache.c
+ *
+ *  In-memory index of the chat members and admins
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "chat_cache.h"
+
+#include "debug_def.h"
+
+
+typedef struct user_chats user_chats;
+struct user_chats {
+	int n_chats;
+	int max_chats;
+	int *chat_ids;
+};
+
+
+void _user_chats_free(void *item) {
+	user_chats *chats = (user_chats*)item;
+
+	free(chats->chat_ids);
+	free(chats);
+}
+
+void _cached_chat_free(void *item) {
+	cached_chat *chat = (cached_chat*)item;
+
+	free(chat->members);
+	free(chat);
+}
+
+int _compare_members(const void *a, const void *b) {
+	int id_a = ((chat_member*)a)->user_id;
+	int id_b = ((chat_member*)b)->user_id;
+
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+
+/* =========================================================================
+ *  user -> chats index
+ * =========================================================================*/
+
+int _index_add(chat_cache *cache, int user_id, int chat_id) {
+	user_chats *chats;
+	int *new_ids;
+	int i;
+
+	chats = hmap_find(cache->users, user_id);
+	if (chats == NULL) {
+		chats = calloc(1, sizeof(user_chats));
+		if (chats == NULL || hmap_add(cache->users, user_id, chats) != 0) {
+			free(chats);
+			return -1;
+		}
+	}
+
+	for (i = 0 ; i < chats->n_chats ; i++) {
+		if (chats->chat_ids[i] == chat_id) {
+			return 0;
+		}
+	}
+
+	if (chats->n_chats == chats->max_chats) {
+		new_ids = realloc(chats->chat_ids, sizeof(int)*(chats->max_chats*2 + 4));
+		if (new_ids == NULL) {
+			return -1;
+		}
+		chats->chat_ids = new_ids;
+		chats->max_chats = chats->max_chats*2 + 4;
+	}
+	chats->chat_ids[chats->n_chats++] = chat_id;
+
+	return 0;
+}
+
+void _index_remove(chat_cache *cache, int user_id, int chat_id) {
+	user_chats *chats;
+	int i;
+
+	chats = hmap_find(cache->users, user_id);
+	if (chats == NULL) {
+		return;
+	}
+
+	for (i = 0 ; i < chats->n_chats ; i++) {
+		if (chats->chat_ids[i] == chat_id) {
+			chats->chat_ids[i] = chats->chat_ids[--chats->n_chats];
+			break;
+		}
+	}
+	if (chats->n_chats == 0) {
+		hmap_delete(cache->users, user_id);
+	}
+}
+
+
+/* =========================================================================
+ *  Chats
+ * =========================================================================*/
+
+chat_member *_find_member(cached_chat *chat, int user_id) {
+	chat_member key;
+
+	key.user_id = user_id;
+	return bsearch(&key, chat->members, chat->n_members, sizeof(chat_member), _compare_members);
+}
+
+/*
+ * Adds the member keeping the array sorted
+ * Returns the new member or NULL if fails
+ */
+chat_member *_insert_member(cached_chat *chat, int user_id) {
+	chat_member *new_members;
+	int pos;
+
+	if (chat->n_members == chat->max_members) {
+		new_members = realloc(chat->members, sizeof(chat_member)*(chat->max_members*2 + 4));
+		if (new_members == NULL) {
+			return NULL;
+		}
+		chat->members = new_members;
+		chat->max_members = chat->max_members*2 + 4;
+	}
+
+	for (pos = chat->n_members ; pos > 0 && chat->members[pos-1].user_id > user_id ; pos--);
+	memmove(&chat->members[pos+1], &chat->members[pos], sizeof(chat_member)*(chat->n_members - pos));
+	chat->n_members++;
+
+	chat->members[pos].user_id = user_id;
+	chat->members[pos].active = 0;
+	chat->members[pos].read_timestamp = 0;
+
+	return &chat->members[pos];
+}
+
+/*
+ * Moves all_read_timestamp up to the min read timestamp of the active members
+ * Returns the new all_read_timestamp if it advanced, or 0
+ */
+int _advance_all_read(cached_chat *chat) {
+	int min_read = -1;
+	int i;
+
+	for (i = 0 ; i < chat->n_members ; i++) {
+		if (chat->members[i].active && (min_read < 0 || chat->members[i].read_timestamp < min_read)) {
+			min_read = chat->members[i].read_timestamp;
+		}
+	}
+	if (min_read <= chat->all_read_timestamp) {
+		return 0;
+	}
+	chat->all_read_timestamp = min_read;
+
+	return min_read;
+}
+
+void _drop_chat(chat_cache *cache, int chat_id) {
+	cached_chat *chat;
+	int i;
+
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat == NULL) {
+		return;
+	}
+
+	for (i = 0 ; i < chat->n_members ; i++) {
+		_index_remove(cache, chat->members[i].user_id, chat_id);
+	}
+	hmap_delete(cache->chats, chat_id);
+}
+
+
+/* =========================================================================
+ *  Cache functions
+ * =========================================================================*/
+
+chat_cache *chat_cache_new() {
+	DEBUG_TRACE_PRINT();
+	chat_cache *cache;
+
+	cache = malloc(sizeof(chat_cache));
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache->chats = hmap_new(1024, _cached_chat_free);
+	cache->users = hmap_new(1024, _user_chats_free);
+	if (cache->chats == NULL || cache->users == NULL) {
+		if (cache->chats != NULL) {
+			hmap_free(cache->chats);
+		}
+		if (cache->users != NULL) {
+			hmap_free(cache->users);
+		}
+		free(cache);
+		return NULL;
+	}
+	cache->generation = 0;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	return cache;
+}
+
+
+void chat_cache_free(chat_cache *cache) {
+	DEBUG_TRACE_PRINT();
+	pthread_mutex_destroy(&cache->mutex);
+	hmap_free(cache->chats);
+	hmap_free(cache->users);
+	free(cache);
+}
+
+
+unsigned long chat_cache_generation(chat_cache *cache) {
+	unsigned long generation;
+
+	pthread_mutex_lock(&cache->mutex);
+	generation = cache->generation;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return generation;
+}
+
+
+int chat_cache_put(chat_cache *cache, int chat_id, unsigned long generation, int exists, int valid, int admin_id,
+		int all_read_timestamp, chat_member *members, int n_members) {
+	DEBUG_TRACE_PRINT();
+	cached_chat *chat;
+	int i;
+
+	chat = malloc(sizeof(cached_chat));
+	if (chat == NULL) {
+		return -1;
+	}
+	chat->members = malloc(sizeof(chat_member)*n_members + 1);
+	if (chat->members == NULL) {
+		free(chat);
+		return -1;
+	}
+	memcpy(chat->members, members, sizeof(chat_member)*n_members);
+	qsort(chat->members, n_members, sizeof(chat_member), _compare_members);
+	chat->n_members = n_members;
+	chat->max_members = n_members;
+	chat->exists = exists;
+	chat->valid = valid;
+	chat->admin_id = admin_id;
+	chat->all_read_timestamp = all_read_timestamp;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (generation != cache->generation) {
+		pthread_mutex_unlock(&cache->mutex);
+		_cached_chat_free(chat);
+		return -1;
+	}
+
+	// another thread may have loaded it meanwhile, both are up to date
+	_drop_chat(cache, chat_id);
+	if (hmap_add(cache->chats, chat_id, chat) != 0) {
+		pthread_mutex_unlock(&cache->mutex);
+		_cached_chat_free(chat);
+		return -1;
+	}
+	for (i = 0 ; i < n_members ; i++) {
+		if (_index_add(cache, chat->members[i].user_id, chat_id) != 0) {
+			// an incomplete index would miss updates
+			_drop_chat(cache, chat_id);
+			pthread_mutex_unlock(&cache->mutex);
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+
+int chat_cache_chat_exist(chat_cache *cache, int chat_id) {
+	cached_chat *chat;
+	int ret_value;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	ret_value = (chat == NULL)? -1 : (chat->exists && chat->valid);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+int chat_cache_is_member(chat_cache *cache, int user_id, int chat_id) {
+	cached_chat *chat;
+	chat_member *member;
+	int ret_value;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat == NULL) {
+		ret_value = -1;
+	}
+	else {
+		member = _find_member(chat, user_id);
+		ret_value = (member != NULL && member->active);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+int chat_cache_has_entry(chat_cache *cache, int user_id, int chat_id) {
+	cached_chat *chat;
+	int ret_value;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	ret_value = (chat == NULL)? -1 : (_find_member(chat, user_id) != NULL);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+int chat_cache_is_admin(chat_cache *cache, int user_id, int chat_id) {
+	cached_chat *chat;
+	int ret_value;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	ret_value = (chat == NULL)? -1 : (chat->exists && chat->admin_id == user_id);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+int chat_cache_has_read(chat_cache *cache, int user_id, int chat_id, int timestamp) {
+	cached_chat *chat;
+	chat_member *member;
+	int ret_value;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat == NULL) {
+		ret_value = -1;
+	}
+	else {
+		member = _find_member(chat, user_id);
+		ret_value = (member != NULL && member->read_timestamp >= timestamp);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+void chat_cache_add_member(chat_cache *cache, int user_id, int chat_id, int read_timestamp) {
+	DEBUG_TRACE_PRINT();
+	cached_chat *chat;
+	chat_member *member;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		member = _find_member(chat, user_id);
+		if (member == NULL) {
+			member = _insert_member(chat, user_id);
+			if (member == NULL || _index_add(cache, user_id, chat_id) != 0) {
+				_drop_chat(cache, chat_id);
+				pthread_mutex_unlock(&cache->mutex);
+				return;
+			}
+			member->read_timestamp = read_timestamp;
+		}
+		member->active = 1;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+void chat_cache_remove_member(chat_cache *cache, int user_id, int chat_id) {
+	DEBUG_TRACE_PRINT();
+	cached_chat *chat;
+	chat_member *member;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		member = _find_member(chat, user_id);
+		if (member != NULL) {
+			member->active = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+int chat_cache_remove_user(chat_cache *cache, int user_id, int *chat_ids, int *all_read, int max_chats) {
+	DEBUG_TRACE_PRINT();
+	user_chats *chats;
+	cached_chat *chat;
+	chat_member *member;
+	int n_advanced = 0;
+	int i;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	chats = hmap_find(cache->users, user_id);
+	if (chats != NULL) {
+		for (i = 0 ; i < chats->n_chats ; i++) {
+			chat = hmap_find(cache->chats, chats->chat_ids[i]);
+			if (chat != NULL && (member = _find_member(chat, user_id)) != NULL) {
+				member->active = 0;
+				// without room it is not advanced, the next read of the chat advances and stores it
+				if (n_advanced < max_chats && (all_read[n_advanced] = _advance_all_read(chat)) > 0) {
+					chat_ids[n_advanced++] = chats->chat_ids[i];
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return n_advanced;
+}
+
+
+void chat_cache_set_admin(chat_cache *cache, int user_id, int chat_id) {
+	DEBUG_TRACE_PRINT();
+	cached_chat *chat;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		chat->admin_id = user_id;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+void chat_cache_set_valid(chat_cache *cache, int chat_id, int valid) {
+	DEBUG_TRACE_PRINT();
+	cached_chat *chat;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		chat->valid = valid;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+int chat_cache_set_read(chat_cache *cache, int user_id, int chat_id, int timestamp) {
+	cached_chat *chat;
+	chat_member *member;
+	int holds_min;
+	int ret_value = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		member = _find_member(chat, user_id);
+		if (member != NULL && member->read_timestamp < timestamp) {
+			// only the members at the min hold the chat back
+			holds_min = member->active && (member->read_timestamp <= chat->all_read_timestamp);
+			member->read_timestamp = timestamp;
+			if (holds_min) {
+				ret_value = _advance_all_read(chat);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+int chat_cache_advance_all_read(chat_cache *cache, int chat_id) {
+	cached_chat *chat;
+	int ret_value = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	chat = hmap_find(cache->chats, chat_id);
+	if (chat != NULL) {
+		ret_value = _advance_all_read(chat);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret_value;
+}
+
+
+void chat_cache_invalidate(chat_cache *cache, int chat_id) {
+	DEBUG_TRACE_PRINT();
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	_drop_chat(cache, chat_id);
+	pthread_mutex_unlock(&cache->mutex);
+}
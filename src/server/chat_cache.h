@@ -0,0 +1,133 @@
+/*******************************************************************************
+ *	chat_cache.h
+ *
+ *  In-memory index of the chat members and admins
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __CHAT_CACHE
+#define __CHAT_CACHE
+
+#include <pthread.h>
+#include "hash_map.h"
+
+
+typedef struct chat_member chat_member;
+struct chat_member {
+	int user_id;
+	int active;				// REM_TIME = 0, the user has not left the chat
+	int read_timestamp;		// READ_MSG_TIME, never ahead of the database
+};
+
+typedef struct cached_chat cached_chat;
+struct cached_chat {
+	int exists;				// there is a row in chats
+	int valid;
+	int admin_id;
+	int all_read_timestamp;	// READ_TIME, min read_timestamp of the active members
+	int n_members;
+	int max_members;
+	chat_member *members;	// sorted by user_id
+};
+
+typedef struct chat_cache chat_cache;
+struct chat_cache {
+	hash_map *chats;			// chat_id -> cached_chat
+	hash_map *users;			// user_id -> user_chats, only the cached chats
+	unsigned long generation;	// incremented by every update
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Returns a pointer to the new cache or NULL if fails
+ */
+chat_cache *chat_cache_new();
+
+void chat_cache_free(chat_cache *cache);
+
+/*
+ * Returns the current generation, it must be read before the chat is
+ * loaded from the database and given to chat_cache_put
+ */
+unsigned long chat_cache_generation(chat_cache *cache);
+
+/*
+ * Stores the chat (the members do not need to be sorted). It is not stored if
+ * the cache was updated since generation, as it may be outdated
+ * Returns 0 or -1 if fails (or it is not stored)
+ */
+int chat_cache_put(chat_cache *cache, int chat_id, unsigned long generation, int exists, int valid, int admin_id,
+		int all_read_timestamp, chat_member *members, int n_members);
+
+/*
+ * The lookups return 1 or 0, or -1 if the chat is not in the cache
+ */
+int chat_cache_chat_exist(chat_cache *cache, int chat_id);
+
+int chat_cache_is_member(chat_cache *cache, int user_id, int chat_id);
+
+int chat_cache_has_entry(chat_cache *cache, int user_id, int chat_id);
+
+int chat_cache_is_admin(chat_cache *cache, int user_id, int chat_id);
+
+/*
+ * 1 if the member already read the chat up to timestamp, so updating
+ * it again would change nothing
+ */
+int chat_cache_has_read(chat_cache *cache, int user_id, int chat_id, int timestamp);
+
+/*
+ * Updates, called once the change is in the database. They only
+ * change the chats in the cache (the rest are loaded up to date)
+ */
+void chat_cache_add_member(chat_cache *cache, int user_id, int chat_id, int read_timestamp);
+
+void chat_cache_remove_member(chat_cache *cache, int user_id, int chat_id);
+
+/*
+ * Removes the user from all the chats. The chats whose all_read_timestamp
+ * advanced, up to max_chats, are written in chat_ids with their new one in all_read
+ * Returns the number of chats written
+ */
+int chat_cache_remove_user(chat_cache *cache, int user_id, int *chat_ids, int *all_read, int max_chats);
+
+void chat_cache_set_admin(chat_cache *cache, int user_id, int chat_id);
+
+void chat_cache_set_valid(chat_cache *cache, int chat_id, int valid);
+
+/*
+ * Advances the read timestamp of the member, it does not change the generation
+ * as a concurrent load would only read an older, still safe, value
+ * Returns the new all_read_timestamp of the chat if it advanced, or 0
+ */
+int chat_cache_set_read(chat_cache *cache, int user_id, int chat_id, int timestamp);
+
+/*
+ * Recomputes the all_read_timestamp of the chat, after a member left it
+ * Returns the new all_read_timestamp if it advanced, or 0
+ */
+int chat_cache_advance_all_read(chat_cache *cache, int chat_id);
+
+void chat_cache_invalidate(chat_cache *cache, int chat_id);
+
+
+#endif /* __CHAT_CACHE */
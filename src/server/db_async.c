@@ -0,0 +1,792 @@
+/*******************************************************************************
+ *	db_async.c
+ *
+ *  Non-blocking database queries driven by a few I/O threads
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include "db_async.h"
+
+#include "debug_def.h"
+
+// states of a connection
+#define DB_CONN_IDLE (0)
+#define DB_CONN_QUERY (1)
+#define DB_CONN_STORE (2)
+#define DB_CONN_CONNECT (3)
+
+// mysql_errno of the client library errors (CR_*), the connection is lost
+#define is_client_error(err) ((err) >= 2000 && (err) < 3000)
+// CR_SERVER_LOST, of the queries of a lease whose connection could not be reconnected
+#define DB_CONN_LOST_ERROR (2013)
+
+
+/* =========================================================================
+ *  Futures
+ * =========================================================================*/
+
+db_future *_future_new(db_async *async, const char *query, db_callback callback, void *arg) {
+	db_future *future;
+
+	future = malloc(sizeof(db_future));
+	if (future == NULL) {
+		return NULL;
+	}
+
+	// a lease has no query
+	future->query = NULL;
+	future->query_len = 0;
+	if (query != NULL) {
+		future->query_len = strlen(query);
+		future->query = malloc(future->query_len + sizeof(char));
+		if (future->query == NULL) {
+			free(future);
+			return NULL;
+		}
+		strcpy(future->query, query);
+	}
+
+	future->async = async;
+	future->res = NULL;
+	future->err = 0;
+	future->error[0] = '\0';
+	future->insert_id = 0;
+	future->done = 0;
+	future->callback = callback;
+	future->arg = arg;
+	future->lease = 0;
+	future->conn = NULL;
+	future->next = NULL;
+	pthread_cond_init(&future->finished, NULL);
+
+	return future;
+}
+
+
+int db_future_wait(db_future *future) {
+	pthread_mutex_lock(&future->async->mutex);
+	while (!future->done) {
+		pthread_cond_wait(&future->finished, &future->async->mutex);
+	}
+	pthread_mutex_unlock(&future->async->mutex);
+
+	return (future->err == 0)? 0 : -1;
+}
+
+
+MYSQL_RES *db_future_result(db_future *future) {
+	MYSQL_RES *res;
+
+	res = future->res;
+	future->res = NULL;
+
+	return res;
+}
+
+
+void db_future_free(db_future *future) {
+	if (future->res != NULL) {
+		mysql_free_result(future->res);
+	}
+	pthread_cond_destroy(&future->finished);
+	free(future->query);
+	free(future);
+}
+
+
+/*
+ * Writes to the wakeup pipe of the thread. It is non-blocking, when
+ * it is full the thread is already going to wake up
+ */
+void _wakeup(db_io_thread *io) {
+	while (write(io->wakeup[1], "", 1) == -1 && errno != EAGAIN) {
+		if (errno != EINTR) {
+			DEBUG_FAILURE_PRINTF("Could not wake up the async I/O thread: %s", strerror(errno));
+			break;
+		}
+	}
+}
+
+
+/*
+ * Queues the future, and wakes up the thread that can run it
+ * Returns 0 or -1 if the db_async is stopping
+ */
+int _queue_future(db_async *async, db_future *future) {
+	int i;
+
+	pthread_mutex_lock(&async->mutex);
+	if (async->stop) {
+		pthread_mutex_unlock(&async->mutex);
+		return -1;
+	}
+
+	if (async->last == NULL) {
+		async->first = future;
+	}
+	else {
+		async->last->next = future;
+	}
+	async->last = future;
+
+	// wake up the thread of the leased connection, or a thread with an idle
+	// connection, or else with a lost one to connect it again. If there is
+	// none the query starts when one of the running ones ends
+	if (future->conn != NULL) {
+		_wakeup(future->conn->io);
+	}
+	else {
+		for (i = 0 ; i < async->n_threads && async->threads[i].n_idle == 0 ; i++) {
+		}
+		if (i == async->n_threads) {
+			for (i = 0 ; i < async->n_threads && async->threads[i].n_down == 0 ; i++) {
+			}
+		}
+		if (i < async->n_threads) {
+			_wakeup(&async->threads[i]);
+		}
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return 0;
+}
+
+
+db_future *db_async_query(db_async *async, const char *query, db_callback callback, void *arg) {
+	DEBUG_TRACE_PRINT();
+	db_future *future;
+
+	future = _future_new(async, query, callback, arg);
+	if (future == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the query future");
+		return NULL;
+	}
+	if (_queue_future(async, future) != 0) {
+		db_future_free(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+
+db_lease *db_async_lease(db_async *async) {
+	DEBUG_TRACE_PRINT();
+	db_lease *lease;
+	db_future *future;
+
+	lease = malloc(sizeof(db_lease));
+	future = _future_new(async, NULL, NULL, NULL);
+	if (lease == NULL || future == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the lease");
+		free(lease);
+		if (future != NULL) {
+			db_future_free(future);
+		}
+		return NULL;
+	}
+	future->lease = 1;
+	if (_queue_future(async, future) != 0) {
+		db_future_free(future);
+		free(lease);
+		return NULL;
+	}
+
+	// an idle connection takes it like a query, in the order they were queued
+	db_future_wait(future);
+	lease->async = async;
+	lease->conn = future->conn;
+	db_future_free(future);
+
+	return lease;
+}
+
+
+db_future *db_lease_query(db_lease *lease, const char *query) {
+	DEBUG_TRACE_PRINT();
+	db_future *future;
+
+	future = _future_new(lease->async, query, NULL, NULL);
+	if (future == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the query future");
+		return NULL;
+	}
+	future->conn = lease->conn;
+	if (_queue_future(lease->async, future) != 0) {
+		db_future_free(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+
+void db_lease_free(db_lease *lease) {
+	db_conn *conn = lease->conn;
+
+	// its queries were waited, the connection is idle
+	pthread_mutex_lock(&lease->async->mutex);
+	conn->leased = 0;
+	if (conn->mysql != NULL) {
+		conn->io->n_idle++;
+	}
+	_wakeup(conn->io);
+	pthread_mutex_unlock(&lease->async->mutex);
+
+	free(lease);
+}
+
+
+#ifdef MARIADB_BASE_VERSION
+
+/* =========================================================================
+ *  I/O threads
+ * =========================================================================*/
+
+long long _db_now_msecs() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+
+/*
+ * Connects blocking, only when db_async is created
+ * Returns 0 or -1 if fails
+ */
+int _conn_connect(db_async *async, db_conn *conn) {
+	conn->future = NULL;
+	conn->connecting = NULL;
+	conn->state = DB_CONN_IDLE;
+	conn->wait_status = 0;
+	conn->retry_msecs = 0;
+	conn->backoff_msecs = DB_RECONNECT_MIN_MSECS;
+
+	conn->mysql = mysql_init(NULL);
+	if (conn->mysql == NULL) {
+		return -1;
+	}
+	mysql_options(conn->mysql, MYSQL_OPT_NONBLOCK, 0);
+
+	if (!mysql_real_connect(conn->mysql, "localhost", async->user_name, async->user_pass, "PSD", 0, NULL, 0)) {
+		DEBUG_FAILURE_PRINTF("Failed to conect to the database");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(conn->mysql));
+		mysql_close(conn->mysql);
+		conn->mysql = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Ends the connect of a lost connection, with the handle returned by the
+ * client library (NULL if it failed, then it is tried again later)
+ */
+void _conn_connected(db_io_thread *io, db_conn *conn, MYSQL *mysql) {
+	conn->state = DB_CONN_IDLE;
+	conn->wait_status = 0;
+
+	if (mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("Failed to reconect to the database, retrying in %d msecs", conn->backoff_msecs);
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(conn->connecting));
+		mysql_close(conn->connecting);
+		conn->connecting = NULL;
+		conn->retry_msecs = _db_now_msecs() + conn->backoff_msecs;
+		conn->backoff_msecs = (conn->backoff_msecs*2 < DB_RECONNECT_MAX_MSECS)? conn->backoff_msecs*2 : DB_RECONNECT_MAX_MSECS;
+		return;
+	}
+
+	conn->mysql = conn->connecting;
+	conn->connecting = NULL;
+	conn->backoff_msecs = DB_RECONNECT_MIN_MSECS;
+
+	pthread_mutex_lock(&io->async->mutex);
+	io->n_down--;
+	if (!conn->leased) {
+		io->n_idle++;
+	}
+	pthread_mutex_unlock(&io->async->mutex);
+}
+
+
+/*
+ * Starts connecting a lost connection, driven by the I/O thread like the
+ * queries, so the other connections of the thread do not wait for it
+ */
+void _conn_connect_start(db_io_thread *io, db_conn *conn) {
+	MYSQL *mysql = NULL;
+
+	conn->connecting = mysql_init(NULL);
+	if (conn->connecting == NULL) {
+		conn->retry_msecs = _db_now_msecs() + conn->backoff_msecs;
+		return;
+	}
+	mysql_options(conn->connecting, MYSQL_OPT_NONBLOCK, 0);
+
+	conn->state = DB_CONN_CONNECT;
+	conn->wait_status = mysql_real_connect_start(&mysql, conn->connecting, "localhost",
+			io->async->user_name, io->async->user_pass, "PSD", 0, NULL, 0);
+	if (conn->wait_status == 0) {
+		_conn_connected(io, conn, mysql);
+	}
+}
+
+
+/*
+ * Ends the query in flight of the connection: wakes up its waiter
+ * or calls its continuation
+ */
+void _conn_finish(db_io_thread *io, db_conn *conn, MYSQL_RES *res) {
+	db_future *future = conn->future;
+	db_callback callback;
+
+	future->res = res;
+	future->err = mysql_errno(conn->mysql);
+	if (future->err != 0) {
+		strncpy(future->error, mysql_error(conn->mysql), DB_ERROR_CHARS - 1);
+		future->error[DB_ERROR_CHARS - 1] = '\0';
+	}
+	future->insert_id = mysql_insert_id(conn->mysql);
+
+	conn->future = NULL;
+	conn->state = DB_CONN_IDLE;
+	conn->wait_status = 0;
+
+	// connected again by the I/O thread when there are queries for it
+	if (is_client_error(future->err)) {
+		DEBUG_FAILURE_PRINTF("Async connection lost, atempting to reconnect...");
+		mysql_close(conn->mysql);
+		conn->mysql = NULL;
+		conn->retry_msecs = 0;
+	}
+
+	// a waited future can be freed as soon as it is done
+	callback = future->callback;
+
+	pthread_mutex_lock(&io->async->mutex);
+	if (conn->mysql == NULL) {
+		io->n_down++;
+	}
+	else if (!conn->leased) {
+		io->n_idle++;
+	}
+	future->done = 1;
+	if (callback == NULL) {
+		pthread_cond_signal(&future->finished);
+	}
+	pthread_mutex_unlock(&io->async->mutex);
+
+	if (callback != NULL) {
+		callback(future, future->arg);
+	}
+}
+
+
+/*
+ * Advances the connection state machine with the events in status
+ * (0 to start the current step)
+ */
+void _conn_step(db_io_thread *io, db_conn *conn, int status) {
+	MYSQL_RES *res = NULL;
+	MYSQL *mysql = NULL;
+	int err = 0;
+
+	if (conn->state == DB_CONN_CONNECT) {
+		conn->wait_status = mysql_real_connect_cont(&mysql, conn->connecting, status);
+		if (conn->wait_status == 0) {
+			_conn_connected(io, conn, mysql);
+		}
+		return;
+	}
+
+	if (conn->state == DB_CONN_QUERY) {
+		if (status == 0) {
+			conn->wait_status = mysql_real_query_start(&err, conn->mysql, conn->future->query, conn->future->query_len);
+		}
+		else {
+			conn->wait_status = mysql_real_query_cont(&err, conn->mysql, status);
+		}
+		if (conn->wait_status != 0) {
+			return;
+		}
+		if (err) {
+			_conn_finish(io, conn, NULL);
+			return;
+		}
+		conn->state = DB_CONN_STORE;
+		status = 0;
+	}
+
+	if (conn->state == DB_CONN_STORE) {
+		if (status == 0) {
+			conn->wait_status = mysql_store_result_start(&res, conn->mysql);
+		}
+		else {
+			conn->wait_status = mysql_store_result_cont(&res, conn->mysql, status);
+		}
+		if (conn->wait_status != 0) {
+			return;
+		}
+		_conn_finish(io, conn, res);
+	}
+}
+
+
+/*
+ * Gives the idle connection the first queued future it can run: the ones
+ * of its lease if it is leased, or else any that is not of a lease.
+ * Must be called with the mutex of db_async held
+ * Returns 1 if a future was taken or 0 if there is none for the connection
+ */
+int _take_queued(db_io_thread *io, db_conn *conn) {
+	db_async *async = io->async;
+	db_future *future, *prev = NULL;
+
+	for (future = async->first ; future != NULL ; prev = future, future = future->next) {
+		if (future->conn == conn || (future->conn == NULL && !conn->leased && conn->mysql != NULL)) {
+			break;
+		}
+	}
+	if (future == NULL) {
+		return 0;
+	}
+
+	if (prev == NULL) {
+		async->first = future->next;
+	}
+	else {
+		prev->next = future->next;
+	}
+	if (async->last == future) {
+		async->last = prev;
+	}
+	future->next = NULL;
+
+	if (future->lease) {
+		conn->leased = 1;
+		future->conn = conn;
+		io->n_idle--;
+		future->done = 1;
+		pthread_cond_signal(&future->finished);
+	}
+	else if (conn->mysql == NULL) {
+		// the connection of the lease was lost, and not reconnected yet
+		future->err = DB_CONN_LOST_ERROR;
+		strcpy(future->error, "Lost connection to the database");
+		future->done = 1;
+		pthread_cond_signal(&future->finished);
+	}
+	else {
+		conn->future = future;
+		conn->state = DB_CONN_QUERY;
+		if (!conn->leased) {
+			io->n_idle--;
+		}
+	}
+
+	return 1;
+}
+
+
+/*
+ * Starts the queued queries on the idle connections
+ * Returns 1 if the thread must stop or 0
+ */
+int _start_queued(db_io_thread *io) {
+	db_async *async = io->async;
+	long long now;
+	int i, n_busy, pending;
+
+	// a lost connection is connected again when there are queries for it,
+	// waiting more after every failure
+	pthread_mutex_lock(&async->mutex);
+	pending = (async->first != NULL);
+	pthread_mutex_unlock(&async->mutex);
+	now = _db_now_msecs();
+	for (i = 0 ; i < io->n_conns && pending ; i++) {
+		if (io->conns[i].mysql == NULL && io->conns[i].connecting == NULL && io->conns[i].retry_msecs <= now) {
+			_conn_connect_start(io, &io->conns[i]);
+		}
+	}
+
+	pthread_mutex_lock(&async->mutex);
+	n_busy = 0;
+	for (i = 0 ; i < io->n_conns ; i++) {
+		// a lease, or a query that fails at once, leave the connection idle
+		while (io->conns[i].future == NULL && _take_queued(io, &io->conns[i])) {
+		}
+		if (io->conns[i].future != NULL) {
+			n_busy++;
+		}
+	}
+	if (async->stop && n_busy == 0 && async->first == NULL) {
+		pthread_mutex_unlock(&async->mutex);
+		return 1;
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	for (i = 0 ; i < io->n_conns ; i++) {
+		if (io->conns[i].future != NULL && io->conns[i].wait_status == 0) {
+			_conn_step(io, &io->conns[i], 0);
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Empties the wakeup pipe, it is non-blocking
+ */
+void _drain_wakeup(db_io_thread *io) {
+	char drain[64];
+	ssize_t n_read;
+
+	while ( (n_read = read(io->wakeup[0], drain, sizeof(drain))) > 0 || (n_read == -1 && errno == EINTR) ) {
+	}
+	if (n_read == -1 && errno != EAGAIN) {
+		DEBUG_FAILURE_PRINTF("Could not read the async wakeup pipe: %s", strerror(errno));
+	}
+}
+
+
+void *_io_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	db_io_thread *io = (db_io_thread*)arg;
+	struct pollfd fds[DB_ASYNC_MAX_CONNS + 1];
+	db_conn *polled[DB_ASYNC_MAX_CONNS + 1];
+	MYSQL *mysql;
+	long long now;
+	int n_fds, timeout, conn_timeout, pending;
+	int i, status;
+
+	while ( !_start_queued(io) ) {
+		fds[0].fd = io->wakeup[0];
+		fds[0].events = POLLIN;
+		n_fds = 1;
+		timeout = -1;
+
+		// the lost connections wait for their next connect
+		pthread_mutex_lock(&io->async->mutex);
+		pending = (io->async->first != NULL);
+		pthread_mutex_unlock(&io->async->mutex);
+		now = _db_now_msecs();
+		for (i = 0 ; i < io->n_conns && pending ; i++) {
+			if (io->conns[i].mysql == NULL && io->conns[i].connecting == NULL) {
+				conn_timeout = (io->conns[i].retry_msecs > now)? io->conns[i].retry_msecs - now : 0;
+				if (timeout < 0 || conn_timeout < timeout) {
+					timeout = conn_timeout;
+				}
+			}
+		}
+
+		for (i = 0 ; i < io->n_conns ; i++) {
+			// running a query, or connecting
+			if (io->conns[i].wait_status == 0) {
+				continue;
+			}
+			mysql = (io->conns[i].connecting != NULL)? io->conns[i].connecting : io->conns[i].mysql;
+			fds[n_fds].fd = mysql_get_socket(mysql);
+			fds[n_fds].events = 0;
+			if (io->conns[i].wait_status & MYSQL_WAIT_READ) {
+				fds[n_fds].events |= POLLIN;
+			}
+			if (io->conns[i].wait_status & MYSQL_WAIT_WRITE) {
+				fds[n_fds].events |= POLLOUT;
+			}
+			if (io->conns[i].wait_status & MYSQL_WAIT_EXCEPT) {
+				fds[n_fds].events |= POLLPRI;
+			}
+			if (io->conns[i].wait_status & MYSQL_WAIT_TIMEOUT) {
+				conn_timeout = 1000*mysql_get_timeout_value(mysql);
+				if (timeout < 0 || conn_timeout < timeout) {
+					timeout = conn_timeout;
+				}
+			}
+			polled[n_fds] = &io->conns[i];
+			n_fds++;
+		}
+
+		if (poll(fds, n_fds, timeout) < 0) {
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			_drain_wakeup(io);
+		}
+
+		for (i = 1 ; i < n_fds ; i++) {
+			status = 0;
+			if (fds[i].revents & POLLIN) {
+				status |= MYSQL_WAIT_READ;
+			}
+			if (fds[i].revents & POLLOUT) {
+				status |= MYSQL_WAIT_WRITE;
+			}
+			if (fds[i].revents & POLLPRI) {
+				status |= MYSQL_WAIT_EXCEPT;
+			}
+			if (status == 0 && (polled[i]->wait_status & MYSQL_WAIT_TIMEOUT) && fds[i].revents == 0 && timeout >= 0) {
+				status = MYSQL_WAIT_TIMEOUT;
+			}
+			if (status != 0) {
+				_conn_step(io, polled[i], status);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+db_async *db_async_new(char *user, char *pass, int n_threads, int n_conns) {
+	DEBUG_TRACE_PRINT();
+	db_async *async;
+	db_io_thread *io;
+	int i, k;
+
+	if (n_threads < 1 || n_conns < n_threads || n_conns > n_threads*DB_ASYNC_MAX_CONNS) {
+		DEBUG_FAILURE_PRINTF("Invalid number of async threads or connections");
+		return NULL;
+	}
+
+	async = malloc(sizeof(db_async));
+	if (async == NULL) {
+		return NULL;
+	}
+	async->threads = calloc(n_threads, sizeof(db_io_thread));
+	async->user_name = malloc(strlen(user) + sizeof(char));
+	async->user_pass = malloc(strlen(pass) + sizeof(char));
+	if (async->threads == NULL || async->user_name == NULL || async->user_pass == NULL) {
+		free(async->threads);
+		free(async->user_name);
+		free(async->user_pass);
+		free(async);
+		return NULL;
+	}
+	strcpy(async->user_name, user);
+	strcpy(async->user_pass, pass);
+	async->n_threads = 0;
+	async->first = NULL;
+	async->last = NULL;
+	async->stop = 0;
+	pthread_mutex_init(&async->mutex, NULL);
+
+	for (i = 0 ; i < n_threads ; i++) {
+		io = &async->threads[i];
+		io->async = async;
+		io->n_conns = n_conns/n_threads + ((i < n_conns%n_threads)? 1 : 0);
+		io->conns = calloc(io->n_conns, sizeof(db_conn));
+		if (io->conns == NULL || pipe(io->wakeup) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not init the async I/O thread");
+			free(io->conns);
+			db_async_free(async);
+			return NULL;
+		}
+		// a writer never blocks holding the mutex, whatever the thread is doing
+		fcntl(io->wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(io->wakeup[1], F_SETFL, O_NONBLOCK);
+		io->n_idle = 0;
+		io->n_down = 0;
+		for (k = 0 ; k < io->n_conns ; k++) {
+			io->conns[k].io = io;
+			if (_conn_connect(async, &io->conns[k]) == 0) {
+				io->n_idle++;
+			}
+			else {
+				io->n_down++;
+			}
+		}
+		if (io->n_idle == 0 || pthread_create(&io->thread, NULL, _io_thread, io) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not start the async I/O thread");
+			for (k = 0 ; k < io->n_conns ; k++) {
+				if (io->conns[k].mysql != NULL) {
+					mysql_close(io->conns[k].mysql);
+				}
+			}
+			free(io->conns);
+			close(io->wakeup[0]);
+			close(io->wakeup[1]);
+			db_async_free(async);
+			return NULL;
+		}
+		async->n_threads++;
+	}
+
+	return async;
+}
+
+#else
+
+db_async *db_async_new(char *user, char *pass, int n_threads, int n_conns) {
+	DEBUG_FAILURE_PRINTF("The async queries need the MariaDB client library");
+	return NULL;
+}
+
+#endif /* MARIADB_BASE_VERSION */
+
+
+void db_async_free(db_async *async) {
+	DEBUG_TRACE_PRINT();
+	db_io_thread *io;
+	int i, k;
+
+	pthread_mutex_lock(&async->mutex);
+	async->stop = 1;
+	for (i = 0 ; i < async->n_threads ; i++) {
+		_wakeup(&async->threads[i]);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	// the threads end when every queued query is done
+	for (i = 0 ; i < async->n_threads ; i++) {
+		io = &async->threads[i];
+		pthread_join(io->thread, NULL);
+		for (k = 0 ; k < io->n_conns ; k++) {
+			if (io->conns[k].mysql != NULL) {
+				mysql_close(io->conns[k].mysql);
+			}
+			if (io->conns[k].connecting != NULL) {
+				mysql_close(io->conns[k].connecting);
+			}
+		}
+		free(io->conns);
+		close(io->wakeup[0]);
+		close(io->wakeup[1]);
+	}
+
+	pthread_mutex_destroy(&async->mutex);
+	free(async->threads);
+	free(async->user_name);
+	free(async->user_pass);
+	free(async);
+}
@@ -0,0 +1,166 @@
+/*******************************************************************************
+ *	db_async.h
+ *
+ *  Non-blocking database queries driven by a few I/O threads
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __DB_ASYNC
+#define __DB_ASYNC
+
+#include <pthread.h>
+#include <mysql.h>
+
+// I/O threads that drive the connections
+#define DB_ASYNC_THREADS (2)
+// max connections of a single I/O thread
+#define DB_ASYNC_MAX_CONNS (64)
+#define DB_ERROR_CHARS (200)
+// a lost connection is connected again after this wait, doubled on every failure
+#define DB_RECONNECT_MIN_MSECS (100)
+#define DB_RECONNECT_MAX_MSECS (5000)
+
+
+typedef struct db_async db_async;
+typedef struct db_future db_future;
+typedef struct db_conn db_conn;
+typedef struct db_io_thread db_io_thread;
+
+/*
+ * Continuation of a query, called from the I/O thread when it ends.
+ * It must not block, and it owns (and frees) the future
+ */
+typedef void (*db_callback)(db_future *future, void *arg);
+
+struct db_future {
+	db_async *async;
+	char *query;
+	unsigned long query_len;
+	MYSQL_RES *res;				// NULL if the query has no result
+	unsigned int err;			// mysql_errno of the query, 0 if ok
+	char error[DB_ERROR_CHARS];
+	my_ulonglong insert_id;
+	int done;
+	db_callback callback;		// NULL if the caller waits for the future
+	void *arg;
+	int lease;					// takes an idle connection for the caller, it has no query
+	db_conn *conn;				// the only connection that can run it (leased), NULL if any
+	pthread_cond_t finished;
+	db_future *next;
+};
+
+struct db_conn {
+	MYSQL *mysql;				// NULL if the connection was lost
+	MYSQL *connecting;			// connected again without blocking, NULL if it is not being connected
+	long long retry_msecs;		// when it can be connected again (monotonic clock)
+	int backoff_msecs;
+	db_io_thread *io;			// that drives it
+	db_future *future;			// query in flight, NULL if idle
+	int state;
+	int wait_status;			// MYSQL_WAIT_* the client library is waiting for
+	int leased;					// only runs the queries of its lease, protected by the mutex of db_async
+};
+
+/*
+ * A connection taken by a caller, that runs all its queries on it
+ * (e.g. a transaction) until it is freed
+ */
+typedef struct db_lease db_lease;
+struct db_lease {
+	db_async *async;
+	db_conn *conn;
+};
+
+struct db_io_thread {
+	db_async *async;
+	pthread_t thread;
+	int wakeup[2];				// pipe, written when there are queued queries
+	db_conn *conns;
+	int n_conns;
+	int n_idle;					// idle connections that are not leased
+	int n_down;					// lost connections, not connected again yet
+};
+
+struct db_async {
+	db_io_thread *threads;
+	int n_threads;
+	db_future *first;			// queued queries, not started yet
+	db_future *last;
+	int stop;
+	pthread_mutex_t mutex;
+	char *user_name;
+	char *user_pass;
+};
+
+
+/*
+ * Opens n_conns non-blocking connections, shared by n_threads I/O threads.
+ * Needs the MariaDB client library, with others it always fails
+ * Returns a pointer to the db_async or NULL if fails
+ */
+db_async *db_async_new(char *user, char *pass, int n_threads, int n_conns);
+
+/*
+ * Waits for the queued queries, stops the I/O threads and closes the connections
+ */
+void db_async_free(db_async *async);
+
+/*
+ * Queues the query, it runs on the first idle connection. If callback is NULL
+ * the caller must wait for the future with db_future_wait and free it
+ * Returns the future or NULL if fails
+ */
+db_future *db_async_query(db_async *async, const char *query, db_callback callback, void *arg);
+
+/*
+ * Waits until the query ends
+ * Returns 0 or -1 if the query failed
+ */
+int db_future_wait(db_future *future);
+
+/*
+ * Takes the result of the query, the caller must free it
+ */
+MYSQL_RES *db_future_result(db_future *future);
+
+void db_future_free(db_future *future);
+
+/*
+ * Waits for an idle connection and takes it for the caller, the
+ * other queries do not run on it until the lease is freed
+ * Returns the lease or NULL if fails
+ */
+db_lease *db_async_lease(db_async *async);
+
+/*
+ * Queues the query on the connection of the lease, the caller must wait
+ * for the future with db_future_wait and free it
+ * Returns the future or NULL if fails
+ */
+db_future *db_lease_query(db_lease *lease, const char *query);
+
+/*
+ * Gives the connection back to the other queries
+ */
+void db_lease_free(db_lease *lease);
+
+
+#endif /* __DB_ASYNC */
@@ -0,0 +1,451 @@
+/*******************************************************************************
+ *	file_io.c
+ *
+ *  Executor of the reads, writes and syncs of the attachment files
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "file_io.h"
+
+#include "debug_def.h"
+
+#define FILE_IO_READ (0)
+#define FILE_IO_WRITE (1)
+#define FILE_IO_SYNC (2)
+
+
+/*
+ * Runs the operation with a blocking syscall
+ * Returns the result of the syscall, -errno if fails
+ */
+ssize_t _file_io_run(file_io_op *op) {
+	ssize_t result;
+
+	do {
+		switch (op->type) {
+			case FILE_IO_READ:
+				result = pread(op->fd, op->buff, op->size, op->offset);
+				break;
+			case FILE_IO_WRITE:
+				result = pwrite(op->fd, op->buff, op->size, op->offset);
+				break;
+			default:
+				result = fdatasync(op->fd);
+				break;
+		}
+	} while (result == -1 && errno == EINTR);
+
+	return (result == -1)? -errno : result;
+}
+
+
+/*
+ * Marks the operation as completed and wakes up its submitter,
+ * called with the mutex locked
+ */
+void _file_io_complete(file_io_op *op, ssize_t result) {
+	op->result = result;
+	op->done = 1;
+	pthread_cond_signal(&op->finished);
+}
+
+
+/* =========================================================================
+ *  Thread pool
+ * =========================================================================*/
+
+void *_file_io_thread(void *arg) {
+	file_io *io = (file_io*)arg;
+	file_io_op *op;
+	ssize_t result;
+
+	pthread_mutex_lock(&io->mutex);
+	while (1) {
+		while (io->first == NULL && !io->stop) {
+			pthread_cond_wait(&io->queued, &io->mutex);
+		}
+		if (io->first == NULL) {
+			break;
+		}
+		op = io->first;
+		io->first = op->next;
+		if (io->first == NULL) {
+			io->last = NULL;
+		}
+		pthread_mutex_unlock(&io->mutex);
+
+		result = _file_io_run(op);
+
+		pthread_mutex_lock(&io->mutex);
+		_file_io_complete(op, result);
+	}
+	pthread_mutex_unlock(&io->mutex);
+
+	return NULL;
+}
+
+
+/*
+ * Queues the operation for the threads, called with the mutex locked
+ */
+void _file_io_queue(file_io *io, file_io_op *op) {
+	if (io->last == NULL) {
+		io->first = op;
+	}
+	else {
+		io->last->next = op;
+	}
+	io->last = op;
+	pthread_cond_signal(&io->queued);
+}
+
+
+#ifdef HAVE_LIBURING
+
+/* =========================================================================
+ *  io_uring
+ * =========================================================================*/
+
+/*
+ * Removes the operation from the ones in the ring, called with the mutex locked
+ */
+void _file_io_unring(file_io *io, file_io_op *op) {
+	file_io_op **prev;
+
+	for (prev = &io->in_ring ; *prev != NULL ; prev = &(*prev)->next) {
+		if (*prev == op) {
+			*prev = op->next;
+			op->next = NULL;
+			break;
+		}
+	}
+}
+
+
+/*
+ * The ring can not be waited anymore: fails the operations in it and starts
+ * the thread pool for the next ones (they are run by their submitters if
+ * it can not be started either). Called with the mutex locked
+ */
+void _file_io_ring_failed(file_io *io, int err) {
+	file_io_op *op;
+
+	DEBUG_FAILURE_PRINTF("io_uring failed (%s), using a thread pool", strerror(-err));
+	io->ring_failed = 1;
+	while ((op = io->in_ring) != NULL) {
+		io->in_ring = op->next;
+		op->next = NULL;
+		_file_io_complete(op, err);
+	}
+	io->in_flight = 0;
+	pthread_cond_broadcast(&io->room);
+
+	if (io->stop || (io->threads = malloc(sizeof(pthread_t)*io->pool_size)) == NULL) {
+		return;
+	}
+	while (io->n_threads < io->pool_size
+			&& pthread_create(&io->threads[io->n_threads], NULL, _file_io_thread, io) == 0) {
+		io->n_threads++;
+	}
+}
+
+
+void *_file_io_reaper(void *arg) {
+	file_io *io = (file_io*)arg;
+	struct io_uring_cqe *cqe;
+	file_io_op *op;
+	int res;
+
+	while (1) {
+		res = io_uring_wait_cqe(&io->ring, &cqe);
+		if (res == -EINTR) {
+			continue;
+		}
+		if (res != 0) {
+			pthread_mutex_lock(&io->mutex);
+			_file_io_ring_failed(io, res);
+			pthread_mutex_unlock(&io->mutex);
+			break;
+		}
+		op = (file_io_op*)io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&io->ring, cqe);
+
+		pthread_mutex_lock(&io->mutex);
+		// the nop of file_io_free, submitted when the ring is empty
+		if (op == NULL && io->stop && io->in_flight == 0) {
+			pthread_mutex_unlock(&io->mutex);
+			break;
+		}
+		io->in_flight--;
+		pthread_cond_signal(&io->room);
+		if (op != NULL) {
+			_file_io_unring(io, op);
+			_file_io_complete(op, res);
+		}
+		pthread_mutex_unlock(&io->mutex);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Submits the operation to the ring, called with the mutex locked
+ * Returns 0 or -1 if fails
+ */
+int _file_io_submit(file_io *io, file_io_op *op) {
+	struct io_uring_sqe *sqe;
+
+	while (io->in_flight >= FILE_IO_QUEUE_DEPTH && !io->ring_failed) {
+		pthread_cond_wait(&io->room, &io->mutex);
+	}
+	if (io->ring_failed || (sqe = io_uring_get_sqe(&io->ring)) == NULL) {
+		return -1;
+	}
+
+	switch (op->type) {
+		case FILE_IO_READ:
+			io_uring_prep_read(sqe, op->fd, op->buff, op->size, op->offset);
+			break;
+		case FILE_IO_WRITE:
+			io_uring_prep_write(sqe, op->fd, op->buff, op->size, op->offset);
+			break;
+		default:
+			io_uring_prep_fsync(sqe, op->fd, IORING_FSYNC_DATASYNC);
+			break;
+	}
+	io_uring_sqe_set_data(sqe, op);
+	io->in_flight++;
+	op->next = io->in_ring;
+	io->in_ring = op;
+
+	// a nop left by a failed submit goes with this one, and completes as one more entry in flight
+	if (io_uring_submit(&io->ring) < 1) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		_file_io_unring(io, op);
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif /* HAVE_LIBURING */
+
+
+file_io *file_io_new(int n_threads) {
+	DEBUG_TRACE_PRINT();
+	file_io *io;
+	int i;
+
+	if ((io = malloc(sizeof(file_io))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&io->mutex, NULL);
+	pthread_cond_init(&io->queued, NULL);
+	io->stop = 0;
+	io->first = NULL;
+	io->last = NULL;
+	io->threads = NULL;
+	io->n_threads = 0;
+	io->pool_size = n_threads;
+
+#ifdef HAVE_LIBURING
+	pthread_cond_init(&io->room, NULL);
+	io->in_flight = 0;
+	io->in_ring = NULL;
+	io->uring = 0;
+	io->ring_failed = 0;
+	if (io_uring_queue_init(FILE_IO_QUEUE_DEPTH, &io->ring, 0) == 0) {
+		if (pthread_create(&io->reaper, NULL, _file_io_reaper, io) == 0) {
+			DEBUG_INFO_PRINTF("Attachment files I/O with io_uring");
+			io->uring = 1;
+			return io;
+		}
+		io_uring_queue_exit(&io->ring);
+	}
+	DEBUG_FAILURE_PRINTF("io_uring is not available, using a thread pool");
+#endif
+
+	if (n_threads < 1 || (io->threads = malloc(sizeof(pthread_t)*n_threads)) == NULL) {
+		file_io_free(io);
+		return NULL;
+	}
+	for (i = 0 ; i < n_threads ; i++) {
+		if (pthread_create(&io->threads[i], NULL, _file_io_thread, io) != 0) {
+			break;
+		}
+		io->n_threads++;
+	}
+	if (io->n_threads == 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the file I/O threads");
+		file_io_free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+
+void file_io_free(file_io *io) {
+	DEBUG_TRACE_PRINT();
+	int i;
+
+	pthread_mutex_lock(&io->mutex);
+	io->stop = 1;
+	pthread_cond_broadcast(&io->queued);
+#ifdef HAVE_LIBURING
+	if (io->uring && !io->ring_failed) {
+		struct io_uring_sqe *sqe;
+
+		// flushes the nop left by a failed submit, the nop below is the last completion of the ring
+		if (io->in_flight > 0) {
+			io_uring_submit(&io->ring);
+		}
+		while (io->in_flight > 0) {
+			pthread_cond_wait(&io->room, &io->mutex);
+		}
+		if ((sqe = io_uring_get_sqe(&io->ring)) != NULL) {
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, NULL);
+			io_uring_submit(&io->ring);
+		}
+	}
+#endif
+	pthread_mutex_unlock(&io->mutex);
+
+#ifdef HAVE_LIBURING
+	if (io->uring) {
+		pthread_join(io->reaper, NULL);
+		io_uring_queue_exit(&io->ring);
+	}
+	pthread_cond_destroy(&io->room);
+#endif
+	for (i = 0 ; i < io->n_threads ; i++) {
+		pthread_join(io->threads[i], NULL);
+	}
+
+	free(io->threads);
+	pthread_cond_destroy(&io->queued);
+	pthread_mutex_destroy(&io->mutex);
+	free(io);
+}
+
+
+/*
+ * Runs the operation in the executor and waits until it is completed
+ * Returns the result of the operation, -1 and errno if fails
+ */
+ssize_t _file_io_do(file_io *io, int type, int fd, void *buff, size_t size, off_t offset) {
+	file_io_op op;
+	int submitted = 0;
+
+	op.type = type;
+	op.fd = fd;
+	op.buff = buff;
+	op.size = size;
+	op.offset = offset;
+	op.result = 0;
+	op.done = 0;
+	op.next = NULL;
+
+	if (io == NULL) {
+		op.result = _file_io_run(&op);
+	}
+	else {
+		pthread_cond_init(&op.finished, NULL);
+		pthread_mutex_lock(&io->mutex);
+		if (!io->stop) {
+#ifdef HAVE_LIBURING
+			if (io->uring && !io->ring_failed) {
+				submitted = (_file_io_submit(io, &op) == 0);
+			}
+			else
+#endif
+			if (io->n_threads > 0) {
+				_file_io_queue(io, &op);
+				submitted = 1;
+			}
+		}
+		while (submitted && !op.done) {
+			pthread_cond_wait(&op.finished, &io->mutex);
+		}
+		pthread_mutex_unlock(&io->mutex);
+		pthread_cond_destroy(&op.finished);
+
+		// not submitted, it is run here
+		if (!submitted) {
+			op.result = _file_io_run(&op);
+		}
+	}
+
+	if (op.result < 0) {
+		errno = -op.result;
+		return -1;
+	}
+
+	return op.result;
+}
+
+
+ssize_t file_io_pread(file_io *io, int fd, void *buff, size_t size, off_t offset) {
+	size_t done = 0;
+	ssize_t n;
+
+	// short reads are resumed, until the end of the file
+	while (done < size) {
+		if ((n = _file_io_do(io, FILE_IO_READ, fd, (char*)buff + done, size - done, offset + done)) < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+
+ssize_t file_io_pwrite(file_io *io, int fd, const void *buff, size_t size, off_t offset) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		if ((n = _file_io_do(io, FILE_IO_WRITE, fd, (char*)buff + done, size - done, offset + done)) <= 0) {
+			return -1;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+
+int file_io_sync(file_io *io, int fd) {
+	return (_file_io_do(io, FILE_IO_SYNC, fd, NULL, 0, 0) < 0)? -1 : 0;
+}
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ *	file_io.h
+ *
+ *  Executor of the reads, writes and syncs of the attachment files
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __FILE_IO
+#define __FILE_IO
+
+#include <pthread.h>
+#include <sys/types.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// operations submitted and not completed yet
+#define FILE_IO_QUEUE_DEPTH (64)
+// threads of the executor without io_uring
+#define FILE_IO_THREADS (4)
+
+
+typedef struct file_io_op file_io_op;
+struct file_io_op {
+	int type;
+	int fd;
+	void *buff;
+	size_t size;
+	off_t offset;
+	ssize_t result;				// as the syscall, -errno if fails
+	int done;
+	pthread_cond_t finished;
+	file_io_op *next;
+};
+
+typedef struct file_io file_io;
+struct file_io {
+	pthread_mutex_t mutex;
+	int stop;
+	pthread_t *threads;			// of the thread pool, NULL with io_uring
+	int n_threads;
+	int pool_size;				// threads of the pool if io_uring is not used
+	file_io_op *first;			// queued operations of the thread pool
+	file_io_op *last;
+	pthread_cond_t queued;
+#ifdef HAVE_LIBURING
+	int uring;					// 1 if the ring was created, with its reaper
+	int ring_failed;			// 1 if the reaper stopped, the operations go to the thread pool
+	struct io_uring ring;
+	pthread_t reaper;			// wakes up the submitters of the completed operations
+	int in_flight;
+	file_io_op *in_ring;		// submitted operations, failed if the reaper stops
+	pthread_cond_t room;		// signaled when an operation leaves the ring
+#endif
+};
+
+
+/*
+ * Creates the executor, with io_uring if it was built with liburing (HAVE_LIBURING)
+ * and the kernel supports it, or with a pool of n_threads threads
+ * Returns a pointer to the file_io or NULL if fails
+ */
+file_io *file_io_new(int n_threads);
+
+/*
+ * Waits for the operations in progress and stops the executor
+ */
+void file_io_free(file_io *io);
+
+/*
+ * The calling thread submits the operation and sleeps until it is completed.
+ * With a NULL io they are simply run by the calling thread
+ */
+
+/*
+ * Reads size bytes from offset, less if the file ends
+ * Returns the bytes read or -1 if fails
+ */
+ssize_t file_io_pread(file_io *io, int fd, void *buff, size_t size, off_t offset);
+
+/*
+ * Writes the size bytes at offset
+ * Returns the bytes written or -1 if fails
+ */
+ssize_t file_io_pwrite(file_io *io, int fd, const void *buff, size_t size, off_t offset);
+
+/*
+ * Flushes the data of the file to the disk (fdatasync)
+ * Returns 0 or -1 if fails
+ */
+int file_io_sync(file_io *io, int fd);
+
+
+#endif /* __FILE_IO */
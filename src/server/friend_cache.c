@@ -0,0 +1,170 @@
+/*******************************************************************************
+ *	friend_cache.c
+ *
+ *  In-memory cache of the friendships
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "friend_cache.h"
+
+#include "debug_def.h"
+
+
+int _compare_edges(const void *a, const void *b) {
+	int id_a = ((friend_edge*)a)->friend_id;
+	int id_b = ((friend_edge*)b)->friend_id;
+
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+
+friend_cache *friend_cache_new() {
+	DEBUG_TRACE_PRINT();
+	friend_cache *cache;
+
+	cache = malloc(sizeof(friend_cache));
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache->users = hmap_new(1024, free);
+	if (cache->users == NULL) {
+		free(cache);
+		return NULL;
+	}
+	cache->generation = 0;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	return cache;
+}
+
+
+void friend_cache_free(friend_cache *cache) {
+	DEBUG_TRACE_PRINT();
+	pthread_mutex_destroy(&cache->mutex);
+	hmap_free(cache->users);
+	free(cache);
+}
+
+
+unsigned long friend_cache_generation(friend_cache *cache) {
+	unsigned long generation;
+
+	pthread_mutex_lock(&cache->mutex);
+	generation = cache->generation;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return generation;
+}
+
+
+int friend_cache_put(friend_cache *cache, int user_id, unsigned long generation, friend_edge *edges, int n_edges) {
+	DEBUG_TRACE_PRINT();
+	friend_list *list;
+
+	list = malloc(sizeof(friend_list) + sizeof(friend_edge)*n_edges);
+	if (list == NULL) {
+		return -1;
+	}
+	list->n_friends = n_edges;
+	memcpy(list->edges, edges, sizeof(friend_edge)*n_edges);
+	qsort(list->edges, n_edges, sizeof(friend_edge), _compare_edges);
+
+	pthread_mutex_lock(&cache->mutex);
+	if (generation != cache->generation) {
+		pthread_mutex_unlock(&cache->mutex);
+		free(list);
+		return -1;
+	}
+	// another thread may have loaded it meanwhile, both are up to date
+	hmap_delete(cache->users, user_id);
+	if (hmap_add(cache->users, user_id, list) != 0) {
+		pthread_mutex_unlock(&cache->mutex);
+		free(list);
+		return -1;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+
+int friend_cache_lookup(friend_cache *cache, int user_id, int friend_id) {
+	friend_list *list;
+	friend_edge key;
+	int found;
+
+	key.friend_id = friend_id;
+
+	pthread_mutex_lock(&cache->mutex);
+	list = hmap_find(cache->users, user_id);
+	if (list == NULL) {
+		found = -1;
+	}
+	else {
+		found = (bsearch(&key, list->edges, list->n_friends, sizeof(friend_edge), _compare_edges) != NULL)? 1 : 0;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+
+int friend_cache_list(friend_cache *cache, int user_id, int timestamp, int **friend_ids) {
+	friend_list *list;
+	int n_ids;
+	int i;
+
+	pthread_mutex_lock(&cache->mutex);
+	list = hmap_find(cache->users, user_id);
+	if (list == NULL) {
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+
+	*friend_ids = malloc(sizeof(int)*list->n_friends + 1);
+	if (*friend_ids == NULL) {
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+
+	n_ids = 0;
+	for (i = 0 ; i < list->n_friends ; i++) {
+		if (list->edges[i].creation_time >= timestamp) {
+			(*friend_ids)[n_ids++] = list->edges[i].friend_id;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return n_ids;
+}
+
+
+void friend_cache_invalidate(friend_cache *cache, int user_id) {
+	DEBUG_TRACE_PRINT();
+
+	pthread_mutex_lock(&cache->mutex);
+	hmap_delete(cache->users, user_id);
+	cache->generation++;
+	pthread_mutex_unlock(&cache->mutex);
+}
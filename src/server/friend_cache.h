@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *	friend_cache.h
+ *
+ *  In-memory cache of the friendships
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __FRIEND_CACHE
+#define __FRIEND_CACHE
+
+#include <pthread.h>
+#include "hash_map.h"
+
+
+typedef struct friend_edge friend_edge;
+struct friend_edge {
+	int friend_id;
+	int creation_time;
+};
+
+/*
+ * The friends of an user, sorted by friend_id
+ */
+typedef struct friend_list friend_list;
+struct friend_list {
+	int n_friends;
+	friend_edge edges[];
+};
+
+typedef struct friend_cache friend_cache;
+struct friend_cache {
+	hash_map *users;			// user_id -> friend_list
+	unsigned long generation;	// incremented by every invalidation
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Returns a pointer to the new cache or NULL if fails
+ */
+friend_cache *friend_cache_new();
+
+void friend_cache_free(friend_cache *cache);
+
+/*
+ * Returns the current generation, it must be read before the friends are
+ * loaded from the database and given to friend_cache_put
+ */
+unsigned long friend_cache_generation(friend_cache *cache);
+
+/*
+ * Stores the friends of the user (the edges do not need to be sorted).
+ * The friends are not stored if the cache was invalidated since generation,
+ * as they may be outdated
+ * Returns 0 or -1 if fails (or they are not stored)
+ */
+int friend_cache_put(friend_cache *cache, int user_id, unsigned long generation, friend_edge *edges, int n_edges);
+
+/*
+ * Returns 1 if friend_id is a friend of user_id, 0 if not or -1 if
+ * the friends of user_id are not in the cache
+ */
+int friend_cache_lookup(friend_cache *cache, int user_id, int friend_id);
+
+/*
+ * Gives in friend_ids (allocated with malloc) the friends of user_id since timestamp
+ * Returns the number of friends or -1 if they are not in the cache
+ */
+int friend_cache_list(friend_cache *cache, int user_id, int timestamp, int **friend_ids);
+
+/*
+ * Removes the friends of the user from the cache
+ */
+void friend_cache_invalidate(friend_cache *cache, int user_id);
+
+
+#endif /* __FRIEND_CACHE */
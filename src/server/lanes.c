@@ -0,0 +1,194 @@
+/*******************************************************************************
+ *	lanes.c
+ *
+ *  Execution lanes of the requests, by operation class
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "lanes.h"
+
+#include "debug_def.h"
+
+// the waits of the pacing are slept in steps, usleep takes up to a second
+#define LANE_MAX_PACE_USECS (1000000LL)
+
+
+static const char *class_names[N_OP_CLASSES] = {
+	"interactive",
+	"transfer"
+};
+
+// operations of the transfer lane, the rest are interactive
+static const char *transfer_ops[] = {
+	"send-attachment",
+	"get-attachment",
+	"upload-chunk",
+	"upload-commit",
+	"get-attachment-chunk",
+	NULL
+};
+
+
+long long _now_usecs() {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (long long)now.tv_sec*1000000 + now.tv_usec;
+}
+
+
+lanes *lanes_new(int transfer_slots, long long transfer_bytes_per_sec) {
+	DEBUG_TRACE_PRINT();
+	lanes *lanes;
+	int i;
+
+	if ((lanes = malloc(sizeof(struct lanes))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&lanes->mutex, NULL);
+	pthread_cond_init(&lanes->freed, NULL);
+	for (i = 0 ; i < N_OP_CLASSES ; i++) {
+		lanes->slots[i] = 0;
+		lanes->busy[i] = 0;
+	}
+	lanes->slots[OP_CLASS_TRANSFER] = (transfer_slots > 0)? transfer_slots : 0;
+	lanes->bytes_per_sec = (transfer_bytes_per_sec > 0)? transfer_bytes_per_sec : 0;
+	lanes->next_send_usecs = 0;
+
+	return lanes;
+}
+
+
+void lanes_free(lanes *lanes) {
+	pthread_cond_destroy(&lanes->freed);
+	pthread_mutex_destroy(&lanes->mutex);
+	free(lanes);
+}
+
+
+op_class lanes_classify(const char *operation) {
+	const char *name;
+	int i;
+
+	if (operation == NULL) {
+		return OP_CLASS_INTERACTIVE;
+	}
+	// without the namespace prefix (or the uri of the action)
+	name = strrchr(operation, ':');
+	name = (name != NULL)? name + 1 : operation;
+	if (strrchr(name, '/') != NULL) {
+		name = strrchr(name, '/') + 1;
+	}
+
+	for (i = 0 ; transfer_ops[i] != NULL ; i++) {
+		if (strcmp(name, transfer_ops[i]) == 0) {
+			return OP_CLASS_TRANSFER;
+		}
+	}
+
+	return OP_CLASS_INTERACTIVE;
+}
+
+
+int lanes_class_id(const char *name) {
+	int i;
+
+	for (i = 0 ; i < N_OP_CLASSES ; i++) {
+		if (strcmp(name, class_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+int lanes_enter(lanes *lanes, op_class class) {
+	struct timespec deadline;
+	struct timeval now;
+	int ret = 0;
+
+	if (lanes->slots[class] == 0) {
+		return 0;
+	}
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + LANE_WAIT_MSECS/1000;
+	deadline.tv_nsec = now.tv_usec*1000 + (LANE_WAIT_MSECS%1000)*1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&lanes->mutex);
+	while (lanes->busy[class] >= lanes->slots[class] && ret != ETIMEDOUT) {
+		ret = pthread_cond_timedwait(&lanes->freed, &lanes->mutex, &deadline);
+	}
+	if (lanes->busy[class] >= lanes->slots[class]) {
+		pthread_mutex_unlock(&lanes->mutex);
+		return -1;
+	}
+	lanes->busy[class]++;
+	pthread_mutex_unlock(&lanes->mutex);
+
+	return 0;
+}
+
+
+void lanes_leave(lanes *lanes, op_class class) {
+	if (lanes->slots[class] == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&lanes->mutex);
+	lanes->busy[class]--;
+	pthread_cond_broadcast(&lanes->freed);
+	pthread_mutex_unlock(&lanes->mutex);
+}
+
+
+void lanes_throttle(lanes *lanes, op_class class, long long bytes) {
+	long long now, start, wait;
+
+	if (class != OP_CLASS_TRANSFER || lanes->bytes_per_sec == 0 || bytes <= 0) {
+		return;
+	}
+
+	// every transfer books its time of the lane, and waits for its turn
+	now = _now_usecs();
+	pthread_mutex_lock(&lanes->mutex);
+	start = (lanes->next_send_usecs > now)? lanes->next_send_usecs : now;
+	lanes->next_send_usecs = start + bytes*1000000/lanes->bytes_per_sec;
+	pthread_mutex_unlock(&lanes->mutex);
+
+	wait = start - now;
+	while (wait > 0) {
+		usleep((wait < LANE_MAX_PACE_USECS)? wait : LANE_MAX_PACE_USECS);
+		wait -= LANE_MAX_PACE_USECS;
+	}
+}
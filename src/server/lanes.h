@@ -0,0 +1,92 @@
+/*******************************************************************************
+ *	lanes.h
+ *
+ *  Execution lanes of the requests, by operation class
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __LANES
+#define __LANES
+
+#include <pthread.h>
+
+// transfers served at once, unless given to the server
+#define LANE_TRANSFER_SLOTS (8)
+// a transfer that waits longer than this for a slot is rejected
+#define LANE_WAIT_MSECS (2000)
+
+
+typedef enum op_class op_class;
+enum op_class {
+	OP_CLASS_INTERACTIVE,		// messages, notifications, lists... never wait for a slot
+	OP_CLASS_TRANSFER,			// attachments, with their own slots and bandwidth
+	N_OP_CLASSES
+};
+
+typedef struct lanes lanes;
+struct lanes {
+	pthread_mutex_t mutex;
+	pthread_cond_t freed;
+	int slots[N_OP_CLASSES];		// requests served at once, 0 if unlimited
+	int busy[N_OP_CLASSES];
+	long long bytes_per_sec;		// of the transfer lane, 0 if unlimited
+	long long next_send_usecs;		// the transfer lane is paced up to this time
+};
+
+
+/*
+ * Creates the lanes, transfer_slots transfers served at once (0 if unlimited)
+ * sharing transfer_bytes_per_sec (0 if unlimited)
+ * Returns a pointer to the lanes or NULL if fails
+ */
+lanes *lanes_new(int transfer_slots, long long transfer_bytes_per_sec);
+
+void lanes_free(lanes *lanes);
+
+/*
+ * Class of the operation, by its SOAP action or its element (psdims:send-attachment)
+ */
+op_class lanes_classify(const char *operation);
+
+/*
+ * Class of its name (interactive, transfer)
+ * Returns the class or -1 if there is none with that name
+ */
+int lanes_class_id(const char *name);
+
+/*
+ * Takes a slot of the lane of the class, waiting up to LANE_WAIT_MSECS if they are busy
+ * Returns 0 or -1 if there was no free slot
+ */
+int lanes_enter(lanes *lanes, op_class class);
+
+/*
+ * Frees the slot taken by lanes_enter
+ */
+void lanes_leave(lanes *lanes, op_class class);
+
+/*
+ * Sleeps until bytes can be sent or received within the bandwidth of the lane
+ */
+void lanes_throttle(lanes *lanes, op_class class, long long bytes);
+
+
+#endif /* __LANES */
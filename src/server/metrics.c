@@ -0,0 +1,142 @@
+/*******************************************************************************
+ *	metrics.c
+ *
+ *  Server counters, exported as text
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <pthread.h>
+#include "metrics.h"
+
+#include "debug_def.h"
+
+
+static const char *metric_names[N_METRICS] = {
+	"psdims_requests_total",
+	"psdims_request_mem_bytes_total",
+	"psdims_request_mem_peak_bytes",
+	"psdims_request_mem_rejected_total",
+	"psdims_admission_queued_total",
+	"psdims_admission_rejected_total",
+	"psdims_soap_contexts_created_total",
+	"psdims_soap_contexts_reused_total",
+	"psdims_coalesced_requests_total",
+	"psdims_compressed_responses_total",
+	"psdims_compression_ratio_permille_sum",
+	"psdims_compression_skipped_total",
+	"psdims_bin_requests_total",
+	"psdims_transfer_requests_total",
+	"psdims_lane_rejected_total",
+	"psdims_rate_limited_user_total",
+	"psdims_rate_limited_addr_total"
+};
+
+static long long metric_values[N_METRICS];
+static long long accepted_values[METRICS_MAX_ACCEPTORS];
+static int n_acceptors = 0;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+void metrics_add(metric metric, long long value) {
+	pthread_mutex_lock(&metrics_mutex);
+	metric_values[metric] += value;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+
+void metrics_max(metric metric, long long value) {
+	pthread_mutex_lock(&metrics_mutex);
+	if (value > metric_values[metric]) {
+		metric_values[metric] = value;
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+
+long long metrics_get(metric metric) {
+	long long value;
+
+	pthread_mutex_lock(&metrics_mutex);
+	value = metric_values[metric];
+	pthread_mutex_unlock(&metrics_mutex);
+
+	return value;
+}
+
+
+void metrics_set_acceptors(int n) {
+	pthread_mutex_lock(&metrics_mutex);
+	n_acceptors = (n < METRICS_MAX_ACCEPTORS)? n : METRICS_MAX_ACCEPTORS;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+
+void metrics_accepted(int acceptor) {
+	if (acceptor < 0 || acceptor >= METRICS_MAX_ACCEPTORS) {
+		return;
+	}
+	pthread_mutex_lock(&metrics_mutex);
+	accepted_values[acceptor]++;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+
+int metrics_print(char *buff, int max_chars) {
+	DEBUG_TRACE_PRINT();
+	long long values[N_METRICS];
+	long long accepted[METRICS_MAX_ACCEPTORS];
+	int n_printed_acceptors;
+	int n_chars = 0;
+	int i, ret;
+
+	// copy them first, so the lines are consistent with each other
+	pthread_mutex_lock(&metrics_mutex);
+	for (i = 0 ; i < N_METRICS ; i++) {
+		values[i] = metric_values[i];
+	}
+	n_printed_acceptors = n_acceptors;
+	for (i = 0 ; i < n_printed_acceptors ; i++) {
+		accepted[i] = accepted_values[i];
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+
+	for (i = 0 ; i < N_METRICS ; i++) {
+		ret = snprintf(buff + n_chars, max_chars - n_chars, "%s %lld\n", metric_names[i], values[i]);
+		if (ret < 0 || ret >= max_chars - n_chars) {
+			DEBUG_FAILURE_PRINTF("The metrics do not fit in the buffer");
+			return -1;
+		}
+		n_chars += ret;
+	}
+
+	// one line per acceptor, the accept rates are given by the scraper
+	for (i = 0 ; i < n_printed_acceptors ; i++) {
+		ret = snprintf(buff + n_chars, max_chars - n_chars, "psdims_acceptor_accepted_total{acceptor=\"%d\"} %lld\n", i, accepted[i]);
+		if (ret < 0 || ret >= max_chars - n_chars) {
+			DEBUG_FAILURE_PRINTF("The metrics do not fit in the buffer");
+			return -1;
+		}
+		n_chars += ret;
+	}
+
+	return n_chars;
+}
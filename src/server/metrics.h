@@ -0,0 +1,87 @@
+/*******************************************************************************
+ *	metrics.h
+ *
+ *  Server counters, exported as text
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __METRICS
+#define __METRICS
+
+// max chars of the text with all the metrics
+#define METRICS_MAX_CHARS (4096)
+// max acceptors with their own accepted connections counter
+#define METRICS_MAX_ACCEPTORS (16)
+
+
+typedef enum metric metric;
+enum metric {
+	METRIC_REQUESTS,				// served requests
+	METRIC_REQUEST_MEM_BYTES,		// sum of the memory peaks of the requests
+	METRIC_REQUEST_MEM_PEAK,		// max memory peak of a single request
+	METRIC_REQUEST_MEM_REJECTED,	// results rejected by the request memory budget
+	METRIC_ADMISSION_QUEUED,		// connections that waited for a thread
+	METRIC_ADMISSION_REJECTED,		// connections answered with 503
+	METRIC_SOAP_CONTEXTS_CREATED,	// soap contexts copied for new connections
+	METRIC_SOAP_CONTEXTS_REUSED,	// soap contexts taken from the pool
+	METRIC_COALESCED_REQUESTS,		// reads that took the result of an identical one
+	METRIC_COMPRESSED_RESPONSES,	// responses sent with gzip or deflate
+	METRIC_COMPRESSION_RATIO_SUM,	// sum of the compressed/uncompressed ratios, in thousandths
+	METRIC_COMPRESSION_SKIPPED,		// responses too small to be compressed
+	METRIC_BIN_REQUESTS,			// requests served by the binary transport
+	METRIC_TRANSFER_REQUESTS,		// requests served in the transfer lane
+	METRIC_LANE_REJECTED,			// transfers answered with 503, their lane was busy
+	METRIC_RATE_LIMITED_USER,		// requests answered with 429 by the rate of their user
+	METRIC_RATE_LIMITED_ADDR,		// requests answered with 429 by the rate of their address
+	N_METRICS
+};
+
+
+/*
+ * Adds value to the metric
+ */
+void metrics_add(metric metric, long long value);
+
+/*
+ * Sets the metric to value if it is greater
+ */
+void metrics_max(metric metric, long long value);
+
+long long metrics_get(metric metric);
+
+/*
+ * Sets the number of acceptors whose counters are printed
+ */
+void metrics_set_acceptors(int n_acceptors);
+
+/*
+ * Counts a connection accepted by the acceptor (0 to METRICS_MAX_ACCEPTORS - 1)
+ */
+void metrics_accepted(int acceptor);
+
+/*
+ * Writes every metric as a "name value" line
+ * Returns the number of chars written or -1 if they do not fit
+ */
+int metrics_print(char *buff, int max_chars);
+
+
+#endif /* __METRICS */
@@ -0,0 +1,209 @@
+/*******************************************************************************
+ *	msg_batch.c
+ *
+ *  Group commit of the message inserts
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "msg_batch.h"
+
+#include "debug_def.h"
+
+
+/*
+ * Waits until there are rows to flush, and then a bit more (up to BATCH_FLUSH_USECS)
+ * so the rows of other handlers can join the same transaction.
+ * Must be called with the mutex locked
+ */
+void _wait_for_rows(msg_batch *batch) {
+	struct timeval now;
+	struct timespec deadline;
+
+	while (batch->n_pending == 0 && !batch->stop) {
+		pthread_cond_wait(&batch->pending, &batch->mutex);
+	}
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + (now.tv_usec + BATCH_FLUSH_USECS) / 1000000;
+	deadline.tv_nsec = ((now.tv_usec + BATCH_FLUSH_USECS) % 1000000) * 1000;
+
+	while (batch->n_pending < BATCH_MAX_ROWS && !batch->stop) {
+		if (pthread_cond_timedwait(&batch->pending, &batch->mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+}
+
+
+void *_committer_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	msg_batch *batch = (msg_batch*)arg;
+	msg_batch_entry *entries[BATCH_MAX_ROWS];
+	message_row *rows[BATCH_MAX_ROWS];
+	int n_rows;
+	int i;
+
+	pthread_mutex_lock(&batch->mutex);
+	while (!batch->stop || batch->n_pending > 0) {
+		_wait_for_rows(batch);
+
+		// take (at most) BATCH_MAX_ROWS from the queue
+		n_rows = 0;
+		while (batch->first != NULL && n_rows < BATCH_MAX_ROWS) {
+			entries[n_rows] = batch->first;
+			rows[n_rows] = &batch->first->row;
+			batch->first = batch->first->next;
+			n_rows++;
+		}
+		if (batch->first == NULL) {
+			batch->last = NULL;
+		}
+		batch->n_pending -= n_rows;
+		pthread_mutex_unlock(&batch->mutex);
+
+		if (n_rows > 0) {
+			if (persistence_err(batch->persistence)) {
+				DEBUG_FAILURE_PRINTF("Batch persistence is disconnected, atempting to reconnect...");
+				reconnect_persistence(batch->persistence);
+			}
+			DEBUG_INFO_PRINTF("Flushing %d messages", n_rows);
+			send_messages_batch(batch->persistence, rows, n_rows, 0);
+		}
+
+		pthread_mutex_lock(&batch->mutex);
+		for (i = 0 ; i < n_rows ; i++) {
+			entries[i]->done = 1;
+		}
+		pthread_cond_broadcast(&batch->committed);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+
+	return NULL;
+}
+
+
+msg_batch *msg_batch_new(persistence *persistence, msg_clock *clock) {
+	DEBUG_TRACE_PRINT();
+	msg_batch *batch;
+
+	batch = malloc(sizeof(msg_batch));
+	if (batch == NULL) {
+		return NULL;
+	}
+
+	batch->persistence = clone_persistence(persistence);
+	if (batch->persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the batch persistence");
+		free(batch);
+		return NULL;
+	}
+
+	batch->clock = clock;
+	batch->first = NULL;
+	batch->last = NULL;
+	batch->n_pending = 0;
+	batch->stop = 0;
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->pending, NULL);
+	pthread_cond_init(&batch->committed, NULL);
+
+	if (pthread_create(&batch->committer, NULL, _committer_thread, batch) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the committer thread");
+		free_persistence(batch->persistence);
+		free(batch);
+		return NULL;
+	}
+
+	return batch;
+}
+
+
+void msg_batch_free(msg_batch *batch) {
+	DEBUG_TRACE_PRINT();
+
+	pthread_mutex_lock(&batch->mutex);
+	batch->stop = 1;
+	pthread_cond_signal(&batch->pending);
+	pthread_mutex_unlock(&batch->mutex);
+
+	// the committer flushes what is left before ending
+	pthread_join(batch->committer, NULL);
+
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->pending);
+	pthread_cond_destroy(&batch->committed);
+	free_persistence(batch->persistence);
+	free(batch);
+}
+
+
+int msg_batch_send(msg_batch *batch, persistence *persistence, int chat_id, int user_id, psdims__message_info *message, int *timestamp) {
+	DEBUG_TRACE_PRINT();
+	msg_batch_entry entry;
+
+	if (message == NULL || message->text == NULL || timestamp == NULL) {
+		return -1;
+	}
+
+	entry.row.timestamp = msg_clock_next(batch->clock, persistence, chat_id);
+	if (entry.row.timestamp < 0) {
+		DEBUG_FAILURE_PRINTF("Could not get the message timestamp");
+		return -1;
+	}
+
+	entry.row.chat_id = chat_id;
+	entry.row.user_id = user_id;
+	entry.row.text = message->text;
+	entry.row.file_name = message->file_name;
+	entry.row.result = ROW_FAILED;
+	entry.done = 0;
+	entry.next = NULL;
+
+	pthread_mutex_lock(&batch->mutex);
+	if (batch->stop) {
+		pthread_mutex_unlock(&batch->mutex);
+		return -1;
+	}
+
+	if (batch->last == NULL) {
+		batch->first = &entry;
+	}
+	else {
+		batch->last->next = &entry;
+	}
+	batch->last = &entry;
+	batch->n_pending++;
+	pthread_cond_signal(&batch->pending);
+
+	while (!entry.done) {
+		pthread_cond_wait(&batch->committed, &batch->mutex);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+
+	*timestamp = entry.row.timestamp;
+
+	return (entry.row.result == 0)? 0 : -1;
+}
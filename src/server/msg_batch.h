@@ -0,0 +1,82 @@
+/*******************************************************************************
+ *	msg_batch.h
+ *
+ *  Group commit of the message inserts
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __MSG_BATCH
+#define __MSG_BATCH
+
+#include <pthread.h>
+#include "persistence.h"
+#include "msg_clock.h"
+
+// the committer waits at most this time for more rows before a flush
+#define BATCH_FLUSH_USECS (5000)
+// max rows in a single INSERT
+#define BATCH_MAX_ROWS (64)
+
+
+typedef struct msg_batch_entry msg_batch_entry;
+struct msg_batch_entry {
+	message_row row;
+	int done;
+	struct msg_batch_entry *next;
+};
+
+typedef struct msg_batch msg_batch;
+struct msg_batch {
+	persistence *persistence;		// own connection, only used by the committer
+	msg_clock *clock;				// gives the message timestamps
+	msg_batch_entry *first;
+	msg_batch_entry *last;
+	int n_pending;
+	int stop;
+	pthread_t committer;
+	pthread_mutex_t mutex;
+	pthread_cond_t pending;			// signaled when there are rows to flush
+	pthread_cond_t committed;		// broadcasted after every flush
+};
+
+
+/*
+ * Creates the batch and starts the committer thread, that uses
+ * its own clone of persistence. The clock is not owned by the batch.
+ * Returns a pointer to the batch or NULL if fails
+ */
+msg_batch *msg_batch_new(persistence *persistence, msg_clock *clock);
+
+/*
+ * Flushes the pending rows, stops the committer and frees the batch
+ */
+void msg_batch_free(msg_batch *batch);
+
+/*
+ * Queues the message and waits until it is committed.
+ * The message timestamp is given here by the clock. persistence is the
+ * caller connection, used by the clock.
+ * Returns 0 and the timestamp or -1 if fails
+ */
+int msg_batch_send(msg_batch *batch, persistence *persistence, int chat_id, int user_id, psdims__message_info *message, int *timestamp);
+
+
+#endif /* __MSG_BATCH */
@@ -0,0 +1,145 @@
+/*******************************************************************************
+ *	msg_clock.c
+ *
+ *  Per chat message timestamps
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "msg_clock.h"
+
+#include "debug_def.h"
+
+
+/*
+ * Returns the last timestamp of the chat, loading it from the database
+ * the first time. Must be called with the mutex locked, it is released
+ * while the database is queried
+ * Returns a pointer to the last timestamp or NULL if fails
+ */
+int *_load_last_time(msg_clock *clock, persistence *persistence, int chat_id) {
+	int *last_time;
+	int db_last_time;
+
+	last_time = hmap_find(clock->last_times, chat_id);
+	if (last_time != NULL) {
+		return last_time;
+	}
+
+	pthread_mutex_unlock(&clock->mutex);
+	db_last_time = get_last_message_time(persistence, chat_id);
+	pthread_mutex_lock(&clock->mutex);
+	if (db_last_time < 0) {
+		return NULL;
+	}
+
+	// another thread may have done the same meanwhile
+	last_time = hmap_find(clock->last_times, chat_id);
+	if (last_time != NULL) {
+		return last_time;
+	}
+
+	last_time = malloc(sizeof(int));
+	if (last_time == NULL) {
+		return NULL;
+	}
+	*last_time = db_last_time;
+	if (hmap_add(clock->last_times, chat_id, last_time) != 0) {
+		free(last_time);
+		return NULL;
+	}
+
+	return last_time;
+}
+
+
+msg_clock *msg_clock_new() {
+	DEBUG_TRACE_PRINT();
+	msg_clock *clock;
+
+	clock = malloc(sizeof(msg_clock));
+	if (clock == NULL) {
+		return NULL;
+	}
+
+	clock->last_times = hmap_new(256, free);
+	if (clock->last_times == NULL) {
+		free(clock);
+		return NULL;
+	}
+	pthread_mutex_init(&clock->mutex, NULL);
+
+	return clock;
+}
+
+
+void msg_clock_free(msg_clock *clock) {
+	DEBUG_TRACE_PRINT();
+	pthread_mutex_destroy(&clock->mutex);
+	hmap_free(clock->last_times);
+	free(clock);
+}
+
+
+int msg_clock_next(msg_clock *clock, persistence *persistence, int chat_id) {
+	DEBUG_TRACE_PRINT();
+	int *last_time;
+	int timestamp;
+
+	pthread_mutex_lock(&clock->mutex);
+	last_time = _load_last_time(clock, persistence, chat_id);
+	if (last_time == NULL) {
+		pthread_mutex_unlock(&clock->mutex);
+		DEBUG_FAILURE_PRINTF("Could not get the last timestamp of the chat");
+		return -1;
+	}
+
+	timestamp = time(NULL);
+	if (timestamp <= *last_time) {
+		timestamp = *last_time + 1;
+	}
+	*last_time = timestamp;
+	pthread_mutex_unlock(&clock->mutex);
+
+	return timestamp;
+}
+
+
+int msg_clock_seen(msg_clock *clock, persistence *persistence, int chat_id, int timestamp) {
+	DEBUG_TRACE_PRINT();
+	int *last_time;
+
+	pthread_mutex_lock(&clock->mutex);
+	last_time = _load_last_time(clock, persistence, chat_id);
+	if (last_time == NULL) {
+		pthread_mutex_unlock(&clock->mutex);
+		return -1;
+	}
+
+	if (timestamp > *last_time) {
+		*last_time = timestamp;
+	}
+	pthread_mutex_unlock(&clock->mutex);
+
+	return 0;
+}
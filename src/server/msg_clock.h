@@ -0,0 +1,67 @@
+/*******************************************************************************
+ *	msg_clock.h
+ *
+ *  Per chat message timestamps
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __MSG_CLOCK
+#define __MSG_CLOCK
+
+#include <pthread.h>
+#include "persistence.h"
+#include "hash_map.h"
+
+
+typedef struct msg_clock msg_clock;
+struct msg_clock {
+	hash_map *last_times;			// chat_id -> last timestamp given in that chat
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Returns a pointer to the new clock or NULL if fails
+ */
+msg_clock *msg_clock_new();
+
+void msg_clock_free(msg_clock *clock);
+
+/*
+ * Gives the timestamp of a new message in the chat: the current time, or one
+ * more than the last one if it was already used (messages have no id,
+ * the timestamp identifies them inside the chat). Also gives the join and
+ * leave times of the members, so they are ordered with the messages.
+ * persistence is the caller connection, used to know the last timestamp
+ * of a chat the first time.
+ * Returns the timestamp or -1 if fails
+ */
+int msg_clock_next(msg_clock *clock, persistence *persistence, int chat_id);
+
+/*
+ * Tells the clock that timestamp is in use in the chat (a message that
+ * is not in the database yet)
+ * Returns 0 or -1 if fails
+ */
+int msg_clock_seen(msg_clock *clock, persistence *persistence, int chat_id, int timestamp);
+
+
+#endif /* __MSG_CLOCK */
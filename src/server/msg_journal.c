@@ -0,0 +1,920 @@
+/*******************************************************************************
+ *	msg_journal.c
+ *
+ *  Write-ahead journal of the sent messages
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "msg_journal.h"
+#include "msg_batch.h"
+
+#include "debug_def.h"
+
+#define NO_FILE_LEN (0xFFFF)
+#define MAX_TEXT_LEN (65536)
+
+#define record_size(entry) \
+		( sizeof(journal_record) + strlen(entry->user_name) + strlen(entry->row.text) + \
+		((entry->row.file_name != NULL)? strlen(entry->row.file_name) : 0) )
+
+
+/* =========================================================================
+ *  Records
+ * =========================================================================*/
+
+// FNV-1a
+unsigned int _checksum(unsigned int hash, const unsigned char *data, size_t size) {
+	size_t i;
+
+	for (i = 0 ; i < size ; i++) {
+		hash ^= data[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+unsigned int _record_checksum(journal_record *record, const char *data, size_t data_size) {
+	unsigned int hash = 2166136261u;
+
+	hash = _checksum(hash, (unsigned char*)&record->chat_id, sizeof(journal_record) - 2*sizeof(unsigned int));
+	return _checksum(hash, (unsigned char*)data, data_size);
+}
+
+
+/*
+ * Allocates the entry and its strings in a single block
+ * Returns the new entry or NULL if fails
+ */
+journal_entry *_entry_new(int chat_id, int user_id, int timestamp, const char *user_name, size_t user_len,
+		const char *file_name, size_t file_len, const char *text, size_t text_len) {
+	journal_entry *entry;
+	char *strings;
+
+	entry = malloc(sizeof(journal_entry) + user_len + file_len + text_len + 3);
+	if (entry == NULL) {
+		return NULL;
+	}
+	strings = (char*)(entry + 1);
+
+	entry->user_name = strings;
+	memcpy(entry->user_name, user_name, user_len);
+	entry->user_name[user_len] = '\0';
+	strings += user_len + 1;
+
+	entry->row.text = strings;
+	memcpy(entry->row.text, text, text_len);
+	entry->row.text[text_len] = '\0';
+	strings += text_len + 1;
+
+	if (file_name != NULL) {
+		entry->row.file_name = strings;
+		memcpy(entry->row.file_name, file_name, file_len);
+		entry->row.file_name[file_len] = '\0';
+	}
+	else {
+		entry->row.file_name = NULL;
+	}
+
+	entry->row.chat_id = chat_id;
+	entry->row.user_id = user_id;
+	entry->row.timestamp = timestamp;
+	entry->row.result = ROW_FAILED;
+	entry->sent = NULL;
+	entry->next = NULL;
+
+	return entry;
+}
+
+
+/*
+ * Writes the entry record in buff
+ * Returns the size of the record
+ */
+size_t _serialize_entry(journal_entry *entry, char *buff) {
+	journal_record *record = (journal_record*)buff;
+	char *data = buff + sizeof(journal_record);
+	char *end = data;
+	size_t len;
+
+	record->magic = JOURNAL_MAGIC;
+	record->chat_id = entry->row.chat_id;
+	record->user_id = entry->row.user_id;
+	record->timestamp = entry->row.timestamp;
+
+	len = strlen(entry->user_name);
+	record->user_len = len;
+	memcpy(end, entry->user_name, len);
+	end += len;
+
+	if (entry->row.file_name != NULL) {
+		len = strlen(entry->row.file_name);
+		record->file_len = len;
+		memcpy(end, entry->row.file_name, len);
+		end += len;
+	}
+	else {
+		record->file_len = NO_FILE_LEN;
+	}
+
+	len = strlen(entry->row.text);
+	record->text_len = len;
+	memcpy(end, entry->row.text, len);
+	end += len;
+
+	record->checksum = _record_checksum(record, data, end - data);
+
+	return end - buff;
+}
+
+
+/*
+ * Reads the record at offset
+ * Returns the new entry, or NULL at the end of the journal or if the record is not valid
+ */
+journal_entry *_read_entry(int fd, off_t offset, off_t *end_offset) {
+	journal_record record;
+	journal_entry *entry;
+	char *data;
+	size_t file_len, data_size;
+
+	if (pread(fd, &record, sizeof(journal_record), offset) != sizeof(journal_record)) {
+		return NULL;
+	}
+	if (record.magic != JOURNAL_MAGIC || record.text_len > MAX_TEXT_LEN) {
+		return NULL;
+	}
+
+	file_len = (record.file_len != NO_FILE_LEN)? record.file_len : 0;
+	data_size = record.user_len + file_len + record.text_len;
+	data = malloc(data_size + 1);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	if (pread(fd, data, data_size, offset + sizeof(journal_record)) != data_size
+			|| _record_checksum(&record, data, data_size) != record.checksum) {
+		free(data);
+		return NULL;
+	}
+
+	entry = _entry_new(record.chat_id, record.user_id, record.timestamp,
+			data, record.user_len,
+			(record.file_len != NO_FILE_LEN)? data + record.user_len : NULL, file_len,
+			data + record.user_len + file_len, record.text_len);
+	free(data);
+
+	*end_offset = offset + sizeof(journal_record) + data_size;
+
+	return entry;
+}
+
+
+/* =========================================================================
+ *  Checkpoint
+ * =========================================================================*/
+
+/*
+ * Syncs the directory of the file, so a rename in it survives a crash
+ * Returns 0 or -1 if fails
+ */
+int _sync_dir(const char *path) {
+	char dir_path[strlen(path) + 2];
+	char *slash;
+	int fd, ret_value;
+
+	strcpy(dir_path, path);
+	if ((slash = strrchr(dir_path, '/')) == NULL) {
+		strcpy(dir_path, ".");
+	}
+	else {
+		slash[(slash == dir_path)? 1 : 0] = '\0';
+	}
+
+	if ((fd = open(dir_path, O_RDONLY | O_DIRECTORY)) == -1) {
+		return -1;
+	}
+	ret_value = fsync(fd);
+	close(fd);
+
+	return ret_value;
+}
+
+/*
+ * Saves the offset of the journal up to which every message is applied
+ * Returns 0 or -1 if fails
+ */
+int _write_checkpoint(msg_journal *journal, off_t offset) {
+	char tmp_path[strlen(journal->checkpoint_path) + 5];
+	FILE *fd;
+
+	sprintf(tmp_path, "%s.tmp", journal->checkpoint_path);
+	if ( (fd = fopen(tmp_path, "w")) == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not write the journal checkpoint");
+		return -1;
+	}
+	fprintf(fd, "%lld\n", (long long)offset);
+	// synced before the rename, or after a crash the new name could have no data
+	if (fflush(fd) != 0 || fsync(fileno(fd)) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not write the journal checkpoint");
+		fclose(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	fclose(fd);
+
+	// rename is atomic, the checkpoint is never seen half written
+	if (rename(tmp_path, journal->checkpoint_path) != 0 || _sync_dir(journal->checkpoint_path) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not write the journal checkpoint");
+		return -1;
+	}
+	return 0;
+}
+
+off_t _read_checkpoint(msg_journal *journal) {
+	long long offset;
+	FILE *fd;
+
+	if ( (fd = fopen(journal->checkpoint_path, "r")) == NULL ) {
+		return 0;
+	}
+	if (fscanf(fd, "%lld", &offset) != 1 || offset < 0) {
+		offset = 0;
+	}
+	fclose(fd);
+
+	return offset;
+}
+
+
+/*
+ * Loads the records after the checkpoint as synced entries, so
+ * the applier inserts them (again, if they were already applied)
+ * Returns 0 or -1 if fails
+ */
+int _replay_journal(msg_journal *journal) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *entry;
+	struct stat st;
+	off_t offset, end_offset;
+	int n_entries;
+
+	if (fstat(journal->fd, &st) != 0) {
+		return -1;
+	}
+
+	offset = _read_checkpoint(journal);
+	if (offset > st.st_size) {
+		// applying everything again is harmless
+		offset = 0;
+	}
+
+	n_entries = 0;
+	while ( (entry = _read_entry(journal->fd, offset, &end_offset)) != NULL ) {
+		entry->seq = journal->next_seq++;
+		entry->end_offset = end_offset;
+		if (journal->synced_last == NULL) {
+			journal->synced = entry;
+		}
+		else {
+			journal->synced_last->next = entry;
+		}
+		journal->synced_last = entry;
+
+		if (msg_clock_seen(journal->clock, journal->persistence, entry->row.chat_id, entry->row.timestamp) != 0) {
+			return -1;
+		}
+		offset = end_offset;
+		n_entries++;
+	}
+
+	if (offset < st.st_size) {
+		// the last write did not finish before the crash, it was never acknowledged
+		DEBUG_FAILURE_PRINTF("Discarding %lld bytes at the end of the journal", (long long)(st.st_size - offset));
+		if (ftruncate(journal->fd, offset) != 0) {
+			return -1;
+		}
+	}
+
+	journal->file_size = offset;
+	journal->synced_seq = journal->next_seq - 1;
+	DEBUG_INFO_PRINTF("Replaying %d messages from the journal", n_entries);
+
+	return 0;
+}
+
+
+/* =========================================================================
+ *  Threads
+ * =========================================================================*/
+
+/*
+ * Gives the result to the senders of the entries, called with the mutex locked
+ */
+void _set_sent(journal_entry *first, int result) {
+	journal_entry *entry;
+
+	for (entry = first ; entry != NULL ; entry = entry->next) {
+		if (entry->sent != NULL) {
+			*entry->sent = result;
+			entry->sent = NULL;
+		}
+	}
+}
+
+
+/*
+ * Writes the queued entries and syncs them with a single fdatasync
+ * Returns 0 or -1 if fails
+ */
+int _write_entries(msg_journal *journal, journal_entry *first, off_t offset) {
+	journal_entry *entry;
+	char *buff, *end;
+	size_t total_size;
+	ssize_t written;
+
+	// a failed write may have left part of a record, the replay would stop there
+	if (journal->dirty) {
+		if (ftruncate(journal->fd, offset) != 0) {
+			return -1;
+		}
+		journal->dirty = 0;
+	}
+
+	total_size = 0;
+	for (entry = first ; entry != NULL ; entry = entry->next) {
+		total_size += record_size(entry);
+	}
+
+	buff = malloc(total_size);
+	if (buff == NULL) {
+		return -1;
+	}
+
+	end = buff;
+	for (entry = first ; entry != NULL ; entry = entry->next) {
+		end += _serialize_entry(entry, end);
+		entry->end_offset = offset + (end - buff);
+	}
+
+	end = buff;
+	while (total_size > 0) {
+		written = write(journal->fd, end, total_size);
+		if (written < 0) {
+			free(buff);
+			return -1;
+		}
+		end += written;
+		total_size -= written;
+	}
+	free(buff);
+
+	return fdatasync(journal->fd);
+}
+
+
+void *_flusher_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	msg_journal *journal = (msg_journal*)arg;
+	journal_entry *first, *last, *next;
+	off_t offset;
+
+	pthread_mutex_lock(&journal->mutex);
+	while (1) {
+		while (journal->queued == NULL && !journal->stop) {
+			pthread_cond_wait(&journal->queued_cond, &journal->mutex);
+		}
+		if (journal->queued == NULL) {
+			break;
+		}
+
+		// while the disk is busy, the next entries are queued, so they are
+		// synced together in the next round
+		first = journal->queued;
+		last = journal->queued_last;
+		journal->queued = NULL;
+		journal->queued_last = NULL;
+		journal->flushing = 1;
+		offset = journal->file_size;
+		pthread_mutex_unlock(&journal->mutex);
+
+		if (_write_entries(journal, first, offset) == 0) {
+			pthread_mutex_lock(&journal->mutex);
+			journal->file_size = last->end_offset;
+			journal->synced_seq = last->seq;
+			_set_sent(first, 0);
+			if (journal->synced_last == NULL) {
+				journal->synced = first;
+			}
+			else {
+				journal->synced_last->next = first;
+			}
+			journal->synced_last = last;
+			pthread_cond_signal(&journal->applied_cond);
+		}
+		else {
+			// only these messages fail, the next ones are written again after the good records
+			DEBUG_FAILURE_PRINTF("Could not write the journal, messages not sent");
+			pthread_mutex_lock(&journal->mutex);
+			_set_sent(first, -1);
+			while (first != NULL) {
+				next = first->next;
+				free(first);
+				first = next;
+			}
+			journal->dirty = 1;
+		}
+		journal->flushing = 0;
+		pthread_cond_broadcast(&journal->synced_cond);
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	return NULL;
+}
+
+
+/*
+ * Appends the record of the entry to the file of the rejected messages, and syncs it
+ * Returns 0 or -1 if fails
+ */
+int _write_rejected(msg_journal *journal, journal_entry *entry) {
+	char *buff;
+	size_t size;
+	ssize_t n_written;
+
+	buff = malloc(record_size(entry));
+	if (buff == NULL) {
+		return -1;
+	}
+	size = _serialize_entry(entry, buff);
+	n_written = write(journal->dead_fd, buff, size);
+	free(buff);
+
+	if (n_written != (ssize_t)size || fdatasync(journal->dead_fd) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+void *_applier_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	msg_journal *journal = (msg_journal*)arg;
+	message_row *rows[BATCH_MAX_ROWS];
+	journal_entry *entries[BATCH_MAX_ROWS];
+	journal_entry *entry, *next;
+	off_t applied_offset;
+	int retry_secs = JOURNAL_RETRY_SECS;
+	int n_rows, n_applied;
+	int i;
+
+	pthread_mutex_lock(&journal->mutex);
+	while (1) {
+		while (journal->synced == NULL && !journal->stop) {
+			pthread_cond_wait(&journal->applied_cond, &journal->mutex);
+		}
+		if (journal->synced == NULL) {
+			break;
+		}
+
+		// the entries stay in the list (visible to the readers) until they are applied.
+		// The flusher only appends to the list, so these are still the first ones later
+		n_rows = 0;
+		for (entry = journal->synced ; entry != NULL && n_rows < BATCH_MAX_ROWS ; entry = entry->next) {
+			entries[n_rows] = entry;
+			rows[n_rows++] = &entry->row;
+		}
+		pthread_mutex_unlock(&journal->mutex);
+
+		send_messages_batch(journal->persistence, rows, n_rows, 1);
+
+		// the messages were acknowledged to their senders, the checkpoint only passes
+		// the applied ones and the ones kept in the rejected file. A temporary error
+		// (deadlock, lock wait timeout, lost connection...) keeps the rest, the ones
+		// after it that were applied are applied again (ignored) next time
+		for (n_applied = 0 ; n_applied < n_rows ; n_applied++) {
+			if (rows[n_applied]->result == ROW_FAILED) {
+				break;
+			}
+			if (rows[n_applied]->result == ROW_REJECTED) {
+				DEBUG_FAILURE_PRINTF("The database rejects journal message %d of chat %d, moved to the rejected file",
+						rows[n_applied]->timestamp, rows[n_applied]->chat_id);
+				if (_write_rejected(journal, entries[n_applied]) != 0) {
+					DEBUG_FAILURE_PRINTF("Could not write the rejected journal message");
+					break;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&journal->mutex);
+		for (i = 0 ; i < n_applied ; i++) {
+			entry = journal->synced;
+			applied_offset = entry->end_offset;
+			next = entry->next;
+			free(entry);
+			journal->synced = next;
+		}
+		if (journal->synced == NULL) {
+			journal->synced_last = NULL;
+		}
+
+		if (journal->synced == NULL && journal->queued == NULL && !journal->flushing
+				&& journal->file_size > JOURNAL_ROTATE_BYTES) {
+			// everything is applied, start the journal again. The checkpoint goes
+			// first, if the truncate is lost all is applied again (harmless)
+			if (_write_checkpoint(journal, 0) == 0 && ftruncate(journal->fd, 0) == 0) {
+				journal->file_size = 0;
+			}
+		}
+		else if (n_applied > 0) {
+			pthread_mutex_unlock(&journal->mutex);
+			_write_checkpoint(journal, applied_offset);
+			pthread_mutex_lock(&journal->mutex);
+		}
+
+		if (n_applied == n_rows) {
+			retry_secs = JOURNAL_RETRY_SECS;
+			continue;
+		}
+		if (journal->stop) {
+			// they will be replayed on the next start
+			break;
+		}
+		pthread_mutex_unlock(&journal->mutex);
+
+		DEBUG_FAILURE_PRINTF("Could not apply the journal, retrying in %d secs", retry_secs);
+		sleep(retry_secs);
+		if (!persistence_alive(journal->persistence)) {
+			reconnect_persistence(journal->persistence);
+		}
+		retry_secs = (retry_secs*2 < JOURNAL_MAX_RETRY_SECS)? retry_secs*2 : JOURNAL_MAX_RETRY_SECS;
+
+		pthread_mutex_lock(&journal->mutex);
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	return NULL;
+}
+
+
+/* =========================================================================
+ *  Journal functions
+ * =========================================================================*/
+
+msg_journal *msg_journal_new(persistence *persistence, msg_clock *clock, char *path) {
+	DEBUG_TRACE_PRINT();
+	msg_journal *journal;
+	char dead_path[strlen(path) + 6];
+
+	journal = malloc(sizeof(msg_journal));
+	if (journal == NULL) {
+		return NULL;
+	}
+
+	journal->checkpoint_path = malloc(strlen(path) + 5);
+	if (journal->checkpoint_path == NULL) {
+		free(journal);
+		return NULL;
+	}
+	sprintf(journal->checkpoint_path, "%s.ckp", path);
+
+	journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (journal->fd < 0) {
+		DEBUG_FAILURE_PRINTF("Could not open the journal %s", path);
+		free(journal->checkpoint_path);
+		free(journal);
+		return NULL;
+	}
+
+	sprintf(dead_path, "%s.dead", path);
+	journal->dead_fd = open(dead_path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (journal->dead_fd < 0) {
+		DEBUG_FAILURE_PRINTF("Could not open the rejected messages file %s", dead_path);
+		close(journal->fd);
+		free(journal->checkpoint_path);
+		free(journal);
+		return NULL;
+	}
+
+	journal->persistence = clone_persistence(persistence);
+	if (journal->persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the journal persistence");
+		close(journal->dead_fd);
+		close(journal->fd);
+		free(journal->checkpoint_path);
+		free(journal);
+		return NULL;
+	}
+
+	journal->clock = clock;
+	journal->queued = NULL;
+	journal->queued_last = NULL;
+	journal->synced = NULL;
+	journal->synced_last = NULL;
+	journal->flushing = 0;
+	journal->next_seq = 1;
+	journal->synced_seq = 0;
+	journal->file_size = 0;
+	journal->dirty = 0;
+	journal->stop = 0;
+	pthread_mutex_init(&journal->mutex, NULL);
+	pthread_cond_init(&journal->queued_cond, NULL);
+	pthread_cond_init(&journal->synced_cond, NULL);
+	pthread_cond_init(&journal->applied_cond, NULL);
+
+	if (_replay_journal(journal) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not replay the journal %s", path);
+		journal->stop = 1;
+		msg_journal_free(journal);
+		return NULL;
+	}
+
+	if (pthread_create(&journal->flusher, NULL, _flusher_thread, journal) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the journal threads");
+		journal->stop = 1;
+		msg_journal_free(journal);
+		return NULL;
+	}
+	if (pthread_create(&journal->applier, NULL, _applier_thread, journal) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the journal threads");
+		pthread_mutex_lock(&journal->mutex);
+		journal->stop = 1;
+		pthread_cond_signal(&journal->queued_cond);
+		pthread_mutex_unlock(&journal->mutex);
+		pthread_join(journal->flusher, NULL);
+		msg_journal_free(journal);
+		return NULL;
+	}
+
+	return journal;
+}
+
+
+void msg_journal_free(msg_journal *journal) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *next;
+	int running;
+
+	pthread_mutex_lock(&journal->mutex);
+	running = !journal->stop;
+	journal->stop = 1;
+	pthread_cond_signal(&journal->queued_cond);
+	pthread_mutex_unlock(&journal->mutex);
+
+	if (running) {
+		// the flusher writes the queued entries before ending,
+		// and then the applier tries to apply them
+		pthread_join(journal->flusher, NULL);
+		pthread_mutex_lock(&journal->mutex);
+		pthread_cond_signal(&journal->applied_cond);
+		pthread_mutex_unlock(&journal->mutex);
+		pthread_join(journal->applier, NULL);
+	}
+
+	// not applied ones are still in the journal
+	while (journal->synced != NULL) {
+		next = journal->synced->next;
+		free(journal->synced);
+		journal->synced = next;
+	}
+
+	pthread_mutex_destroy(&journal->mutex);
+	pthread_cond_destroy(&journal->queued_cond);
+	pthread_cond_destroy(&journal->synced_cond);
+	pthread_cond_destroy(&journal->applied_cond);
+	free_persistence(journal->persistence);
+	close(journal->dead_fd);
+	close(journal->fd);
+	free(journal->checkpoint_path);
+	free(journal);
+}
+
+
+int msg_journal_send(msg_journal *journal, persistence *persistence, int chat_id, int user_id, char *user_name,
+		psdims__message_info *message, int *timestamp) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *entry;
+	long long seq;
+	int local_time;
+	int sent = 1;
+
+	if (message == NULL || message->text == NULL || user_name == NULL || timestamp == NULL) {
+		return -1;
+	}
+	if (strlen(message->text) > MAX_TEXT_LEN || strlen(user_name) >= NO_FILE_LEN
+			|| (message->file_name != NULL && strlen(message->file_name) >= NO_FILE_LEN)) {
+		DEBUG_FAILURE_PRINTF("The message is too long");
+		return -1;
+	}
+
+	local_time = msg_clock_next(journal->clock, persistence, chat_id);
+	if (local_time < 0) {
+		DEBUG_FAILURE_PRINTF("Could not get the message timestamp");
+		return -1;
+	}
+
+	entry = _entry_new(chat_id, user_id, local_time, user_name, strlen(user_name),
+			message->file_name, (message->file_name != NULL)? strlen(message->file_name) : 0,
+			message->text, strlen(message->text));
+	if (entry == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&journal->mutex);
+	if (journal->stop) {
+		pthread_mutex_unlock(&journal->mutex);
+		free(entry);
+		return -1;
+	}
+
+	// after this the entry belongs to the journal threads
+	seq = journal->next_seq++;
+	entry->seq = seq;
+	entry->sent = &sent;
+	if (journal->queued_last == NULL) {
+		journal->queued = entry;
+	}
+	else {
+		journal->queued_last->next = entry;
+	}
+	journal->queued_last = entry;
+	pthread_cond_signal(&journal->queued_cond);
+
+	while (sent == 1) {
+		pthread_cond_wait(&journal->synced_cond, &journal->mutex);
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	*timestamp = local_time;
+
+	return sent;
+}
+
+
+int msg_journal_get_messages(msg_journal *journal, struct soap *soap, int chat_id, int timestamp, int join_time, psdims__message_list *pending) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *entry;
+	psdims__message_info *message;
+	int n_messages;
+
+	pthread_mutex_lock(&journal->mutex);
+	n_messages = 0;
+	for (entry = journal->synced ; entry != NULL ; entry = entry->next) {
+		if (entry->row.chat_id == chat_id && entry->row.timestamp >= timestamp && entry->row.timestamp > join_time) {
+			n_messages++;
+		}
+	}
+
+	pending->__sizenelems = 0;
+	pending->messages = soap_malloc(soap, sizeof(psdims__message_info)*n_messages);
+	if (n_messages > 0 && pending->messages == NULL) {
+		pthread_mutex_unlock(&journal->mutex);
+		return -1;
+	}
+
+	for (entry = journal->synced ; entry != NULL ; entry = entry->next) {
+		if (entry->row.chat_id != chat_id || entry->row.timestamp < timestamp || entry->row.timestamp <= join_time) {
+			continue;
+		}
+		message = &pending->messages[pending->__sizenelems++];
+		message->user = soap_malloc(soap, strlen(entry->user_name) + sizeof(char));
+		message->text = soap_malloc(soap, strlen(entry->row.text) + sizeof(char));
+		strcpy(message->user, entry->user_name);
+		strcpy(message->text, entry->row.text);
+		if (entry->row.file_name != NULL) {
+			message->file_name = soap_malloc(soap, strlen(entry->row.file_name) + sizeof(char));
+			strcpy(message->file_name, entry->row.file_name);
+		}
+		else {
+			message->file_name = NULL;
+		}
+		message->send_date = entry->row.timestamp;
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	return 0;
+}
+
+
+int msg_journal_merge_messages(struct soap *soap, psdims__message_list *messages, psdims__message_list *pending) {
+	DEBUG_TRACE_PRINT();
+	psdims__message_info *merged;
+	int n_merged;
+	int i, k;
+
+	if (pending->__sizenelems == 0) {
+		return 0;
+	}
+
+	merged = soap_malloc(soap, sizeof(psdims__message_info)*(messages->__sizenelems + pending->__sizenelems));
+	if (merged == NULL) {
+		return -1;
+	}
+	memcpy(merged, messages->messages, sizeof(psdims__message_info)*messages->__sizenelems);
+	n_merged = messages->__sizenelems;
+
+	// the timestamp is unique inside the chat, a pending message
+	// may have been applied before the database was read
+	for (i = 0 ; i < pending->__sizenelems ; i++) {
+		for (k = 0 ; k < messages->__sizenelems ; k++) {
+			if (messages->messages[k].send_date == pending->messages[i].send_date) {
+				break;
+			}
+		}
+		if (k < messages->__sizenelems) {
+			continue;
+		}
+		merged[n_merged++] = pending->messages[i];
+		if (pending->messages[i].send_date >= messages->last_timestamp) {
+			messages->last_timestamp = pending->messages[i].send_date + 1;
+		}
+	}
+
+	messages->messages = merged;
+	messages->__sizenelems = n_merged;
+
+	return 0;
+}
+
+
+int msg_journal_get_chats(msg_journal *journal, struct soap *soap, int timestamp, psdims__notif_chat_list *pending) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *entry;
+	int n_entries;
+	int i;
+
+	pthread_mutex_lock(&journal->mutex);
+	n_entries = 0;
+	for (entry = journal->synced ; entry != NULL ; entry = entry->next) {
+		n_entries++;
+	}
+
+	pending->__sizenelems = 0;
+	pending->chat = soap_malloc(soap, sizeof(psdims__notif_chat_info)*n_entries);
+	if (n_entries > 0 && pending->chat == NULL) {
+		pthread_mutex_unlock(&journal->mutex);
+		return -1;
+	}
+
+	for (entry = journal->synced ; entry != NULL ; entry = entry->next) {
+		if (entry->row.timestamp < timestamp) {
+			continue;
+		}
+		for (i = 0 ; i < pending->__sizenelems ; i++) {
+			if (pending->chat[i].chat_id == entry->row.chat_id) {
+				break;
+			}
+		}
+		if (i == pending->__sizenelems) {
+			pending->chat[i].chat_id = entry->row.chat_id;
+			pending->chat[i].timestamp = entry->row.timestamp;
+			pending->__sizenelems++;
+		}
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	return 0;
+}
+
+
+int msg_journal_find(msg_journal *journal, int chat_id, int user_id, int timestamp) {
+	DEBUG_TRACE_PRINT();
+	journal_entry *entry;
+	int found;
+
+	found = 0;
+	pthread_mutex_lock(&journal->mutex);
+	for (entry = journal->synced ; entry != NULL ; entry = entry->next) {
+		if (entry->row.chat_id == chat_id && entry->row.timestamp == timestamp
+				&& (user_id < 0 || entry->row.user_id == user_id)) {
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&journal->mutex);
+
+	return found;
+}
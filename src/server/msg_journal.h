@@ -0,0 +1,149 @@
+/*******************************************************************************
+ *	msg_journal.h
+ *
+ *  Write-ahead journal of the sent messages
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __MSG_JOURNAL
+#define __MSG_JOURNAL
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "soapH.h"
+#include "persistence.h"
+#include "msg_clock.h"
+
+// the journal file is emptied when everything is applied and it is bigger than this
+#define JOURNAL_ROTATE_BYTES (16*1048576)
+// secs to wait before retrying a message that the database could not apply,
+// doubled on every failure up to JOURNAL_MAX_RETRY_SECS
+#define JOURNAL_RETRY_SECS (1)
+#define JOURNAL_MAX_RETRY_SECS (32)
+
+#define JOURNAL_MAGIC (0x4a4d5350)
+
+
+/*
+ * Header of every record of the journal file, followed by
+ * the user name, the file name and the text (not null terminated)
+ */
+typedef struct journal_record journal_record;
+struct journal_record {
+	unsigned int magic;
+	unsigned int checksum;		// of the rest of the header and the data
+	int chat_id;
+	int user_id;
+	int timestamp;
+	unsigned short user_len;
+	unsigned short file_len;	// 0xFFFF if there is no attached file
+	unsigned int text_len;
+};
+
+typedef struct journal_entry journal_entry;
+struct journal_entry {
+	message_row row;
+	char *user_name;
+	long long seq;			// order of the entry in the journal
+	off_t end_offset;		// journal offset after this record
+	int *sent;				// where its sender waits for 0 once synced or -1 if it fails, NULL if none
+	struct journal_entry *next;
+};
+
+typedef struct msg_journal msg_journal;
+struct msg_journal {
+	int fd;
+	int dead_fd;				// messages rejected by the database, as journal records
+	char *checkpoint_path;
+	persistence *persistence;	// own connection, only used by the applier
+	msg_clock *clock;
+	journal_entry *queued;		// waiting to be written and synced
+	journal_entry *queued_last;
+	journal_entry *synced;		// synced, waiting to be applied (readable)
+	journal_entry *synced_last;
+	int flushing;				// the flusher is writing entries out of the lists
+	long long next_seq;
+	long long synced_seq;
+	off_t file_size;
+	int dirty;					// a write failed, the end of the file is cut before the next one
+	int stop;
+	pthread_t flusher;
+	pthread_t applier;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued_cond;		// signaled when there are entries to write
+	pthread_cond_t synced_cond;		// broadcasted after every sync
+	pthread_cond_t applied_cond;	// signaled when there are entries to apply
+};
+
+
+/*
+ * Opens (or creates) the journal file in path, and the checkpoint file path.ckp
+ * The messages written after the checkpoint (not applied before a crash)
+ * are replayed into the database. The ones that the database rejects for
+ * good are moved to path.dead, the rest are retried until they are applied. The clock is not owned by the journal.
+ * Returns a pointer to the journal or NULL if fails
+ */
+msg_journal *msg_journal_new(persistence *persistence, msg_clock *clock, char *path);
+
+/*
+ * Writes and applies the pending messages, stops the threads and frees the journal
+ */
+void msg_journal_free(msg_journal *journal);
+
+/*
+ * Gives the message a timestamp, appends it to the journal and waits until it is
+ * synced to disk. The message is applied to the database later.
+ * persistence is the caller connection, used by the clock.
+ * Returns 0 and the timestamp or -1 if fails
+ */
+int msg_journal_send(msg_journal *journal, persistence *persistence, int chat_id, int user_id, char *user_name,
+		psdims__message_info *message, int *timestamp);
+
+/*
+ * Copies into soap memory the messages of the chat sent at timestamp or
+ * later and after join_time, that are not in the database yet.
+ * Must be called before the database is read, so no message is lost
+ * if it is applied meanwhile (see msg_journal_merge_messages)
+ * Returns 0 or -1 if fails
+ */
+int msg_journal_get_messages(msg_journal *journal, struct soap *soap, int chat_id, int timestamp, int join_time, psdims__message_list *pending);
+
+/*
+ * Adds to messages the pending ones that are not there yet
+ * Returns 0 or -1 if fails
+ */
+int msg_journal_merge_messages(struct soap *soap, psdims__message_list *messages, psdims__message_list *pending);
+
+/*
+ * Copies into soap memory the chats with messages sent at timestamp or later
+ * that are not in the database yet.
+ * Returns 0 or -1 if fails
+ */
+int msg_journal_get_chats(msg_journal *journal, struct soap *soap, int timestamp, psdims__notif_chat_list *pending);
+
+/*
+ * Returns 1 if the message is pending in the journal (sent by user_id,
+ * or by anyone if user_id < 0) or 0
+ */
+int msg_journal_find(msg_journal *journal, int chat_id, int user_id, int timestamp);
+
+
+#endif /* __MSG_JOURNAL */
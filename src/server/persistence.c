@@ -27,14 +27,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <mysql.h>
+#include <mysqld_error.h>
 #include <time.h>
 #include "persistence.h"
 #include "bool.h"
+#include "content_hash.h"
 
 #include "debug_def.h"
 
 #define MAX_QUERY_CHARS (500)
 
+// client library overhead of every stored row and field, in bytes
+#define RESULT_ROW_OVERHEAD (sizeof(MYSQL_ROWS) + sizeof(char*))
+#define RESULT_FIELD_OVERHEAD (sizeof(char*) + sizeof(unsigned long) + 1)
+
+// persistence_err of an async query that could not be queued
+#define ASYNC_QUEUE_ERROR (2000)
+
+// column mask of the strings copied by _arena_alloc
+#define ARENA_COLUMN(column) (1u << (column))
+
+/*
+ * The strings of a result, copied one after the other after the
+ * structs of the response, in the same allocation
+ */
+typedef struct row_arena row_arena;
+struct row_arena {
+	char *next;		// where the next string is copied
+};
+
 persistence * init_persistence(char user[],char pass[]){
 	DEBUG_TRACE_PRINT();
 	persistence *new_persistence;
@@ -74,27 +95,353 @@ persistence * init_persistence(char user[],char pass[]){
 	strcpy(new_persistence->bd_name, "PSD");
 	strcpy(new_persistence->user_name, user);
 	strcpy(new_persistence->user_pass, pass);
+	new_persistence->friend_cache = NULL;
+	new_persistence->chat_cache = NULL;
+	new_persistence->mem_budget = 0;
+	persistence_reset_mem(new_persistence);
+	new_persistence->db_async = NULL;
+	new_persistence->db_lease = NULL;
+	new_persistence->async_res = NULL;
+	new_persistence->async_errno = 0;
+	new_persistence->async_error[0] = '\0';
+	new_persistence->async_insert_id = 0;
+
+	return new_persistence;
+}
+
+
+persistence * clone_persistence(persistence *persistence) {
+	struct persistence *new_persistence;
+
+	new_persistence = init_persistence(persistence->user_name, persistence->user_pass);
+	if (new_persistence != NULL) {
+		new_persistence->friend_cache = persistence->friend_cache;
+		new_persistence->chat_cache = persistence->chat_cache;
+		new_persistence->mem_budget = persistence->mem_budget;
+	}
+
+	return new_persistence;
+}
+
+
+persistence * async_persistence(persistence *persistence, db_async *db_async) {
+	struct persistence *new_persistence;
+
+	new_persistence = malloc(sizeof(struct persistence));
+	if (new_persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Failed to initialize the persistence struct");
+		return NULL;
+	}
+
+	// not connected, it is only used to know that the persistence is initialized
+	new_persistence->mysql = mysql_init(NULL);
+	if (new_persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("Failed to initialize the database struct");
+		free(new_persistence);
+		return NULL;
+	}
+
+	new_persistence->thread_safe = persistence->thread_safe;
+	new_persistence->location = malloc(strlen(persistence->location) + sizeof(char));
+	new_persistence->bd_name = malloc(strlen(persistence->bd_name) + sizeof(char));
+	new_persistence->user_name = malloc(strlen(persistence->user_name) + sizeof(char));
+	new_persistence->user_pass = malloc(strlen(persistence->user_pass) + sizeof(char));
+
+	strcpy(new_persistence->location, persistence->location);
+	strcpy(new_persistence->bd_name, persistence->bd_name);
+	strcpy(new_persistence->user_name, persistence->user_name);
+	strcpy(new_persistence->user_pass, persistence->user_pass);
+	new_persistence->friend_cache = persistence->friend_cache;
+	new_persistence->chat_cache = persistence->chat_cache;
+	new_persistence->mem_budget = persistence->mem_budget;
+	persistence_reset_mem(new_persistence);
+	new_persistence->db_async = db_async;
+	new_persistence->db_lease = NULL;
+	new_persistence->async_res = NULL;
+	new_persistence->async_errno = 0;
+	new_persistence->async_error[0] = '\0';
+	new_persistence->async_insert_id = 0;
 
 	return new_persistence;
 }
 
 
 int reconnect_persistence(persistence *persistence) {
+	// the connections of the pool are reconnected by it
+	if (persistence->db_async != NULL) {
+		return 0;
+	}
 	mysql_close(persistence->mysql);
 	if(!mysql_real_connect(persistence->mysql, "localhost", persistence->user_name, persistence->user_pass, "PSD", 0, NULL, 0)){
 		DEBUG_FAILURE_PRINTF("Failed to reconect to the database");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 	return 0;
 }
 
+int persistence_lease(persistence *persistence) {
+	if (persistence->db_async == NULL || persistence->db_lease != NULL) {
+		return 0;
+	}
+	persistence->db_lease = db_async_lease(persistence->db_async);
+	return (persistence->db_lease != NULL)? 0 : -1;
+}
+
+void persistence_release(persistence *persistence) {
+	if (persistence->db_lease != NULL) {
+		db_lease_free(persistence->db_lease);
+		persistence->db_lease = NULL;
+	}
+}
+
 int persistence_err(persistence *persistence) {
+	if (persistence->db_async != NULL) {
+		return persistence->async_errno;
+	}
 	return mysql_errno(persistence->mysql);
 }
 
+int persistence_alive(persistence *persistence) {
+	if (persistence->db_async != NULL) {
+		return 1;
+	}
+	return (mysql_ping(persistence->mysql) == 0)? 1 : 0;
+}
+
+
+/*
+ * mysql_query on the own connection, or on the db_async pool if the
+ * persistence has no connection. Then the result is kept until
+ * _store_result
+ * Returns 0 or non zero if fails
+ */
+int _query(persistence *persistence, const char *query) {
+	db_future *future;
+
+	if (persistence->db_async == NULL) {
+		return mysql_query(persistence->mysql, query);
+	}
+
+	// the result of a previous query that was not stored
+	if (persistence->async_res != NULL) {
+		mysql_free_result(persistence->async_res);
+		persistence->async_res = NULL;
+	}
+
+	if (persistence->db_lease != NULL) {
+		future = db_lease_query(persistence->db_lease, query);
+	}
+	else {
+		future = db_async_query(persistence->db_async, query, NULL, NULL);
+	}
+	if (future == NULL) {
+		persistence->async_errno = ASYNC_QUEUE_ERROR;
+		strcpy(persistence->async_error, "Could not queue the query");
+		return -1;
+	}
+
+	db_future_wait(future);
+	persistence->async_errno = future->err;
+	strcpy(persistence->async_error, future->error);
+	persistence->async_insert_id = future->insert_id;
+	persistence->async_res = db_future_result(future);
+	db_future_free(future);
+
+	return (persistence->async_errno != 0)? -1 : 0;
+}
+
+const char *_error(persistence *persistence) {
+	return (persistence->db_async != NULL)? persistence->async_error : mysql_error(persistence->mysql);
+}
+
+my_ulonglong _insert_id(persistence *persistence) {
+	return (persistence->db_async != NULL)? persistence->async_insert_id : mysql_insert_id(persistence->mysql);
+}
+
+/*
+ * Estimated client memory of a stored result: the row buffers plus the
+ * per row and per field overhead of the client library
+ */
+size_t _result_bytes(MYSQL_RES *res) {
+	MYSQL_FIELD *fields;
+	size_t row_bytes;
+	unsigned int i, n_fields;
+
+	n_fields = mysql_num_fields(res);
+	fields = mysql_fetch_fields(res);
+	row_bytes = RESULT_ROW_OVERHEAD;
+	for (i = 0 ; i < n_fields ; i++) {
+		row_bytes += fields[i].max_length + RESULT_FIELD_OVERHEAD;
+	}
+
+	return row_bytes * mysql_num_rows(res);
+}
+
+/*
+ * Adds bytes to the memory used by the current request. If force is FALSE,
+ * fails when the bytes do not fit in the request budget
+ */
+int _charge_mem(persistence *persistence, size_t bytes, int force) {
+	if (!force && persistence->mem_budget > 0 && persistence->mem_used + bytes > persistence->mem_budget) {
+		persistence->mem_rejected++;
+		return -1;
+	}
+
+	persistence->mem_used += bytes;
+	if (persistence->mem_used > persistence->mem_peak) {
+		persistence->mem_peak = persistence->mem_used;
+	}
+	return 0;
+}
+
+/*
+ * mysql_store_result accounted in the request memory. The whole result is
+ * already in memory when it is checked, but one that does not fit in the
+ * budget is released before it is copied to the response
+ * Returns the result or NULL if fails
+ */
+MYSQL_RES *_store_result(persistence *persistence) {
+	MYSQL_RES *res;
+
+	if (persistence->db_async != NULL) {
+		res = persistence->async_res;
+		persistence->async_res = NULL;
+	}
+	else {
+		res = mysql_store_result(persistence->mysql);
+	}
+	if (res == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not store the result");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return NULL;
+	}
+
+	if (_charge_mem(persistence, _result_bytes(res), FALSE) == -1) {
+		DEBUG_FAILURE_PRINTF("The result does not fit in the request memory budget");
+		mysql_free_result(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+void _free_result(persistence *persistence, MYSQL_RES *res) {
+	size_t bytes;
+
+	bytes = _result_bytes(res);
+	persistence->mem_used = (persistence->mem_used > bytes)? persistence->mem_used - bytes : 0;
+	mysql_free_result(res);
+}
+
+/*
+ * Frees the result
+ * Returns its number of rows
+ */
+int _free_result_rows(persistence *persistence, MYSQL_RES *res) {
+	int n_rows;
+
+	n_rows = mysql_num_rows(res);
+	_free_result(persistence, res);
+
+	return n_rows;
+}
+
+/*
+ * Returns the number of rows of the last query or -1 if fails
+ */
+int _count_rows(persistence *persistence) {
+	MYSQL_RES *res;
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+
+	return _free_result_rows(persistence, res);
+}
+
+void *persistence_malloc(persistence *persistence, struct soap *soap, size_t size) {
+	_charge_mem(persistence, size, TRUE);
+	return soap_malloc(soap, size);
+}
+
+
+/*
+ * Allocates with a single soap_malloc the structs of every row followed by
+ * room for the strings of the columns in the mask (see ARENA_COLUMN). The
+ * sizes come from mysql_fetch_lengths, so no strlen is done, and the result
+ * is left at its first row again
+ * Returns 0 and the structs or -1 if fails
+ */
+int _arena_alloc(persistence *persistence, struct soap *soap, MYSQL_RES *res, size_t struct_size, unsigned int columns, void **structs, row_arena *arena) {
+	MYSQL_ROW row;
+	unsigned long *lengths;
+	unsigned int i, n_fields;
+	size_t n_rows, string_bytes;
+	char *block;
+
+	n_rows = mysql_num_rows(res);
+	n_fields = mysql_num_fields(res);
+	string_bytes = 0;
+	while ( (row = mysql_fetch_row(res)) != NULL ) {
+		lengths = mysql_fetch_lengths(res);
+		for (i = 0 ; i < n_fields ; i++) {
+			if ( (columns & ARENA_COLUMN(i)) && row[i] != NULL ) {
+				string_bytes += lengths[i] + sizeof(char);
+			}
+		}
+	}
+	mysql_data_seek(res, 0);
+
+	block = persistence_malloc(persistence, soap, struct_size*n_rows + string_bytes);
+	if (block == NULL && n_rows > 0) {
+		DEBUG_FAILURE_PRINTF("Could not allocate the result arena");
+		return -1;
+	}
+
+	*structs = block;
+	arena->next = block + struct_size*n_rows;
+
+	return 0;
+}
+
+/*
+ * Copies the column of the current row to the arena
+ * Returns the copy or NULL if the column is NULL
+ */
+char *_arena_copy(row_arena *arena, MYSQL_ROW row, unsigned long *lengths, int column) {
+	char *copy;
+
+	if (row[column] == NULL) {
+		return NULL;
+	}
+
+	copy = arena->next;
+	memcpy(copy, row[column], lengths[column]);
+	copy[lengths[column]] = '\0';
+	arena->next += lengths[column] + sizeof(char);
+
+	return copy;
+}
+
+
+void persistence_set_budget(persistence *persistence, size_t bytes) {
+	persistence->mem_budget = bytes;
+}
+
+void persistence_reset_mem(persistence *persistence) {
+	persistence->mem_used = 0;
+	persistence->mem_peak = 0;
+	persistence->mem_rejected = 0;
+}
+
 
 void free_persistence(persistence *persistence) {
+	persistence_release(persistence);
+	if (persistence->async_res != NULL) {
+		mysql_free_result(persistence->async_res);
+	}
 	free(persistence->location);
 	free(persistence->bd_name);
 	free(persistence->user_name);
@@ -123,9 +470,9 @@ int add_user(persistence* persistence, char* name, char* pass, char* information
 	strcat(consulta,information);
 	strcat(consulta,"',1);");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
@@ -148,9 +495,9 @@ int del_user(persistence* persistence, char* name){
 	strcat(consulta,name);
 	strcat(consulta,"';");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
@@ -176,17 +523,18 @@ int user_exist(persistence* persistence, char name[]){
 	strcat(consulta,name);
 	strcat(consulta,"') and (VALID = 1));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	if( mysql_num_rows(mysql_store_result(persistence->mysql)) >= 1 ){
-		return 1;
+	resultado = _count_rows(persistence);
+	if (resultado < 0) {
+		return -1;
 	}
 
-	return 0;
+	return (resultado >= 1)? 1 : 0;
 }
 
 
@@ -209,17 +557,18 @@ int user_entry_exist(persistence* persistence, char name[]){
 	strcat(consulta,name);
 	strcat(consulta,"'));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	if( mysql_num_rows(mysql_store_result(persistence->mysql)) >= 1 ){
-		return 1;
+	resultado = _count_rows(persistence);
+	if (resultado < 0) {
+		return -1;
 	}
 
-	return 0;
+	return (resultado >= 1)? 1 : 0;
 }
 
 
@@ -243,26 +592,32 @@ int get_user_pass(persistence* persistence, char name[], char *buff, int max_cha
 	strcat(consulta,"') and (VALID = 1));");
 
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);	
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get user password");
+		_free_result(persistence, res);
 		return -1;
 	}
 	
 	row = mysql_fetch_row(res);
 	if ( strlen(row[0]) >= max_chars ) {
 		DEBUG_FAILURE_PRINTF("password is to long");
+		_free_result(persistence, res);
 		return -1;		
 	}
 	
 	strcpy(buff, row[0]);
 
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -285,22 +640,28 @@ int get_user_id(persistence* persistence, char name[]){
 	strcat(consulta,name);
 	strcat(consulta,"') and (VALID = 1));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
 	// TODO check for errors here
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get user id");
+		_free_result(persistence, res);
 		return -1;
 	}
 	
 	row = mysql_fetch_row(res);
+	resultado = atoi(row[0]);
+	_free_result(persistence, res);
 
-	return atoi(row[0]);
+	return resultado;
 }
 
 int get_user_name(persistence* persistence, int user_id, char* buff, int max_chars){
@@ -327,15 +688,19 @@ int get_user_name(persistence* persistence, int user_id, char* buff, int max_cha
 	strcat(consulta,str_id);
 	strcat(consulta,"';");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get user name");
+		_free_result(persistence, res);
 		return -1;
 	}
 	row = mysql_fetch_row(res);
@@ -345,6 +710,7 @@ int get_user_name(persistence* persistence, int user_id, char* buff, int max_cha
 	}
 	strcpy(buff,row[0]);
 
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -371,15 +737,19 @@ int get_user_info(persistence* persistence, int user_id,char* buff, int max_char
 	strcat(consulta,str_id);
 	strcat(consulta,"';");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get user name");
+		_free_result(persistence, res);
 		return -1;
 	}
 	row = mysql_fetch_row(res);
@@ -390,6 +760,7 @@ int get_user_info(persistence* persistence, int user_id,char* buff, int max_char
 	strcpy(buff,row[0]);
 
 
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -416,22 +787,60 @@ int get_id_admin_chat(persistence* persistence,int id_chat){
 	strcat(consulta,str_id);
 	strcat(consulta,"';");
 
-	if(mysql_query(persistence->mysql, consulta) ) {
+	if(_query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
 	// TODO check for errors here
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get admin id");
+		_free_result(persistence, res);
 		return -1;
 	}
 	
 	row = mysql_fetch_row(res);
+	resultado = atoi(row[0]);
+	_free_result(persistence, res);
+
+	return resultado;
+}
+
+int get_user_chat_join_time(persistence* persistence, int user_id, int chat_id) {
+	DEBUG_TRACE_PRINT();
+
+	int resultado;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	char consulta[MAX_QUERY_CHARS];
+
+	if(persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	sprintf(consulta, "SELECT MIN(CREATION_TIME) FROM users_chats WHERE (ID_USERS = %d) AND (ID_CHAT = %d);", user_id, chat_id);
+	if(_query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+
+	row = mysql_fetch_row(res);
+	resultado = (row != NULL && row[0] != NULL)? atoi(row[0]) : 0;
+	_free_result(persistence, res);
 
-	return atoi(row[0]);
+	return resultado;
 }
 
 int get_chat_info(persistence* persistence, int chat_id,char* buff, int max_chars){
@@ -458,29 +867,125 @@ int get_chat_info(persistence* persistence, int chat_id,char* buff, int max_char
 	strcat(consulta,str_id);
 	strcat(consulta,"';");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
 	// TODO check for errors here
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1 ) {
 		DEBUG_FAILURE_PRINTF("Could not get user name");
+		_free_result(persistence, res);
 		return -1;
 	}
 	row = mysql_fetch_row(res);
 
 	if( strlen(row[0]) >= max_chars ) {
 		DEBUG_FAILURE_PRINTF("chat info too long");
+		_free_result(persistence, res);
 		return -1;
 	}
 	strcpy(buff,row[0]);	
 
+	_free_result(persistence, res);
 	return 0;
 }
 
+/*
+ * Loads the chat and its members in the chat cache
+ * Returns 0 or -1 if fails
+ */
+int _load_chat(persistence* persistence, int chat_id) {
+	DEBUG_TRACE_PRINT();
+	char consulta[100];
+	unsigned long generation;
+	chat_member *members;
+	int exists, valid, admin_id, all_read;
+	int totalrows;
+	int ret_value;
+	int k;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	// read before the queries, if the chat changes meanwhile it is not cached
+	generation = chat_cache_generation(persistence->chat_cache);
+
+	sprintf(consulta, "SELECT ID_ADMIN, VALID, READ_TIME FROM chats WHERE ID = %d;", chat_id);
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	row = mysql_fetch_row(res);
+	exists = (row != NULL);
+	admin_id = (exists && row[0] != NULL)? atoi(row[0]) : -1;
+	valid = (exists && row[1] != NULL)? atoi(row[1]) : 0;
+	all_read = (exists && row[2] != NULL)? atoi(row[2]) : 0;
+	_free_result(persistence, res);
+
+	sprintf(consulta, "SELECT ID_USERS, REM_TIME, READ_MSG_TIME FROM users_chats WHERE ID_CHAT = %d;", chat_id);
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	totalrows = mysql_num_rows(res);
+
+	members = malloc(sizeof(chat_member)*totalrows + 1);
+	if (members == NULL) {
+		_free_result(persistence, res);
+		return -1;
+	}
+	for( k = 0 ; k < totalrows ; k++ ) {
+		row = mysql_fetch_row(res);
+		members[k].user_id = atoi(row[0]);
+		members[k].active = (row[1] == NULL || atoi(row[1]) == 0);
+		members[k].read_timestamp = (row[2] != NULL)? atoi(row[2]) : 0;
+	}
+	_free_result(persistence, res);
+
+	ret_value = chat_cache_put(persistence->chat_cache, chat_id, generation, exists, valid, admin_id, all_read, members, totalrows);
+	free(members);
+
+	return ret_value;
+}
+
+int _cache_chat_exist(chat_cache *cache, int user_id, int chat_id) {
+	return chat_cache_chat_exist(cache, chat_id);
+}
+
+/*
+ * Answers a lookup from the chat cache, loading the chat the first time
+ * Returns 1 or 0, or -1 if the cache can not answer it
+ */
+int _chat_cache_lookup(persistence* persistence, int (*lookup)(chat_cache*, int, int), int user_id, int chat_id) {
+	int ret_value;
+
+	ret_value = lookup(persistence->chat_cache, user_id, chat_id);
+	if (ret_value < 0 && _load_chat(persistence, chat_id) == 0) {
+		ret_value = lookup(persistence->chat_cache, user_id, chat_id);
+	}
+	return ret_value;
+}
+
 int exist_user_in_chat(persistence* persistence,int user_id, int chat_id){
 	DEBUG_TRACE_PRINT();
 
@@ -494,6 +999,13 @@ int exist_user_in_chat(persistence* persistence,int user_id, int chat_id){
 
 	char consulta[200]="SELECT * FROM users_chats where ((ID_USERS = ";
 
+	if (persistence->chat_cache != NULL) {
+		resultado = _chat_cache_lookup(persistence, chat_cache_is_member, user_id, chat_id);
+		if (resultado >= 0) {
+			return resultado;
+		}
+	}
+
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
@@ -509,15 +1021,18 @@ int exist_user_in_chat(persistence* persistence,int user_id, int chat_id){
 	strcat(consulta,str_chat);
 	strcat(consulta,") AND (REM_TIME = 0));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return (_free_result_rows(persistence, res) > 0)? 1 : 0;
 }
 
 int exist_user_entry_in_chat(persistence* persistence,int user_id, int chat_id){
@@ -533,6 +1048,13 @@ int exist_user_entry_in_chat(persistence* persistence,int user_id, int chat_id){
 
 	char consulta[200]="SELECT * FROM users_chats where ((ID_USERS = ";
 
+	if (persistence->chat_cache != NULL) {
+		resultado = _chat_cache_lookup(persistence, chat_cache_has_entry, user_id, chat_id);
+		if (resultado >= 0) {
+			return resultado;
+		}
+	}
+
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
@@ -548,15 +1070,18 @@ int exist_user_entry_in_chat(persistence* persistence,int user_id, int chat_id){
 	strcat(consulta,str_chat);
 	strcat(consulta,"));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return (_free_result_rows(persistence, res) > 0)? 1 : 0;
 }
 
 int chat_exist(persistence* persistence, int chat_id){
@@ -569,6 +1094,13 @@ int chat_exist(persistence* persistence, int chat_id){
 
 	char consulta[200]="SELECT * FROM chats where ((ID = '";
 
+	if (persistence->chat_cache != NULL) {
+		resultado = _chat_cache_lookup(persistence, _cache_chat_exist, -1, chat_id);
+		if (resultado >= 0) {
+			return resultado;
+		}
+	}
+
 	if(persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
@@ -581,79 +1113,195 @@ int chat_exist(persistence* persistence, int chat_id){
 	strcat(consulta,str_chat);
 	strcat(consulta,"') and (VALID = 1));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	resultado = _count_rows(persistence);
+	if (resultado < 0) {
 		return -1;
 	}
 
-	return (mysql_num_rows(mysql_store_result(persistence->mysql)) > 0)? 1 : 0;
+	return (resultado > 0)? 1 : 0;
 }
 
 
-int get_list_friends(persistence* persistence,int user_id, int timestamp, struct soap *soap, psdims__user_list *friends){
+/*
+ * Loads the friends of the user in the friend cache
+ * Returns 0 or -1 if fails
+ */
+int _load_friends(persistence* persistence, int user_id) {
 	DEBUG_TRACE_PRINT();
+	char consulta[100];
+	unsigned long generation;
+	friend_edge *edges;
+	int totalrows;
+	int ret_value;
+	int k;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
 
-	char str_id[20];
-	char str_time[20];
-	int resultado;
-	int i;
-	int j;
+	// read before the query, if the friends change meanwhile they are not cached
+	generation = friend_cache_generation(persistence->friend_cache);
+
+	sprintf(consulta, "SELECT ID2, CREATION_TIME FROM friends WHERE ID1 = %d;", user_id);
+
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	totalrows = mysql_num_rows(res);
+
+	edges = malloc(sizeof(friend_edge)*totalrows + 1);
+	if (edges == NULL) {
+		_free_result(persistence, res);
+		return -1;
+	}
+
+	for( k = 0 ; k < totalrows ; k++ ) {
+		row = mysql_fetch_row(res);
+		edges[k].friend_id = atoi(row[0]);
+		edges[k].creation_time = (row[1] != NULL)? atoi(row[1]) : 0;
+	}
+	_free_result(persistence, res);
+
+	ret_value = friend_cache_put(persistence->friend_cache, user_id, generation, edges, totalrows);
+	free(edges);
+
+	return ret_value;
+}
+
+/*
+ * Fills the list with the users of the last query (NAME, INFORMATION)
+ * Returns 0 or -1 if fails
+ */
+int _fetch_user_list(persistence* persistence, struct soap *soap, psdims__user_list *users) {
 	int k;
 	int totalrows;
-	int numfields;
-	char name[50];
-	char info[500];
   	MYSQL_RES *res;
   	MYSQL_ROW row;
-	
-	sprintf(str_id, "%d", user_id);
-	sprintf(str_time, "%d", timestamp);
+  	unsigned long *lengths;
+  	row_arena arena;
 
-  	char consulta[500]="select DISTINCT users.NAME, users.INFORMATION from users " \
-		"INNER JOIN friends on ( (friends.ID1 = users.ID ) OR (friends.ID2 = " \
-		"users.ID )) where ( ((friends.ID1 = ";
-	
-	if( (strlen(str_id)*2 + strlen(consulta)) >= (sizeof(char)*450) ) {
-		DEBUG_FAILURE_PRINTF("Query is too long to fit");
+	res = _store_result(persistence);
+	if (res == NULL) {
 		return -1;
 	}
- 
-  	strcat(consulta,str_id);
-  	strcat(consulta,") or (friends.ID2 = ");
-    strcat(consulta,str_id);
-  	strcat(consulta,")) and (users.ID != ");
-  	strcat(consulta, str_id);
-  	strcat(consulta, ") and (friends.CREATION_TIME >= ");
-  	strcat(consulta, str_time); 
-  	strcat(consulta, ") and (users.VALID = 1));");	
- 
-  	if( mysql_query(persistence->mysql, consulta) ) {
-		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
-    	return -1;
-	}
-
-    res = mysql_store_result(persistence->mysql);
     totalrows = mysql_num_rows(res);
-    numfields = mysql_num_fields(res);
-
-	
 
-	friends->user = soap_malloc(soap, sizeof(psdims__user_info)*totalrows);
-	friends->__sizenelems = totalrows;
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__user_info), ARENA_COLUMN(0) | ARENA_COLUMN(1), (void**)&users->user, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
+	users->__sizenelems = totalrows;
 	
 	for( k = 0 ; k < totalrows ; k++ ){
 		row = mysql_fetch_row(res);
-		friends->user[k].name = soap_malloc(soap, strlen(row[0])+sizeof(char));
-		friends->user[k].information = soap_malloc(soap, strlen(row[1])+sizeof(char));
-		strcpy(friends->user[k].name, row[0]);
-		strcpy(friends->user[k].information, row[1]);
+		lengths = mysql_fetch_lengths(res);
+		users->user[k].name = _arena_copy(&arena, row, lengths, 0);
+		users->user[k].information = _arena_copy(&arena, row, lengths, 1);
 	}
+	_free_result(persistence, res);
 
 	return 0;
 }
 
+int get_list_users_by_id(persistence* persistence, int user_ids[], int n_users, struct soap *soap, psdims__user_list *users) {
+	DEBUG_TRACE_PRINT();
+	char *consulta, *end;
+	int k;
+
+  	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+    	return -1;
+  	}
+
+	if (n_users == 0) {
+		users->user = NULL;
+		users->__sizenelems = 0;
+		return 0;
+	}
+
+	// by primary key
+	consulta = malloc(sizeof(char)*(100 + 12*n_users));
+	if (consulta == NULL) {
+		return -1;
+	}
+	end = consulta + sprintf(consulta, "select NAME, INFORMATION from users where (VALID = 1) and ID in (");
+	for( k = 0 ; k < n_users ; k++ ) {
+		end += sprintf(end, (k > 0)? ",%d" : "%d", user_ids[k]);
+	}
+	sprintf(end, ");");
+
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		free(consulta);
+    	return -1;
+	}
+	free(consulta);
+
+	return _fetch_user_list(persistence, soap, users);
+}
+
+int get_list_friends(persistence* persistence,int user_id, int timestamp, struct soap *soap, psdims__user_list *friends){
+	DEBUG_TRACE_PRINT();
+
+	char consulta[300];
+	int *friend_ids;
+	int n_ids;
+	int ret;
+
+  	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+    	return -1;
+  	}
+
+	n_ids = -1;
+	if (persistence->friend_cache != NULL) {
+		n_ids = friend_cache_list(persistence->friend_cache, user_id, timestamp, &friend_ids);
+		if (n_ids < 0 && _load_friends(persistence, user_id) == 0) {
+			n_ids = friend_cache_list(persistence->friend_cache, user_id, timestamp, &friend_ids);
+		}
+	}
+
+	if (n_ids == 0) {
+		// no new friends, the database is not queried
+		free(friend_ids);
+		friends->user = NULL;
+		friends->__sizenelems = 0;
+		return 0;
+	}
+
+	if (n_ids > 0) {
+		// the friends are known, only their info is read
+		ret = get_list_users_by_id(persistence, friend_ids, n_ids, soap, friends);
+		free(friend_ids);
+		return ret;
+	}
+
+	// every friendship is stored in both directions, (ID1, ID2) is the primary key
+	sprintf(consulta, "select users.NAME, users.INFORMATION from friends INNER JOIN users " \
+			"on (users.ID = friends.ID2) where (friends.ID1 = %d) and " \
+			"(friends.CREATION_TIME >= %d) and (users.VALID = 1);", user_id, timestamp);
+ 
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+    	return -1;
+	}
+
+	return _fetch_user_list(persistence, soap, friends);
+}
+
 int get_member_list_chats(persistence* persistence, int chat_id, int timestamp, struct soap *soap, psdims__member_list *members){
 	DEBUG_TRACE_PRINT();
 
@@ -668,6 +1316,8 @@ int get_member_list_chats(persistence* persistence, int chat_id, int timestamp,
 	char info[500];
 	MYSQL_RES *res;
 	MYSQL_ROW row;
+	unsigned long *lengths;
+	row_arena arena;
 
 	sprintf(str_id, "%d", chat_id);	
 	sprintf(str_time, "%d", timestamp);
@@ -691,24 +1341,31 @@ int get_member_list_chats(persistence* persistence, int chat_id, int timestamp,
 		return -1;
 	}
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	totalrows = mysql_num_rows(res);
 
-	members->name = soap_malloc(soap, sizeof(psdims__string)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__string), ARENA_COLUMN(0), (void**)&members->name, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	members->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
 		row = mysql_fetch_row(res);
-		members->name[i].string = soap_malloc(soap, strlen(row[0])+sizeof(char));
-		strcpy(members->name[i].string, row[0]);
+		lengths = mysql_fetch_lengths(res);
+		members->name[i].string = _arena_copy(&arena, row, lengths, 0);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -723,6 +1380,8 @@ int get_list_messages(persistence* persistence,int chat_id, int user_id, int tim
 	char name[50];
   	MYSQL_RES *res;
   	MYSQL_ROW row;
+  	unsigned long *lengths;
+  	row_arena arena;
 	
 	sprintf(str_chat_id, "%d", chat_id);
 	sprintf(str_id, "%d", user_id);	
@@ -749,38 +1408,35 @@ int get_list_messages(persistence* persistence,int chat_id, int user_id, int tim
     strcat(consulta, str_id);
   	strcat(consulta, ");");	
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
 	// TODO check for errors here
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
     numfields = mysql_num_fields(res);
 
 	messages->last_timestamp = timestamp;
-	messages->messages = soap_malloc(soap, sizeof(psdims__message_info)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__message_info), ARENA_COLUMN(0) | ARENA_COLUMN(1) | ARENA_COLUMN(3), (void**)&messages->messages, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	messages->__sizenelems=totalrows;
 	
 	for(k=0;k<totalrows;k++){
 		row = mysql_fetch_row(res);
+		lengths = mysql_fetch_lengths(res);
 
-		messages->messages[k].user = soap_malloc(soap, strlen(row[0]) + sizeof(char));
-		messages->messages[k].text = soap_malloc(soap, strlen(row[1]) + sizeof(char));
-		
+		messages->messages[k].user = _arena_copy(&arena, row, lengths, 0);
+		messages->messages[k].text = _arena_copy(&arena, row, lengths, 1);
 		// FILE_ field is NULL if the message has no attached file
-		if (row[3]) {
-			messages->messages[k].file_name = soap_malloc(soap, strlen(row[3]) + sizeof(char));
-			strcpy(messages->messages[k].file_name, row[3]);
-		}
-		else {
-			messages->messages[k].file_name = NULL;
-		}
-		
-		strcpy(messages->messages[k].user, row[0]);
-		strcpy(messages->messages[k].text, row[1]);
+		messages->messages[k].file_name = _arena_copy(&arena, row, lengths, 3);
 		messages->messages[k].send_date = atoi(row[2]);
 		
 		if (messages->messages[k].send_date > messages->last_timestamp) {
@@ -790,57 +1446,62 @@ int get_list_messages(persistence* persistence,int chat_id, int user_id, int tim
 
 	messages->last_timestamp++;
 
+	_free_result(persistence, res);
 	return 0;
 }
 
 
-int del_user_all_chats(persistence* persistence, int user_id, int timestamp){
-	DEBUG_TRACE_PRINT();
-	char str_user_id[10], str_time[10]; 
-	char consulta[200]="UPDATE users_chats set REM_TIME = ";
+/*
+ * Fills the list with the chats of the last query (ID, DESCRIPTION, admin NAME,
+ * READ_MSG_TIME, CREATION_TIME, READ_TIME) and their members since timestamp
+ * Returns 0 or -1 if fails
+ */
+int _fetch_chat_list(persistence* persistence, int timestamp, struct soap *soap, psdims__chat_list *chats) {
+	int i;
+	int totalrows;
+  	MYSQL_RES *res;
+  	MYSQL_ROW row;
+  	unsigned long *lengths;
+  	row_arena arena;
 
-	if (persistence->mysql == NULL) {	
-		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+	res = _store_result(persistence);
+	if (res == NULL) {
 		return -1;
 	}
+    totalrows = mysql_num_rows(res);
 
-	sprintf(str_user_id, "%d", user_id);
-	sprintf(str_time, "%d", timestamp);
-
-	if( (strlen(str_user_id) + strlen(consulta)) >= (sizeof(char)*180) ) {
-		DEBUG_FAILURE_PRINTF("Query is too long to fit");
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__chat_info), ARENA_COLUMN(1) | ARENA_COLUMN(2), (void**)&chats->chat_info, &arena) == -1) {
+		_free_result(persistence, res);
 		return -1;
 	}
+	chats->__sizenelems = totalrows;
+	chats->last_timestamp = 0;
+	
+	for( i = 0 ; i < totalrows ; i++ ){
+		row = mysql_fetch_row(res);
+		lengths = mysql_fetch_lengths(res);
+		chats->chat_info[i].description = _arena_copy(&arena, row, lengths, 1);
+		chats->chat_info[i].admin = _arena_copy(&arena, row, lengths, 2);
+		
+		chats->chat_info[i].chat_id = atoi(row[0]);
+		chats->chat_info[i].read_timestamp = atoi(row[3]);
+		if (atoi(row[4]) > chats->last_timestamp) {
+			chats->last_timestamp = atoi(row[4]);
+		}
+		chats->chat_info[i].all_read_timestamp = atoi(row[5]);
 
-	strcat(consulta, str_time);
-	strcat(consulta, " where (ID_USERS = ");
-	strcat(consulta, str_user_id);
-	strcat(consulta, ");");
-
-	if( mysql_query(persistence->mysql, consulta) ) {
-		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
-		return -1;
+		get_member_list_chats(persistence, atoi(row[0]), timestamp, soap, &(chats->chat_info[i].members));
 	}
 
+	_free_result(persistence, res);
 	return 0;
 }
 
-
 int get_list_chats(persistence* persistence,int user_id, int timestamp, struct soap *soap, psdims__chat_list *chats){
 	DEBUG_TRACE_PRINT();
 
 	char str_id[20];
 	char str_time[20];
-	int resultado;
-	int i;
-	int id_admin;
-	int totalrows;
-	int numfields;
-	char name[50];
-	char info[500];
-  	MYSQL_RES *res;
-  	MYSQL_ROW row;
 	
 	sprintf(str_id, "%d", user_id);	
 	sprintf(str_time, "%d", timestamp);
@@ -863,37 +1524,53 @@ int get_list_chats(persistence* persistence,int user_id, int timestamp, struct s
   	strcat(consulta, str_time);
   	strcat(consulta,") and (users_chats.REM_TIME = 0));");
 
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
-    totalrows = mysql_num_rows(res);
+	return _fetch_chat_list(persistence, timestamp, soap, chats);
+}
 
-	chats->chat_info = soap_malloc(soap, sizeof(psdims__chat_info)*totalrows);
-	chats->__sizenelems = totalrows;
-	chats->last_timestamp = 0;
-	
-	for( i = 0 ; i < totalrows ; i++ ){
-		row = mysql_fetch_row(res);
-		chats->chat_info[i].description = soap_malloc(soap, strlen(row[1])+sizeof(char));
-		chats->chat_info[i].admin = soap_malloc(soap, strlen(row[2])+sizeof(char));
-		
-		chats->chat_info[i].chat_id = atoi(row[0]);
-		strcpy(chats->chat_info[i].description, row[1]);
-		strcpy(chats->chat_info[i].admin, row[2]);
-		chats->chat_info[i].read_timestamp = atoi(row[3]);
-		if (atoi(row[4]) > chats->last_timestamp) {
-			chats->last_timestamp = atoi(row[4]);
-		}
-		chats->chat_info[i].all_read_timestamp = atoi(row[5]);
+int get_list_chats_by_id(persistence* persistence, int user_id, int chat_ids[], int n_chats, struct soap *soap, psdims__chat_list *chats) {
+	DEBUG_TRACE_PRINT();
+	char *consulta, *end;
+	int k;
 
-		get_member_list_chats(persistence, atoi(row[0]), timestamp, soap, &(chats->chat_info[i].members));
+  	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+    	return -1;
+  	}
+
+	if (n_chats == 0) {
+		chats->chat_info = NULL;
+		chats->__sizenelems = 0;
+		chats->last_timestamp = 0;
+		return 0;
 	}
 
-	return 0;
+	consulta = malloc(sizeof(char)*(400 + 12*n_chats));
+	if (consulta == NULL) {
+		return -1;
+	}
+	end = consulta + sprintf(consulta, "select chats.ID, chats.DESCRIPTION, users.NAME, users_chats.READ_MSG_TIME, chats.CREATION_TIME, chats.READ_TIME from chats " \
+			"INNER JOIN users_chats on (users_chats.ID_CHAT = chats.ID) INNER JOIN users on (users.ID = chats.ID_ADMIN) " \
+			"where (users_chats.ID_USERS = %d) and (users_chats.REM_TIME = 0) and chats.ID in (", user_id);
+	for( k = 0 ; k < n_chats ; k++ ) {
+		end += sprintf(end, (k > 0)? ",%d" : "%d", chat_ids[k]);
+	}
+	sprintf(end, ");");
+
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		free(consulta);
+    	return -1;
+	}
+	free(consulta);
+
+	return _fetch_chat_list(persistence, 0, soap, chats);
 }
 
 int exist_timestamp_in_messages(persistence* persistence, int chat_id, int timestamp) {
@@ -914,14 +1591,17 @@ int exist_timestamp_in_messages(persistence* persistence, int chat_id, int times
   	strcat(consulta, str_time);
   	strcat(consulta, "));");
 
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}  	
   	
-  	res = mysql_store_result(persistence->mysql);
-    return mysql_num_rows(res);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	return _free_result_rows(persistence, res);
 }
 
 int send_messages(persistence* persistence, int chat_id, int user_id, int timestamp, psdims__message_info *message){
@@ -964,15 +1644,254 @@ int send_messages(persistence* persistence, int chat_id, int user_id, int timest
 	strcat(consulta, str_time);
 	strcat(consulta,");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
 	return 0;
 }
 
+// Upper bound of the escaped values of one row in a multi-row INSERT
+#define message_row_chars(row) \
+		( 80 + 2*strlen(row->text) + ((row->file_name != NULL)? 2*strlen(row->file_name) : 0) )
+
+/*
+ * Appends "(sender,chat,'file','text',time)" to the query, escaping the strings
+ * Returns the position of the end of the query
+ */
+char *_append_message_row(MYSQL *mysql, char *end, message_row *row) {
+	end += sprintf(end, "(%d,%d,", row->user_id, row->chat_id);
+
+	if (row->file_name != NULL) {
+		*end++ = '\'';
+		end += mysql_real_escape_string(mysql, end, row->file_name, strlen(row->file_name));
+		*end++ = '\'';
+	}
+	else {
+		end += sprintf(end, "NULL");
+	}
+
+	end += sprintf(end, ",'");
+	end += mysql_real_escape_string(mysql, end, row->text, strlen(row->text));
+	end += sprintf(end, "',%d)", row->timestamp);
+
+	return end;
+}
+
+int _send_message_rows(persistence* persistence, message_row *rows[], int n_rows, int ignore_existing) {
+	DEBUG_TRACE_PRINT();
+	char *consulta, *end;
+	int query_chars;
+	int i;
+
+	query_chars = 100;
+	for (i = 0 ; i < n_rows ; i++) {
+		query_chars += message_row_chars(rows[i]);
+	}
+
+	consulta = malloc(query_chars);
+	if (consulta == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not allocate the query");
+		return -1;
+	}
+
+	end = consulta + sprintf(consulta, "INSERT %sINTO messages(ID_SENDER, ID_CHAT, FILE_, TEXT, CREATION_TIME) VALUES",
+			(ignore_existing)? "IGNORE " : "");
+	for (i = 0 ; i < n_rows ; i++) {
+		if (i > 0) {
+			*end++ = ',';
+		}
+		end = _append_message_row(persistence->mysql, end, rows[i]);
+	}
+	*end = '\0';
+
+	if( mysql_real_query(persistence->mysql, consulta, end - consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		free(consulta);
+		return -1;
+	}
+
+	free(consulta);
+	return 0;
+}
+
+/*
+ * Returns 1 if the error of the database is caused by the row itself, and
+ * inserting it again always fails, or 0 if it is temporary (deadlock,
+ * lock wait timeout, lost connection...)
+ */
+int _row_error_permanent(unsigned int err) {
+	switch (err) {
+		case ER_NO_REFERENCED_ROW:
+		case ER_NO_REFERENCED_ROW_2:	// the chat or the sender were removed
+		case ER_DUP_ENTRY:
+		case ER_BAD_NULL_ERROR:
+		case ER_DATA_TOO_LONG:
+		case ER_TRUNCATED_WRONG_VALUE_FOR_FIELD:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+int send_messages_batch(persistence* persistence, message_row *rows[], int n_rows, int ignore_existing) {
+	DEBUG_TRACE_PRINT();
+	int ret_value;
+	int i;
+
+	if (persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+	if (persistence->db_async != NULL) {
+		DEBUG_FAILURE_PRINTF("The batch transaction needs a persistence with its own connection");
+		return -1;
+	}
+	if (n_rows <= 0) {
+		return 0;
+	}
+
+	// one transaction, so the whole batch costs a single commit in the database
+	if ( !mysql_query(persistence->mysql, "START TRANSACTION;") ) {
+		if ( !_send_message_rows(persistence, rows, n_rows, ignore_existing) ) {
+			if ( !mysql_commit(persistence->mysql) ) {
+				for (i = 0 ; i < n_rows ; i++) {
+					rows[i]->result = 0;
+				}
+				return 0;
+			}
+			DEBUG_FAILURE_PRINTF("Commit error");
+			DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		}
+		mysql_rollback(persistence->mysql);
+	}
+
+	DEBUG_FAILURE_PRINTF("Batch insert failed, inserting the %d rows one by one", n_rows);
+	ret_value = 0;
+	for (i = 0 ; i < n_rows ; i++) {
+		rows[i]->result = 0;
+		if (_send_message_rows(persistence, &rows[i], 1, ignore_existing) != 0) {
+			rows[i]->result = _row_error_permanent(mysql_errno(persistence->mysql))? ROW_REJECTED : ROW_FAILED;
+			ret_value = -1;
+		}
+	}
+
+	return ret_value;
+}
+
+int begin_read_transaction(persistence *persistence) {
+	DEBUG_TRACE_PRINT();
+
+	if (persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+	if (persistence->db_async != NULL && persistence->db_lease == NULL) {
+		DEBUG_FAILURE_PRINTF("The transaction needs a persistence with its own connection");
+		return -1;
+	}
+
+	if ( _query(persistence, "START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY;") ) {
+		DEBUG_FAILURE_PRINTF("Could not start the transaction");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+
+	return 0;
+}
+
+int end_read_transaction(persistence *persistence) {
+	DEBUG_TRACE_PRINT();
+
+	if (persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	if ( _query(persistence, "COMMIT;") ) {
+		DEBUG_FAILURE_PRINTF("Commit error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+
+	return 0;
+}
+
+int get_last_message_time(persistence* persistence, int chat_id) {
+	DEBUG_TRACE_PRINT();
+	char consulta[100];
+	int last_time;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (persistence->mysql == NULL) {
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	sprintf(consulta, "SELECT MAX(CREATION_TIME) FROM messages WHERE ID_CHAT = %d;", chat_id);
+
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence));
+		return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+
+	row = mysql_fetch_row(res);
+	last_time = (row != NULL && row[0] != NULL)? atoi(row[0]) : 0;
+	_free_result(persistence, res);
+
+	return last_time;
+}
+
+/*
+ * Records a change of the data of the user. The change is already stored,
+ * so a failure is only logged, the client will miss it until its next snapshot
+ * Returns 0 or -1 if fails
+ */
+int _add_event(persistence* persistence, int user_id, event_type type, int ref_id, int timestamp) {
+	char consulta[200];
+
+	sprintf(consulta, "INSERT INTO events(ID_USER, TYPE, ID_REF, CREATION_TIME) VALUES(%d,%d,%d,%d);",
+			user_id, type, ref_id, timestamp);
+
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Could not record the event");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Records that the chat changed for every current member, in a single statement
+ * Returns 0 or -1 if fails
+ */
+int _add_chat_event(persistence* persistence, int chat_id, int timestamp) {
+	char consulta[300];
+
+	sprintf(consulta, "INSERT INTO events(ID_USER, TYPE, ID_REF, CREATION_TIME) SELECT ID_USERS, %d, ID_CHAT, %d " \
+			"FROM users_chats WHERE (ID_CHAT = %d) AND (REM_TIME = 0);", EVENT_CHAT_CHANGED, timestamp, chat_id);
+
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Could not record the event");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	return 0;
+}
+
+
 int decline_friend_request(persistence* persistence, int user_id1, int user_id2){
 	char str_id1[10], str_id2[10]; 
 	char consulta[200]="DELETE FROM friends_request where (ID1 =";
@@ -996,9 +1915,9 @@ int decline_friend_request(persistence* persistence, int user_id1, int user_id2)
 	strcat(consulta, ");");
 
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
@@ -1007,36 +1926,29 @@ int decline_friend_request(persistence* persistence, int user_id1, int user_id2)
 
 
 int accept_friend_request(persistence* persistence, int user_id1, int user_id2, int timestamp){
-	char str_id1[10], str_id2[10], str_time[10]; 
-	char consulta[200]="INSERT INTO friends(ID1, ID2, CREATION_TIME) VALUES(";
+	char consulta[200];
 
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
 	}
 
-	sprintf(str_id1, "%d", user_id1);
-	sprintf(str_id2, "%d", user_id2);
-	sprintf(str_time, "%d", timestamp);
+	// the friendship is stored in both directions, in a single statement
+	sprintf(consulta, "INSERT INTO friends(ID1, ID2, CREATION_TIME) VALUES(%d,%d,%d),(%d,%d,%d);",
+			user_id1, user_id2, timestamp, user_id2, user_id1, timestamp);
 
-	if( (strlen(str_id1) + strlen(str_id2) + strlen(consulta)) >= (sizeof(char)*190) ) {
-		DEBUG_FAILURE_PRINTF("Query is too long to fit");
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	strcat(consulta, str_id1);
-	strcat(consulta, ",");
-	strcat(consulta, str_id2);
-	strcat(consulta, ",");
-	strcat(consulta, str_time);
-	strcat(consulta, ");");
-
-
-	if( mysql_query(persistence->mysql, consulta) ) {
-		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
-		return -1;
+	if (persistence->friend_cache != NULL) {
+		friend_cache_invalidate(persistence->friend_cache, user_id1);
+		friend_cache_invalidate(persistence->friend_cache, user_id2);
 	}
+	_add_event(persistence, user_id1, EVENT_NEW_FRIEND, user_id2, timestamp);
+	_add_event(persistence, user_id2, EVENT_NEW_FRIEND, user_id1, timestamp);
 
 	// TODO This is weird... FIX
 	decline_friend_request(persistence, user_id1, user_id2);
@@ -1071,11 +1983,12 @@ int send_request(persistence* persistence, int user_id1, int user_id2, int times
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
+	_add_event(persistence, user_id2, EVENT_FRIEND_REQUEST, user_id1, timestamp);
 
 	return 0;
 }
@@ -1108,92 +2021,85 @@ int exist_request(persistence* persistence,int user_id1, int user_id2){
 	strcat(consulta, str_id2);
 	strcat(consulta,");");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return (_free_result_rows(persistence, res) > 0)? 1 : 0;
 }
 
 int exist_friendly(persistence* persistence,int user_id1, int user_id2){
 	DEBUG_TRACE_PRINT();
 
-	int resultado;
-	int totalrows;
-	char str_id1[20],str_id2[20];
+	char consulta[100];
+	int found;
 	MYSQL_RES *res;
-	MYSQL_ROW row;
-
-	sprintf(str_id1, "%d", user_id1);
-	sprintf(str_id2, "%d", user_id2);
-
-	char consulta[200]="SELECT * FROM friends where ((ID1 = ";
 
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
 	}
 
-	if( (strlen(consulta) + strlen(str_id1)*2 + strlen(str_id2)*2 ) >= (sizeof(char)*150) ) {
-		DEBUG_FAILURE_PRINTF("Query is too long to fit");
-		return -1;
+	if (persistence->friend_cache != NULL) {
+		found = friend_cache_lookup(persistence->friend_cache, user_id1, user_id2);
+		if (found < 0 && _load_friends(persistence, user_id1) == 0) {
+			found = friend_cache_lookup(persistence->friend_cache, user_id1, user_id2);
+		}
+		if (found >= 0) {
+			return found;
+		}
 	}
 
-	strcat(consulta,str_id1);
-	strcat(consulta," AND ID2 = ");
-	strcat(consulta,str_id2);
-	strcat(consulta,") OR ");
+	// both directions are stored, so one of them is enough
+	sprintf(consulta, "SELECT ID2 FROM friends where (ID1 = %d AND ID2 = %d);", user_id1, user_id2);
 
-	strcat(consulta,"( ID1 = ");
-	strcat(consulta,str_id2);
-	strcat(consulta," AND ID2 = ");
-	strcat(consulta,str_id1);
-	strcat(consulta,"));");
-
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	found = (mysql_num_rows(res) > 0)? 1 : 0;
+	_free_result(persistence, res);
 
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return found;
 }
 
 int del_friends(persistence* persistence, int user_id1, int user_id2){
 	DEBUG_TRACE_PRINT();
 
-	char str_id1[10], str_id2[10]; 
-	char consulta[200]="DELETE FROM friends where (ID1 =";
-	
-	sprintf(str_id1, "%d", user_id1);
-	sprintf(str_id2, "%d", user_id2);
+	char consulta[200];
 
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
 	}
-	if( (strlen(str_id1) + strlen(str_id2) + strlen(consulta)) >= (sizeof(char)*180) ) {
-		DEBUG_FAILURE_PRINTF("Query is too long to fit");
-		return -1;
-	}
 
-	strcat(consulta, str_id1);
-	strcat(consulta, " AND ID2 = ");
-	strcat(consulta, str_id2);
-	strcat(consulta, ");");
+	sprintf(consulta, "DELETE FROM friends where (ID1 = %d AND ID2 = %d) OR (ID1 = %d AND ID2 = %d);",
+			user_id1, user_id2, user_id2, user_id1);
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
+	if (persistence->friend_cache != NULL) {
+		friend_cache_invalidate(persistence->friend_cache, user_id1);
+		friend_cache_invalidate(persistence->friend_cache, user_id2);
+	}
+
 	return 0;
 }
 
@@ -1225,12 +2131,17 @@ int add_user_chat(persistence* persistence, int user_id, int chat_id, int read_t
 	strcat(consulta, str_read_time);
 	strcat(consulta, ", 0);");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
+	if (persistence->chat_cache != NULL) {
+		chat_cache_add_member(persistence->chat_cache, user_id, chat_id, read_timestamp);
+	}
+	_add_chat_event(persistence, chat_id, timestamp);
+
 	return 0;
 }
 
@@ -1262,13 +2173,18 @@ int add_chat(persistence* persistence, int admin_id, char* description, int time
 	strcat(consulta, str_time);
 	strcat(consulta, ", 1, 0);");
 
-	if(mysql_query(persistence->mysql, consulta) ) {
+	if(_query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	*chat_id = mysql_insert_id(persistence->mysql);
+	*chat_id = _insert_id(persistence);
+
+	// a lookup of the new id may have cached it as not existing
+	if (persistence->chat_cache != NULL) {
+		chat_cache_invalidate(persistence->chat_cache, *chat_id);
+	}
 
 	return 0;
 }
@@ -1292,12 +2208,16 @@ int del_chat(persistence* persistence, int id_chat){
 	strcat(consulta, str_id);
 	strcat(consulta, ";");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
+	if (persistence->chat_cache != NULL) {
+		chat_cache_set_valid(persistence->chat_cache, id_chat, 0);
+	}
+
 	return 0;
 }
 
@@ -1328,12 +2248,39 @@ int recover_user_chat(persistence* persistence, int user_id, int chat_id, int ti
 	strcat(consulta, str_chat_id);
 	strcat(consulta, "));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
+	if (persistence->chat_cache != NULL) {
+		chat_cache_add_member(persistence->chat_cache, user_id, chat_id, 0);
+	}
+	_add_chat_event(persistence, chat_id, timestamp);
+
+	return 0;
+}
+
+
+/*
+ * Stores the new all read timestamp of the chat, if it advanced (all_read > 0)
+ * Returns 0 or -1 if fails
+ */
+int _store_all_read(persistence *persistence, int chat_id, int all_read) {
+	char consulta[150];
+
+	if (all_read <= 0) {
+		return 0;
+	}
+
+	sprintf(consulta, "UPDATE chats set READ_TIME = %d where (ID = %d) AND (READ_TIME < %d);", all_read, chat_id, all_read);
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+    	return -1;
+	}
+
 	return 0;
 }
 
@@ -1364,12 +2311,98 @@ int del_user_chat(persistence* persistence, int user_id, int chat_id, int timest
 	strcat(consulta, str_chat_id);
 	strcat(consulta, ");");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	if (persistence->chat_cache != NULL) {
+		chat_cache_remove_member(persistence->chat_cache, user_id, chat_id);
+		_store_all_read(persistence, chat_id, chat_cache_advance_all_read(persistence->chat_cache, chat_id));
+	}
+	_add_event(persistence, user_id, EVENT_CHAT_LEFT, chat_id, timestamp);
+	_add_chat_event(persistence, chat_id, timestamp);
+
+	return 0;
+}
+
+
+int del_user_all_chats(persistence* persistence, int user_id, int timestamp){
+	DEBUG_TRACE_PRINT();
+	char str_user_id[10], str_time[10]; 
+	char consulta[200]="UPDATE users_chats set REM_TIME = ";
+	char consulta_chats[150];
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int *chat_ids, *all_read;
+	int n_advanced;
+	int totalrows;
+	int i;
+
+	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	// the chats the user leaves, they get the same events as in del_user_chat
+	sprintf(consulta_chats, "SELECT ID_CHAT FROM users_chats WHERE (ID_USERS = %d) AND (REM_TIME = 0);", user_id);
+	if( _query(persistence, consulta_chats) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+
+	sprintf(str_user_id, "%d", user_id);
+	sprintf(str_time, "%d", timestamp);
+
+	if( (strlen(str_user_id) + strlen(consulta)) >= (sizeof(char)*180) ) {
+		DEBUG_FAILURE_PRINTF("Query is too long to fit");
+		_free_result(persistence, res);
+		return -1;
+	}
+
+	strcat(consulta, str_time);
+	strcat(consulta, " where (ID_USERS = ");
+	strcat(consulta, str_user_id);
+	strcat(consulta, ");");
+
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		_free_result(persistence, res);
 		return -1;
 	}
 
+	totalrows = mysql_num_rows(res);
+	if (persistence->chat_cache != NULL) {
+		// the user can only be in the chats read above
+		chat_ids = malloc(sizeof(int)*(totalrows + 1));
+		all_read = malloc(sizeof(int)*(totalrows + 1));
+		if (chat_ids != NULL && all_read != NULL) {
+			n_advanced = chat_cache_remove_user(persistence->chat_cache, user_id, chat_ids, all_read, totalrows);
+			for( i = 0 ; i < n_advanced ; i++ ){
+				_store_all_read(persistence, chat_ids[i], all_read[i]);
+			}
+		}
+		else {
+			chat_cache_remove_user(persistence->chat_cache, user_id, NULL, NULL, 0);
+		}
+		free(chat_ids);
+		free(all_read);
+	}
+
+	for( i = 0 ; i < totalrows ; i++ ){
+		row = mysql_fetch_row(res);
+		_add_event(persistence, user_id, EVENT_CHAT_LEFT, atoi(row[0]), timestamp);
+		_add_chat_event(persistence, atoi(row[0]), timestamp);
+	}
+	_free_result(persistence, res);
+
 	return 0;
 }
 
@@ -1399,12 +2432,17 @@ int change_admin(persistence* persistence, int user_id, int chat_id, int timesta
 	strcat(consulta, str_chat_id);
 	strcat(consulta, ";");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
+	if (persistence->chat_cache != NULL) {
+		chat_cache_set_admin(persistence->chat_cache, user_id, chat_id);
+	}
+	_add_chat_event(persistence, chat_id, timestamp);
+
 	return 0;
 }
 
@@ -1414,9 +2452,17 @@ int is_admin(persistence* persistence, int user_id, int chat_id){
 	MYSQL_RES *res;
 	MYSQL_ROW row; 
 	int totalrows;
+	int found;
 
 	char consulta[200]="SELECT * FROM chats where(ID_ADMIN=";
 
+	if (persistence->chat_cache != NULL) {
+		found = _chat_cache_lookup(persistence, chat_cache_is_admin, user_id, chat_id);
+		if (found >= 0) {
+			return found;
+		}
+	}
+
 	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
 		return -1;
@@ -1435,15 +2481,18 @@ int is_admin(persistence* persistence, int user_id, int chat_id){
 	strcat(consulta, str_chat_id);
 	strcat(consulta, ");");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return (_free_result_rows(persistence, res) > 0)? 1 : 0;
 }
 
 int still_users_in_chat(persistence* persistence,int chat_id){
@@ -1470,15 +2519,18 @@ int still_users_in_chat(persistence* persistence,int chat_id){
 	strcat(consulta, str_chat_id);
 	strcat(consulta, ") and ( REM_TIME = 0));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	
-	return (mysql_num_rows(res) > 0)? 1 : 0;
+	return (_free_result_rows(persistence, res) > 0)? 1 : 0;
 }
 
 
@@ -1507,20 +2559,27 @@ int get_first_users_in_chat(persistence* persistence,int chat_id){
 	strcat(consulta, str_chat_id);
 	strcat(consulta, ") and (REM_TIME = 0));");
 
-	if( mysql_query(persistence->mysql, consulta) ) {
+	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1) {
 		DEBUG_FAILURE_PRINTF("The chat have not users");
+		_free_result(persistence, res);
+		return -1;
 	}
 	
 	row = mysql_fetch_row(res);
+	totalrows = atoi(row[0]);
+	_free_result(persistence, res);
 
-	return atoi(row[0]);
+	return totalrows;
 }
 
 
@@ -1561,21 +2620,26 @@ int get_all_chat_info(persistence* persistence,int chat_id, struct soap *soap, p
   	strcat(consulta, str_time);
   	strcat(consulta, "));"); 
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
 	if( mysql_num_rows(res) < 1) {
 		DEBUG_FAILURE_PRINTF("The chat id does not exist");
+		_free_result(persistence, res);
 		return -1;
 	}
+	row = mysql_fetch_row(res);
 
-	chat->admin = soap_malloc(soap, strlen(row[0]) + sizeof(char) );
-	chat->description = soap_malloc(soap, strlen(row[1]) + sizeof(char));
+	chat->admin = persistence_malloc(persistence, soap, strlen(row[0]) + sizeof(char) );
+	chat->description = persistence_malloc(persistence, soap, strlen(row[1]) + sizeof(char));
 
 	chat->chat_id = chat_id;
 	strcpy(chat->admin, row[0]);
@@ -1584,6 +2648,7 @@ int get_all_chat_info(persistence* persistence,int chat_id, struct soap *soap, p
 	
 	get_member_list_chats(persistence, chat_id, 0, soap, &(chat->members));
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -1618,21 +2683,26 @@ int get_file(persistence* persistence, int user_id, int chat_id,char* path, int
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
 
-	if(mysql_query(persistence->mysql, consulta) ) {
+	if(_query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 	if (mysql_num_rows(res) < 1) {
 		DEBUG_FAILURE_PRINTF("The file does not exist");
+		_free_result(persistence, res);
 		return -1;
 	}
 	row = mysql_fetch_row(res);
 
 	strcpy(path,row[0]);
 
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -1667,15 +2737,108 @@ int message_can_attach(persistence *persistence, int user_id, int chat_id, int m
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
 
-	if(mysql_query(persistence->mysql, consulta) ) {
+	if(_query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+
+	return (_free_result_rows(persistence, res) == 1)? 1 : 0;
+}
+
+
+int add_attachment(persistence *persistence, int chat_id, int msg_timestamp, const char *hash) {
+	DEBUG_TRACE_PRINT();
+	char consulta[200];
+
+	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+	if (!content_hash_valid(hash)) {
+		DEBUG_FAILURE_PRINTF("Not a content hash");
+		return -1;
+	}
+
+	sprintf(consulta, "INSERT INTO attachments(ID_CHAT, SEND_TIME, HASH) VALUES(%d, %d, '%s');", chat_id, msg_timestamp, hash);
+	if(_query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int get_attachment_hash(persistence *persistence, int chat_id, int msg_timestamp, char *hash) {
+	DEBUG_TRACE_PRINT();
+	char consulta[150];
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int found;
+
+	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+
+	sprintf(consulta, "SELECT HASH FROM attachments WHERE (ID_CHAT = %d) AND (SEND_TIME = %d);", chat_id, msg_timestamp);
+	if(_query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+		return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	row = mysql_fetch_row(res);
+	found = (row != NULL && row[0] != NULL && content_hash_valid(row[0]));
+	if (found) {
+		strcpy(hash, row[0]);
+	}
+	_free_result(persistence, res);
+
+	return found;
+}
+
+
+int user_can_read_content(persistence *persistence, int user_id, const char *hash) {
+	DEBUG_TRACE_PRINT();
+	char consulta[350];
+	MYSQL_RES *res;
+
+	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+		return -1;
+	}
+	if (!content_hash_valid(hash)) {
+		DEBUG_FAILURE_PRINTF("Not a content hash");
+		return -1;
+	}
+
+	sprintf(consulta, "SELECT attachments.ID_CHAT FROM attachments JOIN users_chats " \
+			"on (users_chats.ID_CHAT = attachments.ID_CHAT and attachments.SEND_TIME >= users_chats.CREATION_TIME) " \
+			"WHERE (attachments.HASH = '%s') AND (users_chats.ID_USERS = %d) LIMIT 1;", hash, user_id);
+	if(_query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
-	return (mysql_num_rows(res) == 1)? 1 : 0;
+	return (_free_result_rows(persistence, res) == 1)? 1 : 0;
 }
 
 
@@ -1710,15 +2873,18 @@ int message_have_attach(persistence *persistence, int user_id, int chat_id, int
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
 
-	if(mysql_query(persistence->mysql, consulta) ) {
+	if(_query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
 		return -1;
 	}
 
-	res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
 
-	return (mysql_num_rows(res) == 1)? 1 : 0;
+	return (_free_result_rows(persistence, res) == 1)? 1 : 0;
 }
 
 
@@ -1726,6 +2892,7 @@ int update_sync(persistence *persistence, int user_id, int chat_id, int read_tim
 	DEBUG_TRACE_PRINT();
 	
 	int i;
+	int has_read;
 	char str_timestamp[10];
 	char str_id[10];
 	char str_id_chat[10];
@@ -1733,6 +2900,18 @@ int update_sync(persistence *persistence, int user_id, int chat_id, int read_tim
 	char consulta[200] = "UPDATE users_chats set READ_MSG_TIME = ";
 	char consulta2[200] = "UPDATE chats set READ_TIME = ";
 	
+	// most of the syncs repeat the last read timestamp
+	has_read = -1;
+	if (persistence->chat_cache != NULL) {
+		has_read = chat_cache_has_read(persistence->chat_cache, user_id, chat_id, read_timestamp);
+		if (has_read < 0 && _load_chat(persistence, chat_id) == 0) {
+			has_read = chat_cache_has_read(persistence->chat_cache, user_id, chat_id, read_timestamp);
+		}
+		if (has_read == 1) {
+			return 0;
+		}
+	}
+
   	if (persistence->mysql == NULL) {	
 		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
     	return -1;
@@ -1767,14 +2946,20 @@ int update_sync(persistence *persistence, int user_id, int chat_id, int read_tim
 	strcat(consulta2, str_timestamp);
 	strcat(consulta2, " AND REM_TIME = 0);");
 	
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
-  	if( mysql_query(persistence->mysql, consulta2) ) {
+
+	// the cached chat knows the read timestamps of all its members
+	if (has_read == 0) {
+		return _store_all_read(persistence, chat_id, chat_cache_set_read(persistence->chat_cache, user_id, chat_id, read_timestamp));
+	}
+
+  	if( _query(persistence, consulta2) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}	
 	
@@ -1814,16 +2999,19 @@ int get_notif_chats_with_messages(persistence *persistence, int user_id, int tim
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	chat_list->chat = soap_malloc(soap ,sizeof(psdims__notif_chat_info)*totalrows);
+	chat_list->chat = persistence_malloc(persistence, soap, sizeof(psdims__notif_chat_info)*totalrows);
 	chat_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
@@ -1831,6 +3019,7 @@ int get_notif_chats_with_messages(persistence *persistence, int user_id, int tim
 		chat_list->chat[i].chat_id = atoi(row[0]);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -1861,16 +3050,19 @@ int get_notif_chats_read_times(persistence *persistence, int user_id, struct soa
 	strcat(consulta, str_id);
 	strcat(consulta, ");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	chat_list->chat = soap_malloc(soap ,sizeof(psdims__notif_chat_info)*totalrows);
+	chat_list->chat = persistence_malloc(persistence, soap, sizeof(psdims__notif_chat_info)*totalrows);
 	chat_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
@@ -1879,6 +3071,7 @@ int get_notif_chats_read_times(persistence *persistence, int user_id, struct soa
 		chat_list->chat[i].timestamp = atoi(row[1]);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -1890,6 +3083,8 @@ int get_notif_friend_requests(persistence *persistence, int user_id, int timesta
 	char str_time[20];
 	MYSQL_RES *res;
 	MYSQL_ROW row;  
+	unsigned long *lengths;
+	row_arena arena;
 	int totalrows;
 	int i;
 
@@ -1915,27 +3110,33 @@ int get_notif_friend_requests(persistence *persistence, int user_id, int timesta
 	strcat(consulta,str_time);
 	strcat(consulta,");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	request_list->user = soap_malloc(soap,sizeof(psdims__notif_friend_info)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__notif_friend_info), ARENA_COLUMN(0), (void**)&request_list->user, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	request_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
 		row = mysql_fetch_row(res);
+		lengths = mysql_fetch_lengths(res);
 		
-		request_list->user[i].name.string = soap_malloc(soap, strlen(row[0]) + sizeof(char) );
-		
-		strcpy(request_list->user[i].name.string, row[0]);
+		request_list->user[i].name.string = _arena_copy(&arena, row, lengths, 0);
 		request_list->user[i].send_date = atoi(row[1]);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -1946,6 +3147,8 @@ int get_notif_chat_members(persistence *persistence, int user_id, int timestamp,
 	char str_time[20];
 	MYSQL_RES *res;
 	MYSQL_ROW row;  
+	unsigned long *lengths;
+	row_arena arena;
 	int totalrows;
 	int i;
 
@@ -1973,27 +3176,33 @@ int get_notif_chat_members(persistence *persistence, int user_id, int timestamp,
 	strcat(consulta, str_time);
 	strcat(consulta, ") and (member.REM_TIME = 0);");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	member_list->member = soap_malloc(soap, sizeof(psdims__notif_member_info)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__notif_member_info), ARENA_COLUMN(0), (void**)&member_list->member, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	member_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
 		row = mysql_fetch_row(res);
-		member_list->member[i].name.string = soap_malloc(soap, strlen(row[0]) + sizeof(char));
-		
-		strcpy(member_list->member[i].name.string, row[0]);
+		lengths = mysql_fetch_lengths(res);
+		member_list->member[i].name.string = _arena_copy(&arena, row, lengths, 0);
 		member_list->member[i].chat_id = atoi(row[1]);
 		member_list->member[i].timestamp = atoi(row[2]);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -2003,6 +3212,8 @@ int get_notif_chat_rem_members(persistence *persistence, int user_id, int timest
 	char str_time[20];
 	MYSQL_RES *res;
 	MYSQL_ROW row;  
+	unsigned long *lengths;
+	row_arena arena;
 	int totalrows;
 	int i;
 
@@ -2030,27 +3241,33 @@ int get_notif_chat_rem_members(persistence *persistence, int user_id, int timest
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	member_list->member = soap_malloc(soap, sizeof(psdims__notif_member_info)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__notif_member_info), ARENA_COLUMN(0), (void**)&member_list->member, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	member_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
 		row = mysql_fetch_row(res);
-		member_list->member[i].name.string = soap_malloc(soap, strlen(row[0]) + sizeof(char));
-		
-		strcpy(member_list->member[i].name.string, row[0]);
+		lengths = mysql_fetch_lengths(res);
+		member_list->member[i].name.string = _arena_copy(&arena, row, lengths, 0);
 		member_list->member[i].chat_id = atoi(row[1]);
 		member_list->member[i].timestamp = atoi(row[2]);
 	}
 	
+	_free_result(persistence, res);
 	return 0;
 }
 
@@ -2059,6 +3276,8 @@ int get_notif_chat_admins(persistence *persistence, int user_id, int timestamp,
 	char str_time[20];
 	MYSQL_RES *res;
 	MYSQL_ROW row;  
+	unsigned long *lengths;
+	row_arena arena;
 	int totalrows;
 	int i;
 
@@ -2086,26 +3305,125 @@ int get_notif_chat_admins(persistence *persistence, int user_id, int timestamp,
 	strcat(consulta, str_time);
 	strcat(consulta, ");");
  
-  	if( mysql_query(persistence->mysql, consulta) ) {
+  	if( _query(persistence, consulta) ) {
 		DEBUG_FAILURE_PRINTF("Query error");
-		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", mysql_error(persistence->mysql)); 
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
     	return -1;
 	}
 
-    res = mysql_store_result(persistence->mysql);
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
     totalrows = mysql_num_rows(res);
 
-	member_list->member = soap_malloc(soap, sizeof(psdims__notif_member_info)*totalrows);
+	if (_arena_alloc(persistence, soap, res, sizeof(psdims__notif_member_info), ARENA_COLUMN(0), (void**)&member_list->member, &arena) == -1) {
+		_free_result(persistence, res);
+		return -1;
+	}
 	member_list->__sizenelems = totalrows;
 
 	for( i = 0 ; i < totalrows ; i++ ){
 		row = mysql_fetch_row(res);
-		member_list->member[i].name.string = soap_malloc(soap, strlen(row[0]) + sizeof(char));
-		
-		strcpy(member_list->member[i].name.string, row[0]);
+		lengths = mysql_fetch_lengths(res);
+		member_list->member[i].name.string = _arena_copy(&arena, row, lengths, 0);
 		member_list->member[i].chat_id = atoi(row[1]);
 		member_list->member[i].timestamp = atoi(row[2]);
 	}
 	
+	_free_result(persistence, res);
+	return 0;
+}
+
+
+int get_events_range(persistence *persistence, long long *first_seq, long long *last_seq) {
+	DEBUG_TRACE_PRINT();
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+  	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+    	return -1;
+  	}
+
+	// both of them by the primary key
+  	if( _query(persistence, "SELECT MIN(SEQ), MAX(SEQ) FROM events;") ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+    	return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+	row = mysql_fetch_row(res);
+	*first_seq = (row != NULL && row[0] != NULL)? atoll(row[0]) : 0;
+	*last_seq = (row != NULL && row[1] != NULL)? atoll(row[1]) : 0;
+
+	_free_result(persistence, res);
+	return 0;
+}
+
+
+int get_user_events(persistence *persistence, int user_id, long long cursor, sync_event *events, int max_events) {
+	DEBUG_TRACE_PRINT();
+	char consulta[200];
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int totalrows;
+	int i;
+
+  	if (persistence->mysql == NULL) {	
+		DEBUG_FAILURE_PRINTF("DataBase is not initialized");
+    	return -1;
+  	}
+
+	sprintf(consulta, "SELECT SEQ, TYPE, ID_REF, CREATION_TIME FROM events WHERE (ID_USER = %d) AND (SEQ > %lld) " \
+			"ORDER BY SEQ LIMIT %d;", user_id, cursor, max_events);
+
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+    	return -1;
+	}
+
+	res = _store_result(persistence);
+	if (res == NULL) {
+		return -1;
+	}
+    totalrows = mysql_num_rows(res);
+
+	for( i = 0 ; i < totalrows ; i++ ){
+		row = mysql_fetch_row(res);
+		events[i].seq = atoll(row[0]);
+		events[i].type = atoi(row[1]);
+		events[i].ref_id = atoi(row[2]);
+		events[i].timestamp = atoi(row[3]);
+	}
+
+	_free_result(persistence, res);
+	return totalrows;
+}
+
+
+int prune_events(persistence *persistence, int timestamp) {
+	DEBUG_TRACE_PRINT();
+	char consulta[200];
+	long long first_seq, last_seq;
+
+	if (get_events_range(persistence, &first_seq, &last_seq) != 0) {
+		return -1;
+	}
+
+	// the last event is kept, a client is never ahead of the first one
+	sprintf(consulta, "DELETE FROM events WHERE (CREATION_TIME < %d) AND (SEQ < %lld);", timestamp, last_seq);
+
+  	if( _query(persistence, consulta) ) {
+		DEBUG_FAILURE_PRINTF("Query error");
+		DEBUG_FAILURE_PRINTF("MYSQL_ERROR: %s", _error(persistence)); 
+    	return -1;
+	}
+
 	return 0;
 }
@@ -28,6 +28,9 @@
 
 #include <mysql.h>
 #include "soapH.h"
+#include "friend_cache.h"
+#include "chat_cache.h"
+#include "db_async.h"
 
 typedef struct persistence persistence;
 struct persistence {
@@ -37,18 +40,122 @@ struct persistence {
 	char *bd_name;
 	char *user_name;
 	char *user_pass;
+	friend_cache *friend_cache;		// shared by the clones, NULL if not used
+	chat_cache *chat_cache;			// shared by the clones, NULL if not used
+	size_t mem_used;				// bytes of results and responses of the current request
+	size_t mem_peak;
+	size_t mem_budget;				// max bytes of results per request, 0 if unlimited
+	int mem_rejected;				// results rejected by the budget in the current request
+	db_async *db_async;				// runs the queries if not NULL, then mysql is not connected
+	db_lease *db_lease;				// connection of db_async that runs them, if it is leased
+	MYSQL_RES *async_res;			// result of the last async query, until it is stored
+	unsigned int async_errno;
+	char async_error[DB_ERROR_CHARS];
+	my_ulonglong async_insert_id;
 };
 
 #define persistence_thread_safe(persistence) \
 		(persistence->thread_safe)
 
-#define clone_persistence(persistence) \
-		init_persistence(persistence->user_name, persistence->user_pass)
+#define persistence_leased(persistence) \
+		(persistence->db_lease != NULL)
+
+#define persistence_mem_peak(persistence) \
+		(persistence->mem_peak)
+
+#define persistence_mem_rejected(persistence) \
+		(persistence->mem_rejected)
+
+// result of a row that failed, it may be inserted if it is retried
+#define ROW_FAILED (-1)
+// result of a row that the database never inserts (e.g. its chat was removed)
+#define ROW_REJECTED (-2)
+
+/*
+ * A message waiting to be inserted by send_messages_batch
+ */
+typedef struct message_row message_row;
+struct message_row {
+	int chat_id;
+	int user_id;
+	int timestamp;
+	char *text;
+	char *file_name;
+	int result;		// set by send_messages_batch, 0 if inserted, ROW_FAILED or ROW_REJECTED
+};
+
+/*
+ * Changes of the data of a user, recorded by the functions that store them.
+ * Their sequence is the sync cursor of the clients (get_changes)
+ */
+typedef enum event_type event_type;
+enum event_type {
+	EVENT_CHAT_CHANGED = 1,		// the user joined the chat, or its members or admin changed
+	EVENT_CHAT_LEFT,			// the user left or was removed from the chat
+	EVENT_NEW_FRIEND,			// ref_id is the new friend
+	EVENT_FRIEND_REQUEST		// ref_id is the user that sent it
+};
+
+typedef struct sync_event sync_event;
+struct sync_event {
+	long long seq;
+	event_type type;
+	int ref_id;			// chat or user, by type
+	int timestamp;
+};
 
 persistence * init_persistence(char user[],char pass[]);
 
+/*
+ * New connection with the same user, sharing the caches
+ */
+persistence * clone_persistence(persistence *persistence);
+
+/*
+ * Clone without its own connection, its queries run on the connections of
+ * db_async and it waits for them. It shares the caches and the budget.
+ * It cannot be used by send_messages_batch
+ */
+persistence * async_persistence(persistence *persistence, db_async *db_async);
+
 void free_persistence(persistence *persistence);
 
+int reconnect_persistence(persistence *persistence);
+
+/*
+ * Runs the next queries of a db_async persistence on the same connection
+ * (e.g. a transaction), until persistence_release. Nothing is done if the
+ * persistence has its own connection
+ * Returns 0 or -1 if fails
+ */
+int persistence_lease(persistence *persistence);
+
+void persistence_release(persistence *persistence);
+
+int persistence_err(persistence *persistence);
+
+/*
+ * Returns 1 if the database connection is alive or 0
+ */
+int persistence_alive(persistence *persistence);
+
+/*
+ * Limits the memory of the query results that a request can hold,
+ * 0 means unlimited. The clones inherit the budget
+ */
+void persistence_set_budget(persistence *persistence, size_t bytes);
+
+/*
+ * Starts the memory accounting of a new request
+ */
+void persistence_reset_mem(persistence *persistence);
+
+/*
+ * soap_malloc accounted in the request memory. The responses are built
+ * anyway, the budget is only enforced on the query results
+ */
+void *persistence_malloc(persistence *persistence, struct soap *soap, size_t size);
+
 int add_user(persistence* persistence, char* name, char* pass, char* information);
 
 int del_user(persistence* persistence, char* name);
@@ -71,6 +178,13 @@ int exist_user_in_chat(persistence* persistence,int user_id, int chat_id);
 
 int exist_user_entry_in_chat(persistence* persistence,int user_id, int chat_id);
 
+/*
+ * Gets the time the user first joined the chat, the messages sent
+ * before it are not visible to the user
+ * Returns the time, 0 if the user never was in the chat or -1 if fails
+ */
+int get_user_chat_join_time(persistence* persistence, int user_id, int chat_id);
+
 int chat_exist(persistence* persistence, int chat_id);
 
 int get_list_friends(persistence* persistence,int user_id, int timestamp, struct soap *soap, psdims__user_list *friends);
@@ -83,10 +197,52 @@ int del_user_all_chats(persistence* persistence, int user_id, int timestamp);
 
 int get_list_chats(persistence* persistence,int user_id, int timestamp, struct soap *soap, psdims__chat_list *chats);
 
+/*
+ * The chats in chat_ids that the user is a member of, with all their members
+ * Returns 0 or -1 if fails
+ */
+int get_list_chats_by_id(persistence* persistence, int user_id, int chat_ids[], int n_chats, struct soap *soap, psdims__chat_list *chats);
+
+/*
+ * The valid users in user_ids
+ * Returns 0 or -1 if fails
+ */
+int get_list_users_by_id(persistence* persistence, int user_ids[], int n_users, struct soap *soap, psdims__user_list *users);
+
 int exist_timestamp_in_messages(persistence* persistence, int chat_id, int timestamp);
 
 int send_messages(persistence* persistence,int chat_id, int user_id, int timestamp, psdims__message_info *message);
 
+/*
+ * Inserts all the rows in a single transaction (one multi-row INSERT).
+ * If the transaction fails, every row is retried on its own, so one bad
+ * row does not discard the rest. The result of each row is left in row->result,
+ * ROW_REJECTED only if the error of the database is not temporary
+ * If ignore_existing, rows whose (chat, timestamp) is already stored are skipped
+ * as inserted, so the same rows can be safely applied twice.
+ * Returns 0 if every row was inserted or -1
+ */
+int send_messages_batch(persistence* persistence, message_row *rows[], int n_rows, int ignore_existing);
+
+/*
+ * Starts a read only transaction, the next queries see the same snapshot
+ * of the database until end_read_transaction.
+ * It needs a persistence with its own connection, or a leased one
+ * Returns 0 or -1 if fails
+ */
+int begin_read_transaction(persistence *persistence);
+
+/*
+ * Returns 0 or -1 if fails
+ */
+int end_read_transaction(persistence *persistence);
+
+/*
+ * Returns the timestamp of the last message in the chat (0 if there are none)
+ * or -1 if fails
+ */
+int get_last_message_time(persistence* persistence, int chat_id);
+
 int decline_friend_request(persistence* persistence, int user_id1, int user_id2);
 
 int accept_friend_request(persistence* persistence, int user_id1, int user_id2, int timestamp);
@@ -125,6 +281,25 @@ int message_have_attach(persistence *persistence, int user_id, int chat_id, int
 
 int message_can_attach(persistence *persistence, int user_id, int chat_id, int msg_timestamp);
 
+/*
+ * Links the message to the stored content with that hash, once per message
+ * Returns 0 or -1 if fails (or the message has already its file)
+ */
+int add_attachment(persistence *persistence, int chat_id, int msg_timestamp, const char *hash);
+
+/*
+ * Writes the hash of the content attached to the message (CONTENT_HASH_CHARS + 1)
+ * Returns 1 if found, 0 if the message has no stored content or -1 if fails
+ */
+int get_attachment_hash(persistence *persistence, int chat_id, int msg_timestamp, char *hash);
+
+/*
+ * Checks if the user can download the content with that hash, it is attached
+ * to a message the user can read (the same check as message_have_attach)
+ * Returns 1 if the user can read it, 0 if not or -1 if fails
+ */
+int user_can_read_content(persistence *persistence, int user_id, const char *hash);
+
 int update_sync(persistence *persistence, int user_id, int chat_id, int read_timestamp);
 
 int get_notif_chats_with_messages(persistence *persistence, int user_id, int timestamp, struct soap *soap, psdims__notif_chat_list *chat_list);
@@ -139,5 +314,23 @@ int get_notif_chat_rem_members(persistence *persistence, int user_id, int timest
 
 int get_notif_chat_admins(persistence *persistence, int user_id, int timestamp, struct soap *soap, psdims__notif_chat_member_list *member_list);
 
+/*
+ * Gives the sequences of the first and last recorded events, 0 if there are none
+ * Returns 0 or -1 if fails
+ */
+int get_events_range(persistence *persistence, long long *first_seq, long long *last_seq);
+
+/*
+ * Reads (in order) up to max_events events of the user after the cursor
+ * Returns the number of events or -1 if fails
+ */
+int get_user_events(persistence *persistence, int user_id, long long cursor, sync_event *events, int max_events);
+
+/*
+ * Deletes the events older than timestamp, but the last one
+ * Returns 0 or -1 if fails
+ */
+int prune_events(persistence *persistence, int timestamp);
+
 #endif /* __PERSISTENCE */
 
@@ -26,6 +26,20 @@
 #include "soapH.h"
 #include "psdims.nsmap"
 #include "persistence.h"
+#include "msg_clock.h"
+#include "msg_batch.h"
+#include "msg_journal.h"
+#include "metrics.h"
+#include "db_async.h"
+#include "soap_pool.h"
+#include "single_flight.h"
+#include "ims_bin.h"
+#include "blob_store.h"
+#include "upload_staging.h"
+#include "attach_url.h"
+#include "file_io.h"
+#include "lanes.h"
+#include "rate_limit.h"
 #include "bool.h"
 #include "psd_ims_server.h"
 #include <pthread.h>
@@ -35,29 +49,118 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <pwd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
 
 
 #include "debug_def.h"
 
 #define MAX_ALIVE_THREADS (200)
-#define ATTACH_FILES_DIR "server_files"
+// accepted connections that can wait for a thread when all of them are busy
+#define ADMISSION_QUEUE_LEN (64)
+// a queued connection that waits longer than this is rejected
+#define ADMISSION_WAIT_MSECS (500)
+// seconds the rejected clients should wait before retrying
+#define ADMISSION_RETRY_AFTER "1"
+// seconds the clients over their rate should wait before retrying
+#define RATE_RETRY_AFTER "1"
+// pause of the accept loop when it runs out of descriptors
+#define ACCEPT_BACKOFF_USECS (100000)
+// the acceptor threads wake up this often to check if the server is stopping
+#define ACCEPTOR_POLL_SECS (1)
+// ended connection contexts kept for the next ones
+#define SOAP_POOL_MAX_FREE (64)
+// max operations in a single batch request
+#define MAX_BATCH_OPS (64)
+// smaller responses are not compressed, they do not pay the CPU
+#define COMPRESS_MIN_BYTES (1024)
+// idle secs before a binary connection is closed
+#define BIN_RECV_TIMEOUT_SECS (60)
+// max binary connections, their threads are not taken from MAX_ALIVE_THREADS
+#define MAX_BIN_THREADS (64)
+// more pending events than these and the client gets a snapshot
+#define MAX_DELTA_EVENTS (256)
+// events before the cursor read again by every get_changes. The SEQ of an event
+// is taken when it is inserted, and a transaction can commit after later ones
+#define SYNC_OVERLAP_SEQS (64)
+// age of the events pruned, an older cursor gets a snapshot
+#define EVENTS_KEEP_SECS (30*24*3600)
+#define EVENTS_PRUNE_SECS (3600)
+// max chars of the Range header of an attachment download
+#define HTTP_RANGE_CHARS (64)
+// max chars of the headers of an attachment download
+#define HTTP_HEAD_CHARS (512)
+// files of the messages sent before the blob store, in the same directory
+#define ATTACH_FILES_DIR BLOB_FILES_DIR
 
 #define create_file_path(buff, chat_id, timestamp) \
 		sprintf(buff, "%s/_%d%d", ATTACH_FILES_DIR, chat_id, timestamp)
 
+typedef struct pending_connection pending_connection;
+struct pending_connection {
+	struct soap *soap;
+	struct timeval accepted;
+};
+
 struct server {
 	persistence *persistence;
-	struct soap soap;
+	friend_cache *friend_cache;
+	chat_cache *chat_cache;
+	msg_clock *msg_clock;
+	msg_batch *msg_batch;
+	msg_journal *msg_journal;
+	db_async *db_async;
+	soap_pool *soap_pool;			// contexts of the slave connections
+	single_flight *single_flight;	// identical reads in progress
+	file_io *file_io;				// reads, writes and syncs of the attachment files
+	lanes *lanes;					// slots and bandwidth of the operation classes
+	rate_limit *user_limit;			// requests of every user
+	rate_limit *addr_limit;			// requests of every client address
+	struct soap soap;				// first acceptor, served by the main thread
+	struct soap *acceptors[METRICS_MAX_ACCEPTORS];
+	pthread_t acceptor_threads[METRICS_MAX_ACCEPTORS];
+	int n_acceptors;
+	int bin_socket;					// listening socket of the binary transport, -1 if disabled
+	pthread_t bin_thread;
+	volatile int stopping;
+	pthread_mutex_t persistence_mutex;	// reconnection of the shared persistence by the acceptors
+	int last_events_prune;
+	pthread_mutex_t events_mutex;
 	int n_alive_threads;
+	int n_bin_threads;				// serving binary connections, protected by n_threads_mutex
+	pending_connection pending[ADMISSION_QUEUE_LEN];	// waiting for a thread, protected by n_threads_mutex
+	int first_pending;
+	int n_pending;
 	pthread_mutex_t n_threads_mutex;
 	pthread_cond_t zero_alive_threads;
+	int (*fparsehdr)(struct soap*, const char*, const char*);	// header parser of gsoap
+	size_t (*frecv)(struct soap*, char*, size_t);			// socket reader of gsoap
+	int (*fsend)(struct soap*, const char*, size_t);		// socket writer of gsoap
 } server;
 
+// Range header of the request being served by the thread, the headers
+// and the fget callback of a request are run by the thread that serves it
+static __thread char request_range[HTTP_RANGE_CHARS];
+// class of the request being served by the thread, that paces its socket reads
+// and writes, and if its user exceeded its rate
+static __thread op_class request_class;
+static __thread int request_limited;
+// the request already took its token of the user, a batch runs several handlers
+static __thread int request_charged;
+// address of the client of the connection served by the thread
+static __thread char request_addr[INET6_ADDRSTRLEN];
+
 
 /*
  *
@@ -69,266 +172,1962 @@ void end_soap_connection(struct soap *soap) {
 }
 
 
-void *thread_serve_request(void *soap) {
-	DEBUG_TRACE_PRINT();
+/*
+ * Persistence of the request being served on soap, created on the first use
+ * and freed by end_request, so the error paths of the handlers do not leak it
+ * Returns the persistence or NULL if fails
+ */
+persistence *request_persistence(struct soap *soap) {
+	persistence *persistence;
 
-	DEBUG_INFO_PRINTF("Serving slave connection");
+	if (soap->user != NULL) {
+		return (struct persistence*)soap->user;
+	}
 
-	pthread_detach(pthread_self());
-	soap_serve((struct soap*)soap);
+	if (server.db_async != NULL) {
+		persistence = async_persistence(server.persistence, server.db_async);
+	}
+	else {
+		persistence = clone_persistence(server.persistence);
+	}
+	soap->user = persistence;
 
-	// end the connection and free the resources
-	end_soap_connection((struct soap*)soap);
-	free(soap);
+	return persistence;
+}
 
-	DEBUG_INFO_PRINTF("Closing slave connection");
-	// decrement the number of alive threads
-	pthread_mutex_lock(&server.n_threads_mutex);
-	server.n_alive_threads--;
-	if (server.n_alive_threads == 0) {
-		pthread_cond_signal(&server.zero_alive_threads);
+
+/*
+ * Records the memory metrics of the request and frees its persistence.
+ * Called by gsoap after every served request (fserveloop), and when
+ * the connection ends for the requests that failed
+ */
+int end_request(struct soap *soap) {
+	persistence *persistence;
+
+#ifdef WITH_ZLIB
+	if (soap->omode & SOAP_ENC_ZLIB) {
+		metrics_add(METRIC_COMPRESSED_RESPONSES, 1);
+		metrics_add(METRIC_COMPRESSION_RATIO_SUM, (long long)(soap->z_ratio_out * 1000));
+		// the next request of the connection decides again
+		soap_clr_omode(soap, SOAP_ENC_ZLIB);
 	}
-	pthread_mutex_unlock(&server.n_threads_mutex);
+#endif
 
-	return NULL;
-}
+	request_range[0] = '\0';
 
+	if (soap->user == NULL) {
+		return SOAP_OK;
+	}
+	persistence = (struct persistence*)soap->user;
+	soap->user = NULL;
+
+	metrics_add(METRIC_REQUESTS, 1);
+	metrics_add(METRIC_REQUEST_MEM_BYTES, persistence_mem_peak(persistence));
+	metrics_max(METRIC_REQUEST_MEM_PEAK, persistence_mem_peak(persistence));
+	if (persistence_mem_rejected(persistence) > 0) {
+		metrics_add(METRIC_REQUEST_MEM_REJECTED, persistence_mem_rejected(persistence));
+	}
+
+	free_persistence(persistence);
+
+	return SOAP_OK;
+}
 
 
 /*
- *
- * Returns 0 or -1 if fails
+ * Compresses the response if the client accepts it (gzip or deflate) and it
+ * is large enough. Its size is estimated with the memory used by the request results
  */
-int init_server(int bind_port, char persistence_user[], char persistence_pass[]) {
-	DEBUG_TRACE_PRINT();
+void compress_response(struct soap *soap, persistence *persistence) {
+#ifdef WITH_ZLIB
+	if (soap->zlib_out == SOAP_ZLIB_NONE) {
+		return;
+	}
+	if (persistence_mem_peak(persistence) < COMPRESS_MIN_BYTES) {
+		metrics_add(METRIC_COMPRESSION_SKIPPED, 1);
+		soap_clr_omode(soap, SOAP_ENC_ZLIB);
+		return;
+	}
+	soap_set_omode(soap, SOAP_ENC_ZLIB);
+#endif
+}
 
-	SOAP_SOCKET m;
-	server.n_alive_threads = 0;
-	pthread_mutex_init(&server.n_threads_mutex, NULL);
-	pthread_cond_init(&server.zero_alive_threads, NULL);
 
-	server.persistence = init_persistence(persistence_user, persistence_pass);
-	if (server.persistence == NULL ) {
-		DEBUG_FAILURE_PRINTF("Could not init persistence");
-		return -1;
+/*
+ * Path of the file attached to the message, its blob or the file
+ * of the older messages
+ * Returns the path or NULL if fails
+ */
+char *attachment_path(persistence *persistence, struct soap *soap, int chat_id, int msg_timestamp) {
+	char hash[CONTENT_HASH_CHARS + 1];
+	char *file_path;
+	int found;
+
+	if ( (found = get_attachment_hash(persistence, chat_id, msg_timestamp, hash)) < 0 ) {
+		return NULL;
+	}
+	if ( (file_path = persistence_malloc(persistence, soap, BLOB_PATH_CHARS)) == NULL ) {
+		return NULL;
+	}
+	if (found) {
+		blob_path(hash, file_path);
+	}
+	else {
+		create_file_path(file_path, chat_id, msg_timestamp);
 	}
-	
-	DEBUG_INFO_PRINTF("Init soap");
-	soap_init(&server.soap);
-	
-	server.soap.send_timeout = 60; 			// 60 secs
-	server.soap.recv_timeout = 60;			// 60 secs
-	server.soap.accept_timeout = 3600;	// after 3600 secs of inactivity the server stops
-	server.soap.max_keep_alive = 100;		// max keep_alive sequence
-	server.n_alive_threads = 0;
 
-	m = soap_bind(&server.soap, NULL, bind_port, 100);
+	return file_path;
+}
 
-	if (!soap_valid_socket(m)) {
-		soap_print_fault(&server.soap, stderr);
-		return -1;
+
+/*
+ * Keeps the Range header, that gsoap does not parse, for the GET handler
+ * Returns SOAP_OK or an error code if fails
+ */
+int parse_http_header(struct soap *soap, const char *key, const char *val) {
+	if (strcasecmp(key, "Range") == 0) {
+		strncpy(request_range, val, HTTP_RANGE_CHARS - 1);
+		request_range[HTTP_RANGE_CHARS - 1] = '\0';
+		return SOAP_OK;
 	}
 
-	return 0;
+	return server.fparsehdr(soap, key, val);
 }
 
 
 /*
- *
- *
+ * Reads from the socket like gsoap, pacing the bytes of a transfer by the
+ * bandwidth of its lane while they are received, so the client is slowed
+ * down by the socket buffers
+ * Returns the bytes read or 0 if fails
  */
-void free_server() {
-	DEBUG_TRACE_PRINT();
-	// finish the "list" soap connection
-	end_soap_connection(&server.soap);
-	// wait until (n_alive_threads == 0)
-	
-	pthread_mutex_lock(&server.n_threads_mutex);
-	while (server.n_alive_threads > 0) {
-		pthread_cond_wait(&server.zero_alive_threads, &server.n_threads_mutex);
-	}
-	pthread_mutex_unlock(&server.n_threads_mutex);
-	
-	free_persistence(server.persistence);
+size_t recv_paced(struct soap *soap, char *buff, size_t len) {
+	size_t n_read;
+
+	n_read = server.frecv(soap, buff, len);
+	lanes_throttle(server.lanes, request_class, n_read);
+
+	return n_read;
 }
 
 
 /*
- *
- * Returns 0 or -1 if fails
+ * Writes to the socket like gsoap, pacing the bytes of a transfer by the
+ * bandwidth of its lane while they are sent
+ * Returns SOAP_OK or an error code if fails
  */
-int listen_connection () {
-	DEBUG_TRACE_PRINT();
-	int ret_value;
+int send_paced(struct soap *soap, const char *buff, size_t len) {
+	lanes_throttle(server.lanes, request_class, len);
 
-	if ( persistence_thread_safe(server.persistence) )
-		ret_value = mthread_listen_connection();
-	else
-		ret_value = sthread_listen_connection();
-		
-	return ret_value;
+	return server.fsend(soap, buff, len);
 }
 
 
 /*
- *
- * Returns 0 or -1 if fails
+ * Parses a single byte range (bytes=first-last, bytes=first- or bytes=-suffix)
+ * of a file of size bytes. Several ranges are not supported, the whole file is sent
+ * Returns 1 and the range, 0 if there is none or -1 if it can not be satisfied
  */
-int sthread_listen_connection () {
-	DEBUG_TRACE_PRINT();
+int parse_range(const char *range, off_t size, off_t *first, off_t *last) {
+	long long a, b;
+	int n_chars = 0;
 
-	SOAP_SOCKET s;
+	*first = 0;
+	*last = size - 1;
 
-	s = soap_accept(&server.soap);
-	if (!soap_valid_socket(s)) {
-		if(server.soap.errnum) {
-			soap_print_fault(&server.soap, stderr); 
+	if (range[0] == '\0' || strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL) {
+		return 0;
+	}
+	range += 6;
+
+	if (sscanf(range, "-%lld%n", &b, &n_chars) == 1 && range[n_chars] == '\0') {
+		if (b <= 0 || size == 0) {
 			return -1;
 		}
-		DEBUG_INFO_PRINTF("Server timed out");
-		return -1;
+		*first = (b < size)? size - b : 0;
+		return 1;
 	}
-	
-	if (persistence_err(server.persistence)) {
-		DEBUG_FAILURE_PRINTF("Persistence is disconnected, atempting to reconnect...");
-		reconnect_persistence(server.persistence);
-		if (persistence_err(server.persistence)) {
-			DEBUG_FAILURE_PRINTF("Could not reconnect.");
-			return -1;
+	if (sscanf(range, "%lld-%n", &a, &n_chars) != 1 || a < 0) {
+		return 0;
+	}
+	if (range[n_chars] != '\0') {
+		if (sscanf(range + n_chars, "%lld", &b) != 1 || b < a) {
+			return 0;
+		}
+		if (b < *last) {
+			*last = b;
 		}
 	}
-	
-	// Execute invoked operation
-	if (soap_serve(&(server.soap)) != SOAP_OK) {
-		soap_print_fault(&(server.soap), stderr);
+	if (a >= size) {
+		return -1;
 	}
+	*first = a;
 
-	// Clean up!
-	soap_destroy(&(server.soap));
-	soap_end(&(server.soap));
-	return 0;
+	return 1;
 }
 
 
 /*
- *
+ * Writes the whole buffer in the socket of soap, waiting while it is full
  * Returns 0 or -1 if fails
  */
-int mthread_listen_connection () {
-	DEBUG_TRACE_PRINT();
+int send_socket(struct soap *soap, const char *buff, size_t size) {
+	struct pollfd pfd;
+	ssize_t n_sent;
+
+	pfd.fd = soap->socket;
+	pfd.events = POLLOUT;
+	while (size > 0) {
+		n_sent = send(soap->socket, buff, size, MSG_NOSIGNAL);
+		if (n_sent > 0) {
+			buff += n_sent;
+			size -= n_sent;
+		}
+		else if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (poll(&pfd, 1, soap->send_timeout*1000) <= 0) {
+				return -1;
+			}
+		}
+		else {
+			return -1;
+		}
+	}
 
-	SOAP_SOCKET s;
-	pthread_t tid;
-	struct soap *tsoap;
+	return 0;
+}
 
-	DEBUG_INFO_PRINTF("Master connection ready");
 
-	s = soap_accept(&server.soap);
-	if (!soap_valid_socket(s)) {
-		if(server.soap.errnum) {
-			soap_print_fault(&server.soap, stderr); 
+/*
+ * Sends count bytes of the file from offset with sendfile, from the page
+ * cache to the socket without copying them to the process. The bytes are
+ * paced by the bandwidth of the transfer lane, a chunk at a time
+ * Returns 0 or -1 if fails
+ */
+int send_file_range(struct soap *soap, int fd, off_t offset, off_t count) {
+	struct pollfd pfd;
+	ssize_t n_sent;
+	size_t n_bytes;
+
+	pfd.fd = soap->socket;
+	pfd.events = POLLOUT;
+	while (count > 0) {
+		n_bytes = (count < UPLOAD_CHUNK_BYTES)? count : UPLOAD_CHUNK_BYTES;
+		lanes_throttle(server.lanes, OP_CLASS_TRANSFER, n_bytes);
+		n_sent = sendfile(soap->socket, fd, &offset, n_bytes);
+		if (n_sent > 0) {
+			count -= n_sent;
+		}
+		else if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (poll(&pfd, 1, soap->send_timeout*1000) <= 0) {
+				return -1;
+			}
+		}
+		else {
+			// the file was truncated while being sent
 			return -1;
 		}
-		DEBUG_INFO_PRINTF("Server timed out");
-		return -1;
 	}
 
-	if (persistence_err(server.persistence)) {
-		DEBUG_FAILURE_PRINTF("Persistence is disconnected, atempting to reconnect...");
-		reconnect_persistence(server.persistence);
-		if (persistence_err(server.persistence)) {
-			DEBUG_FAILURE_PRINTF("Could not reconnect.");
-			return -1;
-		}
+	return 0;
+}
+
+
+/*
+ * Answers the GET with the status line and no body
+ * Returns SOAP_OK or an error code if fails
+ */
+int send_http_status(struct soap *soap, const char *status, const char *extra_header) {
+	char head[HTTP_HEAD_CHARS];
+
+	snprintf(head, HTTP_HEAD_CHARS, "HTTP/1.1 %s\r\n%sContent-Length: 0\r\nConnection: close\r\n\r\n",
+			status, (extra_header != NULL)? extra_header : "");
+	soap->keep_alive = 0;
+	if (send_socket(soap, head, strlen(head)) != 0) {
+		return soap_closesock(soap);
 	}
 
-	DEBUG_INFO_PRINTF("Creating slave handler");
-	// The threads are not controlled, there may potencially be an infinite number of them
-	// at the same time (resource problems... )
-	tsoap = soap_copy(&server.soap);	//make a safe copy
-	if (!tsoap) {
-		DEBUG_FAILURE_PRINTF("Could not copy the soap struct");
-		return -1;
+	return SOAP_OK;
+}
+
+
+/*
+ * Sends the attachment of the message, whole or the requested range
+ * Returns SOAP_OK or an error code if fails
+ */
+int _http_send_attachment(struct soap *soap, int chat_id, int msg_timestamp) {
+	char head[HTTP_HEAD_CHARS];
+	char content_range[HTTP_HEAD_CHARS/2];
+	char *file_path;
+	struct stat st;
+	off_t first, last;
+	int ranged;
+	int fd;
+	persistence *persistence;
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		return send_http_status(soap, "500 Internal Server Error", NULL);
+	}
+	if ( (file_path = attachment_path(persistence, soap, chat_id, msg_timestamp)) == NULL
+			|| (fd = open(file_path, O_RDONLY)) == -1 ) {
+		return send_http_status(soap, "404 Not Found", NULL);
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return send_http_status(soap, "500 Internal Server Error", NULL);
 	}
 
-	// Increment number of alive threads
-	// it will be decremented inside the thread
-	pthread_mutex_lock(&server.n_threads_mutex);
-	if (server.n_alive_threads >= MAX_ALIVE_THREADS) {
-		pthread_mutex_unlock(&server.n_threads_mutex);
-		return -1;
+	ranged = parse_range(request_range, st.st_size, &first, &last);
+	if (ranged == -1) {
+		close(fd);
+		snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n", (long long)st.st_size);
+		return send_http_status(soap, "416 Range Not Satisfiable", content_range);
 	}
-	server.n_alive_threads++;
-	pthread_mutex_unlock(&server.n_threads_mutex);
-	
-	// Launch the new thread
-	pthread_create(&tid, NULL, (void*(*)(void*))thread_serve_request, (void*)tsoap);
 
-	return 0;
+	content_range[0] = '\0';
+	if (ranged) {
+		snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+				(long long)first, (long long)last, (long long)st.st_size);
+	}
+	snprintf(head, HTTP_HEAD_CHARS, "HTTP/1.1 %s\r\nContent-Type: application/octet-stream\r\n"
+			"Accept-Ranges: bytes\r\n%sContent-Length: %lld\r\nConnection: close\r\n\r\n",
+			ranged? "206 Partial Content" : "200 OK", content_range, (long long)(last - first + 1));
+
+	// the response is not framed by gsoap, the connection ends with it
+	soap->keep_alive = 0;
+	if (send_socket(soap, head, strlen(head)) != 0 || send_file_range(soap, fd, first, last - first + 1) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not send the attachment");
+		close(fd);
+		return soap_closesock(soap);
+	}
+	close(fd);
+
+	return SOAP_OK;
 }
 
 
-int check_login(persistence *persistence, psdims__login_info *login) {
-	char pass[50];
-	int user_id;
-	
-	if ( (login == NULL) || (login->name == NULL) || (login->password == NULL) ) {
-		DEBUG_FAILURE_PRINTF("Login failed");
-		return -1;
+/*
+ * Serves the attachment of a signed url (attach_url.h) with sendfile,
+ * the whole file or a single byte range of it, in the transfer lane
+ * Returns SOAP_OK or an error code if fails
+ */
+int http_get_attachment(struct soap *soap) {
+	DEBUG_TRACE_PRINT();
+	int chat_id, msg_timestamp;
+	int ret_value;
+
+	if (attach_url_verify(soap->path, &chat_id, &msg_timestamp) != 0) {
+		return send_http_status(soap, "403 Forbidden", NULL);
 	}
-	user_id = get_user_id(persistence, login->name);
-	if( user_id == -1) {
-		DEBUG_FAILURE_PRINTF("Login failed: the user does not exist\n");
-		return -1;
+
+	if (lanes_enter(server.lanes, OP_CLASS_TRANSFER) != 0) {
+		metrics_add(METRIC_LANE_REJECTED, 1);
+		return send_http_status(soap, "503 Service Unavailable", "Retry-After: " ADMISSION_RETRY_AFTER "\r\n");
 	}
-	get_user_pass(persistence,login->name, pass, sizeof(char)*50);
- 	if(strcmp(login->password,pass)!=0) {
-		DEBUG_FAILURE_PRINTF("Login failed: the password is not correct\n");
-		return -1;
+	metrics_add(METRIC_TRANSFER_REQUESTS, 1);
+	ret_value = _http_send_attachment(soap, chat_id, msg_timestamp);
+	lanes_leave(server.lanes, OP_CLASS_TRANSFER);
+
+	return ret_value;
+}
+
+
+/*
+ * HTTP GET handler, serves the server metrics on /metrics and the
+ * attachments on their signed urls
+ * Returns SOAP_OK or an error code if fails
+ */
+int http_get(struct soap *soap) {
+	char buff[METRICS_MAX_CHARS];
+
+	if (strncmp(soap->path, ATTACH_URL_PREFIX, sizeof(ATTACH_URL_PREFIX) - 1) == 0) {
+		return http_get_attachment(soap);
 	}
-	
-	return user_id;
+	if (strncmp(soap->path, "/metrics", 8) != 0) {
+		return SOAP_GET_METHOD;
+	}
+	if (metrics_print(buff, METRICS_MAX_CHARS) == -1) {
+		return SOAP_GET_METHOD;
+	}
+
+	soap->http_content = "text/plain";
+	if (soap_response(soap, SOAP_FILE) || soap_send(soap, buff) || soap_end_send(soap)) {
+		return soap_closesock(soap);
+	}
+
+	return SOAP_OK;
 }
 
 
-/* =========================================================================
- *  Gsoap handlers
- * =========================================================================*/
+/*
+ * Answers the connection with a canned 503 and a Retry-After hint, and frees it.
+ * It is called by the acceptor under overload, so it never waits for the
+ * client: the request is not read, only what already arrived is discarded
+ * so the close does not reset the connection before the answer
+ */
+void reject_connection(struct soap *soap) {
+	DEBUG_TRACE_PRINT();
+	static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " ADMISSION_RETRY_AFTER "\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n";
+	char discarded[4096];
+	int i;
+
+	metrics_add(METRIC_ADMISSION_REJECTED, 1);
+
+	// a new connection has its send buffer empty, the response fits in it
+	if (send(soap->socket, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+		shutdown(soap->socket, SHUT_WR);
+		for (i = 0 ; i < 4 && recv(soap->socket, discarded, sizeof(discarded), MSG_DONTWAIT) > 0 ; i++);
+	}
+
+	soap->keep_alive = 0;
+	soap_pool_put(server.soap_pool, soap);
+}
+
+
+int _pending_expired(pending_connection *pending) {
+	struct timeval now;
+	long waited_msecs;
+
+	gettimeofday(&now, NULL);
+	waited_msecs = (now.tv_sec - pending->accepted.tv_sec)*1000 + (now.tv_usec - pending->accepted.tv_usec)/1000;
+
+	return (waited_msecs > ADMISSION_WAIT_MSECS);
+}
 
 /*
- *
- * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ * Must be called with n_threads_mutex locked
  */
-int psdims__user_register(struct soap *soap, psdims__register_info *user_info, int *ERRCODE){
+void _push_pending(struct soap *soap) {
+	pending_connection *pending;
+
+	pending = &server.pending[(server.first_pending + server.n_pending) % ADMISSION_QUEUE_LEN];
+	pending->soap = soap;
+	gettimeofday(&pending->accepted, NULL);
+	server.n_pending++;
+}
+
+/*
+ * Must be called with n_threads_mutex locked and n_pending > 0
+ */
+pending_connection _pop_pending() {
+	pending_connection pending;
+
+	pending = server.pending[server.first_pending];
+	server.first_pending = (server.first_pending + 1) % ADMISSION_QUEUE_LEN;
+	server.n_pending--;
+
+	return pending;
+}
+
+
+/*
+ * Decrements the number of alive threads.
+ * Must be called with n_threads_mutex locked
+ */
+void _thread_ended() {
+	server.n_alive_threads--;
+	if (server.n_alive_threads == 0 && server.n_bin_threads == 0) {
+		pthread_cond_signal(&server.zero_alive_threads);
+	}
+}
+
+/*
+ * Decrements the number of threads of binary connections.
+ * Must be called with n_threads_mutex locked
+ */
+void _bin_thread_ended() {
+	server.n_bin_threads--;
+	if (server.n_alive_threads == 0 && server.n_bin_threads == 0) {
+		pthread_cond_signal(&server.zero_alive_threads);
+	}
+}
+
+/*
+ * Takes the next queued connection, the ones that waited too long are rejected.
+ * If there are none, the calling thread stops being alive
+ * Returns the connection or NULL
+ */
+struct soap *next_pending_connection() {
+	pending_connection pending;
+
+	pthread_mutex_lock(&server.n_threads_mutex);
+	while (server.n_pending > 0) {
+		pending = _pop_pending();
+		if (!_pending_expired(&pending)) {
+			pthread_mutex_unlock(&server.n_threads_mutex);
+			return pending.soap;
+		}
+		pthread_mutex_unlock(&server.n_threads_mutex);
+		reject_connection(pending.soap);
+		pthread_mutex_lock(&server.n_threads_mutex);
+	}
+
+	_thread_ended();
+	pthread_mutex_unlock(&server.n_threads_mutex);
+
+	return NULL;
+}
+
+
+/*
+ * Writes the address of the client of the connection in addr (INET6_ADDRSTRLEN),
+ * empty if it is not known
+ */
+void peer_address(int fd, char *addr) {
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+
+	addr[0] = '\0';
+	if (getpeername(fd, (struct sockaddr*)&peer, &len) != 0) {
+		return;
+	}
+	if (peer.ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, addr, INET6_ADDRSTRLEN);
+	}
+	else if (peer.ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, addr, INET6_ADDRSTRLEN);
+	}
+}
+
+
+/*
+ * Answers the request with a 429 fault and a Retry-After hint
+ * Returns the error code
+ */
+int send_rate_fault(struct soap *soap) {
+	soap_sender_fault(soap, "Too many requests", "Retry after " RATE_RETRY_AFTER " seconds");
+	soap->error = 429;
+	soap->http_extra_header = "Retry-After: " RATE_RETRY_AFTER;
+	return soap_send_fault(soap);
+}
+
+
+/*
+ * Serves the requests of the connection like soap_serve, but every one of
+ * them in the lane of its operation class, known before it is dispatched.
+ * A transfer that finds its lane busy is answered with a 503 fault, and
+ * a request over the rate of its address or its user with a 429 fault
+ * Returns SOAP_OK or an error code if fails
+ */
+int serve_connection(struct soap *soap) {
+	op_class class;
+
+	peer_address(soap->socket, request_addr);
+
+	soap->keep_alive = soap->max_keep_alive + 1;
+	do {
+		if (soap->keep_alive > 0 && soap->max_keep_alive > 0) {
+			soap->keep_alive--;
+		}
+		// the headers are not paced, a GET paces its file on its own
+		request_class = OP_CLASS_INTERACTIVE;
+		if (soap_begin_serve(soap)) {
+			if (soap->error >= SOAP_STOP) {
+				continue;
+			}
+			return soap->error;
+		}
+
+		// the clients send an empty SOAPAction, then the operation is its element
+		if (soap->action != NULL && soap->action[0] != '\0') {
+			class = lanes_classify(soap->action);
+		}
+		else {
+			soap_peek_element(soap);
+			class = lanes_classify(soap->tag);
+		}
+		request_class = class;
+		request_limited = 0;
+		request_charged = 0;
+
+		// rejected before the body of the request is read
+		if (!rate_limit_take(server.addr_limit, request_addr, class)) {
+			metrics_add(METRIC_RATE_LIMITED_ADDR, 1);
+			soap->keep_alive = 0;
+			return send_rate_fault(soap);
+		}
+
+		if (lanes_enter(server.lanes, class) != 0) {
+			metrics_add(METRIC_LANE_REJECTED, 1);
+			// the body of the request is not read, the connection ends
+			soap->keep_alive = 0;
+			soap_receiver_fault(soap, "Server busy", "Retry after " ADMISSION_RETRY_AFTER " seconds");
+			soap->error = 503;
+			soap->http_extra_header = "Retry-After: " ADMISSION_RETRY_AFTER;
+			return soap_send_fault(soap);
+		}
+		if (class == OP_CLASS_TRANSFER) {
+			metrics_add(METRIC_TRANSFER_REQUESTS, 1);
+		}
+
+		if ((soap_serve_request(soap) || (soap->fserveloop && soap->fserveloop(soap))) && soap->error && soap->error < SOAP_STOP) {
+			lanes_leave(server.lanes, class);
+			if (request_limited) {
+				return send_rate_fault(soap);
+			}
+			return soap_send_fault(soap);
+		}
+		lanes_leave(server.lanes, class);
+	} while (soap->keep_alive);
+
+	return SOAP_OK;
+}
+
+
+void *thread_serve_request(void *soap) {
+	DEBUG_TRACE_PRINT();
+
+	pthread_detach(pthread_self());
+
+	// after its connection, the thread serves the queued ones
+	while (soap != NULL) {
+		DEBUG_INFO_PRINTF("Serving slave connection");
+		serve_connection((struct soap*)soap);
+		end_request((struct soap*)soap);
+
+		// end the connection, the context is kept for another one
+		soap_pool_put(server.soap_pool, (struct soap*)soap);
+		DEBUG_INFO_PRINTF("Closing slave connection");
+
+		soap = next_pending_connection();
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Serves the connection in a new thread if there are less than MAX_ALIVE_THREADS,
+ * queues it if they are all busy, or rejects it if the queue is full too
+ */
+void admit_connection(struct soap *soap) {
+	DEBUG_TRACE_PRINT();
+	pthread_t tid;
+	pending_connection expired;
+
+	expired.soap = NULL;
+
+	pthread_mutex_lock(&server.n_threads_mutex);
+	if (server.n_alive_threads < MAX_ALIVE_THREADS) {
+		// it will be decremented by the thread
+		server.n_alive_threads++;
+		pthread_mutex_unlock(&server.n_threads_mutex);
+
+		if (pthread_create(&tid, NULL, thread_serve_request, soap) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not create the slave thread");
+			reject_connection(soap);
+			pthread_mutex_lock(&server.n_threads_mutex);
+			_thread_ended();
+			pthread_mutex_unlock(&server.n_threads_mutex);
+		}
+		return;
+	}
+
+	// the oldest connection gives its place if it waited too long
+	if (server.n_pending == ADMISSION_QUEUE_LEN && _pending_expired(&server.pending[server.first_pending])) {
+		expired = _pop_pending();
+	}
+	if (server.n_pending < ADMISSION_QUEUE_LEN) {
+		_push_pending(soap);
+		soap = NULL;
+	}
+	pthread_mutex_unlock(&server.n_threads_mutex);
+
+	if (expired.soap != NULL) {
+		reject_connection(expired.soap);
+	}
+	if (soap != NULL) {
+		reject_connection(soap);
+	}
+	else {
+		metrics_add(METRIC_ADMISSION_QUEUED, 1);
+	}
+}
+
+
+
+void *acceptor_thread(void *arg);
+
+int init_bin_listener(int port);
+
+/*
+ *
+ * Returns 0 or -1 if fails
+ */
+int init_server(server_options *options) {
+	DEBUG_TRACE_PRINT();
+
+	SOAP_SOCKET m;
+	int i;
+	server.n_alive_threads = 0;
+	server.n_bin_threads = 0;
+	server.first_pending = 0;
+	server.n_pending = 0;
+	server.n_acceptors = 0;
+	server.bin_socket = -1;
+	server.stopping = 0;
+	pthread_mutex_init(&server.persistence_mutex, NULL);
+	pthread_mutex_init(&server.n_threads_mutex, NULL);
+	pthread_mutex_init(&server.events_mutex, NULL);
+	server.last_events_prune = 0;
+	pthread_cond_init(&server.zero_alive_threads, NULL);
+
+	server.persistence = init_persistence(options->persistence_user, options->persistence_pass);
+	if (server.persistence == NULL ) {
+		DEBUG_FAILURE_PRINTF("Could not init persistence");
+		return -1;
+	}
+	persistence_set_budget(server.persistence, options->request_mem_budget);
+
+	// shared by every clone of the persistence
+	server.friend_cache = friend_cache_new();
+	if (server.friend_cache == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the friend cache");
+		return -1;
+	}
+	server.persistence->friend_cache = server.friend_cache;
+
+	server.chat_cache = chat_cache_new();
+	if (server.chat_cache == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the chat cache");
+		return -1;
+	}
+	server.persistence->chat_cache = server.chat_cache;
+
+	// the requests share a few non-blocking connections instead of opening their own
+	server.db_async = NULL;
+	if (options->db_async_conns > 0) {
+		server.db_async = db_async_new(options->persistence_user, options->persistence_pass,
+				(options->db_async_conns < DB_ASYNC_THREADS)? options->db_async_conns : DB_ASYNC_THREADS, options->db_async_conns);
+		if (server.db_async == NULL) {
+			DEBUG_FAILURE_PRINTF("Could not init the async queries, every request will use its own connection");
+		}
+	}
+
+	// the message inserts are grouped by a committer thread (or journaled and
+	// applied later), it needs a thread safe client library.
+	// If not, every handler inserts on its own
+	server.msg_clock = NULL;
+	server.msg_batch = NULL;
+	server.msg_journal = NULL;
+	if ( persistence_thread_safe(server.persistence) ) {
+		server.msg_clock = msg_clock_new();
+		if (server.msg_clock == NULL) {
+			DEBUG_FAILURE_PRINTF("Could not init the message clock");
+			return -1;
+		}
+	}
+
+	if (options->journal_path != NULL) {
+		if (server.msg_clock == NULL) {
+			DEBUG_FAILURE_PRINTF("The message journal needs a thread safe persistence");
+			return -1;
+		}
+		server.msg_journal = msg_journal_new(server.persistence, server.msg_clock, options->journal_path);
+		if (server.msg_journal == NULL) {
+			DEBUG_FAILURE_PRINTF("Could not init the message journal");
+			return -1;
+		}
+	}
+	else if (server.msg_clock != NULL) {
+		server.msg_batch = msg_batch_new(server.persistence, server.msg_clock);
+		if (server.msg_batch == NULL) {
+			DEBUG_FAILURE_PRINTF("Could not init the message batch, messages will not be grouped");
+		}
+	}
+	
+	server.single_flight = single_flight_new();
+	if (server.single_flight == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the single flight");
+		return -1;
+	}
+
+	server.soap_pool = soap_pool_new(SOAP_POOL_MAX_FREE);
+	if (server.soap_pool == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the soap pool");
+		return -1;
+	}
+
+	if (attach_url_init() != 0) {
+		return -1;
+	}
+
+	// the attachments can not take the threads of the interactive requests
+	server.lanes = lanes_new(options->transfer_slots, options->transfer_bytes_per_sec);
+	if (server.lanes == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the execution lanes");
+		return -1;
+	}
+
+	server.user_limit = rate_limit_new(options->user_rates);
+	server.addr_limit = rate_limit_new(options->addr_rates);
+	if (server.user_limit == NULL || server.addr_limit == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the rate limits");
+		return -1;
+	}
+
+	// the handlers wait for the disk without taking it from other requests
+	server.file_io = file_io_new(FILE_IO_THREADS);
+	if (server.file_io == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not init the file I/O executor");
+		return -1;
+	}
+
+	DEBUG_INFO_PRINTF("Init soap");
+	soap_init(&server.soap);
+	
+	server.soap.send_timeout = 60; 			// 60 secs
+	server.soap.recv_timeout = 60;			// 60 secs
+	server.soap.accept_timeout = 3600;	// after 3600 secs of inactivity the server stops
+	server.soap.max_keep_alive = 100;		// max keep_alive sequence
+	server.n_alive_threads = 0;
+	server.soap.user = NULL;
+	server.soap.fserveloop = end_request;	// copied by soap_copy to the slave connections
+	server.soap.fget = http_get;
+	server.fparsehdr = server.soap.fparsehdr;
+	server.soap.fparsehdr = parse_http_header;
+	server.frecv = server.soap.frecv;
+	server.soap.frecv = recv_paced;
+	server.fsend = server.soap.fsend;
+	server.soap.fsend = send_paced;
+
+	// every acceptor binds its own socket to the port, and the kernel
+	// spreads the new connections among them
+	server.n_acceptors = 1;
+	if (options->n_acceptors > 1) {
+#ifdef SO_REUSEPORT
+		if ( !persistence_thread_safe(server.persistence) ) {
+			DEBUG_FAILURE_PRINTF("Several acceptors need a thread safe persistence, using only one");
+		}
+		else {
+			server.n_acceptors = (options->n_acceptors < METRICS_MAX_ACCEPTORS)? options->n_acceptors : METRICS_MAX_ACCEPTORS;
+			server.soap.bind_flags = SO_REUSEPORT;
+		}
+#else
+		DEBUG_FAILURE_PRINTF("SO_REUSEPORT is not supported, using only one acceptor");
+#endif
+	}
+
+	server.acceptors[0] = &server.soap;
+	for (i = 1 ; i < server.n_acceptors ; i++) {
+		server.acceptors[i] = soap_copy(&server.soap);
+		if (server.acceptors[i] == NULL) {
+			DEBUG_FAILURE_PRINTF("Could not copy the soap struct of the acceptor %d", i);
+			server.n_acceptors = i;
+			break;
+		}
+		server.acceptors[i]->accept_timeout = ACCEPTOR_POLL_SECS;
+	}
+	metrics_set_acceptors(server.n_acceptors);
+
+	for (i = 0 ; i < server.n_acceptors ; i++) {
+		m = soap_bind(server.acceptors[i], NULL, options->bind_port, 100);
+
+		if (!soap_valid_socket(m)) {
+			soap_print_fault(server.acceptors[i], stderr);
+			return -1;
+		}
+	}
+
+	for (i = 1 ; i < server.n_acceptors ; i++) {
+		if (pthread_create(&server.acceptor_threads[i], NULL, acceptor_thread, (void*)(long)i) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not create the acceptor thread %d", i);
+			return -1;
+		}
+	}
+	DEBUG_INFO_PRINTF("Listening with %d acceptors", server.n_acceptors);
+
+	// the binary transport runs the same handlers, each connection in its own thread
+	if (options->bin_port > 0) {
+		if ( !persistence_thread_safe(server.persistence) ) {
+			DEBUG_FAILURE_PRINTF("The binary transport needs a thread safe persistence, it is disabled");
+		}
+		else if (init_bin_listener(options->bin_port) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ *
+ *
+ */
+void free_server() {
+	DEBUG_TRACE_PRINT();
+	int i;
+
+	// the acceptor threads stop before their next accept
+	server.stopping = 1;
+	for (i = 1 ; i < server.n_acceptors ; i++) {
+		pthread_join(server.acceptor_threads[i], NULL);
+		end_soap_connection(server.acceptors[i]);
+		free(server.acceptors[i]);
+	}
+	if (server.bin_socket != -1) {
+		pthread_join(server.bin_thread, NULL);
+		close(server.bin_socket);
+	}
+
+	// finish the "list" soap connection
+	end_soap_connection(&server.soap);
+	// wait until (n_alive_threads == 0) and (n_bin_threads == 0)
+	
+	pthread_mutex_lock(&server.n_threads_mutex);
+	while (server.n_alive_threads > 0 || server.n_bin_threads > 0) {
+		pthread_cond_wait(&server.zero_alive_threads, &server.n_threads_mutex);
+	}
+	pthread_mutex_unlock(&server.n_threads_mutex);
+
+	if (server.msg_batch != NULL) {
+		msg_batch_free(server.msg_batch);
+	}
+	if (server.msg_journal != NULL) {
+		msg_journal_free(server.msg_journal);
+	}
+	if (server.msg_clock != NULL) {
+		msg_clock_free(server.msg_clock);
+	}
+	if (server.db_async != NULL) {
+		db_async_free(server.db_async);
+	}
+	soap_pool_free(server.soap_pool);
+	single_flight_free(server.single_flight);
+	file_io_free(server.file_io);
+	lanes_free(server.lanes);
+	rate_limit_free(server.user_limit);
+	rate_limit_free(server.addr_limit);
+	free_persistence(server.persistence);
+	friend_cache_free(server.friend_cache);
+	chat_cache_free(server.chat_cache);
+}
+
+
+/*
+ *
+ * Returns 0 or -1 if fails
+ */
+int listen_connection () {
+	DEBUG_TRACE_PRINT();
+	int ret_value;
+
+	if ( persistence_thread_safe(server.persistence) )
+		ret_value = mthread_listen_connection(0);
+	else
+		ret_value = sthread_listen_connection();
+		
+	return ret_value;
+}
+
+
+/*
+ *
+ * Returns 0 or -1 if fails
+ */
+int sthread_listen_connection () {
+	DEBUG_TRACE_PRINT();
+
+	SOAP_SOCKET s;
+
+	s = soap_accept(&server.soap);
+	if (!soap_valid_socket(s)) {
+		if(server.soap.errnum) {
+			soap_print_fault(&server.soap, stderr); 
+			return -1;
+		}
+		DEBUG_INFO_PRINTF("Server timed out");
+		return -1;
+	}
+	metrics_accepted(0);
+	
+	if (persistence_err(server.persistence)) {
+		DEBUG_FAILURE_PRINTF("Persistence is disconnected, atempting to reconnect...");
+		reconnect_persistence(server.persistence);
+		if (persistence_err(server.persistence)) {
+			DEBUG_FAILURE_PRINTF("Could not reconnect.");
+			return -1;
+		}
+	}
+	
+	// Execute invoked operation
+	if (serve_connection(&(server.soap)) != SOAP_OK) {
+		soap_print_fault(&(server.soap), stderr);
+	}
+	end_request(&(server.soap));
+
+	// Clean up!
+	soap_destroy(&(server.soap));
+	soap_end(&(server.soap));
+	return 0;
+}
+
+
+/*
+ * Accepts a connection on the socket of the acceptor
+ * Returns 0 or -1 if fails (or times out)
+ */
+int mthread_listen_connection (int acceptor) {
+	DEBUG_TRACE_PRINT();
+
+	SOAP_SOCKET s;
+	struct soap *master;
+	struct soap *tsoap;
+	int persistence_ok;
+
+	master = server.acceptors[acceptor];
+	DEBUG_INFO_PRINTF("Master connection ready");
+
+	s = soap_accept(master);
+	if (!soap_valid_socket(s)) {
+		if(master->errnum) {
+			soap_print_fault(master, stderr); 
+			// the server keeps listening if it is only out of descriptors for a while
+			if (master->errnum == EMFILE || master->errnum == ENFILE) {
+				usleep(ACCEPT_BACKOFF_USECS);
+				return 0;
+			}
+			if (master->errnum == ECONNABORTED || master->errnum == EINTR) {
+				return 0;
+			}
+			return -1;
+		}
+		DEBUG_INFO_PRINTF("Server timed out");
+		return -1;
+	}
+	metrics_accepted(acceptor);
+
+	DEBUG_INFO_PRINTF("Creating slave handler");
+	tsoap = soap_pool_get(server.soap_pool, master);
+	if (!tsoap) {
+		DEBUG_FAILURE_PRINTF("Could not copy the soap struct");
+		soap_closesock(master);
+		return 0;
+	}
+
+	pthread_mutex_lock(&server.persistence_mutex);
+	if (persistence_err(server.persistence)) {
+		DEBUG_FAILURE_PRINTF("Persistence is disconnected, atempting to reconnect...");
+		reconnect_persistence(server.persistence);
+	}
+	persistence_ok = !persistence_err(server.persistence);
+	pthread_mutex_unlock(&server.persistence_mutex);
+
+	if (!persistence_ok) {
+		DEBUG_FAILURE_PRINTF("Could not reconnect.");
+		reject_connection(tsoap);
+		return 0;
+	}
+
+	admit_connection(tsoap);
+
+	return 0;
+}
+
+
+/*
+ * Accept loop of every acceptor but the first one, that is run by the main thread.
+ * It ends when the server stops or the accept fails
+ */
+void *acceptor_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	int acceptor = (int)(long)arg;
+
+	while (!server.stopping) {
+		// the short accept timeout only lets the thread check if the server is stopping
+		if (mthread_listen_connection(acceptor) != 0 && server.acceptors[acceptor]->errnum != 0) {
+			DEBUG_FAILURE_PRINTF("Acceptor %d stopped", acceptor);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Decodes the binary request in buff, runs its handler on soap and
+ * encodes the response in the same buffer
+ * Returns 0 or -1 if the request is not valid
+ */
+int serve_bin_request(struct soap *soap, bin_buffer *buff) {
+	DEBUG_TRACE_PRINT();
+	bin_reader reader;
+	psdims__login_info login;
+	psdims__sync sync;
+	psdims__message_list messages;
+	psdims__notifications notifications;
+	int op, chat_id, timestamp;
+	int ret;
+
+	bin_reader_init(&reader, bin_buffer_payload(buff), bin_buffer_payload_size(buff));
+	op = (int)bin_get_uint(&reader);
+	if (bin_get_login(&reader, soap, &login) != 0) {
+		DEBUG_FAILURE_PRINTF("Invalid binary request");
+		return -1;
+	}
+
+	switch (op) {
+		case BIN_OP_GET_CHAT_MESSAGES:
+			chat_id = (int)bin_get_int(&reader);
+			timestamp = (int)bin_get_int(&reader);
+			if (reader.error) {
+				DEBUG_FAILURE_PRINTF("Invalid binary request");
+				return -1;
+			}
+			ret = psdims__get_chat_messages(soap, &login, chat_id, timestamp, &messages);
+			break;
+		case BIN_OP_GET_PENDING_NOTIFICATIONS:
+			timestamp = (int)bin_get_int(&reader);
+			if (bin_get_sync(&reader, soap, &sync) != 0) {
+				DEBUG_FAILURE_PRINTF("Invalid binary request");
+				return -1;
+			}
+			ret = psdims__get_pending_notifications(soap, &login, timestamp, &sync, &notifications);
+			break;
+		default:
+			DEBUG_FAILURE_PRINTF("Unknown binary operation %d", op);
+			return -1;
+	}
+	metrics_add(METRIC_BIN_REQUESTS, 1);
+
+	// the arguments were copied to soap, the buffer keeps the response now
+	bin_buffer_clear(buff);
+	if (ret != SOAP_OK) {
+		return bin_put_uint(buff, BIN_STATUS_ERROR);
+	}
+	if (bin_put_uint(buff, BIN_STATUS_OK) != 0) {
+		return -1;
+	}
+	if (op == BIN_OP_GET_CHAT_MESSAGES) {
+		return bin_put_message_list(buff, &messages);
+	}
+	return bin_put_notifications(buff, &notifications);
+}
+
+
+/*
+ * Serves the requests of a binary connection until it is closed or idle
+ * for BIN_RECV_TIMEOUT_SECS. The soap struct only holds the memory of the handlers
+ */
+void *thread_serve_bin(void *arg) {
+	DEBUG_TRACE_PRINT();
+	int fd = (int)(long)arg;
+	struct soap *soap;
+	bin_buffer buff;
+	int ret;
+
+	pthread_detach(pthread_self());
+
+	soap = soap_new();
+	if (soap == NULL || bin_buffer_init(&buff, BIN_MAX_FRAME_BYTES) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not init the binary connection");
+		if (soap != NULL) {
+			soap_free(soap);
+		}
+		close(fd);
+		pthread_mutex_lock(&server.n_threads_mutex);
+		_bin_thread_ended();
+		pthread_mutex_unlock(&server.n_threads_mutex);
+		return NULL;
+	}
+	soap->user = NULL;
+	peer_address(fd, request_addr);
+	request_class = OP_CLASS_INTERACTIVE;
+
+	// the length of the frame comes from the client, a large one is never reserved
+	while (!server.stopping && bin_read_frame(fd, &buff, BIN_MAX_REQUEST_BYTES) == 0) {
+		// as in soap, a client over the rate of its address gets an error and the connection ends
+		if (!rate_limit_take(server.addr_limit, request_addr, request_class)) {
+			metrics_add(METRIC_RATE_LIMITED_ADDR, 1);
+			bin_buffer_clear(&buff);
+			if (bin_put_uint(&buff, BIN_STATUS_ERROR) == 0) {
+				bin_write_frame(fd, &buff);
+			}
+			break;
+		}
+		request_limited = 0;
+		request_charged = 0;
+		ret = serve_bin_request(soap, &buff);
+		end_request(soap);
+		soap_destroy(soap);
+		soap_end(soap);
+
+		if (ret != 0 || bin_write_frame(fd, &buff) != 0) {
+			break;
+		}
+	}
+	DEBUG_INFO_PRINTF("Closing binary connection");
+
+	bin_buffer_free(&buff);
+	soap_free(soap);
+	close(fd);
+
+	pthread_mutex_lock(&server.n_threads_mutex);
+	_bin_thread_ended();
+	pthread_mutex_unlock(&server.n_threads_mutex);
+
+	return NULL;
+}
+
+
+/*
+ * Accept loop of the binary transport. Its connections have their own
+ * threads limit, an idle binary client never takes a thread of the soap
+ * requests. They are not queued: the client gets the connection closed
+ * if all the binary threads are busy
+ */
+void *bin_listener_thread(void *arg) {
+	DEBUG_TRACE_PRINT();
+	struct pollfd pfd;
+	struct timeval timeout;
+	pthread_t tid;
+	boolean admitted;
+	int fd, ret;
+	int one = 1;
+
+	pfd.fd = server.bin_socket;
+	pfd.events = POLLIN;
+	timeout.tv_sec = BIN_RECV_TIMEOUT_SECS;
+	timeout.tv_usec = 0;
+
+	while (!server.stopping) {
+		// the poll timeout only lets the thread check if the server is stopping
+		ret = poll(&pfd, 1, ACCEPTOR_POLL_SECS*1000);
+		if (ret < 0 && errno != EINTR) {
+			DEBUG_FAILURE_PRINTF("Binary listener stopped: %s", strerror(errno));
+			break;
+		}
+		if (ret <= 0) {
+			continue;
+		}
+
+		fd = accept(server.bin_socket, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				usleep(ACCEPT_BACKOFF_USECS);
+			}
+			continue;
+		}
+		// the frames are small and answered at once
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		pthread_mutex_lock(&server.n_threads_mutex);
+		admitted = (server.n_bin_threads < MAX_BIN_THREADS);
+		if (admitted) {
+			// it will be decremented by the thread
+			server.n_bin_threads++;
+		}
+		pthread_mutex_unlock(&server.n_threads_mutex);
+
+		if (admitted && pthread_create(&tid, NULL, thread_serve_bin, (void*)(long)fd) != 0) {
+			DEBUG_FAILURE_PRINTF("Could not create the binary connection thread");
+			pthread_mutex_lock(&server.n_threads_mutex);
+			_bin_thread_ended();
+			pthread_mutex_unlock(&server.n_threads_mutex);
+			admitted = FALSE;
+		}
+		if (!admitted) {
+			metrics_add(METRIC_ADMISSION_REJECTED, 1);
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Binds the listening socket of the binary transport and starts its thread
+ * Returns 0 or -1 if fails
+ */
+int init_bin_listener(int port) {
+	DEBUG_TRACE_PRINT();
+	struct sockaddr_in addr;
+	int one = 1;
+
+	server.bin_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (server.bin_socket < 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the binary socket: %s", strerror(errno));
+		server.bin_socket = -1;
+		return -1;
+	}
+	setsockopt(server.bin_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(server.bin_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server.bin_socket, 100) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not listen on the binary port %d: %s", port, strerror(errno));
+		close(server.bin_socket);
+		server.bin_socket = -1;
+		return -1;
+	}
+
+	if (pthread_create(&server.bin_thread, NULL, bin_listener_thread, NULL) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not create the binary listener thread");
+		close(server.bin_socket);
+		server.bin_socket = -1;
+		return -1;
+	}
+	DEBUG_INFO_PRINTF("Binary transport listening on port %d", port);
+
+	return 0;
+}
+
+
+/*
+ * Authenticates the user of the request, the persistence of the request is
+ * created after its rate is checked, so a user over it costs no database work
+ * Returns the id of the user or -1 if fails
+ */
+int check_login(struct soap *soap, psdims__login_info *login) {
+	persistence *persistence;
+	char pass[50];
+	int user_id;
+	
+	if ( (login == NULL) || (login->name == NULL) || (login->password == NULL) ) {
+		DEBUG_FAILURE_PRINTF("Login failed");
+		return -1;
+	}
+	// the name is not authenticated yet, the token is only checked
+	if ( !request_charged && !rate_limit_peek(server.user_limit, login->name, request_class) ) {
+		DEBUG_FAILURE_PRINTF("Login failed: too many requests\n");
+		metrics_add(METRIC_RATE_LIMITED_USER, 1);
+		request_limited = 1;
+		return -1;
+	}
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return -1;
+	}
+	user_id = get_user_id(persistence, login->name);
+	if( user_id == -1) {
+		DEBUG_FAILURE_PRINTF("Login failed: the user does not exist\n");
+		// a failed login costs a request more to its address, not to the user named
+		rate_limit_take(server.addr_limit, request_addr, request_class);
+		return -1;
+	}
+	get_user_pass(persistence,login->name, pass, sizeof(char)*50);
+ 	if(strcmp(login->password,pass)!=0) {
+		DEBUG_FAILURE_PRINTF("Login failed: the password is not correct\n");
+		rate_limit_take(server.addr_limit, request_addr, request_class);
+		return -1;
+	}
+	// only an authenticated request takes a token of its user, others cannot spend them.
+	// It is taken once per request, the operations of a batch do not take more
+	if ( !request_charged ) {
+		request_charged = 1;
+		if ( !rate_limit_take(server.user_limit, login->name, request_class) ) {
+			metrics_add(METRIC_RATE_LIMITED_USER, 1);
+			request_limited = 1;
+		}
+	}
+	if ( request_limited ) {
+		DEBUG_FAILURE_PRINTF("Login failed: too many requests\n");
+		return -1;
+	}
+	
+	return user_id;
+}
+
+
+/*
+ * Adds to chats the ones with journaled messages that are
+ * not there yet, if the user is in them
+ * Returns 0 or -1 if fails
+ */
+int merge_pending_chats(struct soap *soap, persistence *persistence, int user_id, psdims__notif_chat_list *chats, psdims__notif_chat_list *pending) {
+	psdims__notif_chat_info *merged;
+	int n_merged;
+	int i, k;
+
+	if (pending->__sizenelems == 0) {
+		return 0;
+	}
+
+	merged = persistence_malloc(persistence, soap, sizeof(psdims__notif_chat_info)*(chats->__sizenelems + pending->__sizenelems));
+	if (merged == NULL) {
+		return -1;
+	}
+	memcpy(merged, chats->chat, sizeof(psdims__notif_chat_info)*chats->__sizenelems);
+	n_merged = chats->__sizenelems;
+
+	for (i = 0 ; i < pending->__sizenelems ; i++) {
+		for (k = 0 ; k < chats->__sizenelems ; k++) {
+			if (chats->chat[k].chat_id == pending->chat[i].chat_id) {
+				break;
+			}
+		}
+		if (k == chats->__sizenelems && exist_user_in_chat(persistence, user_id, pending->chat[i].chat_id) == 1) {
+			merged[n_merged++] = pending->chat[i];
+		}
+	}
+
+	chats->chat = merged;
+	chats->__sizenelems = n_merged;
+
+	return 0;
+}
+
+
+/* =========================================================================
+ *  Coalesced reads
+ * =========================================================================*/
+
+/*
+ * The copies are accounted in the memory of the follower request
+ */
+void *_copy_malloc(struct soap *soap, size_t size) {
+	return persistence_malloc(request_persistence(soap), soap, size);
+}
+
+char *_copy_string(struct soap *soap, const char *string) {
+	char *copy;
+	size_t size;
+
+	if (string == NULL) {
+		return NULL;
+	}
+	size = strlen(string) + 1;
+	copy = _copy_malloc(soap, size);
+	if (copy != NULL) {
+		memcpy(copy, string, size);
+	}
+	return copy;
+}
+
+
+/*
+ * Copies of the results of a coalesced read, allocated in the follower soap.
+ * Return 0 or -1 if fails
+ */
+int copy_message_list(struct soap *soap, const void *src, void *dest) {
+	const psdims__message_list *from = src;
+	psdims__message_list *to = dest;
+	int i;
+
+	*to = *from;
+	if (from->__sizenelems <= 0) {
+		return 0;
+	}
+
+	to->messages = _copy_malloc(soap, from->__sizenelems * sizeof(psdims__message_info));
+	if (to->messages == NULL) {
+		return -1;
+	}
+	for (i = 0 ; i < from->__sizenelems ; i++) {
+		to->messages[i].user = _copy_string(soap, from->messages[i].user);
+		to->messages[i].text = _copy_string(soap, from->messages[i].text);
+		to->messages[i].file_name = _copy_string(soap, from->messages[i].file_name);
+		to->messages[i].send_date = from->messages[i].send_date;
+	}
+
+	return 0;
+}
+
+int _copy_friend_requests(struct soap *soap, const psdims__notif_friend_list *from, psdims__notif_friend_list *to) {
+	int i;
+
+	*to = *from;
+	if (from->__sizenelems <= 0) {
+		return 0;
+	}
+
+	to->user = _copy_malloc(soap, from->__sizenelems * sizeof(psdims__notif_friend_info));
+	if (to->user == NULL) {
+		return -1;
+	}
+	memcpy(to->user, from->user, from->__sizenelems * sizeof(psdims__notif_friend_info));
+	for (i = 0 ; i < from->__sizenelems ; i++) {
+		to->user[i].name.string = _copy_string(soap, from->user[i].name.string);
+	}
+
+	return 0;
+}
+
+int _copy_user_list(struct soap *soap, const psdims__user_list *from, psdims__user_list *to) {
+	int i;
+
+	*to = *from;
+	if (from->__sizenelems <= 0) {
+		return 0;
+	}
+
+	to->user = _copy_malloc(soap, from->__sizenelems * sizeof(psdims__user_info));
+	if (to->user == NULL) {
+		return -1;
+	}
+	for (i = 0 ; i < from->__sizenelems ; i++) {
+		to->user[i].name = _copy_string(soap, from->user[i].name);
+		to->user[i].information = _copy_string(soap, from->user[i].information);
+	}
+
+	return 0;
+}
+
+int _copy_chat_list(struct soap *soap, const psdims__notif_chat_list *from, psdims__notif_chat_list *to) {
+	*to = *from;
+	if (from->__sizenelems <= 0) {
+		return 0;
+	}
+
+	to->chat = _copy_malloc(soap, from->__sizenelems * sizeof(psdims__notif_chat_info));
+	if (to->chat == NULL) {
+		return -1;
+	}
+	memcpy(to->chat, from->chat, from->__sizenelems * sizeof(psdims__notif_chat_info));
+
+	return 0;
+}
+
+int _copy_member_list(struct soap *soap, const psdims__notif_chat_member_list *from, psdims__notif_chat_member_list *to) {
+	int i;
+
+	*to = *from;
+	if (from->__sizenelems <= 0) {
+		return 0;
+	}
+
+	to->member = _copy_malloc(soap, from->__sizenelems * sizeof(psdims__notif_member_info));
+	if (to->member == NULL) {
+		return -1;
+	}
+	memcpy(to->member, from->member, from->__sizenelems * sizeof(psdims__notif_member_info));
+	for (i = 0 ; i < from->__sizenelems ; i++) {
+		to->member[i].name.string = _copy_string(soap, from->member[i].name.string);
+	}
+
+	return 0;
+}
+
+int copy_notifications(struct soap *soap, const void *src, void *dest) {
+	const psdims__notifications *from = src;
+	psdims__notifications *to = dest;
+
+	to->last_timestamp = from->last_timestamp;
+	if (_copy_friend_requests(soap, &from->friend_request, &to->friend_request) != 0
+			|| _copy_user_list(soap, &from->new_friends, &to->new_friends) != 0
+			|| _copy_chat_list(soap, &from->chats_with_messages, &to->chats_with_messages) != 0
+			|| _copy_chat_list(soap, &from->chats_read_times, &to->chats_read_times) != 0
+			|| _copy_member_list(soap, &from->chat_members, &to->chat_members) != 0
+			|| _copy_member_list(soap, &from->rem_chat_members, &to->rem_chat_members) != 0
+			|| _copy_member_list(soap, &from->chat_admins, &to->chat_admins) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Reads the messages of the chat sent after timestamp
+ * Returns 0 or -1 if fails
+ */
+int read_chat_messages(struct soap *soap, persistence *persistence, int id_user, int chat_id, int timestamp, psdims__message_list *messages) {
+	psdims__message_list pending;
+	int join_time;
+
+	// the journaled messages are read before the database, if one is
+	// applied meanwhile it is in both and merged only once. As in the
+	// database, the messages sent before the user joined are not shown
+	if (server.msg_journal != NULL) {
+		join_time = get_user_chat_join_time(persistence, id_user, chat_id);
+		if (join_time < 0)
+			return -1;
+		if (join_time == 0) {
+			pending.__sizenelems = 0;
+			pending.messages = NULL;
+		}
+		else if (msg_journal_get_messages(server.msg_journal, soap, chat_id, timestamp, join_time, &pending) != 0)
+			return -1;
+	}
+
+	if(get_list_messages(persistence, chat_id, id_user, timestamp, soap, messages) != 0)
+		return -1;
+
+	if (server.msg_journal != NULL) {
+		if (msg_journal_merge_messages(soap, messages, &pending) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Reads the notifications of the user after timestamp
+ * Returns 0 or -1 if fails
+ */
+int read_notifications(struct soap *soap, persistence *persistence, int id_user, int timestamp, psdims__notifications *notifications) {
+	psdims__notif_chat_list pending_chats;
+
+	// There may be problems with this concerns...
+	notifications->last_timestamp = time(NULL);
+
+	if (server.msg_journal != NULL) {
+		if (msg_journal_get_chats(server.msg_journal, soap, timestamp, &pending_chats) != 0)
+			return -1;
+	}
+	if(get_notif_chats_with_messages(persistence, id_user, timestamp, soap, &(notifications->chats_with_messages)) < 0){
+		return -1;
+	}
+	if (server.msg_journal != NULL) {
+		if (merge_pending_chats(soap, persistence, id_user, &(notifications->chats_with_messages), &pending_chats) != 0)
+			return -1;
+	}
+	if(get_notif_chats_read_times(persistence, id_user, soap, &(notifications->chats_read_times)) < 0){
+		return -1;
+	}	
+	if(get_notif_friend_requests(persistence, id_user, timestamp, soap, &(notifications->friend_request)) < 0){
+		return -1;
+	}
+	if(get_notif_chat_members(persistence, id_user, timestamp, soap, &(notifications->chat_members)) < 0){
+		return -1;
+	}
+	if(get_notif_chat_rem_members(persistence, id_user, timestamp, soap, &(notifications->rem_chat_members)) < 0){
+		return -1;
+	}
+	if(get_notif_chat_admins(persistence, id_user, timestamp, soap, &(notifications->chat_admins)) < 0) {
+		return -1;
+	}
+	if(get_list_friends(persistence, id_user, timestamp, soap, &(notifications->new_friends)) < 0){
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Gives the time a member joins or leaves the chat. With the message clock
+ * it is after every message already sent and before the next ones, the
+ * clock can be ahead of time(NULL) when the chat is busy
+ * Returns the timestamp or -1 if fails
+ */
+int member_time(persistence *persistence, int chat_id) {
+	if (server.msg_clock == NULL) {
+		return time(NULL);
+	}
+
+	return msg_clock_next(server.msg_clock, persistence, chat_id);
+}
+
+
+/*
+ * Reads the messages of the chat for the authenticated user, shared by
+ * get_chat_messages and the batches
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int serve_chat_messages(struct soap *soap, persistence *persistence, int id_user, int chat_id, int timestamp, psdims__message_list *messages) {
+	int leader;
+	int ret;
+	flight_key key;
+	flight *flight;
+
+	if (messages == NULL) {
+		return SOAP_USER_ERROR;
+	}
+
+	if(chat_exist(persistence, chat_id) != 1)
+		return SOAP_USER_ERROR;
+
+	if(exist_user_in_chat(persistence, id_user, chat_id) != 1)
+		return SOAP_USER_ERROR;
+
+	// the same read by other clients of the user is done only once. Not with a
+	// leased connection, its leader could be waiting for it to be free
+	key.op = FLIGHT_CHAT_MESSAGES;
+	key.user_id = id_user;
+	key.arg1 = chat_id;
+	key.arg2 = timestamp;
+	key.args_hash = 0;
+	flight = persistence_leased(persistence)? NULL : single_flight_join(server.single_flight, &key, &leader);
+	if (flight == NULL) {
+		ret = read_chat_messages(soap, persistence, id_user, chat_id, timestamp, messages);
+	}
+	else if (leader) {
+		ret = read_chat_messages(soap, persistence, id_user, chat_id, timestamp, messages);
+		single_flight_land(server.single_flight, flight, ret, messages);
+	}
+	else {
+		ret = single_flight_wait(server.single_flight, flight, copy_message_list, soap, messages);
+	}
+
+	return (ret == 0)? SOAP_OK : SOAP_USER_ERROR;
+}
+
+
+/*
+ * Updates the read times of sync and reads the notifications of the
+ * authenticated user, shared by get_pending_notifications and the batches
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int serve_notifications(struct soap *soap, persistence *persistence, int id_user, int timestamp, psdims__sync *sync, psdims__notifications *notifications) {
+	int i;
+	int leader;
+	int ret;
+	flight_key key;
+	flight *flight;
+
+	if ((notifications == NULL) || (sync == NULL)) {
+		return SOAP_USER_ERROR;
+	}
+
+	// use sync to update chats' read_timestamp
+	key.args_hash = 0;
+	for(i = 0 ; i < sync->chat_read_timestamps.__sizenelems ; i++) {
+		update_sync(persistence, id_user, sync->chat_read_timestamps.chat[i].chat_id, sync->chat_read_timestamps.chat[i].timestamp);
+		key.args_hash = key.args_hash*31 + sync->chat_read_timestamps.chat[i].chat_id;
+		key.args_hash = key.args_hash*31 + sync->chat_read_timestamps.chat[i].timestamp;
+	}
+
+	// the same read by other clients of the user is done only once,
+	// the sync is part of the key because it changes the read times
+	key.op = FLIGHT_NOTIFICATIONS;
+	key.user_id = id_user;
+	key.arg1 = timestamp;
+	key.arg2 = sync->chat_read_timestamps.__sizenelems;
+	flight = persistence_leased(persistence)? NULL : single_flight_join(server.single_flight, &key, &leader);
+	if (flight == NULL) {
+		ret = read_notifications(soap, persistence, id_user, timestamp, notifications);
+	}
+	else if (leader) {
+		ret = read_notifications(soap, persistence, id_user, timestamp, notifications);
+		single_flight_land(server.single_flight, flight, ret, notifications);
+	}
+	else {
+		ret = single_flight_wait(server.single_flight, flight, copy_notifications, soap, notifications);
+	}
+
+	return (ret == 0)? SOAP_OK : SOAP_USER_ERROR;
+}
+
+
+/* =========================================================================
+ *  Gsoap handlers
+ * =========================================================================*/
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__user_register(struct soap *soap, psdims__register_info *user_info, int *ERRCODE){
+	DEBUG_TRACE_PRINT();
+	*ERRCODE = 1;
+	persistence *persistence;
+	
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+
+	if ( (user_info == NULL) || (user_info->name == NULL) || (user_info->password == NULL) || (user_info->information == NULL) ) {
+		DEBUG_FAILURE_PRINTF("Some fields are empty");
+		return SOAP_USER_ERROR;
+	}
+
+	if (user_entry_exist(persistence, user_info->name)) {
+		DEBUG_FAILURE_PRINTF("Failed to add user: The name is already in use");
+		return SOAP_USER_ERROR;
+	}
+
+	DEBUG_INFO_PRINTF("Registering: name:%s pass:%s", user_info->name, user_info->password);
+
+	if( add_user(persistence, user_info->name, user_info->password, user_info->information) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Failed to add user");
+		return SOAP_USER_ERROR;
+	}
+
+	return SOAP_OK; 
+}
+
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__user_unregister(struct soap *soap, psdims__login_info *login, int *ERRCODE){
+	DEBUG_TRACE_PRINT();
+	*ERRCODE = 1;
+	int user_id, timestamp;
+	persistence *persistence;
+	
+	user_id = check_login(soap, login);
+	if ( user_id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+
+	if ( (login == NULL) || (login->name == NULL) || (login->password == NULL) ) {
+		DEBUG_FAILURE_PRINTF("Some fields are empty");
+		return SOAP_USER_ERROR;
+	}
+
+
+	DEBUG_INFO_PRINTF("Unregistering: name:%s ", login->name);
+
+	timestamp = time(NULL);
+	if( del_user(persistence, login->name) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Failed to delete user");
+		return SOAP_USER_ERROR;
+	}
+
+	if( del_user_all_chats(persistence, user_id, timestamp) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Failed to delete user");
+		return SOAP_USER_ERROR;
+	}
+
+	return SOAP_OK;
+}
+
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__get_user(struct soap *soap, psdims__login_info *login, psdims__user_info *user) {
+	DEBUG_TRACE_PRINT();
+	int user_id;
+	persistence *persistence;
+	
+	user_id = check_login(soap, login);
+	if ( user_id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+	
+	if ( user == NULL) {
+		return SOAP_USER_ERROR;
+	}
+	
+	user->name = persistence_malloc(persistence, soap, strlen(login->name) + sizeof(char));
+	user->information = persistence_malloc(persistence, soap, sizeof(char)*200);
+
+	strcpy(user->name,login->name);  
+	get_user_info(persistence, user_id, user->information, 200);
+
+	return SOAP_OK;
+}
+
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__get_friends(struct soap *soap,psdims__login_info *login, int timestamp, psdims__user_list *friends){
+	DEBUG_TRACE_PRINT();
+	int id;
+	persistence *persistence;
+	
+	id = check_login(soap, login);
+	if ( id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+
+	if (friends == NULL) {
+		return SOAP_USER_ERROR;
+	}
+	
+  	if(get_list_friends(persistence, id, timestamp, soap, friends) != 0){
+		return SOAP_USER_ERROR;
+	}
+
+	compress_response(soap, persistence);
+	return SOAP_OK;
+}
+
+
+// get friend info
+int psdims__get_friend_info(struct soap *soap, psdims__login_info *login, char *name, psdims__user_info *friend_info) {
+	DEBUG_TRACE_PRINT();
+	int id, friend_id;
+	persistence *persistence;
+	
+	id = check_login(soap, login);
+	if ( id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+
+	if ((name == NULL) || (friend_info == NULL)) {
+		return SOAP_USER_ERROR;
+	}
+	
+	friend_id = get_user_id(persistence, name);
+	if( friend_id == -1) {
+		DEBUG_FAILURE_PRINTF("Login failed: the user does not exist\n");
+		return -1;
+	}
+	
+	friend_info->name = persistence_malloc(persistence, soap, strlen(name) + sizeof(char));
+	friend_info->information = persistence_malloc(persistence, soap, sizeof(char)*200);
+
+	strcpy(friend_info->name, name);  
+	get_user_info(persistence, friend_id, friend_info->information, 200);	
+
+	return SOAP_OK;
+}
+
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__get_chats(struct soap *soap,psdims__login_info *login, int timestamp, psdims__chat_list *chats){
 	DEBUG_TRACE_PRINT();
-	*ERRCODE = 1;
+	int id;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id = check_login(soap, login);
+	if ( id < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( (user_info == NULL) || (user_info->name == NULL) || (user_info->password == NULL) || (user_info->information == NULL) ) {
-		DEBUG_FAILURE_PRINTF("Some fields are empty");
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	if (user_entry_exist(persistence, user_info->name)) {
-		DEBUG_FAILURE_PRINTF("Failed to add user: The name is already in use");
+	if (chats == NULL) {
 		return SOAP_USER_ERROR;
 	}
 
-	DEBUG_INFO_PRINTF("Registering: name:%s pass:%s", user_info->name, user_info->password);
 
-	if( add_user(persistence, user_info->name, user_info->password, user_info->information) != 0 ) {
-		DEBUG_FAILURE_PRINTF("Failed to add user");
+	if(get_list_chats(persistence, id, timestamp, soap, chats) != 0){
 		return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
-
+	compress_response(soap, persistence);
 	return SOAP_OK; 
 }
 
@@ -337,45 +2136,33 @@ int psdims__user_register(struct soap *soap, psdims__register_info *user_info, i
  *
  * Returns SOAP_OK or SOAP_USER_ERROR if fails
  */
-int psdims__user_unregister(struct soap *soap, psdims__login_info *login, int *ERRCODE){
+int psdims__get_chat_info(struct soap *soap, psdims__login_info *login, int chat_id, psdims__chat_info *chat) {
 	DEBUG_TRACE_PRINT();
-	*ERRCODE = 1;
-	int user_id, timestamp;
+	int id_user;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( (login == NULL) || (login->name == NULL) || (login->password == NULL) ) {
-		DEBUG_FAILURE_PRINTF("Some fields are empty");
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-
-	user_id = check_login(persistence, login);
-	if ( user_id < 0 ) {
+	if (chat == NULL) {
 		return SOAP_USER_ERROR;
 	}
 
-	DEBUG_INFO_PRINTF("Unregistering: name:%s ", login->name);
-
-	timestamp = time(NULL);
-	if( del_user(persistence, login->name) != 0 ) {
-		DEBUG_FAILURE_PRINTF("Failed to delete user");
+	if(chat_exist(persistence, chat_id) != 1)
 		return SOAP_USER_ERROR;
-	}
 
-	if( del_user_all_chats(persistence, user_id, timestamp) != 0 ) {
-		DEBUG_FAILURE_PRINTF("Failed to delete user");
+	if( get_all_chat_info(persistence, chat_id, soap, chat) != 1)
 		return SOAP_USER_ERROR;
-	}
 
-	free_persistence(persistence);
-
-	return SOAP_OK;
+	return SOAP_OK; 
 }
 
 
@@ -383,347 +2170,416 @@ int psdims__user_unregister(struct soap *soap, psdims__login_info *login, int *E
  *
  * Returns SOAP_OK or SOAP_USER_ERROR if fails
  */
-int psdims__get_user(struct soap *soap, psdims__login_info *login, psdims__user_info *user) {
+int psdims__get_chat_messages(struct soap *soap,psdims__login_info *login, int chat_id, int timestamp, psdims__message_list *messages){
 	DEBUG_TRACE_PRINT();
-	int user_id;
+	int id_user;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
-		return SOAP_USER_ERROR;
-	}
-	
-	if ( user == NULL) {
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
-	
-	user_id = check_login(persistence, login);
-	if ( user_id < 0 ) {
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
-	
-	user->name = soap_malloc(soap, strlen(login->name) + sizeof(char));
-	user->information = soap_malloc(soap, sizeof(char)*200);
-
-	strcpy(user->name,login->name);  
-	get_user_info(persistence, user_id, user->information, 200);
 
-	free_persistence(persistence);
+	if (serve_chat_messages(soap, persistence, id_user, chat_id, timestamp, messages) != SOAP_OK)
+		return SOAP_USER_ERROR;
 
-	return SOAP_OK;
+	compress_response(soap, persistence);
+	return SOAP_OK; 
 }
 
 
-/*
- *
- * Returns SOAP_OK or SOAP_USER_ERROR if fails
- */
-int psdims__get_friends(struct soap *soap,psdims__login_info *login, int timestamp, psdims__user_list *friends){
+// Get the file attached to msd_id
+int psdims__get_attachment(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, psdims__file *file) {
 	DEBUG_TRACE_PRINT();
-	int id;
+	int id_user;
+	int i = 0;
+	char *file_path;
+	struct stat st;
+	int fd;
+	unsigned char * file_buffer;
+	int total_blocks;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	if (friends == NULL) {
+	if ( file == NULL) {
+		return SOAP_USER_ERROR;
+	}
+
+	if( message_have_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, -1, msg_timestamp)
+			&& exist_user_in_chat(persistence, id_user, chat_id) == 1) ) {
+		DEBUG_FAILURE_PRINTF("The message does not have attachment");
 		return SOAP_USER_ERROR;
 	}
 	
-	id = check_login(persistence, login);
-	if ( id < 0 ) {
+	if ( (file_path = attachment_path(persistence, soap, chat_id, msg_timestamp)) == NULL ) {
 		return SOAP_USER_ERROR;
 	}
 
-  	if(get_list_friends(persistence, id, timestamp, soap, friends) != 0){
+	if( (fd = open(file_path, O_RDONLY)) == -1) {
+		DEBUG_FAILURE_PRINTF("The file does not exist yet");
+		return SOAP_USER_ERROR;
+	}
+	if( fstat(fd, &st) != 0 ) {
+		close(fd);
 		return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
+	total_blocks = (st.st_size < MAX_FILE_CHARS)? st.st_size : MAX_FILE_CHARS;
+	file_buffer = persistence_malloc(persistence, soap, total_blocks + 1);
+	if( file_buffer == NULL || (total_blocks = file_io_pread(server.file_io, fd, file_buffer, total_blocks, 0)) < 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not read the file");
+		close(fd);
+		return SOAP_USER_ERROR;
+	}
+
+	close(fd);
+
+	file->__ptr = file_buffer;
+	file->__size = total_blocks * sizeof(char);
 
 	return SOAP_OK;
 }
 
 
-// get friend info
-int psdims__get_friend_info(struct soap *soap, psdims__login_info *login, char *name, psdims__user_info *friend_info) {
+// Send a file to attach msd_id
+int psdims__send_attachment(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, psdims__file *file, int *ERRCODE) {
 	DEBUG_TRACE_PRINT();
-	int id, friend_id;
+	*ERRCODE = 0;
+
+	int id_user;
+	char hash[CONTENT_HASH_CHARS + 1];
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
+	
 
-	if ((name == NULL) || (friend_info == NULL)) {
+	if ( file == NULL) {
 		return SOAP_USER_ERROR;
 	}
+
 	
-	id = check_login(persistence, login);
-	if ( id < 0 ) {
+	if( message_can_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, id_user, msg_timestamp)) ) {
+		DEBUG_FAILURE_PRINTF("The message does not have attachment");
 		return SOAP_USER_ERROR;
 	}
-	
-	friend_id = get_user_id(persistence, name);
-	if( friend_id == -1) {
-		DEBUG_FAILURE_PRINTF("Login failed: the user does not exist\n");
-		return -1;
+
+	// check if the file exist
+	if( get_attachment_hash(persistence, chat_id, msg_timestamp, hash) != 0 ) {
+		DEBUG_FAILURE_PRINTF("The file does exist yet");
+		return SOAP_USER_ERROR;
 	}
-	
-	friend_info->name = soap_malloc(soap, strlen(name) + sizeof(char));
-	friend_info->information = soap_malloc(soap, sizeof(char)*200);
 
-	strcpy(friend_info->name, name);  
-	get_user_info(persistence, friend_id, friend_info->information, 200);	
+	if( blob_put(server.file_io, file->__ptr, file->__size, hash) != 0 ) {
+		DEBUG_FAILURE_PRINTF("Could not save the received file");
+		return SOAP_USER_ERROR;
+	}
+
+	if( add_attachment(persistence, chat_id, msg_timestamp, hash) != 0 ) {
+		return SOAP_USER_ERROR;
+	}
 
-	free_persistence(persistence);
-	
 	return SOAP_OK;
 }
 
 
-/*
- *
- * Returns SOAP_OK or SOAP_USER_ERROR if fails
- */
-int psdims__get_chats(struct soap *soap,psdims__login_info *login, int timestamp, psdims__chat_list *chats){
+// Attach a file the server already has, without sending it again
+int psdims__send_attachment_hash(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, char *hash, int *ERRCODE) {
 	DEBUG_TRACE_PRINT();
-	int id;
+	int id_user;
+	char old_hash[CONTENT_HASH_CHARS + 1];
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	if (chats == NULL) {
+	if ( !content_hash_valid(hash) ) {
 		return SOAP_USER_ERROR;
 	}
 
-	id = check_login(persistence, login);
-	if ( id < 0 ) {
+	if( message_can_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, id_user, msg_timestamp)) ) {
+		DEBUG_FAILURE_PRINTF("The message does not have attachment");
+		return SOAP_USER_ERROR;
+	}
+
+	if( get_attachment_hash(persistence, chat_id, msg_timestamp, old_hash) != 0 ) {
+		DEBUG_FAILURE_PRINTF("The file does exist yet");
 		return SOAP_USER_ERROR;
 	}
 
+	// the client sends the whole file. A hash alone does not give access to the
+	// content, only the users that can already read it skip the upload
+	if( !blob_exists(hash) || user_can_read_content(persistence, id_user, hash) != 1 ) {
+		*ERRCODE = 1;
+		return SOAP_OK;
+	}
 
-	if(get_list_chats(persistence, id, timestamp, soap, chats) != 0){
+	if( add_attachment(persistence, chat_id, msg_timestamp, hash) != 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
-	
-	return SOAP_OK; 
+	*ERRCODE = 0;
+	return SOAP_OK;
 }
 
 
-/*
- *
- * Returns SOAP_OK or SOAP_USER_ERROR if fails
- */
-int psdims__get_chat_info(struct soap *soap, psdims__login_info *login, int chat_id, psdims__chat_info *chat) {
+// Get a url, valid for a while, to download the file attached to msg_id with a plain GET
+int psdims__get_attachment_url(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, char **url) {
 	DEBUG_TRACE_PRINT();
 	int id_user;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if (chat == NULL) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( url == NULL ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if(chat_exist(persistence, chat_id) != 1)
+	if( message_have_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, -1, msg_timestamp)
+			&& exist_user_in_chat(persistence, id_user, chat_id) == 1) ) {
+		DEBUG_FAILURE_PRINTF("The message does not have attachment");
 		return SOAP_USER_ERROR;
+	}
 
-	if( get_all_chat_info(persistence, chat_id, soap, chat) != 1)
+	*url = persistence_malloc(persistence, soap, ATTACH_URL_CHARS);
+	if ( *url == NULL || attach_url_sign(chat_id, msg_timestamp, *url) != 0 ) {
 		return SOAP_USER_ERROR;
+	}
 
-	free_persistence(persistence);
-
-	return SOAP_OK; 
+	return SOAP_OK;
 }
 
 
-/*
- *
- * Returns SOAP_OK or SOAP_USER_ERROR if fails
- */
-int psdims__get_chat_messages(struct soap *soap,psdims__login_info *login, int chat_id, int timestamp, psdims__message_list *messages){
+// Start or resume the upload of a file in chunks
+int psdims__upload_begin(struct soap *soap, psdims__login_info *login, psdims__upload_info *info, psdims__upload_state *state) {
 	DEBUG_TRACE_PRINT();
 	int id_user;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	if (messages == NULL) {
+	if ( info == NULL || !content_hash_valid(info->hash) || info->size < 0 || info->size > MAX_FILE_CHARS ) {
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	state->chunk_size = UPLOAD_CHUNK_BYTES;
+	state->offset = info->size;
+	// as in send_attachment_hash, only a user that can read the content skips the upload
+	state->done = blob_exists(info->hash) && user_can_read_content(persistence, id_user, info->hash) == 1;
+	if ( state->done ) {
+		return SOAP_OK;
+	}
+
+	if ( (state->offset = staging_begin(id_user, info->hash, info->size)) < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if(chat_exist(persistence, chat_id) != 1)
+	return SOAP_OK;
+}
+
+
+// Store a chunk of an upload
+int psdims__upload_chunk(struct soap *soap, psdims__login_info *login, char *file_hash, psdims__chunk *chunk, int *ERRCODE) {
+	DEBUG_TRACE_PRINT();
+	int id_user;
+	char hash[CONTENT_HASH_CHARS + 1];
+	persistence *persistence;
+	
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
+	}
 
-	if(exist_user_in_chat(persistence, id_user, chat_id) != 1)
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
+	}
 
-	if(get_list_messages(persistence, chat_id, id_user, timestamp, soap, messages) != 0)
+	if ( chunk == NULL || chunk->hash == NULL || chunk->data.__size < 0 ) {
 		return SOAP_USER_ERROR;
+	}
 
-	free_persistence(persistence);
+	// corrupted on the way, the client sends it again
+	if ( content_hash_buffer(chunk->data.__ptr, chunk->data.__size, hash) != 0 || strcmp(hash, chunk->hash) != 0 ) {
+		DEBUG_FAILURE_PRINTF("The chunk does not match its hash");
+		*ERRCODE = 1;
+		return SOAP_OK;
+	}
 
-	return SOAP_OK; 
+	if ( staging_put(server.file_io, id_user, file_hash, chunk->offset, chunk->data.__ptr, chunk->data.__size) != 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	*ERRCODE = 0;
+	return SOAP_OK;
 }
 
 
-// Get the file attached to msd_id
-int psdims__get_attachment(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, psdims__file *file) {
+// Attach an uploaded file
+int psdims__upload_commit(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, char *hash, int *ERRCODE) {
 	DEBUG_TRACE_PRINT();
 	int id_user;
-	int i = 0;
-	char *file_path;
-	struct stat st;
-	FILE *fd;
-	unsigned char * file_buffer;
-	unsigned char *file_buff_aux;
-	int total_blocks, readed_blocks;
+	char old_hash[CONTENT_HASH_CHARS + 1];
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( file == NULL) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( !content_hash_valid(hash) ) {
 		return SOAP_USER_ERROR;
 	}
-	
-	if( message_have_attach(persistence, id_user, chat_id, msg_timestamp) == 0) {
+
+	if( message_can_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, id_user, msg_timestamp)) ) {
 		DEBUG_FAILURE_PRINTF("The message does not have attachment");
 		return SOAP_USER_ERROR;
 	}
-	
-	file_path = soap_malloc(soap, sizeof(char)*20 );
-	create_file_path(file_path, chat_id, msg_timestamp);
 
-	if( (fd = fopen(file_path, "r")) == NULL) {
-		DEBUG_FAILURE_PRINTF("The file does not exist yet");
-		fclose(fd);
+	if( get_attachment_hash(persistence, chat_id, msg_timestamp, old_hash) != 0 ) {
+		DEBUG_FAILURE_PRINTF("The file does exist yet");
 		return SOAP_USER_ERROR;
 	}
 
-	file_buffer = soap_malloc(soap, MAX_FILE_CHARS);
-	total_blocks = 0;
-
-	file_buff_aux = file_buffer;
-	do {
-		readed_blocks = fread(file_buff_aux++, 1, 1, fd);
-		total_blocks += readed_blocks;
-	} while( (readed_blocks == 1) && (total_blocks < MAX_FILE_CHARS) );
-
-	fclose(fd);
-
-	file->__ptr = file_buffer;
-	file->__size = total_blocks * sizeof(char);
+	// another upload of the same file may have been committed before,
+	// but only a user that can read it does not have to upload it
+	if( !(blob_exists(hash) && user_can_read_content(persistence, id_user, hash) == 1)
+			&& staging_commit(id_user, hash) != 0 ) {
+		return SOAP_USER_ERROR;
+	}
 
-	free_persistence(persistence);
+	if( add_attachment(persistence, chat_id, msg_timestamp, hash) != 0 ) {
+		return SOAP_USER_ERROR;
+	}
 
+	*ERRCODE = 0;
 	return SOAP_OK;
 }
 
 
-// Send a file to attach msd_id
-int psdims__send_attachment(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, psdims__file *file, int *ERRCODE) {
+// Get a chunk of the file attached to msd_id
+int psdims__get_attachment_chunk(struct soap *soap, psdims__login_info *login, int chat_id, int msg_timestamp, int offset, psdims__chunk *chunk) {
 	DEBUG_TRACE_PRINT();
-	*ERRCODE = 0;
-
 	int id_user;
-	int i = 0;
+	int fd;
+	int size;
 	char *file_path;
+	char *hash;
 	struct stat st;
-	FILE *fd_write;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
-	
 
-	if ( file == NULL) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( chunk == NULL || offset < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	
-	if( message_can_attach(persistence, id_user, chat_id, msg_timestamp) == 0) {
+	if( message_have_attach(persistence, id_user, chat_id, msg_timestamp) == 0
+			&& !(server.msg_journal != NULL && msg_journal_find(server.msg_journal, chat_id, -1, msg_timestamp)
+			&& exist_user_in_chat(persistence, id_user, chat_id) == 1) ) {
 		DEBUG_FAILURE_PRINTF("The message does not have attachment");
 		return SOAP_USER_ERROR;
 	}
 
-	if( stat(ATTACH_FILES_DIR, &st) == -1 ) {
-		mkdir(ATTACH_FILES_DIR, 0700);
+	if ( (file_path = attachment_path(persistence, soap, chat_id, msg_timestamp)) == NULL ) {
+		return SOAP_USER_ERROR;
 	}
-	
-	file_path = soap_malloc(soap, sizeof(char)*20 );
-	create_file_path(file_path, chat_id, msg_timestamp);
-	
-	// check if the file exist
-	if( (fd_write = fopen(file_path, "r")) != NULL) {
-		DEBUG_FAILURE_PRINTF("The file does exist yet");
-		fclose(fd_write);
+	if ( (fd = open(file_path, O_RDONLY)) == -1 ) {
+		DEBUG_FAILURE_PRINTF("The file does not exist yet");
 		return SOAP_USER_ERROR;
 	}
-
-	// create the new file
-	if( (fd_write = fopen(file_path, "w")) == NULL ) {
-		DEBUG_FAILURE_PRINTF("Could not create the file");
+	if ( fstat(fd, &st) != 0 || offset > st.st_size ) {
+		close(fd);
 		return SOAP_USER_ERROR;
 	}
 
-	if( fwrite(file->__ptr, file->__size, 1, fd_write) != 1 ) {
-		DEBUG_FAILURE_PRINTF("Could not save the received file");
-		fclose(fd_write);
+	size = (st.st_size - offset < UPLOAD_CHUNK_BYTES)? (st.st_size - offset) : UPLOAD_CHUNK_BYTES;
+	chunk->data.__ptr = persistence_malloc(persistence, soap, size + 1);
+	hash = persistence_malloc(persistence, soap, CONTENT_HASH_CHARS + 1);
+	if ( chunk->data.__ptr == NULL || hash == NULL || file_io_pread(server.file_io, fd, chunk->data.__ptr, size, offset) != size ) {
+		close(fd);
 		return SOAP_USER_ERROR;
 	}
+	close(fd);
 
-
-	fclose(fd_write);
-
-	free_persistence(persistence);
+	if ( content_hash_buffer(chunk->data.__ptr, size, hash) != 0 ) {
+		return SOAP_USER_ERROR;
+	}
+	chunk->data.__size = size;
+	chunk->hash = hash;
+	chunk->offset = offset;
+	chunk->total_size = st.st_size;
 
 	return SOAP_OK;
 }
@@ -738,7 +2594,12 @@ int psdims__get_all_data(struct soap *soap, psdims__login_info *login, psdims__c
 	int user_id;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	user_id = check_login(soap, login);
+	if ( user_id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
@@ -748,11 +2609,6 @@ int psdims__get_all_data(struct soap *soap, psdims__login_info *login, psdims__c
 		return SOAP_USER_ERROR;
 	}
 
-	user_id = check_login(persistence, login);
-	if ( user_id < 0 ) {
-		return SOAP_USER_ERROR;
-	}	
-	
 	client_data->timestamp = time(NULL);
 	
 	if (get_notif_friend_requests(persistence, user_id, 0, soap, &(client_data->friend_requests))) {
@@ -766,69 +2622,190 @@ int psdims__get_all_data(struct soap *soap, psdims__login_info *login, psdims__c
 		return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
-	
+	compress_response(soap, persistence);
 	return SOAP_OK;
 }
 
 
 /*
- *
+ * Deletes the old events once every EVENTS_PRUNE_SECS, by the first request that sees it due
+ */
+void prune_old_events(persistence *persistence, int timestamp) {
+	int due;
+
+	pthread_mutex_lock(&server.events_mutex);
+	due = (timestamp - server.last_events_prune) >= EVENTS_PRUNE_SECS;
+	if (due) {
+		server.last_events_prune = timestamp;
+	}
+	pthread_mutex_unlock(&server.events_mutex);
+
+	if (due && prune_events(persistence, timestamp - EVENTS_KEEP_SECS)) {
+		DEBUG_FAILURE_PRINTF("Could not prune the events");
+	}
+}
+
+
+/*
+ * The changes of the data of the client since cursor, read from its events.
+ * A client without cursor, or too far behind, gets a snapshot like get_all_data
  * Returns SOAP_OK or SOAP_USER_ERROR if fails
  */
-int psdims__get_pending_notifications(struct soap *soap,psdims__login_info *login, int timestamp, psdims__sync *sync,  psdims__notifications *notifications){
+int psdims__get_changes(struct soap *soap, psdims__login_info *login, LONG64 cursor, psdims__changes *changes){
 	DEBUG_TRACE_PRINT();
-	int i;
-	int id_user;
+	int user_id;
+	int i, j;
+	int n_events;
+	int n_chats, n_left, n_friends;
+	int requests_timestamp;
+	long long first_seq, last_seq, read_seq;
+	sync_event events[MAX_DELTA_EVENTS + 1];
+	int chat_ids[MAX_DELTA_EVENTS];
+	int friend_ids[MAX_DELTA_EVENTS];
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	user_id = check_login(soap, login);
+	if ( user_id < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	if ((notifications == NULL) || (sync == NULL)) {
+	if (changes == NULL) {
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	changes->timestamp = time(NULL);
+	prune_old_events(persistence, changes->timestamp);
+
+	// read before the data, a change made meanwhile is sent again next time
+	if (get_events_range(persistence, &first_seq, &last_seq)) {
 		return SOAP_USER_ERROR;
 	}
+	changes->cursor = last_seq;
 
-	// use sync to update chats' read_timestamp
-	for(i = 0 ; i < sync->chat_read_timestamps.__sizenelems ; i++) {
-		update_sync(persistence, id_user, sync->chat_read_timestamps.chat[i].chat_id, sync->chat_read_timestamps.chat[i].timestamp);
+	// the events are idempotent, the ones of the overlap are only sent twice
+	n_events = MAX_DELTA_EVENTS + 1;
+	if ((cursor >= 0) && (cursor >= first_seq - 1)) {
+		read_seq = (cursor > SYNC_OVERLAP_SEQS)? cursor - SYNC_OVERLAP_SEQS : 0;
+		n_events = get_user_events(persistence, user_id, read_seq, events, MAX_DELTA_EVENTS + 1);
+		if (n_events < 0) {
+			return SOAP_USER_ERROR;
+		}
 	}
 
-	// There may be problems with this concerns...
-	notifications->last_timestamp = time(NULL);
+	if (n_events > MAX_DELTA_EVENTS) {
+		changes->snapshot = 1;
+		changes->left_chats.__sizenelems = 0;
+		changes->left_chats.chat = NULL;
+		if (get_notif_friend_requests(persistence, user_id, 0, soap, &(changes->friend_requests))) {
+			return SOAP_USER_ERROR;
+		}
+		if (get_list_chats(persistence, user_id, 0, soap, &(changes->chats))) {
+			return SOAP_USER_ERROR;
+		}
+		if (get_list_friends(persistence, user_id, 0, soap, &(changes->friends))) {
+			return SOAP_USER_ERROR;
+		}
 
-	if(get_notif_chats_with_messages(persistence, id_user, timestamp, soap, &(notifications->chats_with_messages)) < 0){
-		return SOAP_USER_ERROR;
+		compress_response(soap, persistence);
+		return SOAP_OK;
+	}
+
+	changes->snapshot = 0;
+	n_chats = 0;
+	n_left = 0;
+	n_friends = 0;
+	requests_timestamp = -1;
+	changes->left_chats.chat = persistence_malloc(persistence, soap, sizeof(psdims__notif_chat_info)*(n_events + 1));
+	if (changes->left_chats.chat == NULL) {
+		return SOAP_USER_ERROR;
+	}
+
+	for (i = 0 ; i < n_events ; i++) {
+		switch (events[i].type) {
+			case EVENT_CHAT_CHANGED:
+			case EVENT_CHAT_LEFT:
+				// only the last event of each chat matters
+				for (j = i + 1 ; j < n_events ; j++) {
+					if (((events[j].type == EVENT_CHAT_CHANGED) || (events[j].type == EVENT_CHAT_LEFT)) 
+							&& (events[j].ref_id == events[i].ref_id)) {
+						break;
+					}
+				}
+				if (j < n_events) {
+					break;
+				}
+				if (events[i].type == EVENT_CHAT_CHANGED) {
+					chat_ids[n_chats++] = events[i].ref_id;
+				}
+				else {
+					changes->left_chats.chat[n_left].chat_id = events[i].ref_id;
+					changes->left_chats.chat[n_left].timestamp = events[i].timestamp;
+					n_left++;
+				}
+				break;
+			case EVENT_NEW_FRIEND:
+				friend_ids[n_friends++] = events[i].ref_id;
+				break;
+			case EVENT_FRIEND_REQUEST:
+				if ((requests_timestamp < 0) || (events[i].timestamp < requests_timestamp)) {
+					requests_timestamp = events[i].timestamp;
+				}
+				break;
+		}
 	}
-	if(get_notif_chats_read_times(persistence, id_user, soap, &(notifications->chats_read_times)) < 0){
-		return SOAP_USER_ERROR;
-	}	
-	if(get_notif_friend_requests(persistence, id_user, timestamp, soap, &(notifications->friend_request)) < 0){
+	changes->left_chats.__sizenelems = n_left;
+
+	if (get_list_chats_by_id(persistence, user_id, chat_ids, n_chats, soap, &(changes->chats))) {
 		return SOAP_USER_ERROR;
 	}
-	if(get_notif_chat_members(persistence, id_user, timestamp, soap, &(notifications->chat_members)) < 0){
+	if (get_list_users_by_id(persistence, friend_ids, n_friends, soap, &(changes->friends))) {
 		return SOAP_USER_ERROR;
 	}
-	if(get_notif_chat_rem_members(persistence, id_user, timestamp, soap, &(notifications->rem_chat_members)) < 0){
-		return SOAP_USER_ERROR;
+	if (requests_timestamp >= 0) {
+		if (get_notif_friend_requests(persistence, user_id, requests_timestamp, soap, &(changes->friend_requests))) {
+			return SOAP_USER_ERROR;
+		}
 	}
-	if(get_notif_chat_admins(persistence, id_user, timestamp, soap, &(notifications->chat_admins)) < 0) {
+	else {
+		changes->friend_requests.__sizenelems = 0;
+		changes->friend_requests.user = NULL;
+	}
+
+	compress_response(soap, persistence);
+	return SOAP_OK;
+}
+
+
+/*
+ *
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__get_pending_notifications(struct soap *soap,psdims__login_info *login, int timestamp, psdims__sync *sync,  psdims__notifications *notifications){
+	DEBUG_TRACE_PRINT();
+	int id_user;
+	persistence *persistence;
+	
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
-	if(get_list_friends(persistence, id_user, timestamp, soap, &(notifications->new_friends)) < 0){
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
-	
+	if (serve_notifications(soap, persistence, id_user, timestamp, sync, notifications) != SOAP_OK)
+		return SOAP_USER_ERROR;
+
+	compress_response(soap, persistence);
 	return SOAP_OK; 
 }
 
@@ -845,7 +2822,12 @@ int psdims__create_chat(struct soap *soap, psdims__login_info *login, psdims__ne
 	int aux_chat_id;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
@@ -855,11 +2837,6 @@ int psdims__create_chat(struct soap *soap, psdims__login_info *login, psdims__ne
 		return SOAP_USER_ERROR;
 	}
 	
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
-		return SOAP_USER_ERROR;
-	}
-	
 	timestamp = time(NULL);
 
 	id_member = get_user_id(persistence, new_chat->member);
@@ -881,8 +2858,6 @@ int psdims__create_chat(struct soap *soap, psdims__login_info *login, psdims__ne
 
 	*chat_id = aux_chat_id;
 
-	free_persistence(persistence);
-
 	return SOAP_OK; 
 }
 
@@ -899,23 +2874,21 @@ int psdims__add_member(struct soap *soap, psdims__login_info *login, char *name,
 	int timestamp;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_login = check_login(soap, login);
+	if ( id_login < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( name == NULL ) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_login = check_login(persistence, login);
-	if ( id_login < 0 ) {
+	if ( name == NULL ) {
 		return SOAP_USER_ERROR;
 	}
 
-	timestamp = time(NULL);
-
 	if(chat_exist(persistence, chat_id) != 1) {
 		printf("Chat does not exist\n");
 		return SOAP_USER_ERROR;
@@ -947,6 +2920,11 @@ int psdims__add_member(struct soap *soap, psdims__login_info *login, char *name,
 		return SOAP_USER_ERROR;
 	}
 
+	timestamp = member_time(persistence, chat_id);
+	if (timestamp < 0) {
+		return SOAP_USER_ERROR;
+	}
+
 	if (exist_user_entry_in_chat(persistence, id_user, chat_id) == 1 ) {
 		 if( recover_user_chat(persistence, id_user, chat_id, timestamp) != 0) {
 			return SOAP_USER_ERROR;
@@ -959,8 +2937,6 @@ int psdims__add_member(struct soap *soap, psdims__login_info *login, char *name,
 		}	
 	}
 
-	free_persistence(persistence);
-
 	return SOAP_OK;  
 }
 
@@ -977,7 +2953,12 @@ int psdims__remove_member(struct soap *soap, psdims__login_info *login, char *na
 	int timestamp;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_login = check_login(soap, login);
+	if ( id_login < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
@@ -987,11 +2968,6 @@ int psdims__remove_member(struct soap *soap, psdims__login_info *login, char *na
 		return SOAP_USER_ERROR;
 	}
 
-	id_login = check_login(persistence, login);
-	if ( id_login < 0 ) {
-		return SOAP_USER_ERROR;
-	}
-	
 	if(chat_exist(persistence, chat_id) != 1) {
 		printf("Chat does not exist\n");
 		return SOAP_USER_ERROR;
@@ -1018,12 +2994,10 @@ int psdims__remove_member(struct soap *soap, psdims__login_info *login, char *na
 		return SOAP_USER_ERROR;
 	}
 	
-	timestamp = time(NULL);
-	if(del_user_chat(persistence, id_user, chat_id, timestamp) != 0)
+	timestamp = member_time(persistence, chat_id);
+	if(timestamp < 0 || del_user_chat(persistence, id_user, chat_id, timestamp) != 0)
 		return SOAP_USER_ERROR;
 
-	free_persistence(persistence);
-
 	return SOAP_OK;  
 }
 
@@ -1038,14 +3012,14 @@ int psdims__quit_from_chat(struct soap *soap, psdims__login_info *login, int cha
 	int id_user,first_user, timestamp;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
@@ -1055,9 +3029,9 @@ int psdims__quit_from_chat(struct soap *soap, psdims__login_info *login, int cha
 	if(exist_user_in_chat(persistence, id_user, chat_id) != 1)
 		return SOAP_USER_ERROR;
 
-	timestamp = time(NULL);
+	timestamp = member_time(persistence, chat_id);
 
-	if(del_user_chat(persistence, id_user, chat_id, timestamp) != 0)	
+	if(timestamp < 0 || del_user_chat(persistence, id_user, chat_id, timestamp) != 0)	
 		return SOAP_USER_ERROR;
 
 	if(still_users_in_chat(persistence, chat_id) == 1){
@@ -1073,8 +3047,6 @@ int psdims__quit_from_chat(struct soap *soap, psdims__login_info *login, int cha
 			return SOAP_USER_ERROR;
 	}
 
-	free_persistence(persistence);
-
 	return SOAP_OK;  
 }
 
@@ -1089,7 +3061,12 @@ int psdims__send_message(struct soap *soap,psdims__login_info *login, int chat_i
 	int local_time;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
 	if (persistence == NULL) {
 		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
@@ -1099,32 +3076,37 @@ int psdims__send_message(struct soap *soap,psdims__login_info *login, int chat_i
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
-		return SOAP_USER_ERROR;
-	}
-	
 
 	if(exist_user_in_chat(persistence, id_user, chat_id)!=1)
 		return SOAP_USER_ERROR;
 
 	
-	// As timestamp are in seconds resolution, and the messages do not have id, 
-	// they need diferent timestamps...
-	// Sure this can be done better.
-	local_time = time(NULL);
-	while( exist_timestamp_in_messages(persistence, chat_id, local_time) ) {
-		sleep(1);
+	if (server.msg_journal != NULL) {
+		// acknowledged once it is in the journal, it is inserted later
+		if( msg_journal_send(server.msg_journal, persistence, chat_id, id_user, login->name, message, &local_time) != 0)
+			return SOAP_USER_ERROR;
+	}
+	else if (server.msg_batch != NULL) {
+		// the batch gives the timestamp (the message id inside the chat) and
+		// inserts the message in the same transaction as other handlers' ones
+		if( msg_batch_send(server.msg_batch, persistence, chat_id, id_user, message, &local_time) != 0)
+			return SOAP_USER_ERROR;
+	}
+	else {
+		// As timestamp are in seconds resolution, and the messages do not have id, 
+		// they need diferent timestamps...
 		local_time = time(NULL);
+		while( exist_timestamp_in_messages(persistence, chat_id, local_time) ) {
+			sleep(1);
+			local_time = time(NULL);
+		}
+
+		if( send_messages(persistence, chat_id, id_user, local_time, message) != 0)
+			return SOAP_USER_ERROR;
 	}
-	
-	if( send_messages(persistence, chat_id, id_user, local_time, message) != 0)
-		return SOAP_USER_ERROR;
 
 	*timestamp = local_time;
 
-	free_persistence(persistence);
-
 	return SOAP_OK; 
 }
 
@@ -1138,18 +3120,18 @@ int psdims__send_friend_request(struct soap *soap,psdims__login_info *login, cha
 	int id_user,id_request_name;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( (request_name == NULL) || (timestamp == NULL) ) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( (request_name == NULL) || (timestamp == NULL) ) {
 		return SOAP_USER_ERROR;
 	}
 
@@ -1173,8 +3155,6 @@ int psdims__send_friend_request(struct soap *soap,psdims__login_info *login, cha
 	if(send_request(persistence,id_user, id_request_name, *timestamp) != 0)
 		return SOAP_USER_ERROR;
 
-	free_persistence(persistence);
-
 	return SOAP_OK; 
 }
 
@@ -1188,18 +3168,18 @@ int psdims__accept_request(struct soap *soap,psdims__login_info *login, char *re
 	int id_user, id_request_name;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( (request_name == NULL) || (timestamp == NULL) ) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( (request_name == NULL) || (timestamp == NULL) ) {
 		return SOAP_USER_ERROR;
 	}
 
@@ -1215,8 +3195,6 @@ int psdims__accept_request(struct soap *soap,psdims__login_info *login, char *re
     if(accept_friend_request(persistence, id_request_name, id_user, *timestamp) != 0)
 		return SOAP_USER_ERROR;
 
-	free_persistence(persistence);
-
 	return SOAP_OK; 
 }
 
@@ -1230,18 +3208,18 @@ int psdims__decline_request(struct soap *soap, psdims__login_info *login, char *
 	int id_user,id_request_name;
 	persistence *persistence;
 	
-	persistence = clone_persistence(server.persistence);
-	if (persistence == NULL) {
-		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
 		return SOAP_USER_ERROR;
 	}
 
-	if ( (request_name == NULL) || (timestamp == NULL) ) {
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
 		return SOAP_USER_ERROR;
 	}
 
-	id_user = check_login(persistence, login);
-	if ( id_user < 0 ) {
+	if ( (request_name == NULL) || (timestamp == NULL) ) {
 		return SOAP_USER_ERROR;
 	}
 
@@ -1256,8 +3234,110 @@ int psdims__decline_request(struct soap *soap, psdims__login_info *login, char *
 	if(decline_friend_request(persistence, id_request_name, id_user) != 0)
 		return SOAP_USER_ERROR;
 
-	free_persistence(persistence);
-
 	return SOAP_OK; 
 }
 
+
+
+/*
+ * Runs a single operation of a batch for the authenticated user, its result is allocated in soap
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int run_batch_op(struct soap *soap, persistence *persistence, int id_user, psdims__batch_op *op, psdims__batch_result *result) {
+	psdims__sync empty_sync;
+
+	result->type = op->type;
+	result->notifications = NULL;
+	result->messages = NULL;
+	result->chats = NULL;
+
+	switch (op->type) {
+		case BATCH_NOTIFICATIONS:
+			result->notifications = persistence_malloc(persistence, soap, sizeof(psdims__notifications));
+			if (op->sync == NULL) {
+				empty_sync.chat_read_timestamps.__sizenelems = 0;
+				empty_sync.chat_read_timestamps.chat = NULL;
+				return serve_notifications(soap, persistence, id_user, op->timestamp, &empty_sync, result->notifications);
+			}
+			return serve_notifications(soap, persistence, id_user, op->timestamp, op->sync, result->notifications);
+
+		case BATCH_CHAT_MESSAGES:
+			result->messages = persistence_malloc(persistence, soap, sizeof(psdims__message_list));
+			return serve_chat_messages(soap, persistence, id_user, op->chat_id, op->timestamp, result->messages);
+
+		case BATCH_CHATS:
+			result->chats = persistence_malloc(persistence, soap, sizeof(psdims__chat_list));
+			if (result->chats == NULL || get_list_chats(persistence, id_user, op->timestamp, soap, result->chats) != 0) {
+				return SOAP_USER_ERROR;
+			}
+			return SOAP_OK;
+	}
+
+	DEBUG_FAILURE_PRINTF("Unknown batch operation %d", op->type);
+	return SOAP_USER_ERROR;
+}
+
+
+/*
+ * Authenticates the user once and runs the operations of the batch in order
+ * on the same connection (leased from the pool with -a), in one read
+ * transaction if it is requested. A failed operation does not stop the rest
+ * Returns SOAP_OK or SOAP_USER_ERROR if fails
+ */
+int psdims__batch(struct soap *soap, psdims__login_info *login, psdims__batch_ops *batch, psdims__batch_results *results) {
+	DEBUG_TRACE_PRINT();
+	int i;
+	int id_user;
+	int in_transaction = FALSE;
+	persistence *persistence;
+
+	if ((batch == NULL) || (results == NULL)) {
+		return SOAP_USER_ERROR;
+	}
+	if ((batch->__sizenelems < 0) || (batch->__sizenelems > MAX_BATCH_OPS)) {
+		DEBUG_FAILURE_PRINTF("Invalid number of batch operations: %d", batch->__sizenelems);
+		return SOAP_USER_ERROR;
+	}
+
+	id_user = check_login(soap, login);
+	if ( id_user < 0 ) {
+		return SOAP_USER_ERROR;
+	}
+
+	persistence = request_persistence(soap);
+	if (persistence == NULL) {
+		DEBUG_FAILURE_PRINTF("Could not create the persistence struct");
+		return SOAP_USER_ERROR;
+	}
+
+	results->__sizenelems = batch->__sizenelems;
+	results->result = persistence_malloc(persistence, soap, batch->__sizenelems * sizeof(psdims__batch_result));
+	if (results->result == NULL) {
+		return SOAP_USER_ERROR;
+	}
+
+	// the queries of every operation run on one pooled connection, that keeps the transaction
+	if (persistence_lease(persistence) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not lease a database connection");
+		return SOAP_USER_ERROR;
+	}
+	if (batch->transaction) {
+		if (begin_read_transaction(persistence) != 0) {
+			persistence_release(persistence);
+			return SOAP_USER_ERROR;
+		}
+		in_transaction = TRUE;
+	}
+
+	for (i = 0 ; i < batch->__sizenelems ; i++) {
+		results->result[i].error = (run_batch_op(soap, persistence, id_user, &batch->op[i], &results->result[i]) == SOAP_OK)? 0 : -1;
+	}
+
+	if (in_transaction) {
+		end_read_transaction(persistence);
+	}
+	persistence_release(persistence);
+
+	compress_response(soap, persistence);
+	return SOAP_OK;
+}
@@ -28,6 +28,7 @@
 
 #include "soapH.h"
 #include "persistence.h"
+#include "rate_limit.h"
 #include <mysql.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,7 +36,24 @@
 #define MAX_FILE_CHARS (10485760)
 
 
-int init_server(int bind_port, char persistence_user[], char persistence_pass[]);
+typedef struct server_options server_options;
+struct server_options {
+	int bind_port;
+	char *persistence_user;
+	char *persistence_pass;
+	char *journal_path;		// NULL if the sent messages are not journaled
+	size_t request_mem_budget;	// max bytes of query results per request, 0 if unlimited
+	int db_async_conns;			// connections shared by the requests, 0 if each one opens its own
+	int n_acceptors;			// listening sockets on the port (SO_REUSEPORT), each one with its thread
+	int bin_port;				// port of the binary transport, 0 if disabled
+	int transfer_slots;			// attachment transfers served at once, 0 if unlimited
+	long long transfer_bytes_per_sec;	// shared by the transfers, 0 if unlimited
+	rate_rule user_rates[N_OP_CLASSES];	// requests of every user, by operation class
+	rate_rule addr_rates[N_OP_CLASSES];	// requests of every client address
+};
+
+
+int init_server(server_options *options);
 
 void free_server();
 
@@ -0,0 +1,229 @@
+/*******************************************************************************
+ *	rate_limit.c
+ *
+ *  Token buckets of the requests of every user and address
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "rate_limit.h"
+
+#include "debug_def.h"
+
+#define tokens_of(state) ((uint32_t)((state) >> 32))
+#define msecs_of(state) ((uint32_t)(state))
+#define make_state(tokens, msecs) (((uint64_t)(tokens) << 32) | (uint32_t)(msecs))
+
+
+long long _rate_now_msecs() {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (long long)now.tv_sec*1000 + now.tv_usec/1000;
+}
+
+
+unsigned int _rate_hash(const char *key, int class) {
+	unsigned int hash = 5381 + class;
+
+	while (*key != '\0') {
+		hash = hash*33 + (unsigned char)*key++;
+	}
+
+	return hash;
+}
+
+
+rate_limit *rate_limit_new(const rate_rule *rules) {
+	DEBUG_TRACE_PRINT();
+	rate_limit *limit;
+	int i;
+
+	if ((limit = malloc(sizeof(rate_limit))) == NULL) {
+		return NULL;
+	}
+	if ((limit->shards = calloc(RATE_LIMIT_SHARDS, sizeof(rate_shard))) == NULL) {
+		free(limit);
+		return NULL;
+	}
+	for (i = 0 ; i < RATE_LIMIT_SHARDS ; i++) {
+		pthread_mutex_init(&limit->shards[i].mutex, NULL);
+	}
+	for (i = 0 ; i < N_OP_CLASSES ; i++) {
+		limit->rules[i] = rules[i];
+		if (limit->rules[i].burst < limit->rules[i].per_sec) {
+			limit->rules[i].burst = limit->rules[i].per_sec;
+		}
+	}
+	limit->start_msecs = _rate_now_msecs();
+
+	return limit;
+}
+
+
+void rate_limit_free(rate_limit *limit) {
+	int i;
+
+	for (i = 0 ; i < RATE_LIMIT_SHARDS ; i++) {
+		pthread_mutex_destroy(&limit->shards[i].mutex);
+	}
+	free(limit->shards);
+	free(limit);
+}
+
+
+/*
+ * Finds the bucket of the key in the shard, or takes one for it (full of tokens).
+ * The mutex of the shard must be held while the bucket is used, an idle bucket
+ * may be taken by another key as soon as it is released
+ * Returns the bucket
+ */
+rate_bucket *_rate_bucket(rate_limit *limit, rate_shard *shard, unsigned int hash, const char *key, op_class class, uint32_t now) {
+	rate_bucket *bucket, *oldest = NULL;
+	uint32_t idle, oldest_idle = 0;
+	int i;
+
+	for (i = 0 ; i < RATE_LIMIT_PROBES ; i++) {
+		bucket = &shard->buckets[(hash + i) % RATE_LIMIT_SHARD_BUCKETS];
+		if (bucket->key[0] == '\0') {
+			break;
+		}
+		if (bucket->class == class && strcmp(bucket->key, key) == 0) {
+			return bucket;
+		}
+		idle = now - msecs_of(bucket->state);
+		if (oldest == NULL || idle > oldest_idle) {
+			oldest = bucket;
+			oldest_idle = idle;
+		}
+	}
+	if (i == RATE_LIMIT_PROBES) {
+		bucket = oldest;
+	}
+
+	strncpy(bucket->key, key, RATE_LIMIT_KEY_CHARS - 1);
+	bucket->key[RATE_LIMIT_KEY_CHARS - 1] = '\0';
+	bucket->class = class;
+	bucket->state = make_state(limit->rules[class].burst*1000, now);
+
+	return bucket;
+}
+
+
+/*
+ * Tokens (thousandths) of the bucket, refilled until now
+ * Returns the tokens
+ */
+unsigned long long _rate_tokens(rate_rule *rule, rate_bucket *bucket, uint32_t now, uint32_t *elapsed) {
+	unsigned long long tokens;
+
+	*elapsed = now - msecs_of(bucket->state);
+	// the clock of the system went back
+	if (*elapsed > (uint32_t)1 << 31) {
+		*elapsed = 0;
+	}
+	tokens = tokens_of(bucket->state) + (unsigned long long)*elapsed*rule->per_sec;
+	if (tokens > (unsigned long long)rule->burst*1000) {
+		tokens = (unsigned long long)rule->burst*1000;
+	}
+
+	return tokens;
+}
+
+
+int rate_limit_take(rate_limit *limit, const char *key, op_class class) {
+	rate_rule *rule = &limit->rules[class];
+	rate_shard *shard;
+	rate_bucket *bucket;
+	char cut_key[RATE_LIMIT_KEY_CHARS];
+	unsigned int hash;
+	uint32_t now, elapsed;
+	unsigned long long tokens;
+	int taken;
+
+	if (rule->per_sec <= 0 || key == NULL || key[0] == '\0') {
+		return 1;
+	}
+	strncpy(cut_key, key, RATE_LIMIT_KEY_CHARS - 1);
+	cut_key[RATE_LIMIT_KEY_CHARS - 1] = '\0';
+
+	hash = _rate_hash(cut_key, class);
+	shard = &limit->shards[hash % RATE_LIMIT_SHARDS];
+	hash /= RATE_LIMIT_SHARDS;
+
+	// refilled and taken in the same hold of the shard, so the bucket
+	// is not given to another key meanwhile
+	pthread_mutex_lock(&shard->mutex);
+	now = (uint32_t)(_rate_now_msecs() - limit->start_msecs);
+	bucket = _rate_bucket(limit, shard, hash, cut_key, class, now);
+
+	tokens = _rate_tokens(rule, bucket, now, &elapsed);
+	taken = (tokens >= 1000);
+	if (taken) {
+		tokens -= 1000;
+	}
+	bucket->state = make_state(tokens, (elapsed > 0)? now : msecs_of(bucket->state));
+	pthread_mutex_unlock(&shard->mutex);
+
+	return taken;
+}
+
+
+int rate_limit_peek(rate_limit *limit, const char *key, op_class class) {
+	rate_rule *rule = &limit->rules[class];
+	rate_shard *shard;
+	rate_bucket *bucket;
+	char cut_key[RATE_LIMIT_KEY_CHARS];
+	unsigned int hash;
+	uint32_t now, elapsed;
+	int has_token = 1;
+	int i;
+
+	if (rule->per_sec <= 0 || key == NULL || key[0] == '\0') {
+		return 1;
+	}
+	strncpy(cut_key, key, RATE_LIMIT_KEY_CHARS - 1);
+	cut_key[RATE_LIMIT_KEY_CHARS - 1] = '\0';
+
+	hash = _rate_hash(cut_key, class);
+	shard = &limit->shards[hash % RATE_LIMIT_SHARDS];
+	hash /= RATE_LIMIT_SHARDS;
+
+	// no bucket is taken for the key, the names of the requests are not trusted yet
+	pthread_mutex_lock(&shard->mutex);
+	now = (uint32_t)(_rate_now_msecs() - limit->start_msecs);
+	for (i = 0 ; i < RATE_LIMIT_PROBES ; i++) {
+		bucket = &shard->buckets[(hash + i) % RATE_LIMIT_SHARD_BUCKETS];
+		if (bucket->key[0] == '\0') {
+			break;
+		}
+		if (bucket->class == class && strcmp(bucket->key, cut_key) == 0) {
+			has_token = (_rate_tokens(rule, bucket, now, &elapsed) >= 1000);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return has_token;
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ *	rate_limit.h
+ *
+ *  Token buckets of the requests of every user and address
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __RATE_LIMIT
+#define __RATE_LIMIT
+
+#include <pthread.h>
+#include <stdint.h>
+#include "lanes.h"
+
+// the buckets are spread in shards, each one with its own lock
+#define RATE_LIMIT_SHARDS (64)
+#define RATE_LIMIT_SHARD_BUCKETS (1024)
+// buckets probed for a key, if none is free the least recently used is replaced
+#define RATE_LIMIT_PROBES (8)
+// max chars of a key (user name or address), longer ones are cut
+#define RATE_LIMIT_KEY_CHARS (64)
+
+
+typedef struct rate_rule rate_rule;
+struct rate_rule {
+	int per_sec;				// requests refilled every second, 0 if unlimited
+	int burst;					// max requests at once
+};
+
+typedef struct rate_bucket rate_bucket;
+struct rate_bucket {
+	char key[RATE_LIMIT_KEY_CHARS];		// empty if the bucket is free
+	int class;
+	uint64_t state;				// tokens (thousandths) << 32 | msecs of the last refill
+};
+
+typedef struct rate_shard rate_shard;
+struct rate_shard {
+	pthread_mutex_t mutex;		// of the keys and their tokens
+	rate_bucket buckets[RATE_LIMIT_SHARD_BUCKETS];
+};
+
+typedef struct rate_limit rate_limit;
+struct rate_limit {
+	rate_rule rules[N_OP_CLASSES];
+	rate_shard *shards;
+	long long start_msecs;
+};
+
+
+/*
+ * Creates the buckets, with the rule of every operation class
+ * Returns a pointer to the rate_limit or NULL if fails
+ */
+rate_limit *rate_limit_new(const rate_rule *rules);
+
+void rate_limit_free(rate_limit *limit);
+
+/*
+ * Takes a token of the bucket of the key for the class, refilled since the last time
+ * Returns 1 if the request can be served or 0 if it exceeds the rate
+ */
+int rate_limit_take(rate_limit *limit, const char *key, op_class class);
+
+/*
+ * Checks if the bucket of the key for the class has a token, without taking it.
+ * A key without a bucket has all of them
+ * Returns 1 if the request can be served or 0 if it exceeds the rate
+ */
+int rate_limit_peek(rate_limit *limit, const char *key, op_class class);
+
+
+#endif /* __RATE_LIMIT */
@@ -32,9 +32,20 @@
 #include <unistd.h>
 
 #include "psd_ims_server.h"
+#include "lanes.h"
 
 #include "debug_def.h"
 
+// max bytes of query results per request, unless given with -m (0 is unlimited)
+#define DEFAULT_REQUEST_MEM_BUDGET (64*1024*1024)
+
+// requests per second of a user and of an address, by operation class,
+// unless given with -r (0 is unlimited). The bursts are twice them
+#define DEFAULT_USER_INTERACTIVE_RATE (20)
+#define DEFAULT_USER_TRANSFER_RATE (50)
+#define DEFAULT_ADDR_INTERACTIVE_RATE (200)
+#define DEFAULT_ADDR_TRANSFER_RATE (200)
+
 // TODO Must catch CTRL-C signal to free the resources and end the listen loop
 
 volatile int continue_listening;
@@ -42,16 +53,89 @@ volatile int continue_listening;
 
 void stop_server(int sig);
 
+/*
+ * Sets the rates of the class given as <class>:<user_per_sec>:<addr_per_sec>
+ * Returns 0 or -1 if it is not valid
+ */
+int parse_rate(const char *arg, server_options *options) {
+	char class_name[16];
+	int user_rate, addr_rate;
+	int class;
+
+	if (sscanf(arg, "%15[a-z]:%d:%d", class_name, &user_rate, &addr_rate) != 3
+			|| (class = lanes_class_id(class_name)) < 0 || user_rate < 0 || addr_rate < 0) {
+		return -1;
+	}
+	options->user_rates[class].per_sec = user_rate;
+	options->user_rates[class].burst = 2*user_rate;
+	options->addr_rates[class].per_sec = addr_rate;
+	options->addr_rates[class].burst = 2*addr_rate;
+
+	return 0;
+}
+
 
 int main( int argc, char **argv) {
 
 	int listenner_ret_value = 0;
-	int bind_port;
+	int opt;
+	int i;
+	server_options options;
 	sigset_t sig_blocked_mask;
 	sigset_t old_sig_mask;
 
-	if (argc < 4) {
-		printf("Usage: %s <port> <bd_user> <bd_pass>\n", argv[0]);
+	options.journal_path = NULL;
+	options.request_mem_budget = DEFAULT_REQUEST_MEM_BUDGET;
+	options.db_async_conns = 0;
+	options.n_acceptors = 1;
+	options.bin_port = 0;
+	options.transfer_slots = LANE_TRANSFER_SLOTS;
+	options.transfer_bytes_per_sec = 0;
+	options.user_rates[OP_CLASS_INTERACTIVE].per_sec = DEFAULT_USER_INTERACTIVE_RATE;
+	options.user_rates[OP_CLASS_TRANSFER].per_sec = DEFAULT_USER_TRANSFER_RATE;
+	options.addr_rates[OP_CLASS_INTERACTIVE].per_sec = DEFAULT_ADDR_INTERACTIVE_RATE;
+	options.addr_rates[OP_CLASS_TRANSFER].per_sec = DEFAULT_ADDR_TRANSFER_RATE;
+	for (i = 0 ; i < N_OP_CLASSES ; i++) {
+		options.user_rates[i].burst = 2*options.user_rates[i].per_sec;
+		options.addr_rates[i].burst = 2*options.addr_rates[i].per_sec;
+	}
+	while ( (opt = getopt(argc, argv, "j:m:a:n:b:s:w:r:")) != -1 ) {
+		switch (opt) {
+			case 'j':
+				options.journal_path = optarg;
+				break;
+			case 'm':
+				options.request_mem_budget = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				options.db_async_conns = atoi(optarg);
+				break;
+			case 'n':
+				options.n_acceptors = atoi(optarg);
+				break;
+			case 'b':
+				options.bin_port = atoi(optarg);
+				break;
+			case 's':
+				options.transfer_slots = atoi(optarg);
+				break;
+			case 'w':
+				options.transfer_bytes_per_sec = strtoll(optarg, NULL, 10);
+				break;
+			case 'r':
+				if (parse_rate(optarg, &options) == 0) {
+					break;
+				}
+				printf("Invalid rate %s, expected <interactive|transfer>:<user_per_sec>:<addr_per_sec>\n", optarg);
+				exit(-1);
+			default:
+				printf("Usage: %s [-j <journal_file>] [-m <request_mem_bytes>] [-a <db_connections>] [-n <acceptors>] [-b <binary_port>] [-s <transfer_slots>] [-w <transfer_bytes_per_sec>] [-r <class>:<user_per_sec>:<addr_per_sec>] <port> <bd_user> <bd_pass>\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	if (argc - optind < 3) {
+		printf("Usage: %s [-j <journal_file>] [-m <request_mem_bytes>] [-a <db_connections>] [-n <acceptors>] [-b <binary_port>] [-s <transfer_slots>] [-w <transfer_bytes_per_sec>] [-r <class>:<user_per_sec>:<addr_per_sec>] <port> <bd_user> <bd_pass>\n", argv[0]);
 		exit(-1);
 	}	
 
@@ -67,6 +151,11 @@ int main( int argc, char **argv) {
 		DEBUG_FAILURE_PRINTF("Could not attach SIGABRT handler");
 		return -1;
 	}
+	// a client that closes its socket during a sendfile must only fail the transfer
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		DEBUG_FAILURE_PRINTF("Could not ignore SIGPIPE");
+		return -1;
+	}
 
 	// Initialize variables
 	sigemptyset(&sig_blocked_mask);
@@ -74,15 +163,17 @@ int main( int argc, char **argv) {
 	sigaddset(&sig_blocked_mask, SIGTERM);	//sig mask to block sigint
 	sigaddset(&sig_blocked_mask, SIGABRT);	//sig mask to block sigint
 	continue_listening = 1;
-	bind_port = atoi(argv[1]);
-	if( bind_port <= 1024 ) {
+	options.bind_port = atoi(argv[optind]);
+	options.persistence_user = argv[optind + 1];
+	options.persistence_pass = argv[optind + 2];
+	if( options.bind_port <= 1024 ) {
 		DEBUG_FAILURE_PRINTF("Invalid PORT");
 		return 0;
 	}
 
 	// init server structure
 	DEBUG_INFO_PRINTF("Init server");
-	if (init_server(bind_port, argv[2], argv[3]) != 0 ) {
+	if (init_server(&options) != 0 ) {
 		DEBUG_FAILURE_PRINTF("Could not init server");
 		return 0;
 	}
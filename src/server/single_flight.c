@@ -0,0 +1,149 @@
+/*******************************************************************************
+ *	single_flight.c
+ *
+ *  Coalescing of identical concurrent reads
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include "single_flight.h"
+#include "metrics.h"
+#include "bool.h"
+
+#include "debug_def.h"
+
+
+int _same_key(flight_key *a, flight_key *b) {
+	return (a->op == b->op) && (a->user_id == b->user_id) && (a->arg1 == b->arg1)
+			&& (a->arg2 == b->arg2) && (a->args_hash == b->args_hash);
+}
+
+
+single_flight *single_flight_new() {
+	DEBUG_TRACE_PRINT();
+	single_flight *sf;
+
+	sf = malloc(sizeof(single_flight));
+	if (sf == NULL) {
+		return NULL;
+	}
+
+	sf->flights = NULL;
+	pthread_mutex_init(&sf->mutex, NULL);
+
+	return sf;
+}
+
+
+void single_flight_free(single_flight *sf) {
+	DEBUG_TRACE_PRINT();
+	pthread_mutex_destroy(&sf->mutex);
+	free(sf);
+}
+
+
+flight *single_flight_join(single_flight *sf, flight_key *key, int *leader) {
+	DEBUG_TRACE_PRINT();
+	flight *flight;
+
+	pthread_mutex_lock(&sf->mutex);
+	for (flight = sf->flights ; flight != NULL ; flight = flight->next) {
+		if (_same_key(&flight->key, key)) {
+			flight->n_followers++;
+			pthread_mutex_unlock(&sf->mutex);
+			*leader = FALSE;
+			return flight;
+		}
+	}
+
+	flight = malloc(sizeof(struct flight));
+	if (flight == NULL) {
+		pthread_mutex_unlock(&sf->mutex);
+		return NULL;
+	}
+	flight->key = *key;
+	flight->ret = -1;
+	flight->result = NULL;
+	flight->done = 0;
+	flight->n_followers = 0;
+	pthread_cond_init(&flight->changed, NULL);
+	flight->next = sf->flights;
+	sf->flights = flight;
+	pthread_mutex_unlock(&sf->mutex);
+
+	*leader = TRUE;
+	return flight;
+}
+
+
+void single_flight_land(single_flight *sf, flight *flight, int ret, void *result) {
+	DEBUG_TRACE_PRINT();
+	struct flight **prev;
+
+	pthread_mutex_lock(&sf->mutex);
+	// the callers that come from now on start another flight
+	for (prev = &sf->flights ; *prev != flight ; prev = &(*prev)->next);
+	*prev = flight->next;
+
+	flight->ret = ret;
+	flight->result = result;
+	flight->done = 1;
+	pthread_cond_broadcast(&flight->changed);
+
+	// the result is freed with the soap of the leader
+	while (flight->n_followers > 0) {
+		pthread_cond_wait(&flight->changed, &sf->mutex);
+	}
+	pthread_mutex_unlock(&sf->mutex);
+
+	pthread_cond_destroy(&flight->changed);
+	free(flight);
+}
+
+
+int single_flight_wait(single_flight *sf, flight *flight, int (*copy)(struct soap *soap, const void *src, void *dest), struct soap *soap, void *dest) {
+	DEBUG_TRACE_PRINT();
+	int ret;
+
+	metrics_add(METRIC_COALESCED_REQUESTS, 1);
+
+	pthread_mutex_lock(&sf->mutex);
+	while (!flight->done) {
+		pthread_cond_wait(&flight->changed, &sf->mutex);
+	}
+	pthread_mutex_unlock(&sf->mutex);
+
+	// the leader waits until every follower copies the result
+	ret = flight->ret;
+	if (ret == 0 && copy(soap, flight->result, dest) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not copy the coalesced result");
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&sf->mutex);
+	flight->n_followers--;
+	if (flight->n_followers == 0) {
+		pthread_cond_broadcast(&flight->changed);
+	}
+	pthread_mutex_unlock(&sf->mutex);
+
+	return ret;
+}
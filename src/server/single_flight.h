@@ -0,0 +1,100 @@
+/*******************************************************************************
+ *	single_flight.h
+ *
+ *  Coalescing of identical concurrent reads
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __SINGLE_FLIGHT
+#define __SINGLE_FLIGHT
+
+#include <pthread.h>
+#include "soapH.h"
+
+
+// reads that can be coalesced
+typedef enum flight_op flight_op;
+enum flight_op {
+	FLIGHT_CHAT_MESSAGES,
+	FLIGHT_NOTIFICATIONS
+};
+
+// two reads are the same if all the fields are equal
+typedef struct flight_key flight_key;
+struct flight_key {
+	flight_op op;
+	int user_id;
+	int arg1;
+	int arg2;
+	unsigned int args_hash;		// of the arguments that do not fit in arg1 and arg2
+};
+
+typedef struct flight flight;
+struct flight {
+	flight_key key;
+	int ret;					// of the first caller, the one that does the read
+	void *result;				// allocated in the soap of the first caller
+	int done;
+	int n_followers;			// callers that did not copy the result yet
+	pthread_cond_t changed;		// broadcasted when done or n_followers change
+	struct flight *next;
+};
+
+typedef struct single_flight single_flight;
+struct single_flight {
+	flight *flights;			// in progress
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Returns a pointer to a new single_flight or NULL if fails
+ */
+single_flight *single_flight_new();
+
+/*
+ * Frees the single_flight, there must be no flights in progress
+ */
+void single_flight_free(single_flight *sf);
+
+/*
+ * Joins the flight with the same key, or starts a new one if there is none.
+ * leader is set to TRUE if the caller started it, and then it must do the read
+ * and call single_flight_land. If not, it must call single_flight_wait.
+ * Returns the flight or NULL if fails (the caller should do the read on its own)
+ */
+flight *single_flight_join(single_flight *sf, flight_key *key, int *leader);
+
+/*
+ * Gives the result of the read to the followers and waits until they
+ * copy it. Frees the flight
+ */
+void single_flight_land(single_flight *sf, flight *flight, int ret, void *result);
+
+/*
+ * Waits for the result of the leader and copies it to dest (allocated in soap)
+ * with copy, which returns 0 or -1 if fails
+ * Returns the value given by the leader or -1 if the copy fails
+ */
+int single_flight_wait(single_flight *sf, flight *flight, int (*copy)(struct soap *soap, const void *src, void *dest), struct soap *soap, void *dest);
+
+
+#endif /* __SINGLE_FLIGHT */
@@ -0,0 +1,126 @@
+/*******************************************************************************
+ *	soap_pool.c
+ *
+ *  Pool of reusable soap contexts for the accepted connections
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "soap_pool.h"
+#include "metrics.h"
+
+#include "debug_def.h"
+
+
+soap_pool *soap_pool_new(int max_free) {
+	DEBUG_TRACE_PRINT();
+	soap_pool *pool;
+
+	pool = malloc(sizeof(soap_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->free_contexts = malloc(max_free * sizeof(struct soap*));
+	if (pool->free_contexts == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->n_free = 0;
+	pool->max_free = max_free;
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	return pool;
+}
+
+
+void soap_pool_free(soap_pool *pool) {
+	DEBUG_TRACE_PRINT();
+	int i;
+
+	for (i = 0 ; i < pool->n_free ; i++) {
+		soap_done(pool->free_contexts[i]);
+		free(pool->free_contexts[i]);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->free_contexts);
+	free(pool);
+}
+
+
+struct soap *soap_pool_get(soap_pool *pool, struct soap *master) {
+	struct soap *soap = NULL;
+
+	// the last ended context is the first reused, its memory is more likely cached
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->n_free > 0) {
+		pool->n_free--;
+		soap = pool->free_contexts[pool->n_free];
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (soap == NULL) {
+		metrics_add(METRIC_SOAP_CONTEXTS_CREATED, 1);
+		return soap_copy(master);
+	}
+	metrics_add(METRIC_SOAP_CONTEXTS_REUSED, 1);
+
+	// the context keeps its buffers and hash tables, it only takes
+	// the accepted connection and the settings that a request may change
+	soap->socket = master->socket;
+	soap->ip = master->ip;
+	soap->port = master->port;
+	strcpy(soap->host, master->host);
+	soap->omode = master->omode;
+	soap->keep_alive = master->keep_alive;
+	soap->max_keep_alive = master->max_keep_alive;
+	soap->recv_timeout = master->recv_timeout;
+	soap->send_timeout = master->send_timeout;
+	soap->http_extra_header = NULL;
+	soap->user = NULL;
+	soap->error = SOAP_OK;
+	soap->errnum = 0;
+
+	return soap;
+}
+
+
+void soap_pool_put(soap_pool *pool, struct soap *soap) {
+	soap_destroy(soap);
+	soap_end(soap);
+	soap_force_closesock(soap);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->n_free < pool->max_free) {
+		pool->free_contexts[pool->n_free] = soap;
+		pool->n_free++;
+		soap = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (soap != NULL) {
+		soap_done(soap);
+		free(soap);
+	}
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+ *	soap_pool.h
+ *
+ *  Pool of reusable soap contexts for the accepted connections
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __SOAP_POOL
+#define __SOAP_POOL
+
+#include <pthread.h>
+#include "soapH.h"
+
+
+typedef struct soap_pool soap_pool;
+struct soap_pool {
+	struct soap **free_contexts;	// ended connections, ready to be reused
+	int n_free;
+	int max_free;
+	pthread_mutex_t mutex;
+};
+
+
+/*
+ * Creates an empty pool that keeps up to max_free unused contexts
+ * Returns a pointer to the pool or NULL if fails
+ */
+soap_pool *soap_pool_new(int max_free);
+
+/*
+ * Frees the pool and its unused contexts
+ */
+void soap_pool_free(soap_pool *pool);
+
+/*
+ * Gives a context for the connection just accepted by master. It is a
+ * reused one if there are any, or a copy of master if not
+ * Returns the context or NULL if fails
+ */
+struct soap *soap_pool_get(soap_pool *pool, struct soap *master);
+
+/*
+ * Ends the connection of the context and keeps it for another one,
+ * (or frees it if the pool is full)
+ */
+void soap_pool_put(soap_pool *pool, struct soap *soap);
+
+
+#endif /* __SOAP_POOL */
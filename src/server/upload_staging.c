@@ -0,0 +1,308 @@
+/*******************************************************************************
+ *	upload_staging.c
+ *
+ *  Partially uploaded attachments, stored by chunks until they are complete
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "blob_store.h"
+#include "upload_staging.h"
+
+#include "debug_def.h"
+
+// chars of the path of a staged file, with the '\0'
+#define STAGING_PATH_CHARS (sizeof(STAGING_DIR) + CONTENT_HASH_CHARS + 20)
+// chars of the path of any entry of the staging directory
+#define STAGING_ENTRY_CHARS (sizeof(STAGING_DIR) + sizeof(((struct dirent*)0)->d_name))
+
+#define n_chunks(size) \
+		(((size) + UPLOAD_CHUNK_BYTES - 1) / UPLOAD_CHUNK_BYTES)
+
+// the sweep is run by the first upload that sees it due
+static pthread_mutex_t sweep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t last_sweep = 0;
+
+
+/*
+ * The data of the upload, with the size of the whole file from the
+ * beginning, and its map, one byte per chunk set to 1 once it is stored
+ */
+void _staging_paths(int user_id, const char *hash, char *data_path, char *map_path) {
+	sprintf(data_path, "%s/%d_%s", STAGING_DIR, user_id, hash);
+	sprintf(map_path, "%s/%d_%s.map", STAGING_DIR, user_id, hash);
+}
+
+
+/*
+ * Returns the offset of the first chunk not stored, the size if all of them are, or -1 if fails
+ */
+int _staging_offset(const char *map_path, int size) {
+	char map[256];
+	int fd;
+	int chunk, n_read, i;
+
+	if ((fd = open(map_path, O_RDONLY)) == -1) {
+		return -1;
+	}
+	chunk = 0;
+	while ((n_read = read(fd, map, sizeof(map))) > 0) {
+		for (i = 0 ; i < n_read ; i++, chunk++) {
+			if (map[i] != 1) {
+				close(fd);
+				return chunk*UPLOAD_CHUNK_BYTES;
+			}
+		}
+	}
+	close(fd);
+
+	return (n_read == 0 && chunk == n_chunks(size))? size : -1;
+}
+
+
+/*
+ * Counts the uploads of the user, and the bytes of all of them
+ * Returns the number of uploads or -1 if fails
+ */
+int _staging_user_uploads(int user_id, long long *bytes) {
+	char prefix[16];
+	char path[STAGING_ENTRY_CHARS];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+	int n_uploads = 0;
+	size_t prefix_len;
+
+	if ((dir = opendir(STAGING_DIR)) == NULL) {
+		return -1;
+	}
+	sprintf(prefix, "%d_", user_id);
+	prefix_len = strlen(prefix);
+	*bytes = 0;
+	while ((entry = readdir(dir)) != NULL) {
+		// the data of an upload, its map is not counted
+		if (strncmp(entry->d_name, prefix, prefix_len) != 0 || strlen(entry->d_name) != prefix_len + CONTENT_HASH_CHARS) {
+			continue;
+		}
+		sprintf(path, "%s/%s", STAGING_DIR, entry->d_name);
+		if (stat(path, &st) == 0) {
+			*bytes += st.st_size;
+			n_uploads++;
+		}
+	}
+	closedir(dir);
+
+	return n_uploads;
+}
+
+
+void staging_sweep(int max_age) {
+	DEBUG_TRACE_PRINT();
+	char path[STAGING_ENTRY_CHARS];
+	struct dirent *entry;
+	struct stat st;
+	time_t now;
+	DIR *dir;
+
+	if ((dir = opendir(STAGING_DIR)) == NULL) {
+		return;
+	}
+	now = time(NULL);
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		// the data and the map are written with every chunk, a lone one is started again
+		sprintf(path, "%s/%s", STAGING_DIR, entry->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > max_age) {
+			DEBUG_INFO_PRINTF("Deleting the abandoned upload %s", entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+}
+
+
+/*
+ * Sweeps the old uploads once every STAGING_SWEEP_SECS
+ */
+void _staging_sweep_if_due() {
+	time_t now = time(NULL);
+	int due;
+
+	pthread_mutex_lock(&sweep_mutex);
+	due = (now - last_sweep >= STAGING_SWEEP_SECS);
+	if (due) {
+		last_sweep = now;
+	}
+	pthread_mutex_unlock(&sweep_mutex);
+
+	if (due) {
+		staging_sweep(STAGING_MAX_AGE_SECS);
+	}
+}
+
+
+int staging_begin(int user_id, const char *hash, int size) {
+	DEBUG_TRACE_PRINT();
+	char data_path[STAGING_PATH_CHARS];
+	char map_path[STAGING_PATH_CHARS];
+	struct stat st;
+	long long user_bytes;
+	int fd;
+	int offset;
+	int n_uploads;
+
+	if (!content_hash_valid(hash) || size < 0) {
+		return -1;
+	}
+	if ((mkdir(BLOB_FILES_DIR, 0700) == -1 && errno != EEXIST) || (mkdir(STAGING_DIR, 0700) == -1 && errno != EEXIST)) {
+		DEBUG_FAILURE_PRINTF("Could not create the staging directory");
+		return -1;
+	}
+	_staging_paths(user_id, hash, data_path, map_path);
+
+	// resumed
+	if (stat(data_path, &st) == 0 && st.st_size == size && (offset = _staging_offset(map_path, size)) >= 0) {
+		return offset;
+	}
+
+	_staging_sweep_if_due();
+	// an upload of the same hash with another size is replaced, it is not counted
+	n_uploads = _staging_user_uploads(user_id, &user_bytes);
+	if (stat(data_path, &st) == 0) {
+		n_uploads--;
+		user_bytes -= st.st_size;
+	}
+	if (n_uploads < 0 || n_uploads >= STAGING_MAX_USER_UPLOADS || user_bytes + size > STAGING_MAX_USER_BYTES) {
+		DEBUG_FAILURE_PRINTF("Too many uploads of the user %d", user_id);
+		return -1;
+	}
+
+	if ((fd = open(data_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		DEBUG_FAILURE_PRINTF("Could not create the file");
+		return -1;
+	}
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// zeroed, no chunk stored
+	if ((fd = open(map_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		DEBUG_FAILURE_PRINTF("Could not create the file");
+		return -1;
+	}
+	if (ftruncate(fd, n_chunks(size)) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+int staging_put(file_io *io, int user_id, const char *hash, int offset, const unsigned char *data, int size) {
+	DEBUG_TRACE_PRINT();
+	char data_path[STAGING_PATH_CHARS];
+	char map_path[STAGING_PATH_CHARS];
+	char stored = 1;
+	struct stat st;
+	int fd;
+	int chunk_size;
+
+	if (!content_hash_valid(hash) || offset < 0 || (offset % UPLOAD_CHUNK_BYTES) != 0) {
+		return -1;
+	}
+	_staging_paths(user_id, hash, data_path, map_path);
+
+	if ((fd = open(data_path, O_WRONLY)) == -1) {
+		DEBUG_FAILURE_PRINTF("The upload was not started");
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || offset >= st.st_size) {
+		close(fd);
+		return -1;
+	}
+	chunk_size = (st.st_size - offset < UPLOAD_CHUNK_BYTES)? (st.st_size - offset) : UPLOAD_CHUNK_BYTES;
+	// synced before it is marked, a resumed upload does not skip a lost chunk
+	if (size != chunk_size || file_io_pwrite(io, fd, data, size, offset) != size || file_io_sync(io, fd) != 0) {
+		DEBUG_FAILURE_PRINTF("Could not save the received chunk");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// the chunks are written in parallel, each one sets only its own byte
+	if ((fd = open(map_path, O_WRONLY)) == -1) {
+		return -1;
+	}
+	if (pwrite(fd, &stored, 1, offset/UPLOAD_CHUNK_BYTES) != 1) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+int staging_commit(int user_id, const char *hash) {
+	DEBUG_TRACE_PRINT();
+	char data_path[STAGING_PATH_CHARS];
+	char map_path[STAGING_PATH_CHARS];
+	char file_hash[CONTENT_HASH_CHARS + 1];
+	struct stat st;
+
+	if (!content_hash_valid(hash)) {
+		return -1;
+	}
+	_staging_paths(user_id, hash, data_path, map_path);
+
+	if (stat(data_path, &st) != 0 || _staging_offset(map_path, st.st_size) != st.st_size) {
+		DEBUG_FAILURE_PRINTF("The upload is not complete");
+		return -1;
+	}
+	if (content_hash_file(data_path, file_hash) != 0 || strcmp(file_hash, hash) != 0) {
+		DEBUG_FAILURE_PRINTF("The uploaded file does not match its hash");
+		unlink(data_path);
+		unlink(map_path);
+		return -1;
+	}
+	if (blob_move(data_path, hash) != 0) {
+		return -1;
+	}
+	unlink(map_path);
+
+	return 0;
+}
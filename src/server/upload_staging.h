@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *	upload_staging.h
+ *
+ *  Partially uploaded attachments, stored by chunks until they are complete
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+#ifndef __UPLOAD_STAGING
+#define __UPLOAD_STAGING
+
+#include "file_io.h"
+
+#define STAGING_DIR BLOB_FILES_DIR "/staging"
+// size of every chunk but the last one
+#define UPLOAD_CHUNK_BYTES (256*1024)
+// uploads not written for this long are deleted, swept once every STAGING_SWEEP_SECS
+#define STAGING_MAX_AGE_SECS (24*3600)
+#define STAGING_SWEEP_SECS (3600)
+// max uploads started and not committed by a user, and max bytes of them
+#define STAGING_MAX_USER_UPLOADS (8)
+#define STAGING_MAX_USER_BYTES (64*1024*1024)
+
+
+/*
+ * Starts the upload of a file of the user, or resumes it if it was already
+ * started with the same hash and size. A new one fails if the user has
+ * STAGING_MAX_USER_UPLOADS or it does not fit in STAGING_MAX_USER_BYTES
+ * Returns the offset up to which every chunk is stored or -1 if fails
+ */
+int staging_begin(int user_id, const char *hash, int size);
+
+/*
+ * Stores a chunk of the upload, in any order, written and synced by io (NULL
+ * to do it in the calling thread). offset must be a multiple of
+ * UPLOAD_CHUNK_BYTES and size the size of that chunk
+ * Returns 0 or -1 if fails
+ */
+int staging_put(file_io *io, int user_id, const char *hash, int offset, const unsigned char *data, int size);
+
+/*
+ * Checks that every chunk is stored and the content matches its hash, and
+ * moves the file to the blob store
+ * Returns 0 or -1 if fails
+ */
+int staging_commit(int user_id, const char *hash);
+
+/*
+ * Deletes the uploads not written in the last max_age secs
+ */
+void staging_sweep(int max_age);
+
+
+#endif /* __UPLOAD_STAGING */
@@ -0,0 +1,407 @@
+/*******************************************************************************
+ *	test_bin_codec.c
+ *
+ *  Compares the binary encoding of the replies with soap, and checks that
+ *  both decode the same data that was encoded
+ *
+ *
+ *  This file is part of PSD-IMS
+ *
+ *  Copyright (C) 2015  Daniel Pinto Rivero, Javier Bermúdez Blanco
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ********************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "soapH.h"
+#include "ims_bin.h"
+
+
+#define DEFAULT_N_MESSAGES (100)
+#define DEFAULT_ITERATIONS (1000)
+
+
+double _now_usecs() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000.0 + now.tv_nsec/1000.0;
+}
+
+
+void _fill_messages(psdims__message_list *messages, int n_messages) {
+	int i;
+
+	messages->__sizenelems = n_messages;
+	messages->messages = malloc(sizeof(psdims__message_info)*n_messages);
+	for (i = 0 ; i < n_messages ; i++) {
+		messages->messages[i].user = "some_user";
+		messages->messages[i].text = "A chat message of an average length, with a few words in it";
+		messages->messages[i].file_name = (i % 10 == 0)? "picture.png" : NULL;
+		messages->messages[i].send_date = 1430000000 + i;
+	}
+	messages->read_timestamp = 1430000000;
+	messages->last_timestamp = 1430000000 + n_messages;
+}
+
+
+void _fill_notifications(psdims__notifications *notifications, int n_chats) {
+	int i;
+
+	memset(notifications, 0, sizeof(psdims__notifications));
+	notifications->friend_request.__sizenelems = n_chats;
+	notifications->friend_request.user = malloc(sizeof(psdims__notif_friend_info)*n_chats);
+	notifications->new_friends.__sizenelems = n_chats;
+	notifications->new_friends.user = malloc(sizeof(psdims__user_info)*n_chats);
+	notifications->chats_with_messages.__sizenelems = n_chats;
+	notifications->chats_with_messages.chat = malloc(sizeof(psdims__notif_chat_info)*n_chats);
+	notifications->chat_members.__sizenelems = n_chats;
+	notifications->chat_members.member = malloc(sizeof(psdims__notif_member_info)*n_chats);
+	for (i = 0 ; i < n_chats ; i++) {
+		notifications->friend_request.user[i].name.string = "new_friend";
+		notifications->friend_request.user[i].send_date = 1430000000 + i;
+		notifications->new_friends.user[i].name = "new_friend";
+		notifications->new_friends.user[i].information = (i % 10 == 0)? NULL : "Some information";
+		notifications->chats_with_messages.chat[i].chat_id = i + 1;
+		notifications->chats_with_messages.chat[i].timestamp = 1430000000 + i;
+		notifications->chat_members.member[i].name.string = "new_member";
+		notifications->chat_members.member[i].chat_id = i + 1;
+		notifications->chat_members.member[i].timestamp = 1430000000 + i;
+	}
+	// the other lists have the same entries
+	notifications->chats_read_times = notifications->chats_with_messages;
+	notifications->rem_chat_members = notifications->chat_members;
+	notifications->chat_admins = notifications->chat_members;
+	notifications->new_friends.last_timestamp = 1430000000 + n_chats;
+	notifications->last_timestamp = 1430000000 + n_chats;
+}
+
+
+/*
+ * Returns 1 if both strings are NULL or equal, or 0
+ */
+int _same_string(const char *a, const char *b) {
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+
+/*
+ * Compares field by field the decoded messages with the encoded ones
+ * Returns 0 or -1 if they differ
+ */
+int _check_messages(const char *codec, psdims__message_list *messages, psdims__message_list *decoded) {
+	int i;
+
+	if (decoded->__sizenelems != messages->__sizenelems
+			|| decoded->read_timestamp != messages->read_timestamp
+			|| decoded->last_timestamp != messages->last_timestamp) {
+		printf("  %s: the message_list differs\n", codec);
+		return -1;
+	}
+	for (i = 0 ; i < messages->__sizenelems ; i++) {
+		if (!_same_string(decoded->messages[i].user, messages->messages[i].user)
+				|| !_same_string(decoded->messages[i].text, messages->messages[i].text)
+				|| !_same_string(decoded->messages[i].file_name, messages->messages[i].file_name)
+				|| decoded->messages[i].send_date != messages->messages[i].send_date) {
+			printf("  %s: the message %d differs\n", codec, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+int _check_chat_list(psdims__notif_chat_list *list, psdims__notif_chat_list *decoded) {
+	int i;
+
+	if (decoded->__sizenelems != list->__sizenelems) {
+		return -1;
+	}
+	for (i = 0 ; i < list->__sizenelems ; i++) {
+		if (decoded->chat[i].chat_id != list->chat[i].chat_id
+				|| decoded->chat[i].timestamp != list->chat[i].timestamp) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+int _check_member_list(psdims__notif_chat_member_list *list, psdims__notif_chat_member_list *decoded) {
+	int i;
+
+	if (decoded->__sizenelems != list->__sizenelems) {
+		return -1;
+	}
+	for (i = 0 ; i < list->__sizenelems ; i++) {
+		if (!_same_string(decoded->member[i].name.string, list->member[i].name.string)
+				|| decoded->member[i].chat_id != list->member[i].chat_id
+				|| decoded->member[i].timestamp != list->member[i].timestamp) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Compares field by field the decoded notifications with the encoded ones
+ * Returns 0 or -1 if they differ
+ */
+int _check_notifications(const char *codec, psdims__notifications *notifications, psdims__notifications *decoded) {
+	int i;
+
+	if (decoded->friend_request.__sizenelems != notifications->friend_request.__sizenelems
+			|| decoded->new_friends.__sizenelems != notifications->new_friends.__sizenelems
+			|| decoded->new_friends.last_timestamp != notifications->new_friends.last_timestamp
+			|| decoded->last_timestamp != notifications->last_timestamp) {
+		printf("  %s: the notifications differ\n", codec);
+		return -1;
+	}
+	for (i = 0 ; i < notifications->friend_request.__sizenelems ; i++) {
+		if (!_same_string(decoded->friend_request.user[i].name.string, notifications->friend_request.user[i].name.string)
+				|| decoded->friend_request.user[i].send_date != notifications->friend_request.user[i].send_date) {
+			printf("  %s: the friend request %d differs\n", codec, i);
+			return -1;
+		}
+	}
+	for (i = 0 ; i < notifications->new_friends.__sizenelems ; i++) {
+		if (!_same_string(decoded->new_friends.user[i].name, notifications->new_friends.user[i].name)
+				|| !_same_string(decoded->new_friends.user[i].information, notifications->new_friends.user[i].information)) {
+			printf("  %s: the new friend %d differs\n", codec, i);
+			return -1;
+		}
+	}
+	if (_check_chat_list(&notifications->chats_with_messages, &decoded->chats_with_messages) != 0
+			|| _check_chat_list(&notifications->chats_read_times, &decoded->chats_read_times) != 0
+			|| _check_member_list(&notifications->chat_members, &decoded->chat_members) != 0
+			|| _check_member_list(&notifications->rem_chat_members, &decoded->rem_chat_members) != 0
+			|| _check_member_list(&notifications->chat_admins, &decoded->chat_admins) != 0) {
+		printf("  %s: the chat lists of the notifications differ\n", codec);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns 0 or -1 if a decoded message_list differs
+ */
+int _bench_messages(struct soap *soap, psdims__message_list *messages, int iterations) {
+	psdims__message_list decoded;
+	bin_buffer buff;
+	bin_reader reader;
+	char *xml = NULL;
+	size_t xml_size;
+	double start, encode, decode;
+	int i, ret = 0;
+
+	// soap, to and from a string
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		soap->os = &xml;
+		soap_write_psdims__message_list(soap, messages);
+		soap->os = NULL;
+		if (i < iterations - 1) {
+			soap_end(soap);
+		}
+	}
+	encode = _now_usecs() - start;
+
+	// the decoded data is freed on every iteration, like the binary one, so
+	// the xml is kept out of the soap memory
+	xml = strdup(xml);
+	xml_size = strlen(xml);
+	soap_end(soap);
+
+	soap->is = xml;
+	soap_read_psdims__message_list(soap, &decoded);
+	soap->is = NULL;
+	if (_check_messages("soap", messages, &decoded) != 0) {
+		ret = -1;
+	}
+	soap_end(soap);
+
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		soap->is = xml;
+		soap_read_psdims__message_list(soap, &decoded);
+		soap->is = NULL;
+		soap_end(soap);
+	}
+	decode = _now_usecs() - start;
+	printf("  soap   %8zu bytes %10.2f us/encode %10.2f us/decode\n", xml_size, encode/iterations, decode/iterations);
+	free(xml);
+
+	// binary
+	bin_buffer_init(&buff, BIN_MAX_FRAME_BYTES);
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		bin_buffer_clear(&buff);
+		bin_put_message_list(&buff, messages);
+	}
+	encode = _now_usecs() - start;
+
+	bin_reader_init(&reader, bin_buffer_payload(&buff), bin_buffer_payload_size(&buff));
+	if (bin_get_message_list(&reader, soap, &decoded) != 0 || _check_messages("binary", messages, &decoded) != 0) {
+		ret = -1;
+	}
+	soap_end(soap);
+
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		bin_reader_init(&reader, bin_buffer_payload(&buff), bin_buffer_payload_size(&buff));
+		bin_get_message_list(&reader, soap, &decoded);
+		soap_end(soap);
+	}
+	decode = _now_usecs() - start;
+	printf("  binary %8zu bytes %10.2f us/encode %10.2f us/decode\n", bin_buffer_payload_size(&buff), encode/iterations, decode/iterations);
+	bin_buffer_free(&buff);
+
+	return ret;
+}
+
+
+/*
+ * Returns 0 or -1 if decoded notifications differ
+ */
+int _bench_notifications(struct soap *soap, psdims__notifications *notifications, int iterations) {
+	psdims__notifications decoded;
+	bin_buffer buff;
+	bin_reader reader;
+	char *xml = NULL;
+	size_t xml_size;
+	double start, encode, decode;
+	int i, ret = 0;
+
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		soap->os = &xml;
+		soap_write_psdims__notifications(soap, notifications);
+		soap->os = NULL;
+		if (i < iterations - 1) {
+			soap_end(soap);
+		}
+	}
+	encode = _now_usecs() - start;
+
+	// the decoded data is freed on every iteration, like the binary one, so
+	// the xml is kept out of the soap memory
+	xml = strdup(xml);
+	xml_size = strlen(xml);
+	soap_end(soap);
+
+	soap->is = xml;
+	soap_read_psdims__notifications(soap, &decoded);
+	soap->is = NULL;
+	if (_check_notifications("soap", notifications, &decoded) != 0) {
+		ret = -1;
+	}
+	soap_end(soap);
+
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		soap->is = xml;
+		soap_read_psdims__notifications(soap, &decoded);
+		soap->is = NULL;
+		soap_end(soap);
+	}
+	decode = _now_usecs() - start;
+	printf("  soap   %8zu bytes %10.2f us/encode %10.2f us/decode\n", xml_size, encode/iterations, decode/iterations);
+	free(xml);
+
+	bin_buffer_init(&buff, BIN_MAX_FRAME_BYTES);
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		bin_buffer_clear(&buff);
+		bin_put_notifications(&buff, notifications);
+	}
+	encode = _now_usecs() - start;
+
+	bin_reader_init(&reader, bin_buffer_payload(&buff), bin_buffer_payload_size(&buff));
+	if (bin_get_notifications(&reader, soap, &decoded) != 0 || _check_notifications("binary", notifications, &decoded) != 0) {
+		ret = -1;
+	}
+	soap_end(soap);
+
+	start = _now_usecs();
+	for (i = 0 ; i < iterations ; i++) {
+		bin_reader_init(&reader, bin_buffer_payload(&buff), bin_buffer_payload_size(&buff));
+		bin_get_notifications(&reader, soap, &decoded);
+		soap_end(soap);
+	}
+	decode = _now_usecs() - start;
+	printf("  binary %8zu bytes %10.2f us/encode %10.2f us/decode\n", bin_buffer_payload_size(&buff), encode/iterations, decode/iterations);
+	bin_buffer_free(&buff);
+
+	return ret;
+}
+
+
+int main(int argc, char **argv) {
+	struct soap *soap;
+	psdims__message_list messages;
+	psdims__notifications notifications;
+	int n_messages = DEFAULT_N_MESSAGES;
+	int iterations = DEFAULT_ITERATIONS;
+	int ret = 0;
+
+	if (argc > 1) {
+		n_messages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		iterations = atoi(argv[2]);
+	}
+	if (n_messages <= 0 || iterations <= 0) {
+		printf("Usage: %s [<n_messages>] [<iterations>]\n", argv[0]);
+		return -1;
+	}
+
+	soap = soap_new();
+	_fill_messages(&messages, n_messages);
+	_fill_notifications(&notifications, n_messages);
+
+	printf("message_list of %d messages\n", n_messages);
+	if (_bench_messages(soap, &messages, iterations) != 0) {
+		ret = -1;
+	}
+	printf("notifications of %d chats\n", n_messages);
+	if (_bench_notifications(soap, &notifications, iterations) != 0) {
+		ret = -1;
+	}
+
+	free(messages.messages);
+	free(notifications.friend_request.user);
+	free(notifications.new_friends.user);
+	free(notifications.chats_with_messages.chat);
+	free(notifications.chat_members.member);
+	soap_destroy(soap);
+	soap_end(soap);
+	soap_free(soap);
+
+	return ret;
+}